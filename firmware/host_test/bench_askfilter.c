@@ -0,0 +1,109 @@
+/* Decodes a synthetic noisy Clemsa capture with the ASK matched filter,
+   checking the code and reporting the decode time. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "askfilter.h"
+#include "clemsacode_defs.h"
+
+#define SAMPLE_RATE_HZ 200000
+#define REPETITIONS 2
+
+/* Peak amplitude of the noise, relative to the amplitude of the
+   signal */
+#define NOISE_AMPLITUDE 0.8f
+
+#define CYCLE_US (CLEMSA_CODEGEN_CLK_HIGH_COUNT + CLEMSA_CODEGEN_CLK_LOW_COUNT)
+
+static float* samples;
+static size_t sample_count;
+static size_t sample_cap;
+
+static void put_level(float level, uint64_t duration_us) {
+  size_t n = (size_t) (duration_us * SAMPLE_RATE_HZ / 1000000);
+
+  for (size_t i = 0; i < n && sample_count < sample_cap; i++) {
+    samples[sample_count++] = level;
+  }
+}
+
+// Digits carry ASK ticks from the rising edge of the base clock until
+// their tick count is reached or the clock falls, like the generator
+static void put_digit(bool digit) {
+  uint64_t tick_us = 1000000 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY;
+  uint64_t ticks = digit ? CLEMSA_CODEGEN_ASK_TICKS_ONE : CLEMSA_CODEGEN_ASK_TICKS_ZERO;
+  uint64_t elapsed = tick_us;
+
+  if (ticks > (CLEMSA_CODEGEN_CLK_HIGH_COUNT - 1) / tick_us) {
+    ticks = (CLEMSA_CODEGEN_CLK_HIGH_COUNT - 1) / tick_us;
+  }
+
+  put_level(0, tick_us);
+  for (uint64_t t = 0; t < ticks; t++) {
+    put_level(t % 2 == 0 ? 1 : 0, tick_us);
+    elapsed += tick_us;
+  }
+  put_level(0, CYCLE_US - elapsed);
+}
+
+static void build_capture(const bool* code, uint32_t* seed) {
+  sample_cap = (size_t) ((uint64_t) (CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES + CLEMSA_CODEGEN_WAIT_CLOCK_CYCLES +
+				     REPETITIONS * (CLEMSA_CODEGEN_DEFAULT_CODE_SIZE +
+						    CLEMSA_CODEGEN_CYCLES_BETWEEN_REPETITIONS))
+			 * CYCLE_US * SAMPLE_RATE_HZ / 1000000);
+  samples = malloc(sample_cap * sizeof(float));
+  sample_count = 0;
+
+  for (int i = 0; i < CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES; i++) {
+    put_level(1, CLEMSA_CODEGEN_CLK_HIGH_COUNT);
+    put_level(0, CLEMSA_CODEGEN_CLK_LOW_COUNT);
+  }
+  put_level(0, CLEMSA_CODEGEN_WAIT_CLOCK_CYCLES * CYCLE_US);
+
+  for (int rep = 0; rep < REPETITIONS; rep++) {
+    if (rep > 0) {
+      put_level(0, CLEMSA_CODEGEN_CYCLES_BETWEEN_REPETITIONS * CYCLE_US);
+    }
+    for (int i = 0; i < CLEMSA_CODEGEN_DEFAULT_CODE_SIZE; i++) {
+      put_digit(code[i]);
+    }
+  }
+
+  for (size_t i = 0; i < sample_count; i++) {
+    float noise = (float) host_test_rand(seed) / UINT32_MAX * 2 - 1;
+    samples[i] += NOISE_AMPLITUDE * noise;
+  }
+}
+
+int main(int argc, char** argv) {
+  int iterations = argc > 1 && strcmp(argv[1], "--quick") == 0 ? 3 : 50;
+  bool code[CLEMSA_CODEGEN_DEFAULT_CODE_SIZE];
+  bool decoded[CLEMSA_CODEGEN_DEFAULT_CODE_SIZE];
+  uint32_t seed = 0xc1e35a;
+  double start;
+  double elapsed;
+
+  for (int i = 0; i < CLEMSA_CODEGEN_DEFAULT_CODE_SIZE; i++) {
+    code[i] = host_test_rand(&seed) & 1;
+  }
+  build_capture(code, &seed);
+
+  start = host_test_now_s();
+  for (int i = 0; i < iterations; i++) {
+    memset(decoded, 0, sizeof(decoded));
+    CHECK_EQ(askfilter_decode_clemsa(samples, sample_count, SAMPLE_RATE_HZ, decoded,
+				     CLEMSA_CODEGEN_DEFAULT_CODE_SIZE), ESP_OK);
+  }
+  elapsed = host_test_now_s() - start;
+
+  CHECK(memcmp(code, decoded, sizeof(code)) == 0);
+
+  printf("askfilter: %.2f s capture at %d Hz, %.2f ms per decode, %.1f Msamples/s\n",
+	 (double) sample_count / SAMPLE_RATE_HZ, SAMPLE_RATE_HZ, elapsed / iterations * 1000,
+	 sample_count * (double) iterations / elapsed / 1e6);
+
+  free(samples);
+  return HOST_TEST_RESULT();
+}
@@ -0,0 +1,162 @@
+/* Feeds a stream of SPP commands to the framer, split in fragments of
+   random sizes like the data indications of the stack, checking the
+   commands it emits and reporting its throughput. */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "bluetooth/bt_spp_framer.h"
+
+#define MAX_CMD_LEN 48
+
+/* Largest fragment. Data indications carry up to an L2CAP MTU, but
+   the ring only takes what fits besides the partial command. */
+#define MAX_FRAGMENT_LEN (BT_SPP_PEER_RECV_BUFFER_SIZE - MAX_CMD_LEN - 1)
+
+struct consumer {
+  struct bt_spp_framer* framer;
+  const uint8_t* stream;
+  size_t stream_pos;
+  size_t commands;
+  size_t bytes;
+  bool check;
+  bool last_emitted;
+  uint32_t last_offset;
+  size_t last_len;
+};
+
+static uint8_t* stream;
+static size_t stream_len;
+static size_t stream_commands;
+static size_t* fragments;
+static size_t fragment_count;
+
+// Commands of printable characters, like the ones of the app, with the
+// odd empty one
+static void build_stream(size_t len, uint32_t* seed) {
+  size_t cmd_len;
+
+  stream = malloc(len);
+  stream_len = 0;
+  stream_commands = 0;
+  while (true) {
+    cmd_len = host_test_rand(seed) % (MAX_CMD_LEN + 1);
+    if (stream_len + cmd_len + 1 > len) {
+      break;
+    }
+    for (size_t i = 0; i < cmd_len; i++) {
+      stream[stream_len++] = ' ' + host_test_rand(seed) % ('~' - ' ' + 1);
+    }
+    stream[stream_len++] = '\r';
+    stream_commands++;
+  }
+}
+
+// Mostly small fragments, as phones split writes, with some that fill
+// most of the ring
+static void build_fragments(uint32_t* seed) {
+  size_t pos = 0;
+  size_t len;
+
+  fragments = malloc(stream_len * sizeof(size_t));
+  fragment_count = 0;
+  while (pos < stream_len) {
+    len = host_test_rand(seed) % 4 == 0 ? 1 + host_test_rand(seed) % MAX_FRAGMENT_LEN
+      : 1 + host_test_rand(seed) % 20;
+    if (len > stream_len - pos) {
+      len = stream_len - pos;
+    }
+    fragments[fragment_count++] = len;
+    pos += len;
+  }
+}
+
+static bool emit(uint32_t offset, size_t len, void* arg) {
+  struct consumer* consumer = arg;
+  struct bt_spp_slice slice;
+  const uint8_t* expected;
+
+  if (consumer->check) {
+    // Commands are contiguous in the stream, each with its terminator
+    expected = consumer->stream + consumer->stream_pos;
+    bt_spp_framer_slice(consumer->framer, offset, len, &slice);
+    CHECK(consumer->stream_pos + len < stream_len);
+    CHECK(expected[len] == '\r');
+    CHECK(memcmp(slice.data[0], expected, slice.len[0]) == 0);
+    CHECK(memcmp(slice.data[1], expected + slice.len[0], slice.len[1]) == 0);
+    consumer->stream_pos += len + 1;
+  }
+
+  consumer->commands++;
+  consumer->bytes += len;
+  consumer->last_emitted = true;
+  consumer->last_offset = offset;
+  consumer->last_len = len;
+  return true;
+}
+
+// Feeds the whole stream, releasing the commands emitted after each
+// fragment, like the consumer task keeping up
+static void run(struct consumer* consumer) {
+  struct bt_spp_framer framer;
+  size_t pos = 0;
+
+  memset(&framer, 0, sizeof(framer));
+  consumer->framer = &framer;
+  consumer->stream = stream;
+  consumer->stream_pos = 0;
+  consumer->commands = 0;
+  consumer->bytes = 0;
+
+  for (size_t i = 0; i < fragment_count; i++) {
+    if (bt_spp_framer_used(&framer) + fragments[i] >= BT_SPP_PEER_RECV_BUFFER_SIZE) {
+      CHECK(false);
+      return;
+    }
+
+    consumer->last_emitted = false;
+    bt_spp_framer_write(&framer, &stream[pos], fragments[i]);
+    bt_spp_framer_process(&framer, emit, consumer);
+    pos += fragments[i];
+
+    if (consumer->last_emitted) {
+      bt_spp_framer_release(&framer, consumer->last_offset, consumer->last_len);
+    }
+  }
+
+  CHECK_EQ(bt_spp_framer_used(&framer), 0);
+}
+
+int main(int argc, char** argv) {
+  bool quick = argc > 1 && strcmp(argv[1], "--quick") == 0;
+  int iterations = quick ? 3 : 50;
+  struct consumer consumer = { 0 };
+  uint32_t seed = 0x5bb;
+  double start;
+  double elapsed;
+
+  build_stream(quick ? 256 * 1024 : 4 * 1024 * 1024, &seed);
+  build_fragments(&seed);
+
+  consumer.check = true;
+  run(&consumer);
+  CHECK_EQ(consumer.commands, stream_commands);
+  CHECK_EQ(consumer.stream_pos, stream_len);
+
+  consumer.check = false;
+  start = host_test_now_s();
+  for (int i = 0; i < iterations; i++) {
+    run(&consumer);
+  }
+  elapsed = host_test_now_s() - start;
+
+  printf("spp_framer: %zu B in %zu fragments, %zu commands, %.1f MB/s, %.2f Mcommands/s\n",
+	 stream_len, fragment_count, stream_commands,
+	 stream_len * (double) iterations / elapsed / 1e6,
+	 stream_commands * (double) iterations / elapsed / 1e6);
+
+  free(fragments);
+  free(stream);
+  return HOST_TEST_RESULT();
+}
@@ -0,0 +1,50 @@
+#ifndef HOST_TEST_H
+#define HOST_TEST_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+/* Minimal checks for the host tests. A failed check is reported and
+   counted, and the test keeps going so every failure shows up in a
+   single run. */
+
+static int host_test_failures = 0;
+
+#define CHECK(cond)							\
+  do {									\
+    if (!(cond)) {							\
+      fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__, __LINE__, #cond); \
+      host_test_failures++;						\
+    }									\
+  } while (0)
+
+#define CHECK_EQ(a, b)							\
+  do {									\
+    long long _a = (long long) (a);					\
+    long long _b = (long long) (b);					\
+    if (_a != _b) {							\
+      fprintf(stderr, "%s:%d: check failed: %s == %s (%lld != %lld)\n", \
+	      __FILE__, __LINE__, #a, #b, _a, _b);			\
+      host_test_failures++;						\
+    }									\
+  } while (0)
+
+#define HOST_TEST_RESULT() (host_test_failures == 0 ? 0 : 1)
+
+/* xorshift32, so runs are reproducible across hosts */
+static inline uint32_t host_test_rand(uint32_t* state) {
+  uint32_t x = *state;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return *state = x;
+}
+
+static inline double host_test_now_s(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#endif
@@ -0,0 +1,16 @@
+/* Host stand-in for the RTC controller registers written by the ULP
+   waveform player. Tests define the register variables. */
+
+#ifndef SOC_RTC_CNTL_REG_H
+#define SOC_RTC_CNTL_REG_H
+
+#include <stdint.h>
+
+extern uint32_t host_rtc_cntl_cocpu_ctrl_reg;
+
+#define RTC_CNTL_COCPU_CTRL_REG (&host_rtc_cntl_cocpu_ctrl_reg)
+#define RTC_CNTL_COCPU_SW_INT_TRIGGER (1u << 26)
+
+#define SET_PERI_REG_MASK(reg, mask) (*(reg) |= (mask))
+
+#endif /* SOC_RTC_CNTL_REG_H */
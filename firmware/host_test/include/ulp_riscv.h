@@ -0,0 +1,6 @@
+/* Host stand-in for the ULP-RISC-V headers, see ulp_riscv_utils.h */
+
+#ifndef ULP_RISCV_H
+#define ULP_RISCV_H
+
+#endif /* ULP_RISCV_H */
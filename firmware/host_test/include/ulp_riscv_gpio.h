@@ -0,0 +1,11 @@
+/* Host stand-in for the ULP-RISC-V GPIO functions, see
+   ulp_riscv_utils.h */
+
+#ifndef ULP_RISCV_GPIO_H
+#define ULP_RISCV_GPIO_H
+
+#include <stdint.h>
+
+void ulp_riscv_gpio_output_level(uint32_t gpio_num, uint8_t level);
+
+#endif /* ULP_RISCV_GPIO_H */
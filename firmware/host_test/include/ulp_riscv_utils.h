@@ -0,0 +1,17 @@
+/* Host stand-in for the ULP-RISC-V utilities used by the waveform
+   player. Tests implement the functions, simulating the cycle counter
+   and recording what the player does. */
+
+#ifndef ULP_RISCV_UTILS_H
+#define ULP_RISCV_UTILS_H
+
+#include <stdint.h>
+
+/* As on the ESP32-S3 */
+#define ULP_RISCV_CYCLES_PER_US 8.5
+
+uint32_t ulp_riscv_get_cpu_cycles(void);
+void ulp_riscv_timer_stop(void);
+void ulp_riscv_wakeup_main_processor(void);
+
+#endif /* ULP_RISCV_UTILS_H */
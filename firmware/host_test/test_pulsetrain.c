@@ -0,0 +1,314 @@
+/* Round trip, truncated and corrupt input, and varint edge cases of the
+   pulse train codec. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "pulsetrain.h"
+
+#define MAX_PULSES 2048
+#define MAX_ENCODED (MAX_PULSES * PULSETRAIN_MAX_VARINT_LEN + 32)
+
+static struct pulsetrain_pulse pulses[MAX_PULSES];
+static struct pulsetrain_pulse decoded[MAX_PULSES + 1];
+static uint8_t encoded[MAX_ENCODED];
+
+static uint32_t quantized(uint32_t duration_us, uint32_t timebase_us) {
+  uint32_t units = (uint32_t) (((uint64_t) duration_us + timebase_us / 2) / timebase_us);
+  return (units == 0 && duration_us > 0 ? 1 : units) * timebase_us;
+}
+
+// Decodes the whole train, returning the status that ended it and the
+// number of pulses read in count
+static pulsetrain_status_t decode_all(const uint8_t* data, size_t len, size_t* count) {
+  struct pulsetrain_reader reader;
+  pulsetrain_status_t rc;
+
+  *count = 0;
+  if ((rc = pulsetrain_reader_init(&reader, data, len)) != PULSETRAIN_OK) {
+    return rc;
+  }
+
+  while (*count <= MAX_PULSES && (rc = pulsetrain_read(&reader, &decoded[*count])) == PULSETRAIN_OK) {
+    (*count)++;
+  }
+
+  return rc;
+}
+
+static void check_round_trip(size_t count, uint32_t timebase_us) {
+  size_t len;
+  size_t n;
+
+  CHECK_EQ(pulsetrain_encode(pulses, count, timebase_us, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  CHECK_EQ(decode_all(encoded, len, &n), PULSETRAIN_DONE);
+  CHECK_EQ(n, count);
+
+  for (size_t i = 0; i < n && i < count; i++) {
+    CHECK_EQ(decoded[i].level, pulses[i].level);
+    CHECK_EQ(decoded[i].duration_us, quantized(pulses[i].duration_us, timebase_us));
+  }
+}
+
+static void test_round_trip_random(void) {
+  uint32_t seed = 0x1234567;
+
+  for (int round = 0; round < 200; round++) {
+    size_t count = host_test_rand(&seed) % MAX_PULSES;
+    uint32_t timebase_us = 1 + host_test_rand(&seed) % 500;
+
+    for (size_t i = 0; i < count; i++) {
+      pulses[i].level = host_test_rand(&seed) & 1;
+      pulses[i].duration_us = host_test_rand(&seed) % 100000;
+    }
+
+    check_round_trip(count, timebase_us);
+  }
+}
+
+// Trains made of repeated sections, like the real ones, exercise the
+// repeat tokens
+static void test_round_trip_repeated(void) {
+  uint32_t seed = 0xbeef;
+  size_t len;
+
+  for (int round = 0; round < 200; round++) {
+    size_t period = 1 + host_test_rand(&seed) % (PULSETRAIN_MAX_REPEAT_PERIOD + 8);
+    size_t count = 0;
+
+    while (count + period <= MAX_PULSES) {
+      size_t reps = 1 + host_test_rand(&seed) % 12;
+      for (size_t i = 0; i < period; i++) {
+	pulses[count + i].level = i & 1;
+	pulses[count + i].duration_us = 100 * (1 + host_test_rand(&seed) % 8);
+      }
+      for (size_t r = 1; r < reps && count + (r + 1) * period <= MAX_PULSES; r++) {
+	memcpy(&pulses[count + r * period], &pulses[count], period * sizeof(pulses[0]));
+      }
+      count += period * reps;
+      if (count > MAX_PULSES) {
+	count = MAX_PULSES;
+      }
+      if (host_test_rand(&seed) % 4 == 0) {
+	break;
+      }
+    }
+
+    check_round_trip(count, 100);
+  }
+
+  // A long run of a single period should collapse to a few bytes
+  for (size_t i = 0; i < 1000; i++) {
+    pulses[i].level = i & 1;
+    pulses[i].duration_us = i & 1 ? 400 : 800;
+  }
+  CHECK_EQ(pulsetrain_encode(pulses, 1000, 400, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  CHECK(len < 16);
+  check_round_trip(1000, 400);
+}
+
+static void test_writer_round_trip(void) {
+  struct pulsetrain_writer writer;
+  size_t len;
+  size_t n;
+
+  CHECK_EQ(pulsetrain_writer_init(&writer, 50, encoded, sizeof(encoded)), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_put(&writer, true, 5000), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_begin_repeat(&writer), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_put(&writer, true, 100), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_put(&writer, false, 200), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_end_repeat(&writer, 7), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_put(&writer, false, 10000), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_finish(&writer, &len), PULSETRAIN_OK);
+  CHECK_EQ(writer.pulse_count, 16);
+
+  CHECK_EQ(decode_all(encoded, len, &n), PULSETRAIN_DONE);
+  CHECK_EQ(n, 16);
+  CHECK_EQ(decoded[0].duration_us, 5000);
+  for (size_t i = 1; i < 15; i++) {
+    CHECK_EQ(decoded[i].level, i & 1);
+    CHECK_EQ(decoded[i].duration_us, i & 1 ? 100 : 200);
+  }
+  CHECK_EQ(decoded[15].duration_us, 10000);
+
+  // Nested and unbalanced sections are rejected, and the error sticks
+  CHECK_EQ(pulsetrain_writer_init(&writer, 50, encoded, sizeof(encoded)), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_begin_repeat(&writer), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_begin_repeat(&writer), PULSETRAIN_ERR_INVALID_ARG);
+  CHECK_EQ(pulsetrain_writer_put(&writer, true, 100), PULSETRAIN_ERR_INVALID_ARG);
+
+  CHECK_EQ(pulsetrain_writer_init(&writer, 50, encoded, sizeof(encoded)), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_begin_repeat(&writer), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_finish(&writer, &len), PULSETRAIN_ERR_INVALID_ARG);
+
+  // Running out of space
+  CHECK_EQ(pulsetrain_writer_init(&writer, 50, encoded, 8), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_put(&writer, true, 100), PULSETRAIN_OK);
+  CHECK_EQ(pulsetrain_writer_put(&writer, true, 100), PULSETRAIN_ERR_NO_SPACE);
+  CHECK_EQ(pulsetrain_writer_finish(&writer, &len), PULSETRAIN_ERR_NO_SPACE);
+}
+
+// Every prefix of a train that cuts any of its pulses must be reported
+// as truncated. Only the END token can be missing, as the reader stops
+// once the pulse count in the header is reached.
+static void test_truncated(void) {
+  uint32_t seed = 42;
+  size_t count = 300;
+  size_t len;
+  size_t n;
+
+  for (size_t i = 0; i < count; i++) {
+    pulses[i].level = i & 1;
+    pulses[i].duration_us = i < 100 ? 300 * (1 + i % 3) : 1 + host_test_rand(&seed) % 60000;
+  }
+
+  CHECK_EQ(pulsetrain_encode(pulses, count, 10, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  CHECK_EQ(encoded[len - 1], PULSETRAIN_TOK_END);
+
+  CHECK_EQ(decode_all(encoded, 0, &n), PULSETRAIN_ERR_INVALID_ARG);
+  for (size_t cut = 1; cut < len - 1; cut++) {
+    CHECK_EQ(decode_all(encoded, cut, &n), PULSETRAIN_ERR_TRUNCATED);
+  }
+  CHECK_EQ(decode_all(encoded, len - 1, &n), PULSETRAIN_DONE);
+
+  // Out of space while encoding
+  for (size_t cap = 0; cap < len; cap++) {
+    CHECK_EQ(pulsetrain_encode(pulses, count, 10, encoded, cap, &n), PULSETRAIN_ERR_NO_SPACE);
+  }
+}
+
+// Corrupt input must end in an error or a short train, never in a
+// crash, an out of bounds read or an endless loop. The sanitizers catch
+// the former, and MAX_PULSES bounds the latter.
+static void test_corrupt(void) {
+  uint32_t seed = 7;
+  uint8_t corrupt[512];
+  size_t count = 200;
+  size_t len;
+  size_t n;
+
+  for (size_t i = 0; i < count; i++) {
+    pulses[i].level = i & 1;
+    pulses[i].duration_us = 250 * (1 + (i / 3) % 4);
+  }
+  CHECK_EQ(pulsetrain_encode(pulses, count, 250, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  CHECK(len <= sizeof(corrupt));
+
+  for (int round = 0; round < 20000; round++) {
+    memcpy(corrupt, encoded, len);
+    int flips = 1 + host_test_rand(&seed) % 4;
+    for (int f = 0; f < flips; f++) {
+      corrupt[host_test_rand(&seed) % len] ^= 1 << (host_test_rand(&seed) % 8);
+    }
+    // Only the exact copy of the heap buffer is readable, so reads past
+    // its end are caught
+    uint8_t* copy = malloc(len);
+    memcpy(copy, corrupt, len);
+    decode_all(copy, len, &n);
+    free(copy);
+  }
+
+  for (int round = 0; round < 20000; round++) {
+    size_t garbage_len = 1 + host_test_rand(&seed) % 64;
+    uint8_t* garbage = malloc(garbage_len);
+    for (size_t i = 0; i < garbage_len; i++) {
+      garbage[i] = host_test_rand(&seed);
+    }
+    garbage[0] = PULSETRAIN_FORMAT_VERSION;
+    decode_all(garbage, garbage_len, &n);
+    free(garbage);
+  }
+
+  // Unknown version
+  memcpy(corrupt, encoded, len);
+  corrupt[0] = PULSETRAIN_FORMAT_VERSION + 1;
+  CHECK_EQ(decode_all(corrupt, len, &n), PULSETRAIN_ERR_FORMAT);
+
+  // Repeat token pointing before the start of the data
+  const uint8_t bad_repeat[] = { PULSETRAIN_FORMAT_VERSION, 1, 4, (20 << 2) | PULSETRAIN_TOK_REPEAT, 1 };
+  CHECK_EQ(decode_all(bad_repeat, sizeof(bad_repeat), &n), PULSETRAIN_ERR_FORMAT);
+
+  // Repeat token with zero repetitions
+  const uint8_t zero_times[] = { PULSETRAIN_FORMAT_VERSION, 1, 4, (5 << 2) | PULSETRAIN_TOK_HIGH,
+				 (1 << 2) | PULSETRAIN_TOK_REPEAT, 0 };
+  CHECK_EQ(decode_all(zero_times, sizeof(zero_times), &n), PULSETRAIN_ERR_FORMAT);
+
+  // END before the pulse count in the header is reached
+  const uint8_t early_end[] = { PULSETRAIN_FORMAT_VERSION, 1, 2, (5 << 2) | PULSETRAIN_TOK_HIGH,
+				PULSETRAIN_TOK_END };
+  CHECK_EQ(decode_all(early_end, sizeof(early_end), &n), PULSETRAIN_ERR_FORMAT);
+  CHECK_EQ(n, 1);
+}
+
+static void test_varint_edges(void) {
+  const uint32_t timebases[] = { 1, 127, 128, 16383, 16384, 2097151, 2097152, UINT32_MAX };
+  struct pulsetrain_reader reader;
+  size_t len;
+  size_t n;
+
+  // The timebase goes through a varint of every length
+  for (size_t i = 0; i < sizeof(timebases) / sizeof(timebases[0]); i++) {
+    pulses[0].level = true;
+    pulses[0].duration_us = timebases[i];
+    CHECK_EQ(pulsetrain_encode(pulses, 1, timebases[i], encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+    CHECK_EQ(pulsetrain_reader_init(&reader, encoded, len), PULSETRAIN_OK);
+    CHECK_EQ(reader.timebase_us, timebases[i]);
+    CHECK_EQ(reader.remaining_pulses, 1);
+  }
+
+  // Longest pulse that fits in a token, and the first that doesn't
+  pulses[0].level = false;
+  pulses[0].duration_us = UINT32_MAX >> 2;
+  CHECK_EQ(pulsetrain_encode(pulses, 1, 1, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  CHECK_EQ(decode_all(encoded, len, &n), PULSETRAIN_DONE);
+  CHECK_EQ(n, 1);
+  CHECK_EQ(decoded[0].duration_us, UINT32_MAX >> 2);
+
+  pulses[0].duration_us = (UINT32_MAX >> 2) + 1;
+  CHECK_EQ(pulsetrain_encode(pulses, 1, 1, encoded, sizeof(encoded), &len), PULSETRAIN_ERR_INVALID_ARG);
+
+  // Pulses shorter than half the timebase are kept as one unit
+  pulses[0].duration_us = 1;
+  check_round_trip(1, 1000);
+  CHECK_EQ(decoded[0].duration_us, 1000);
+
+  // 5 byte varint whose last byte would overflow 32 bits
+  const uint8_t overflow[] = { PULSETRAIN_FORMAT_VERSION, 0xff, 0xff, 0xff, 0xff, 0x1f, 1 };
+  CHECK_EQ(pulsetrain_reader_init(&reader, overflow, sizeof(overflow)), PULSETRAIN_ERR_FORMAT);
+
+  // Largest 5 byte varint
+  const uint8_t max32[] = { PULSETRAIN_FORMAT_VERSION, 0xff, 0xff, 0xff, 0xff, 0x0f, 0 };
+  CHECK_EQ(pulsetrain_reader_init(&reader, max32, sizeof(max32)), PULSETRAIN_OK);
+  CHECK_EQ(reader.timebase_us, UINT32_MAX);
+
+  // Varint that doesn't end within PULSETRAIN_MAX_VARINT_LEN bytes
+  const uint8_t overlong[] = { PULSETRAIN_FORMAT_VERSION, 0x80, 0x80, 0x80, 0x80, 0x80, 0x01 };
+  CHECK_EQ(pulsetrain_reader_init(&reader, overlong, sizeof(overlong)), PULSETRAIN_ERR_FORMAT);
+
+  // Padded varints, as written by pulsetrain_writer_finish, are valid
+  const uint8_t padded[] = { PULSETRAIN_FORMAT_VERSION, 0x81, 0x80, 0x00, 0x82, 0x80, 0x80, 0x80, 0x00 };
+  CHECK_EQ(pulsetrain_reader_init(&reader, padded, sizeof(padded)), PULSETRAIN_OK);
+  CHECK_EQ(reader.timebase_us, 1);
+  CHECK_EQ(reader.remaining_pulses, 2);
+
+  // Zero timebase
+  const uint8_t zero_timebase[] = { PULSETRAIN_FORMAT_VERSION, 0, 0, PULSETRAIN_TOK_END };
+  CHECK_EQ(pulsetrain_reader_init(&reader, zero_timebase, sizeof(zero_timebase)), PULSETRAIN_ERR_FORMAT);
+  CHECK_EQ(pulsetrain_encode(pulses, 1, 0, encoded, sizeof(encoded), &len), PULSETRAIN_ERR_INVALID_ARG);
+
+  // Empty train
+  CHECK_EQ(pulsetrain_encode(NULL, 0, 10, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  CHECK_EQ(decode_all(encoded, len, &n), PULSETRAIN_DONE);
+  CHECK_EQ(n, 0);
+}
+
+int main(void) {
+  test_round_trip_random();
+  test_round_trip_repeated();
+  test_writer_round_trip();
+  test_truncated();
+  test_corrupt();
+  test_varint_edges();
+
+  return HOST_TEST_RESULT();
+}
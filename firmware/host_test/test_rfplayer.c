@@ -0,0 +1,258 @@
+/* Runs the ULP waveform player against timelines in the pulse train
+   format, on a simulated cycle counter, checking the levels and the
+   timing of the edges it outputs and how it reports its end. */
+
+#include <stdlib.h>
+#include <string.h>
+#include "host_test.h"
+#include "pulsetrain.h"
+#include "soc/rtc_cntl_reg.h"
+#include "ulp/rfplayer.h"
+#include "ulp_riscv_gpio.h"
+#include "ulp_riscv_utils.h"
+
+/* Cycles the simulated counter advances on each read, so busy waits
+   end. Edges come between one and two reads after their deadline. */
+#define CYCLES_PER_READ 3
+
+/* Same, for trains with pulses of minutes, so they play quickly. Their
+   pulses must last several reads. */
+#define LONG_CYCLES_PER_READ 4096
+
+#define GPIO_NUM 5
+#define MAX_EDGES 100000
+#define MAX_PULSES 4000
+
+/* Player state, defined by ulp/rfplayer.c, whose main is renamed */
+extern uint32_t gpio_num;
+extern uint32_t cycles_per_us_fp8;
+extern uint32_t timeline_len;
+extern uint8_t timeline[RFPLAYER_MAX_TIMELINE_LEN];
+extern volatile uint32_t done;
+extern volatile int32_t status;
+int rfplayer_main(void);
+
+struct edge {
+  uint8_t level;
+  uint32_t cycles;
+};
+
+uint32_t host_rtc_cntl_cocpu_ctrl_reg;
+
+static uint32_t cycles;
+static uint32_t cycles_per_read = CYCLES_PER_READ;
+static struct edge edges[MAX_EDGES];
+static size_t edge_count;
+static bool bad_gpio;
+static bool timer_stopped;
+static bool woke_up;
+static bool interrupted_before_wake_up;
+
+static struct pulsetrain_pulse pulses[MAX_PULSES];
+
+uint32_t ulp_riscv_get_cpu_cycles(void) {
+  uint32_t now = cycles;
+  cycles += cycles_per_read;
+  return now;
+}
+
+void ulp_riscv_timer_stop(void) {
+  timer_stopped = true;
+}
+
+void ulp_riscv_wakeup_main_processor(void) {
+  interrupted_before_wake_up = (host_rtc_cntl_cocpu_ctrl_reg & RTC_CNTL_COCPU_SW_INT_TRIGGER) != 0;
+  woke_up = true;
+}
+
+void ulp_riscv_gpio_output_level(uint32_t gpio, uint8_t level) {
+  bad_gpio |= gpio != GPIO_NUM;
+  if (edge_count < MAX_EDGES) {
+    edges[edge_count].level = level;
+    edges[edge_count].cycles = cycles;
+    edge_count++;
+  }
+}
+
+static void run_player(const uint8_t* data, size_t len, uint32_t start_cycles, uint32_t fp8) {
+  memcpy(timeline, data, len);
+  timeline_len = len;
+  gpio_num = GPIO_NUM;
+  cycles_per_us_fp8 = fp8;
+  done = 0;
+  status = 0;
+
+  cycles = start_cycles;
+  edge_count = 0;
+  bad_gpio = false;
+  timer_stopped = false;
+  woke_up = false;
+  interrupted_before_wake_up = false;
+  host_rtc_cntl_cocpu_ctrl_reg = 0;
+
+  rfplayer_main();
+}
+
+// Checks how the player ended: pin low, status published, timer
+// stopped, and the main processor interrupted and woken up
+static void check_end(pulsetrain_status_t expected) {
+  CHECK(edge_count > 0);
+  if (edge_count > 0) {
+    CHECK_EQ(edges[edge_count - 1].level, 0);
+  }
+  CHECK_EQ(done, 1);
+  CHECK_EQ(status, expected);
+  CHECK(timer_stopped);
+  CHECK(woke_up);
+  CHECK(interrupted_before_wake_up);
+  CHECK(!bad_gpio);
+}
+
+// Each edge must come once the previous pulse has lasted its duration,
+// measured from the first edge, so errors never accumulate.
+static void check_edges(const struct pulsetrain_pulse* expected, size_t count, uint32_t timebase_us,
+			uint32_t fp8) {
+  uint32_t deadline;
+
+  CHECK_EQ(edge_count, count + 1);
+  if (edge_count != count + 1) {
+    return;
+  }
+
+  // The first deadline is read right before the first edge
+  deadline = edges[0].cycles - cycles_per_read;
+  for (size_t i = 0; i < count; i++) {
+    uint32_t units = (expected[i].duration_us + timebase_us / 2) / timebase_us;
+
+    if (units == 0 && expected[i].duration_us > 0) {
+      units = 1;
+    }
+
+    CHECK_EQ(edges[i].level, expected[i].level);
+    CHECK((uint32_t) (edges[i].cycles - deadline) <= 2 * cycles_per_read);
+    deadline += (uint32_t) (((uint64_t) units * timebase_us * fp8) >> 8);
+  }
+
+  CHECK((uint32_t) (edges[count].cycles - deadline) <= 2 * cycles_per_read);
+}
+
+static void test_random_trains(void) {
+  uint8_t encoded[RFPLAYER_MAX_TIMELINE_LEN];
+  uint32_t seed = 0x5eed;
+  size_t len;
+
+  for (int round = 0; round < 50; round++) {
+    size_t count = 1 + host_test_rand(&seed) % 400;
+    uint32_t timebase_us = 1 + host_test_rand(&seed) % 20;
+
+    for (size_t i = 0; i < count; i++) {
+      pulses[i].level = host_test_rand(&seed) & 1;
+      pulses[i].duration_us = 1 + host_test_rand(&seed) % 5000;
+    }
+
+    CHECK_EQ(pulsetrain_encode(pulses, count, timebase_us, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+    run_player(encoded, len, host_test_rand(&seed), 0);
+    check_edges(pulses, count, timebase_us, RFPLAYER_NOMINAL_CYCLES_PER_US_FP8);
+    check_end(PULSETRAIN_DONE);
+  }
+}
+
+// Timeline shaped like the Clemsa ones: a repeated sync, then digits
+// made of repeated ASK ticks. It must fit the RTC memory of the player.
+static void test_repeated_timeline(void) {
+  uint8_t encoded[RFPLAYER_MAX_TIMELINE_LEN];
+  struct pulsetrain_writer writer;
+  size_t count = 0;
+  size_t len;
+
+  CHECK_EQ(pulsetrain_writer_init(&writer, 10, encoded, sizeof(encoded)), PULSETRAIN_OK);
+  pulsetrain_writer_begin_repeat(&writer);
+  pulsetrain_writer_put(&writer, true, 2070);
+  pulsetrain_writer_put(&writer, false, 1030);
+  pulsetrain_writer_end_repeat(&writer, 79);
+  for (int i = 0; i < 79; i++) {
+    pulses[count++] = (struct pulsetrain_pulse) { .level = true, .duration_us = 2070 };
+    pulses[count++] = (struct pulsetrain_pulse) { .level = false, .duration_us = 1030 };
+  }
+
+  for (int rep = 0; rep < 3; rep++) {
+    for (int digit = 0; digit < 36; digit++) {
+      int ticks = digit % 3 == 0 ? 17 : 7;
+      pulsetrain_writer_put(&writer, false, 60);
+      pulses[count++] = (struct pulsetrain_pulse) { .level = false, .duration_us = 60 };
+      pulsetrain_writer_begin_repeat(&writer);
+      pulsetrain_writer_put(&writer, true, 60);
+      pulsetrain_writer_put(&writer, false, 60);
+      pulsetrain_writer_end_repeat(&writer, ticks);
+      for (int t = 0; t < ticks; t++) {
+	pulses[count++] = (struct pulsetrain_pulse) { .level = true, .duration_us = 60 };
+	pulses[count++] = (struct pulsetrain_pulse) { .level = false, .duration_us = 60 };
+      }
+      pulsetrain_writer_put(&writer, false, 1000);
+      pulses[count++] = (struct pulsetrain_pulse) { .level = false, .duration_us = 1000 };
+    }
+  }
+
+  CHECK_EQ(pulsetrain_writer_finish(&writer, &len), PULSETRAIN_OK);
+  CHECK(count <= MAX_PULSES);
+
+  // Also check that the cycle counter wrapping doesn't disturb the
+  // timing
+  run_player(encoded, len, UINT32_MAX - 100000, 0);
+  check_edges(pulses, count, 10, RFPLAYER_NOMINAL_CYCLES_PER_US_FP8);
+  check_end(PULSETRAIN_DONE);
+}
+
+// Pulses whose cycles overflow 32 bits, or even the range of a single
+// deadline, played with a measured clock off its nominal frequency
+static void test_long_pulses(void) {
+  uint8_t encoded[64];
+  uint32_t fp8 = RFPLAYER_NOMINAL_CYCLES_PER_US_FP8 * 21 / 20;
+  size_t len;
+
+  pulses[0] = (struct pulsetrain_pulse) { .level = true, .duration_us = 1500000 };
+  pulses[1] = (struct pulsetrain_pulse) { .level = false, .duration_us = 2000 };
+  pulses[2] = (struct pulsetrain_pulse) { .level = true, .duration_us = 300000000 };
+  pulses[3] = (struct pulsetrain_pulse) { .level = false, .duration_us = 4000000 };
+
+  CHECK_EQ(pulsetrain_encode(pulses, 4, 50, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+  cycles_per_read = LONG_CYCLES_PER_READ;
+  run_player(encoded, len, UINT32_MAX - 1000, fp8);
+  check_edges(pulses, 4, 50, fp8);
+  check_end(PULSETRAIN_DONE);
+  cycles_per_read = CYCLES_PER_READ;
+}
+
+static void test_bad_timelines(void) {
+  uint8_t encoded[64];
+  size_t len;
+
+  for (size_t i = 0; i < 8; i++) {
+    pulses[i].level = i & 1;
+    pulses[i].duration_us = 100 * (i + 1);
+  }
+  CHECK_EQ(pulsetrain_encode(pulses, 8, 100, encoded, sizeof(encoded), &len), PULSETRAIN_OK);
+
+  // Cut in the middle of the pulses: the ones before are played
+  run_player(encoded, 6, 0, 0);
+  check_end(PULSETRAIN_ERR_TRUNCATED);
+  CHECK_EQ(edge_count, 4);
+
+  // Unknown version: nothing is played, and the pin is left low
+  encoded[0] = PULSETRAIN_FORMAT_VERSION + 1;
+  run_player(encoded, len, 0, 0);
+  check_end(PULSETRAIN_ERR_FORMAT);
+  CHECK_EQ(edge_count, 1);
+
+  run_player(encoded, 0, 0, 0);
+  check_end(PULSETRAIN_ERR_INVALID_ARG);
+}
+
+int main(void) {
+  test_random_trains();
+  test_repeated_timeline();
+  test_long_pulses();
+  test_bad_timelines();
+
+  return HOST_TEST_RESULT();
+}
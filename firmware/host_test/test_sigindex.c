@@ -0,0 +1,205 @@
+/* Insertion, lookup, collisions and duplicates of the signal index,
+   and fingerprints of jittered Clemsa captures. */
+
+#include <stdbool.h>
+#include <string.h>
+#include "host_test.h"
+#include "clemsacode_defs.h"
+#include "sigindex.h"
+
+#define CODE_LEN CLEMSA_CODEGEN_DEFAULT_CODE_SIZE
+#define MAX_PULSES 20000
+
+/* Max deviation of each edge of the synthetic captures */
+#define JITTER_US 8
+
+#define ASK_HALF_PERIOD_US (1000000 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY)
+#define CYCLE_US (CLEMSA_CODEGEN_CLK_HIGH_COUNT + CLEMSA_CODEGEN_CLK_LOW_COUNT)
+
+static struct pulsetrain_pulse pulses[MAX_PULSES];
+static size_t pulse_count;
+
+static void random_code(bool* code, uint32_t* seed) {
+  for (size_t i = 0; i < CODE_LEN; i++) {
+    code[i] = host_test_rand(seed) & 1;
+  }
+}
+
+static void fingerprint_code(const bool* code, struct sigindex_fingerprint* fingerprint) {
+  sigindex_fingerprint_bits(SIGINDEX_PROTO_CLEMSA, code, CODE_LEN, fingerprint);
+}
+
+static void test_insert_lookup(void) {
+  struct sigindex index;
+  struct sigindex_fingerprint fingerprints[20];
+  struct sigindex_fingerprint unknown;
+  bool code[CODE_LEN];
+  uint32_t seed = 0x51;
+  uint32_t id;
+
+  sigindex_init(&index);
+  for (uint32_t i = 0; i < 20; i++) {
+    random_code(code, &seed);
+    fingerprint_code(code, &fingerprints[i]);
+    CHECK_EQ(sigindex_insert(&index, &fingerprints[i], i + 1), ESP_OK);
+  }
+  CHECK_EQ(index.count, 20);
+
+  for (uint32_t i = 0; i < 20; i++) {
+    id = 0;
+    CHECK_EQ(sigindex_lookup(&index, &fingerprints[i], &id), ESP_OK);
+    CHECK_EQ(id, i + 1);
+  }
+
+  random_code(code, &seed);
+  fingerprint_code(code, &unknown);
+  CHECK_EQ(sigindex_lookup(&index, &unknown, &id), ESP_ERR_NOT_FOUND);
+}
+
+// Same hash with a different protocol or length, and different hashes
+// that land on the same slot, must all be told apart
+static void test_collisions(void) {
+  struct sigindex index;
+  struct sigindex_fingerprint fingerprints[6] = {
+    { .protocol = SIGINDEX_PROTO_CLEMSA, .bit_count = 36, .hash = 0x1234 },
+    { .protocol = SIGINDEX_PROTO_TESLA_CHARGER, .bit_count = 36, .hash = 0x1234 },
+    { .protocol = SIGINDEX_PROTO_CLEMSA, .bit_count = 35, .hash = 0x1234 },
+    { .protocol = SIGINDEX_PROTO_CLEMSA, .bit_count = 36, .hash = 0x1234 + SIGINDEX_CAPACITY },
+    { .protocol = SIGINDEX_PROTO_CLEMSA, .bit_count = 36, .hash = 0x1234 + 2 * SIGINDEX_CAPACITY },
+    // Wraps around the end of the table while probing
+    { .protocol = SIGINDEX_PROTO_CLEMSA, .bit_count = 36, .hash = SIGINDEX_CAPACITY - 1 },
+  };
+  uint32_t id;
+
+  sigindex_init(&index);
+  for (uint32_t i = 0; i < 6; i++) {
+    CHECK_EQ(sigindex_insert(&index, &fingerprints[i], 100 + i), ESP_OK);
+  }
+
+  for (uint32_t i = 0; i < 6; i++) {
+    id = 0;
+    CHECK_EQ(sigindex_lookup(&index, &fingerprints[i], &id), ESP_OK);
+    CHECK_EQ(id, 100 + i);
+  }
+}
+
+static void test_duplicates(void) {
+  struct sigindex index;
+  struct sigindex_fingerprint from_bits;
+  struct sigindex_fingerprint from_bytes;
+  uint8_t bytes[(CODE_LEN + 7) / 8] = { 0 };
+  bool code[CODE_LEN];
+  uint32_t seed = 0xd0;
+  uint32_t id;
+
+  random_code(code, &seed);
+  for (size_t i = 0; i < CODE_LEN; i++) {
+    bytes[i / 8] |= code[i] << (7 - i % 8);
+  }
+  fingerprint_code(code, &from_bits);
+  sigindex_fingerprint_bytes(SIGINDEX_PROTO_CLEMSA, bytes, CODE_LEN, &from_bytes);
+
+  sigindex_init(&index);
+  CHECK_EQ(sigindex_insert(&index, &from_bits, 1), ESP_OK);
+  CHECK_EQ(sigindex_insert(&index, &from_bits, 2), ESP_ERR_INVALID_STATE);
+
+  // The same payload packed in bytes is the same signal
+  CHECK_EQ(sigindex_insert(&index, &from_bytes, 3), ESP_ERR_INVALID_STATE);
+  CHECK_EQ(index.count, 1);
+  CHECK_EQ(sigindex_lookup(&index, &from_bytes, &id), ESP_OK);
+  CHECK_EQ(id, 1);
+}
+
+// A slot is kept free, so lookups of unknown signals end
+static void test_full(void) {
+  struct sigindex index;
+  struct sigindex_fingerprint fingerprint = { .protocol = SIGINDEX_PROTO_CLEMSA, .bit_count = 36 };
+  uint32_t id;
+
+  sigindex_init(&index);
+  for (uint32_t i = 0; i < SIGINDEX_CAPACITY - 1; i++) {
+    fingerprint.hash = i * 7;
+    CHECK_EQ(sigindex_insert(&index, &fingerprint, i), ESP_OK);
+  }
+
+  fingerprint.hash = 12345;
+  CHECK_EQ(sigindex_insert(&index, &fingerprint, 0), ESP_ERR_NO_MEM);
+  CHECK_EQ(sigindex_lookup(&index, &fingerprint, &id), ESP_ERR_NOT_FOUND);
+}
+
+static void put(bool level, int32_t duration_us, uint32_t* seed) {
+  duration_us += (int32_t) (host_test_rand(seed) % (2 * JITTER_US + 1)) - JITTER_US;
+
+  if (pulse_count > 0 && pulses[pulse_count - 1].level == level) {
+    pulses[pulse_count - 1].duration_us += duration_us;
+  } else if (pulse_count < MAX_PULSES) {
+    pulses[pulse_count++] = (struct pulsetrain_pulse) { .level = level, .duration_us = duration_us };
+  }
+}
+
+// Like the generator: a sync signal, then each digit as a burst of ASK
+// ticks within the high section of the base clock, and repetitions
+// separated by a few silent cycles
+static void build_capture(const bool* code, int repetitions, uint32_t* seed) {
+  pulse_count = 0;
+
+  for (int i = 0; i < CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES; i++) {
+    put(true, CLEMSA_CODEGEN_CLK_HIGH_COUNT, seed);
+    put(false, CLEMSA_CODEGEN_CLK_LOW_COUNT, seed);
+  }
+  put(false, CLEMSA_CODEGEN_WAIT_CLOCK_CYCLES * CYCLE_US, seed);
+
+  for (int rep = 0; rep < repetitions; rep++) {
+    for (size_t i = 0; i < CODE_LEN; i++) {
+      int ticks = code[i] ? CLEMSA_CODEGEN_ASK_TICKS_ONE : CLEMSA_CODEGEN_ASK_TICKS_ZERO;
+      int elapsed = 0;
+
+      for (int t = 0; t < ticks && elapsed + ASK_HALF_PERIOD_US <= CLEMSA_CODEGEN_CLK_HIGH_COUNT; t++) {
+	put(t % 2 == 0, ASK_HALF_PERIOD_US, seed);
+	elapsed += ASK_HALF_PERIOD_US;
+      }
+      put(false, CYCLE_US - elapsed, seed);
+    }
+    put(false, CLEMSA_CODEGEN_CYCLES_BETWEEN_REPETITIONS * CYCLE_US, seed);
+  }
+}
+
+static void test_captures(void) {
+  struct sigindex_fingerprint expected;
+  struct sigindex_fingerprint fingerprint;
+  bool code[CODE_LEN];
+  uint32_t seed = 0xca7;
+
+  for (int round = 0; round < 20; round++) {
+    random_code(code, &seed);
+    fingerprint_code(code, &expected);
+
+    build_capture(code, 2, &seed);
+    memset(&fingerprint, 0, sizeof(fingerprint));
+    CHECK_EQ(sigindex_fingerprint_clemsa_capture(pulses, pulse_count, CODE_LEN, &fingerprint), ESP_OK);
+    CHECK_EQ(fingerprint.hash, expected.hash);
+    CHECK_EQ(fingerprint.bit_count, CODE_LEN);
+
+    // Missing the sync and the start of the first code, the next
+    // repetition is used
+    CHECK_EQ(sigindex_fingerprint_clemsa_capture(pulses + 2 * CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES + 20,
+						 pulse_count - 2 * CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES - 20,
+						 CODE_LEN, &fingerprint), ESP_OK);
+    CHECK_EQ(fingerprint.hash, expected.hash);
+
+    // A single code cut short has no complete code
+    build_capture(code, 1, &seed);
+    CHECK_EQ(sigindex_fingerprint_clemsa_capture(pulses, pulse_count - 20, CODE_LEN, &fingerprint),
+	     ESP_ERR_NOT_FOUND);
+  }
+}
+
+int main(void) {
+  test_insert_lookup();
+  test_collisions();
+  test_duplicates();
+  test_full();
+  test_captures();
+
+  return HOST_TEST_RESULT();
+}
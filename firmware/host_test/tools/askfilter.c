@@ -0,0 +1,210 @@
+#include "askfilter.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include "clemsacode_defs.h"
+
+/* The ASK clock toggles the output, so the carrier runs at half its
+   frequency */
+#define ASKFILTER_CARRIER_HZ (CLEMSA_CODEGEN_ASK_CLK_FREQUENCY / 2)
+
+/* Expected length of the ASK burst of each digit. Bursts of ones are
+   cut by the falling edge of the base clock. */
+#define ASKFILTER_ZERO_BURST_US \
+  ((uint64_t) CLEMSA_CODEGEN_ASK_TICKS_ZERO * 1000000 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY)
+#define ASKFILTER_ONE_BURST_US                                                 \
+  ((uint64_t) CLEMSA_CODEGEN_ASK_TICKS_ONE * 1000000 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY < \
+   CLEMSA_CODEGEN_CLK_HIGH_COUNT                                               \
+   ? (uint64_t) CLEMSA_CODEGEN_ASK_TICKS_ONE * 1000000 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY \
+   : CLEMSA_CODEGEN_CLK_HIGH_COUNT)
+
+/* Bursts shorter than this are considered noise */
+#define ASKFILTER_MIN_BURST_US (ASKFILTER_ZERO_BURST_US / 2)
+
+/* A silence longer than this separates two code repetitions */
+#define ASKFILTER_REPETITION_GAP_US \
+  (2 * (CLEMSA_CODEGEN_CLK_HIGH_COUNT + CLEMSA_CODEGEN_CLK_LOW_COUNT))
+
+/* Fraction of the peak envelope power above which the carrier is
+   considered present (half of the peak amplitude) */
+#define ASKFILTER_THRESHOLD_DIV 4
+
+static float askfilter_template_i[ASKFILTER_MAX_TEMPLATE_LEN];
+static float askfilter_template_q[ASKFILTER_MAX_TEMPLATE_LEN];
+static float askfilter_corr_i[ASKFILTER_BLOCK_LEN];
+static float askfilter_corr_q[ASKFILTER_BLOCK_LEN];
+
+struct askfilter_decoder {
+  bool* code;
+  size_t code_len;
+  size_t digits;
+  bool synced;
+
+  bool in_burst;
+  size_t burst_start;
+  size_t burst_last_seen;
+  size_t last_burst_end;
+
+  float threshold;
+  size_t hold_len;
+  size_t min_burst_len;
+  size_t digit_threshold_len;
+  size_t repetition_gap_len;
+};
+
+static size_t askfilter_us_to_samples(uint64_t micros, uint32_t sample_rate_hz) {
+  return (size_t) ((micros * sample_rate_hz + 500000) / 1000000);
+}
+
+// Builds an in-phase and quadrature square wave template of the
+// carrier, both zero mean, so a constant level on the input does not
+// correlate with them.
+static size_t askfilter_build_templates(uint32_t sample_rate_hz) {
+  size_t len = (size_t) (((uint64_t) sample_rate_hz * ASKFILTER_TEMPLATE_PERIODS +
+			  ASKFILTER_CARRIER_HZ / 2) / ASKFILTER_CARRIER_HZ);
+
+  for (size_t n = 0; n < len; n++) {
+    // Phase within the carrier period, in quarters of period
+    uint32_t quarter = (uint32_t) (((uint64_t) n * ASKFILTER_CARRIER_HZ * 4 / sample_rate_hz) % 4);
+    askfilter_template_i[n] = quarter < 2 ? 1.0f : -1.0f;
+    askfilter_template_q[n] = (quarter == 0 || quarter == 3) ? 1.0f : -1.0f;
+  }
+
+  return len;
+}
+
+static void askfilter_correlate(const float* samples, size_t out_count, const float* tpl,
+				size_t tpl_len, float* out) {
+  for (size_t n = 0; n < out_count; n++) {
+    float acc = 0;
+    for (size_t k = 0; k < tpl_len; k++) {
+      acc += samples[n + k] * tpl[k];
+    }
+    out[n] = acc;
+  }
+}
+
+// Runs the filter over the whole capture, calling on_block with the
+// envelope power of each block of outputs.
+static bool askfilter_run(const float* samples, size_t count, size_t tpl_len,
+			  bool (*on_block)(void* arg, size_t offset, size_t len), void* arg) {
+  size_t outputs = count - tpl_len + 1;
+
+  for (size_t offset = 0; offset < outputs; offset += ASKFILTER_BLOCK_LEN) {
+    size_t len = outputs - offset < ASKFILTER_BLOCK_LEN ? outputs - offset : ASKFILTER_BLOCK_LEN;
+
+    askfilter_correlate(samples + offset, len, askfilter_template_i, tpl_len, askfilter_corr_i);
+    askfilter_correlate(samples + offset, len, askfilter_template_q, tpl_len, askfilter_corr_q);
+
+    for (size_t n = 0; n < len; n++) {
+      askfilter_corr_i[n] = askfilter_corr_i[n] * askfilter_corr_i[n] +
+	askfilter_corr_q[n] * askfilter_corr_q[n];
+    }
+
+    if (on_block(arg, offset, len)) {
+      return true;
+    }
+  }
+
+  return false;
+}
+
+static bool askfilter_find_peak(void* arg, size_t offset, size_t len) {
+  float* peak = (float*) arg;
+
+  for (size_t n = 0; n < len; n++) {
+    if (askfilter_corr_i[n] > *peak) {
+      *peak = askfilter_corr_i[n];
+    }
+  }
+
+  return false;
+}
+
+static bool askfilter_decoder_burst(struct askfilter_decoder* decoder, size_t start, size_t end) {
+  size_t len = end - start;
+
+  if (len < decoder->min_burst_len) {
+    return false;
+  }
+
+  if (start - decoder->last_burst_end >= decoder->repetition_gap_len) {
+    // Either the sync signal, which doesn't carry the ASK carrier, or
+    // the gap between repetitions. A complete code starts here.
+    decoder->digits = 0;
+    decoder->synced = true;
+  }
+  decoder->last_burst_end = end;
+
+  if (!decoder->synced) {
+    return false;
+  }
+
+  decoder->code[decoder->digits++] = len > decoder->digit_threshold_len;
+  return decoder->digits == decoder->code_len;
+}
+
+static bool askfilter_decoder_block(void* arg, size_t offset, size_t len) {
+  struct askfilter_decoder* decoder = (struct askfilter_decoder*) arg;
+
+  for (size_t n = 0; n < len; n++) {
+    bool present = askfilter_corr_i[n] > decoder->threshold;
+
+    if (present) {
+      if (!decoder->in_burst) {
+	decoder->in_burst = true;
+	decoder->burst_start = offset + n;
+      }
+      decoder->burst_last_seen = offset + n;
+    } else if (decoder->in_burst && offset + n - decoder->burst_last_seen > decoder->hold_len) {
+      // Noise may briefly drop the envelope in the middle of a burst,
+      // so it only ends after the carrier has been missing for a
+      // while.
+      decoder->in_burst = false;
+      if (askfilter_decoder_burst(decoder, decoder->burst_start, decoder->burst_last_seen + 1)) {
+	return true;
+      }
+    }
+  }
+
+  return false;
+}
+
+esp_err_t askfilter_decode_clemsa(const float* samples, size_t count, uint32_t sample_rate_hz,
+				  bool* code, size_t code_len) {
+  struct askfilter_decoder decoder = {0};
+  float peak = 0;
+  size_t tpl_len;
+
+  if (sample_rate_hz < 2 * CLEMSA_CODEGEN_ASK_CLK_FREQUENCY || code_len == 0) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  if ((uint64_t) sample_rate_hz * ASKFILTER_TEMPLATE_PERIODS / ASKFILTER_CARRIER_HZ >= ASKFILTER_MAX_TEMPLATE_LEN) {
+    return ESP_ERR_INVALID_ARG;
+  }
+
+  tpl_len = askfilter_build_templates(sample_rate_hz);
+  if (count < tpl_len) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  askfilter_run(samples, count, tpl_len, askfilter_find_peak, &peak);
+  if (peak <= 0) {
+    return ESP_ERR_NOT_FOUND;
+  }
+
+  decoder.code = code;
+  decoder.code_len = code_len;
+  decoder.min_burst_len = askfilter_us_to_samples(ASKFILTER_MIN_BURST_US, sample_rate_hz);
+  decoder.digit_threshold_len = askfilter_us_to_samples((ASKFILTER_ZERO_BURST_US + ASKFILTER_ONE_BURST_US) / 2,
+							sample_rate_hz);
+  decoder.repetition_gap_len = askfilter_us_to_samples(ASKFILTER_REPETITION_GAP_US, sample_rate_hz);
+
+  decoder.threshold = peak / ASKFILTER_THRESHOLD_DIV;
+  decoder.hold_len = tpl_len / 2;
+  if (askfilter_run(samples, count, tpl_len, askfilter_decoder_block, &decoder)) {
+    return ESP_OK;
+  }
+
+  return ESP_ERR_NOT_FOUND;
+}
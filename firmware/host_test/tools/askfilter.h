@@ -0,0 +1,42 @@
+#ifndef ASKFILTER_H
+#define ASKFILTER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+
+/* ASK matched filter for decoding captures of Clemsa transmissions
+   taken on the host. The firmware has no receiver, so it is not part
+   of the app. */
+
+/* Number of carrier periods covered by the symbol template. Longer
+   templates reject more noise, but must stay shorter than the
+   shortest ASK burst to be detected. */
+#define ASKFILTER_TEMPLATE_PERIODS 4
+
+/* Max length, in samples, of the symbol template. Limits the max
+   sample rate of the captures. */
+#define ASKFILTER_MAX_TEMPLATE_LEN 256
+
+/* Number of correlation outputs computed on each pass of the
+   filter. */
+#define ASKFILTER_BLOCK_LEN 512
+
+/**
+ * Recovers the first complete Clemsa code of code_len digits carried by
+ * a sampled capture of a receiver output, by correlating it against
+ * the ASK carrier and measuring the length of the resulting bursts.
+ * Unlike edge based decoding, this keeps working on captures of weak
+ * signals where noise produces spurious edges.
+ *
+ * samples holds the capture sampled at sample_rate_hz, which must be
+ * at least twice the frequency of the ASK clock. Returns
+ * ESP_ERR_NOT_FOUND if the capture does not contain a complete code.
+ *
+ * Uses static scratch buffers, so it must not be called concurrently.
+ */
+esp_err_t askfilter_decode_clemsa(const float* samples, size_t count, uint32_t sample_rate_hz,
+				  bool* code, size_t code_len);
+
+#endif /* ASKFILTER_H */
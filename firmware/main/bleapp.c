@@ -8,10 +8,16 @@ void app_main(void) {
   RF_LOGI("Device is up!");
   init_status_led();
   init_nvs();
+  init_power_management();
   init_pairing_mode_button();
   init_antenna();
-  init_clemsa_codegen();
+  rf_core_init();
+  init_ble_frontend();
+  init_spp_frontend();
 
+  // Migration: firmwares that rebooted to switch modes left the
+  // requested mode in NVS. Honour it once and clear it, so a device
+  // updated in the middle of a switch still ends up in that mode.
   uint8_t boot_mode = rf_app_get_next_boot_mode();
   RF_LOGI("Next boot mode: %d", boot_mode);
   rf_app_clear_next_boot_mode();
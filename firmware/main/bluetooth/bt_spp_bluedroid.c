@@ -4,6 +4,9 @@
  * SPDX-License-Identifier: Unlicense OR CC0-1.0
  */
 
+#include "sdkconfig.h"
+
+#if CONFIG_RFAPP_FRONTEND_SPP
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -15,6 +18,7 @@
 #include "nvs_flash.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "freertos/semphr.h"
 #include "esp_log.h"
 #include "esp_bt.h"
 #include "esp_bt_main.h"
@@ -35,6 +39,27 @@
 static struct bt_spp_bluedroid_peer peer = {0};
 static struct bt_spp_bluedroid_config bt_spp_config = {0};
 
+/* Send buffers are handed between the free and send queues by
+   reference. Both can hold the whole pool, so queueing never fails. */
+static struct bt_spp_bluedroid_send_msg send_pool[BT_SPP_SEND_POOL_SIZE];
+
+static StaticQueue_t send_free_queue_holder;
+static uint8_t send_free_queue_storage[BT_SPP_SEND_POOL_SIZE * sizeof(struct bt_spp_bluedroid_send_msg*)];
+static QueueHandle_t send_free_queue;
+
+static StaticQueue_t send_queue_holder;
+static uint8_t send_queue_storage[BT_SPP_SEND_POOL_SIZE * sizeof(struct bt_spp_bluedroid_send_msg*)];
+static QueueHandle_t send_queue;
+
+/* Serializes the writes, and the congestion state of the peer, between
+   the senders and the Bluetooth task */
+static StaticSemaphore_t send_lock_storage;
+static SemaphoreHandle_t send_lock;
+
+/* Queued messages merged together. esp_spp_write() copies the data,
+   so a single buffer is enough. */
+static uint8_t send_batch[BT_SPP_SEND_BATCH_SIZE];
+
 static const esp_spp_mode_t esp_spp_mode = ESP_SPP_MODE_CB;
 static const bool esp_spp_enable_l2cap_ertm = true;
 
@@ -58,22 +83,74 @@ static char *bda2str(uint8_t * bda, char *str, size_t size)
 
 void bt_spp_peer_reset() {
   peer.handle = 0;
-  peer.data_len = 0;
+  bt_spp_framer_reset(&peer.framer);
   peer.cong = false;
   peer.write_ready = true;
 }
 
-static bool bt_spp_poll_send_queue() {
-  struct bt_spp_bluedroid_send_msg msg;
+static void bt_spp_send_free(struct bt_spp_bluedroid_send_msg* msg) {
+  xQueueSend(send_free_queue, &msg, 0);
+}
+
+struct bt_spp_bluedroid_send_msg* bt_spp_send_alloc(TickType_t timeout) {
+  struct bt_spp_bluedroid_send_msg* msg;
 
-  if (xQueueReceive(bt_spp_config.send_queue, &msg, 0) == pdTRUE) {
-    ESP_LOGI(SPP_TAG, "Polled message from send queue");
-    ESP_ERROR_CHECK(esp_spp_write(msg.handle, msg.data_len, msg.buffer));
-    return true;
+  if (xQueueReceive(send_free_queue, &msg, timeout) != pdTRUE) {
+    return NULL;
   }
 
-  ESP_LOGI(SPP_TAG, "Polled send queue but it was empty");
-  return false;
+  return msg;
+}
+
+// Writes the next queued message, merged with the ones after it for the
+// same peer, while they fit in a batch. Messages left for a previous
+// peer, or whose write fails, are dropped until a write is in flight,
+// so they never stall the current peer. Needs send_lock.
+static esp_err_t bt_spp_poll_send_queue() {
+  struct bt_spp_bluedroid_send_msg* msg;
+  struct bt_spp_bluedroid_send_msg* next;
+  uint32_t handle;
+  size_t len;
+  esp_err_t err = ESP_OK;
+
+  while (xQueueReceive(send_queue, &msg, 0) == pdTRUE) {
+    if (msg->handle != peer.handle) {
+      ESP_LOGW(SPP_TAG, "Dropping message for disconnected peer %" PRIu32, msg->handle);
+      bt_spp_send_free(msg);
+      continue;
+    }
+
+    if (xQueuePeek(send_queue, &next, 0) != pdTRUE
+	|| next->handle != msg->handle
+	|| msg->data_len + next->data_len > BT_SPP_SEND_BATCH_SIZE) {
+      err = esp_spp_write(msg->handle, msg->data_len, msg->buffer);
+      bt_spp_send_free(msg);
+    } else {
+      handle = msg->handle;
+      len = 0;
+
+      do {
+	memcpy(send_batch + len, msg->buffer, msg->data_len);
+	len += msg->data_len;
+	bt_spp_send_free(msg);
+      } while (xQueuePeek(send_queue, &msg, 0) == pdTRUE
+	       && msg->handle == handle
+	       && len + msg->data_len <= BT_SPP_SEND_BATCH_SIZE
+	       && xQueueReceive(send_queue, &msg, 0) == pdTRUE);
+
+      ESP_LOGD(SPP_TAG, "Merged queued messages into a write of %zu bytes", len);
+      err = esp_spp_write(handle, len, send_batch);
+    }
+
+    if (err == ESP_OK) {
+      peer.write_ready = false;
+      break;
+    }
+
+    ESP_LOGE(SPP_TAG, "Cannot write to peer: %s", esp_err_to_name(err));
+  }
+
+  return err;
 }
 
 static struct bt_spp_bluedroid_peer* bt_spp_alloc_peer(uint32_t handle) {
@@ -92,50 +169,28 @@ static bool bt_spp_peer_clear_to_send(struct bt_spp_bluedroid_peer* peer) {
   return peer->write_ready && !peer->cong;
 }
 
-void process_peer_buffer(struct bt_spp_bluedroid_peer* peer) {
-  struct bt_spp_bluedroid_msg_event evt;
-
-  char* buf = (char*) peer->buffer;
-  char ch;
-  evt.handle = peer->handle;
-  size_t cur_cmd_start = 0; // Beginning of next command, inclusive
-
-  ESP_LOGI(SPP_TAG, "Contents of peer buffer before scan: %zd", peer->data_len);
-  ESP_LOG_BUFFER_HEXDUMP(SPP_TAG, peer->buffer, peer->data_len, ESP_LOG_INFO);
-
-  for (size_t i = 0; i < peer->data_len; i++) {
-    ch = buf[i];
-    if (ch == '\r') {
-      // Command found between cur_cmd_start and i
-      evt.data_len = i - cur_cmd_start;
-      memcpy(evt.buffer, buf + cur_cmd_start, evt.data_len);
-      evt.buffer[evt.data_len] = '\0';
-      cur_cmd_start = i + 1;
-
-      ESP_LOGI(SPP_TAG, "Will emit message received event with data:");
-      ESP_LOG_BUFFER_HEXDUMP(SPP_TAG, evt.buffer, evt.data_len + 1, ESP_LOG_INFO);
+// Queues a command found by the framer to the consumer
+static bool bt_spp_peer_emit(uint32_t offset, size_t len, void* arg) {
+  struct bt_spp_bluedroid_peer* peer = arg;
+  struct bt_spp_bluedroid_msg_event evt = {
+    .handle = peer->handle,
+    .offset = offset,
+    .data_len = len,
+  };
 
-      if (xQueueSend(bt_spp_config.recv_queue, &evt, 0) != pdTRUE) {
-	ESP_LOGE(SPP_TAG, "Cannot handle next SPP message! Queue overflow! Discarding!");
-      }
-    }
+  if (xQueueSend(bt_spp_config.recv_queue, &evt, 0) != pdTRUE) {
+    ESP_LOGE(SPP_TAG, "Cannot handle next SPP message! Queue overflow! Discarding!");
+    return false;
   }
 
-  if (cur_cmd_start < peer->data_len) {
-    memmove(peer->buffer, peer->buffer + cur_cmd_start, peer->data_len - cur_cmd_start);
-  } else {
-    peer->data_len = 0;
-  }
-
-  ESP_LOGI(SPP_TAG, "Contents of peer buffer after scan:");
-  ESP_LOG_BUFFER_HEXDUMP(SPP_TAG, peer->buffer, peer->data_len, ESP_LOG_INFO);
+  return true;
 }
 
 static void esp_spp_handle_msg(struct spp_data_ind_evt_param* param) {
 
   struct bt_spp_bluedroid_peer* peer = bt_spp_alloc_peer(param->handle);
 
-  if (peer->data_len + param->len >= BT_SPP_PEER_RECV_BUFFER_SIZE) {
+  if (bt_spp_framer_used(&peer->framer) + param->len >= BT_SPP_PEER_RECV_BUFFER_SIZE) {
     esp_spp_disconnect(peer->handle);
     ESP_LOGE(SPP_TAG, "Client %" PRIu32 " did overflow the reception buffer. Disconnected", peer->handle);
     return;
@@ -145,22 +200,61 @@ static void esp_spp_handle_msg(struct spp_data_ind_evt_param* param) {
     return;
   }
 
-  memcpy(peer->buffer + peer->data_len, param->data, param->len);
-  peer->data_len += param->len;
+  ESP_LOG_BUFFER_HEXDUMP(SPP_TAG, param->data, param->len, ESP_LOG_VERBOSE);
+
+  bt_spp_framer_write(&peer->framer, param->data, param->len);
+  bt_spp_framer_process(&peer->framer, bt_spp_peer_emit, peer);
+}
 
-  process_peer_buffer(peer);
+void bt_spp_msg_slice(const struct bt_spp_bluedroid_msg_event* evt, struct bt_spp_slice* slice) {
+  bt_spp_framer_slice(&peer.framer, evt->offset, evt->data_len, slice);
+}
+
+bool bt_spp_msg_equals(const struct bt_spp_bluedroid_msg_event* evt, const char* str) {
+  struct bt_spp_slice slice;
+
+  if (strlen(str) != evt->data_len) {
+    return false;
+  }
+
+  bt_spp_msg_slice(evt, &slice);
+  return memcmp(slice.data[0], str, slice.len[0]) == 0
+    && memcmp(slice.data[1], str + slice.len[0], slice.len[1]) == 0;
+}
+
+void bt_spp_msg_release(const struct bt_spp_bluedroid_msg_event* evt) {
+  bt_spp_framer_release(&peer.framer, evt->offset, evt->data_len);
 }
 
 static void esp_spp_handle_cong(struct spp_cong_evt_param* param) {
+  xSemaphoreTake(send_lock, portMAX_DELAY);
+
   struct bt_spp_bluedroid_peer* peer = bt_spp_alloc_peer(param->handle);
   peer->cong = param->cong;
 
   if (bt_spp_peer_clear_to_send(peer)) {
     bt_spp_poll_send_queue();
   }
+
+  xSemaphoreGive(send_lock);
+}
+
+// Forgets the peer once its connection is gone, so the messages left
+// for it are dropped and the next client starts clear to send
+static void esp_spp_handle_close(struct spp_close_evt_param* param) {
+  xSemaphoreTake(send_lock, portMAX_DELAY);
+
+  if (param->handle == peer.handle) {
+    bt_spp_peer_reset();
+    bt_spp_poll_send_queue();
+  }
+
+  xSemaphoreGive(send_lock);
 }
 
 static void esp_spp_handle_write_event(struct spp_write_evt_param* param) {
+  xSemaphoreTake(send_lock, portMAX_DELAY);
+
   struct bt_spp_bluedroid_peer* peer = bt_spp_alloc_peer(param->handle);
   peer->write_ready = true;
   peer->cong = param->cong;
@@ -168,20 +262,31 @@ static void esp_spp_handle_write_event(struct spp_write_evt_param* param) {
   if (bt_spp_peer_clear_to_send(peer)) {
     bt_spp_poll_send_queue();
   }
+
+  xSemaphoreGive(send_lock);
 }
 
-void bt_spp_send_msg(struct bt_spp_bluedroid_send_msg *msg) {
-  ESP_LOGI(SPP_TAG, "Will try to send");
-  struct bt_spp_bluedroid_peer* peer = bt_spp_alloc_peer(msg->handle);
-  ESP_LOGI(SPP_TAG, "Write ready? %d; Cong? %d", peer->write_ready, peer->cong);
-  if (bt_spp_peer_clear_to_send(peer)) {
-    ESP_LOGI(SPP_TAG, "Clear to send to peer %" PRIu32, peer->handle);
-    ESP_ERROR_CHECK(esp_spp_write(peer->handle, msg->data_len, msg->buffer));
-  } else if (xQueueSend(bt_spp_config.send_queue, msg, 0) != pdTRUE) {
-    ESP_LOGE(SPP_TAG, "Cannot schedule message for sending. Send queue is full!");
+esp_err_t bt_spp_send_msg(struct bt_spp_bluedroid_send_msg *msg) {
+  esp_err_t err = ESP_OK;
+
+  xSemaphoreTake(send_lock, portMAX_DELAY);
+
+  if (msg->handle != peer.handle) {
+    ESP_LOGW(SPP_TAG, "Dropping message for disconnected peer %" PRIu32, msg->handle);
+    bt_spp_send_free(msg);
+    err = ESP_ERR_INVALID_STATE;
   } else {
-    ESP_LOGI(SPP_TAG, "Message scheduled to be sent");
+    // Queued behind any pending message, to keep the order
+    xQueueSend(send_queue, &msg, 0);
+    if (bt_spp_peer_clear_to_send(&peer)) {
+      err = bt_spp_poll_send_queue();
+    } else {
+      ESP_LOGD(SPP_TAG, "Message queued; write_ready=%d; cong=%d", peer.write_ready, peer.cong);
+    }
   }
+
+  xSemaphoreGive(send_lock);
+  return err;
 }
 
 static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
@@ -206,6 +311,7 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
     case ESP_SPP_CLOSE_EVT:
         ESP_LOGI(SPP_TAG, "ESP_SPP_CLOSE_EVT status:%d handle:%"PRIu32" close_by_remote:%d", param->close.status,
                  param->close.handle, param->close.async);
+        esp_spp_handle_close(&param->close);
         break;
     case ESP_SPP_START_EVT:
         if (param->start.status == ESP_SPP_SUCCESS) {
@@ -221,15 +327,15 @@ static void esp_spp_cb(esp_spp_cb_event_t event, esp_spp_cb_param_t *param)
         ESP_LOGI(SPP_TAG, "ESP_SPP_CL_INIT_EVT");
         break;
     case ESP_SPP_DATA_IND_EVT:
-      ESP_LOGI(SPP_TAG, "DATA IND peer %" PRIu32, param->data_ind.handle);
+      ESP_LOGV(SPP_TAG, "DATA IND peer %" PRIu32, param->data_ind.handle);
       esp_spp_handle_msg(&param->data_ind);
         break;
     case ESP_SPP_CONG_EVT:
-        ESP_LOGI(SPP_TAG, "ESP_SPP_CONG_EVT");
+        ESP_LOGD(SPP_TAG, "ESP_SPP_CONG_EVT cong:%d", param->cong.cong);
 	esp_spp_handle_cong(&param->cong);
         break;
     case ESP_SPP_WRITE_EVT:
-        ESP_LOGI(SPP_TAG, "ESP_SPP_WRITE_EVT");
+        ESP_LOGV(SPP_TAG, "ESP_SPP_WRITE_EVT len:%d cong:%d", param->write.len, param->write.cong);
 	esp_spp_handle_write_event(&param->write);
         break;
     case ESP_SPP_SRV_OPEN_EVT:
@@ -312,6 +418,17 @@ void bt_spp_bluedroid_init(struct bt_spp_bluedroid_config* cfg) {
   esp_err_t ret = nvs_flash_init();
 
   memcpy(&bt_spp_config, cfg, sizeof(struct bt_spp_bluedroid_config));
+
+  send_free_queue = xQueueCreateStatic(BT_SPP_SEND_POOL_SIZE, sizeof(struct bt_spp_bluedroid_send_msg*),
+				       send_free_queue_storage, &send_free_queue_holder);
+  send_queue = xQueueCreateStatic(BT_SPP_SEND_POOL_SIZE, sizeof(struct bt_spp_bluedroid_send_msg*),
+				  send_queue_storage, &send_queue_holder);
+  send_lock = xSemaphoreCreateMutexStatic(&send_lock_storage);
+
+  for (size_t i = 0; i < BT_SPP_SEND_POOL_SIZE; i++) {
+    bt_spp_send_free(&send_pool[i]);
+  }
+
   if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
     ESP_ERROR_CHECK(nvs_flash_erase());
     ret = nvs_flash_init();
@@ -376,3 +493,4 @@ void bt_spp_bluedroid_init(struct bt_spp_bluedroid_config* cfg) {
 
   ESP_LOGI(SPP_TAG, "Own address:[%s]", bda2str((uint8_t *)esp_bt_dev_get_address(), bda_str, sizeof(bda_str)));
 }
+#endif
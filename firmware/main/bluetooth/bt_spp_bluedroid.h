@@ -1,23 +1,33 @@
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
 #include "freertos/queue.h"
+#include "bt_spp_framer.h"
 
-#define BT_SPP_PEER_RECV_BUFFER_SIZE 256
 #define BT_SPP_PEER_SEND_BUFFER_SIZE 256
-#define BT_SPP_SEND_QUEUE_SIZE 10
+
+/* Number of send buffers. Once all are taken, senders wait for one to
+   be written in bt_spp_send_alloc(). */
+#define BT_SPP_SEND_POOL_SIZE 10
+
+/* Largest write made of queued messages merged together */
+#define BT_SPP_SEND_BATCH_SIZE 512
 
 struct bt_spp_bluedroid_peer {
   uint32_t handle;
-  uint8_t buffer[BT_SPP_PEER_RECV_BUFFER_SIZE];
-  size_t data_len;
+  struct bt_spp_framer framer;
   bool cong;
   bool write_ready;
 };
 
+/* A command received, without its terminator. It points into the
+   reception ring, and needs to be released with bt_spp_msg_release()
+   once handled, in the order they were received. */
 struct bt_spp_bluedroid_msg_event {
   uint32_t handle;
-  char buffer[BT_SPP_PEER_RECV_BUFFER_SIZE];
+  uint32_t offset;
   size_t data_len;
 };
 
@@ -29,9 +39,22 @@ struct bt_spp_bluedroid_send_msg {
 
 struct bt_spp_bluedroid_config {
   QueueHandle_t recv_queue;
-  QueueHandle_t send_queue;
 };
 
 void bt_spp_bluedroid_init(struct bt_spp_bluedroid_config* config);
 void bt_spp_peer_reset();
-void bt_spp_send_msg(struct bt_spp_bluedroid_send_msg *msg);
+
+/** Takes a buffer from the send pool, waiting up to timeout for one
+    to be free. Returns NULL if none got free in time. */
+struct bt_spp_bluedroid_send_msg* bt_spp_send_alloc(TickType_t timeout);
+
+/** Sends a message taken with bt_spp_send_alloc(), giving the buffer
+    back to the pool. It is written right away if the link is clear,
+    or queued otherwise and merged with the messages queued after it.
+    Returns ESP_ERR_INVALID_STATE if the peer is not connected anymore,
+    or the error of the write. */
+esp_err_t bt_spp_send_msg(struct bt_spp_bluedroid_send_msg *msg);
+
+void bt_spp_msg_slice(const struct bt_spp_bluedroid_msg_event* evt, struct bt_spp_slice* slice);
+bool bt_spp_msg_equals(const struct bt_spp_bluedroid_msg_event* evt, const char* str);
+void bt_spp_msg_release(const struct bt_spp_bluedroid_msg_event* evt);
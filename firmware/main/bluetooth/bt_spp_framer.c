@@ -0,0 +1,91 @@
+#include "bt_spp_framer.h"
+#include <string.h>
+
+#define RING_MASK (BT_SPP_PEER_RECV_BUFFER_SIZE - 1)
+
+_Static_assert((BT_SPP_PEER_RECV_BUFFER_SIZE & RING_MASK) == 0,
+	       "BT_SPP_PEER_RECV_BUFFER_SIZE must be a power of two");
+
+void bt_spp_framer_reset(struct bt_spp_framer* framer) {
+  framer->cmd_start = framer->head;
+  framer->scan = framer->head;
+}
+
+uint32_t bt_spp_framer_used(const struct bt_spp_framer* framer) {
+  uint32_t released = framer->released;
+
+  // Once the consumer has released every command emitted, the ring is
+  // free up to the command being received. This also reclaims the
+  // commands that could not be emitted, and the partial command of a
+  // peer that was reset.
+  if (released == framer->emitted) {
+    return framer->head - framer->cmd_start;
+  }
+
+  return framer->head - released;
+}
+
+void bt_spp_framer_write(struct bt_spp_framer* framer, const uint8_t* data, size_t len) {
+  size_t idx = framer->head & RING_MASK;
+  size_t first = BT_SPP_PEER_RECV_BUFFER_SIZE - idx;
+
+  if (first > len) {
+    first = len;
+  }
+
+  memcpy(framer->ring + idx, data, first);
+  memcpy(framer->ring, data + first, len - first);
+  framer->head += len;
+}
+
+void bt_spp_framer_process(struct bt_spp_framer* framer, bt_spp_framer_emit_cb emit, void* arg) {
+  const uint8_t* start;
+  const uint8_t* end;
+  uint32_t offset;
+  size_t idx;
+  size_t avail;
+
+  while (framer->scan != framer->head) {
+    idx = framer->scan & RING_MASK;
+    start = framer->ring + idx;
+    avail = framer->head - framer->scan;
+    if (avail > BT_SPP_PEER_RECV_BUFFER_SIZE - idx) {
+      avail = BT_SPP_PEER_RECV_BUFFER_SIZE - idx;
+    }
+
+    end = memchr(start, '\r', avail);
+    if (end == NULL) {
+      framer->scan += avail;
+      continue;
+    }
+
+    // Command found between cmd_start and the terminator
+    framer->scan += end - start + 1;
+    offset = framer->cmd_start;
+    framer->cmd_start = framer->scan;
+
+    if (emit(offset, framer->scan - 1 - offset, arg)) {
+      framer->emitted = framer->cmd_start;
+    }
+  }
+}
+
+void bt_spp_framer_slice(const struct bt_spp_framer* framer, uint32_t offset, size_t len,
+			 struct bt_spp_slice* slice) {
+  size_t idx = offset & RING_MASK;
+  size_t first = BT_SPP_PEER_RECV_BUFFER_SIZE - idx;
+
+  if (first > len) {
+    first = len;
+  }
+
+  slice->data[0] = (const char*) framer->ring + idx;
+  slice->len[0] = first;
+  slice->data[1] = (const char*) framer->ring;
+  slice->len[1] = len - first;
+}
+
+void bt_spp_framer_release(struct bt_spp_framer* framer, uint32_t offset, size_t len) {
+  // Skips the terminator too
+  framer->released = offset + len + 1;
+}
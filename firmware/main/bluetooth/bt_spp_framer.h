@@ -0,0 +1,75 @@
+#ifndef BT_SPP_FRAMER_H
+#define BT_SPP_FRAMER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <stdbool.h>
+
+/* Size of the reception ring. Must be a power of two. */
+#define BT_SPP_PEER_RECV_BUFFER_SIZE 256
+
+/* Splits the data received from a peer into commands terminated by
+   '\r'. It has no dependencies on the Bluetooth stack.
+
+   Received data is kept in a ring, and commands are handed out as
+   slices of it. Positions are free running, and wrap around the ring
+   when masked with BT_SPP_PEER_RECV_BUFFER_SIZE - 1. They keep the
+   order:
+
+     released <= emitted <= cmd_start <= scan <= head
+
+   The bytes between released and emitted belong to commands still
+   being handled by the consumer, and cannot be overwritten. */
+struct bt_spp_framer {
+  uint8_t ring[BT_SPP_PEER_RECV_BUFFER_SIZE];
+
+  /** Where the next received byte is written */
+  uint32_t head;
+
+  /** Start of the command being received */
+  uint32_t cmd_start;
+
+  /** Next byte to look for a terminator at */
+  uint32_t scan;
+
+  /** End of the last command queued to the consumer */
+  uint32_t emitted;
+
+  /** End of the last command released by the consumer */
+  volatile uint32_t released;
+};
+
+/* The bytes of a command, in up to two parts as it can wrap around
+   the end of the ring */
+struct bt_spp_slice {
+  const char* data[2];
+  size_t len[2];
+};
+
+/** Hands a command found at offset over to the consumer. Returns
+    false if it could not take it, and the command is dropped. */
+typedef bool (*bt_spp_framer_emit_cb)(uint32_t offset, size_t len, void* arg);
+
+/** Drops the partial command. Commands already emitted stay in the
+    ring until the consumer releases them. */
+void bt_spp_framer_reset(struct bt_spp_framer* framer);
+
+/** Returns the bytes of the ring that cannot be overwritten */
+uint32_t bt_spp_framer_used(const struct bt_spp_framer* framer);
+
+/** Appends received data. The caller checks it fits first, with
+    bt_spp_framer_used(). */
+void bt_spp_framer_write(struct bt_spp_framer* framer, const uint8_t* data, size_t len);
+
+/** Emits every complete command in the ring, scanning only the bytes
+    received since the last call */
+void bt_spp_framer_process(struct bt_spp_framer* framer, bt_spp_framer_emit_cb emit, void* arg);
+
+void bt_spp_framer_slice(const struct bt_spp_framer* framer, uint32_t offset, size_t len,
+			 struct bt_spp_slice* slice);
+
+/** Gives the bytes of a command back, once handled. Commands are
+    released in the order they were emitted. */
+void bt_spp_framer_release(struct bt_spp_framer* framer, uint32_t offset, size_t len);
+
+#endif
@@ -1,8 +1,12 @@
 #include <assert.h>
+#include "freertos/FreeRTOS.h"
 #include "freertos/portmacro.h"
+#include "freertos/semphr.h"
 #include "hal/gpio_types.h"
 #include "esp_log.h"
 #include "esp_random.h"
+#include "esp_attr.h"
+#include "esp_timer.h"
 #include "host/ble_gap.h"
 #include "host/ble_l2cap.h"
 #include "host/ble_sm.h"
@@ -22,6 +26,12 @@
 #include "driver/gpio.h"
 
 #include "rfble.h"
+#include "rfble_conn.h"
+#include "rfble_cache.h"
+#include "rfble_bonds.h"
+#include "rfble_trigger.h"
+#include "rfble_ota.h"
+#include <inttypes.h>
 #include <stdint.h>
 #include <string.h>
 
@@ -39,17 +49,166 @@ void ble_store_config_init(void);
 static struct ble_gap_event_listener power_control_event_listener;
 #endif
 
+#define RFBLE_LAST_PEER_MAGIC 0x52464c50
+
+/** Identity address of the last peer that established a bonded
+    connection. Kept in RTC memory, so it survives restarts. Only valid
+    when last_peer_magic == RFBLE_LAST_PEER_MAGIC. */
+RTC_NOINIT_ATTR static ble_addr_t last_peer;
+RTC_NOINIT_ATTR static uint32_t last_peer_magic;
+
+static rfble_adv_phase_t adv_phase = RFBLE_ADV_PHASE_DIRECTED;
+
+/** Time at which the advertising schedule last started over, for
+    measuring how long peers take to find the device */
+static int64_t adv_started_us = 0;
+
 bool rfble_is_connected() {
-  return rfble_state.conn_handle != 0;
+  return rfble_connection_count() > 0;
+}
+
+size_t rfble_connection_count() {
+  size_t count = 0;
+
+  for (int i = 0; i < RFBLE_MAX_CONNECTIONS; i++) {
+    if (rfble_state.conns[i].used) {
+      count++;
+    }
+  }
+
+  return count;
+}
+
+rfble_conn_slot_t* rfble_conn_slot(uint16_t conn_handle) {
+  for (int i = 0; i < RFBLE_MAX_CONNECTIONS; i++) {
+    if (rfble_state.conns[i].used && rfble_state.conns[i].conn_handle == conn_handle) {
+      return &rfble_state.conns[i];
+    }
+  }
+
+  return NULL;
+}
+
+static rfble_conn_slot_t* rfble_conn_slot_alloc(uint16_t conn_handle) {
+  for (int i = 0; i < RFBLE_MAX_CONNECTIONS; i++) {
+    rfble_conn_slot_t* slot = &rfble_state.conns[i];
+    if (!slot->used) {
+      memset(slot, 0, sizeof(rfble_conn_slot_t));
+      slot->used = true;
+      slot->conn_handle = conn_handle;
+      return slot;
+    }
+  }
+
+  return NULL;
+}
+
+static void rfble_conn_slot_free(uint16_t conn_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  if (slot != NULL) {
+    slot->used = false;
+  }
+}
+
+/** Whether the controller lists need to be refreshed before
+    advertising again, because the recently used bonds changed */
+static bool controller_lists_dirty = false;
+
+/* Identities that may be in the controller resolving list: the ones
+   loaded by rfble_sync_resolving_list_with_bonded_devs, plus the ones
+   the host adds by itself as peers bond. When the host has loaded
+   every bond, or there were more identities than fit here, every
+   bonded identity is assumed loaded. */
+#define RFBLE_RL_TRACKED_MAX (2 * RFBLE_WHITELIST_SIZE)
+static ble_addr_t rl_tracked[RFBLE_RL_TRACKED_MAX];
+static size_t rl_tracked_len = 0;
+static bool rl_all_bonds_loaded = false;
+
+static void rfble_track_resolving_list_entry(const ble_addr_t* addr) {
+  for (size_t i = 0; i < rl_tracked_len; i++) {
+    if (ble_addr_cmp(&rl_tracked[i], addr) == 0) {
+      return;
+    }
+  }
+
+  if (rl_tracked_len < RFBLE_RL_TRACKED_MAX) {
+    rl_tracked[rl_tracked_len++] = *addr;
+  } else {
+    rl_all_bonds_loaded = true;
+  }
+}
+
+// NimBLE loads the IRK of every bonded peer into the resolving list by
+// itself when it syncs, and adds the IRK of each new bond when its keys
+// are persisted, whatever its order of use. Removes the identities that
+// may be loaded, so the list only holds the most recently used bonds
+// loaded by rfble_sync_resolving_list_with_bonded_devs, which would
+// fail as duplicates or on a full list otherwise.
+static void rfble_clear_resolving_list(void) {
+  static struct rfble_bond bonds[RFBLE_MAX_KNOWN_DEVICES];
+  size_t num_bonds;
+
+  if (rl_all_bonds_loaded) {
+    num_bonds = rfble_bonds_list(bonds, RFBLE_MAX_KNOWN_DEVICES);
+    for (int i = 0; i < num_bonds; i++) {
+      if (bonds[i].irk_present) {
+	ble_hs_pvcy_remove_entry(bonds[i].addr.type, bonds[i].addr.val);
+      }
+    }
+  } else {
+    for (size_t i = 0; i < rl_tracked_len; i++) {
+      ble_hs_pvcy_remove_entry(rl_tracked[i].type, rl_tracked[i].val);
+    }
+  }
+
+  rl_tracked_len = 0;
+  rl_all_bonds_loaded = false;
+}
+
+void rfble_sync_resolving_list_with_bonded_devs() {
+  struct rfble_bond bonds[RFBLE_WHITELIST_SIZE];
+  size_t num_bonds;
+  size_t loaded = 0;
+  int rc;
+
+  rfble_clear_resolving_list();
+
+  num_bonds = rfble_bonds_most_recent(bonds, RFBLE_WHITELIST_SIZE);
+  for (int i = 0; i < num_bonds; i++) {
+    if (!bonds[i].irk_present) {
+      continue;
+    }
+
+    rc = ble_hs_pvcy_add_entry(bonds[i].addr.val, bonds[i].addr.type, bonds[i].irk);
+    if (rc == 0) {
+      loaded++;
+      rfble_track_resolving_list_entry(&bonds[i].addr);
+
+      // Device privacy mode also accepts the identity address of the
+      // peer, for phones that don't always use a private address.
+      rc = ble_gap_set_priv_mode(&bonds[i].addr, BLE_GAP_PRIVATE_MODE_DEVICE);
+    }
+
+    if (rc != 0) {
+      ESP_LOGE(TAG, "Failed to add " RFBLE_ADDR_FMT " to the resolving list; rc=%d",
+	       RFBLE_ADDR_FMT_PARAMS(bonds[i].addr), rc);
+    }
+  }
+
+  ESP_LOGI(TAG, "Loaded %d peer IRKs into the controller resolving list", (int) loaded);
 }
 
 void rfble_sync_whitelist_with_bonded_devs() {
-  ble_addr_t peers[RFBLE_MAX_KNOWN_DEVICES];
-  int num_peers = 0;
+  struct rfble_bond bonds[RFBLE_WHITELIST_SIZE];
+  ble_addr_t peers[RFBLE_WHITELIST_SIZE];
+  size_t num_peers;
   int rc;
 
-  rc = ble_store_util_bonded_peers(peers, &num_peers, RFBLE_MAX_KNOWN_DEVICES);
-  assert(rc == 0);
+  // Only the most recently used bonds fit in the whitelist
+  num_peers = rfble_bonds_most_recent(bonds, RFBLE_WHITELIST_SIZE);
+  for (int i = 0; i < num_peers; i++) {
+    peers[i] = bonds[i].addr;
+  }
 
   rc = ble_gap_wl_set(peers, num_peers);
   if (rc == 0) {
@@ -64,70 +223,169 @@ void rfble_sync_whitelist_with_bonded_devs() {
     ESP_LOGE(TAG, "Failed to update whitelist with error code %d", rc);
   }
 }
-static void rfble_advertise(void) {
-  struct ble_gap_adv_params adv_params;
+static void rfble_remember_last_peer(const ble_addr_t* addr) {
+  last_peer = *addr;
+  last_peer_magic = RFBLE_LAST_PEER_MAGIC;
+}
+
+// Returns whether the last peer is known, still bonded and not
+// already connected
+static bool rfble_last_peer_available() {
+  struct ble_gap_conn_desc desc;
+
+  if (last_peer_magic != RFBLE_LAST_PEER_MAGIC) {
+    return false;
+  }
+
+  if (ble_gap_conn_find_by_addr(&last_peer, &desc) == 0) {
+    return false;
+  }
+
+  return rfble_bonds_is_authorised(&last_peer);
+}
+
+// Sets the advertising data and scan response. The advertisement only
+// carries the flags and the RF Companion service UUID (21 octets),
+// which is what scanners filter on, so it stays short on air and
+// phones can match it in their controllers. The name goes in the
+// scan response, only while discoverable.
+static int rfble_advertise_set_fields(void) {
   struct ble_hs_adv_fields fields;
   const char *name;
   int rc;
 
-  /**
-   *  Set the advertisement data included in our advertisements:
-   *     o Flags (indicates advertisement type and other general info).
-   *     o Advertising tx power.
-   *     o Device name.
-   *     o 16-bit service UUIDs (alert notifications).
-   */
-
   memset(&fields, 0, sizeof fields);
 
-  /* Advertise two flags:
-   *     o Discoverability in forthcoming advertisement (general)
-   *     o BLE-only (BR/EDR unsupported).
-   */
   fields.flags = BLE_HS_ADV_F_BREDR_UNSUP;
+  if (rfble_opts.discovery_mode == RFBLE_DISC_GENERAL) {
+    fields.flags |= BLE_HS_ADV_F_DISC_GEN;
+  }
 
-  /* Indicate that the TX power level field should be included; have the
-   * stack fill this value automatically.  This is done by assigning the
-   * special value BLE_HS_ADV_TX_PWR_LVL_AUTO.
-   */
-  fields.tx_pwr_lvl_is_present = 1;
-  fields.tx_pwr_lvl = BLE_HS_ADV_TX_PWR_LVL_AUTO;
-
-  name = ble_svc_gap_device_name();
-  fields.name = (uint8_t *)name;
-  fields.name_len = strlen(name);
-  fields.name_is_complete = 1;
-
-  fields.uuids16 = (ble_uuid16_t[]) {
-    BLE_UUID16_INIT(GATT_SVR_SVC_ALERT_UUID)
-  };
-  fields.num_uuids16 = 1;
-  fields.uuids16_is_complete = 1;
+  fields.uuids128 = (ble_uuid128_t*) &rfble_gatt_svc_rf_companion_uuid;
+  fields.num_uuids128 = 1;
+  fields.uuids128_is_complete = 1;
 
   rc = ble_gap_adv_set_fields(&fields);
   if (rc != 0) {
-    ESP_LOGE(TAG, "Error setting advertisement data; rc=%d\n", rc);
-    return;
+    return rc;
   }
 
-  /* Begin advertising. */
-  memset(&adv_params, 0, sizeof adv_params);
-  adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+  memset(&fields, 0, sizeof fields);
 
   if (rfble_opts.discovery_mode == RFBLE_DISC_GENERAL) {
-    adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
-    adv_params.filter_policy = BLE_HCI_ADV_FILT_NONE;
-  } else {
+    name = ble_svc_gap_device_name();
+    fields.name = (uint8_t *)name;
+    fields.name_len = strlen(name);
+    fields.name_is_complete = 1;
+  }
+
+  return ble_gap_adv_rsp_set_fields(&fields);
+}
+
+// Loads the most recently used bonds into the controller. The
+// controller resolves the private addresses of those peers against
+// their IRKs, so the whitelist, which holds their identity addresses,
+// is applied in the link layer without waking the host.
+static void rfble_sync_controller_lists(void) {
+  rfble_sync_resolving_list_with_bonded_devs();
+  rfble_sync_whitelist_with_bonded_devs();
+  controller_lists_dirty = false;
+}
+
+// Starts advertising for the current phase of the schedule
+static void rfble_advertise(void) {
+  struct ble_gap_adv_params adv_params;
+  const ble_addr_t* direct_addr = NULL;
+  int32_t duration_ms;
+  int rc;
+
+  if (adv_phase == RFBLE_ADV_PHASE_DIRECTED &&
+      (rfble_opts.discovery_mode != RFBLE_DISC_FILTERED || !rfble_last_peer_available())) {
+    adv_phase = RFBLE_ADV_PHASE_FAST;
+  }
+
+  memset(&adv_params, 0, sizeof adv_params);
+
+  if (adv_phase == RFBLE_ADV_PHASE_DIRECTED) {
+    // Directed advertising doesn't carry any data, and only the given
+    // peer can connect.
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_DIR;
     adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;
-    adv_params.filter_policy = BLE_HCI_ADV_FILT_BOTH;
+    adv_params.high_duty_cycle = 1;
+    direct_addr = &last_peer;
+    duration_ms = RFBLE_ADV_DIRECTED_DURATION_MS;
+  } else {
+    rc = rfble_advertise_set_fields();
+    if (rc != 0) {
+      ESP_LOGE(TAG, "Error setting advertisement data; rc=%d\n", rc);
+      return;
+    }
+
+    adv_params.conn_mode = BLE_GAP_CONN_MODE_UND;
+
+    if (rfble_opts.discovery_mode == RFBLE_DISC_GENERAL) {
+      adv_params.disc_mode = BLE_GAP_DISC_MODE_GEN;
+      adv_params.filter_policy = BLE_HCI_ADV_FILT_NONE;
+    } else if (adv_phase == RFBLE_ADV_PHASE_SLOW && rfble_bonds_count() > RFBLE_WHITELIST_SIZE) {
+      // Bonds that don't fit in the whitelist can only connect while
+      // connections are not filtered, and are checked by the host.
+      adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;
+      adv_params.filter_policy = BLE_HCI_ADV_FILT_SCAN;
+    } else {
+      adv_params.disc_mode = BLE_GAP_DISC_MODE_NON;
+      adv_params.filter_policy = BLE_HCI_ADV_FILT_BOTH;
+    }
+
+    if (adv_phase == RFBLE_ADV_PHASE_FAST) {
+      adv_params.itvl_min = RFBLE_ADV_FAST_ITVL_MIN;
+      adv_params.itvl_max = RFBLE_ADV_FAST_ITVL_MAX;
+      duration_ms = RFBLE_ADV_FAST_DURATION_MS;
+    } else {
+      adv_params.itvl_min = RFBLE_ADV_SLOW_ITVL_MIN;
+      adv_params.itvl_max = RFBLE_ADV_SLOW_ITVL_MAX;
+      duration_ms = BLE_HS_FOREVER;
+    }
   }
 
-  rc = ble_gap_adv_start(BLE_OWN_ADDR_RPA_PUBLIC_DEFAULT, NULL, BLE_HS_FOREVER,
+  rc = ble_gap_adv_start(BLE_OWN_ADDR_RPA_PUBLIC_DEFAULT, direct_addr, duration_ms,
 			 &adv_params, rfble_gap_event, NULL);
   if (rc != 0) {
-    ESP_LOGE(TAG, "Error enabling advertisement; rc=%d\n", rc);
+    ESP_LOGE(TAG, "Error enabling advertisement; phase=%d; rc=%d\n", adv_phase, rc);
     return;
   }
+
+  ESP_LOGI(TAG, "Advertising; phase=%d", adv_phase);
+}
+
+// Starts the advertising schedule from the beginning, as long as
+// there are free connection slots
+static void rfble_advertise_restart(void) {
+  if (ble_gap_adv_active()) {
+    ble_gap_adv_stop();
+  }
+
+  // The controller lists cannot be modified while advertising
+  if (controller_lists_dirty) {
+    rfble_sync_controller_lists();
+  }
+
+  if (rfble_connection_count() >= RFBLE_MAX_CONNECTIONS) {
+    ESP_LOGI(TAG, "All connection slots in use. Advertising stopped");
+    return;
+  }
+
+  adv_phase = RFBLE_ADV_PHASE_DIRECTED;
+  adv_started_us = esp_timer_get_time();
+  rfble_advertise();
+}
+
+// Moves to the next phase of the advertising schedule, once the
+// current one has timed out.
+static void rfble_advertise_next_phase(void) {
+  if (adv_phase != RFBLE_ADV_PHASE_SLOW) {
+    adv_phase++;
+  }
+  rfble_advertise();
 }
 
 /* #if MYNEWT_VAL(BLE_POWER_CONTROL) */
@@ -144,12 +402,30 @@ static void rfble_advertise(void) {
 /* #endif */
 
 
-static void rfble_gap_handle_connect(uint16_t conn_handle, int status) {
-  int rc;
+// Handles a connection from a bonded peer that doesn't fit in the
+// controller resolving list, so its private address arrived
+// unresolved. The host can't find its keys by that address, so the
+// peer is moved into the controller lists and disconnected, for it to
+// reconnect. Returns false if the address isn't from a bonded peer.
+static bool rfble_promote_unresolved_peer(uint16_t conn_handle, struct ble_gap_conn_desc* desc) {
+  struct rfble_bond bond;
+
+  if (!rfble_bonds_resolve(&desc->peer_id_addr, &bond) || !bond.ltk_present) {
+    return false;
+  }
+
+  ESP_LOGI(TAG, "Bonded peer " RFBLE_ADDR_FMT " is not in the controller lists. "
+	   "Promoting it and waiting for it to reconnect", RFBLE_ADDR_FMT_PARAMS(bond.addr));
+  if (rfble_bonds_touch(&bond.addr, RFBLE_WHITELIST_SIZE)) {
+    controller_lists_dirty = true;
+  }
 
+  ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+  return true;
+}
+
+static void rfble_gap_handle_connect(uint16_t conn_handle, int status) {
   struct ble_gap_conn_desc desc;
-  struct ble_store_key_sec key_sec = {0};
-  struct ble_store_value_sec value_sec;
 
   if (status == 0) {
     assert(ble_gap_conn_find(conn_handle, &desc) == 0);
@@ -158,10 +434,12 @@ static void rfble_gap_handle_connect(uint16_t conn_handle, int status) {
       // If the current configuration doesn't allow unknown devices to
       // connect, ensure that we do know this device. This shouldn't
       // be needed because of the whitelist, but dunno, just in case.
-      key_sec.peer_addr = desc.peer_id_addr;
-      rc = ble_store_read_peer_sec(&key_sec, &value_sec);
+      if (!rfble_bonds_is_authorised(&desc.peer_id_addr) &&
+	  rfble_promote_unresolved_peer(conn_handle, &desc)) {
+	return;
+      }
 
-      if (rc != 0 || !value_sec.ltk_present) {
+      if (!rfble_bonds_is_authorised(&desc.peer_id_addr)) {
 	// Kick out
 	ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
 	ESP_LOGE(TAG,
@@ -172,15 +450,42 @@ static void rfble_gap_handle_connect(uint16_t conn_handle, int status) {
       }
     }
 
-    rfble_state.conn_handle = conn_handle;
+    if (rfble_conn_slot_alloc(conn_handle) == NULL) {
+      // Shouldn't happen, as the host is configured with the same
+      // amount of connections.
+      ble_gap_terminate(conn_handle, BLE_ERR_CONN_LIMIT);
+      ESP_LOGE(TAG, "No free connection slots for handle=%d", conn_handle);
+      return;
+    }
+
+    ESP_LOGI(TAG, "Peer connected after %" PRId64 " ms of advertising; phase=%d; handle=%d",
+	     (esp_timer_get_time() - adv_started_us) / 1000, adv_phase, conn_handle);
+
+    rfble_conn_on_connect(conn_handle);
     ble_gap_security_initiate(conn_handle);
+
+    // Keep advertising, so other peers can connect too
+    rfble_advertise_restart();
   } else {
-    /* Connection failed; resume advertising. */
-    rfble_state.conn_handle = 0;
-    rfble_advertise();
+    /* Connection failed; resume advertising. Directed advertising
+       reports its timeout as a failed connection, so the schedule
+       moves on instead of starting over. */
+    rfble_advertise_next_phase();
   }
 }
 
+int rfble_pair_numcmp_reply(uint16_t conn_handle, bool accept) {
+  struct ble_sm_io pkey = {
+    .action = BLE_SM_IOACT_NUMCMP,
+    .numcmp_accept = accept
+  };
+  int rc;
+
+  rc = ble_sm_inject_io(conn_handle, &pkey);
+  ESP_LOGI(tag, "ble_sm_inject_io result: %d\n", rc);
+  return rc;
+}
+
 static void rfble_gap_handle_passkey_action(uint16_t conn_handle, struct ble_gap_passkey_params* params) {
   struct ble_sm_io pkey = {0};
   int rc;
@@ -212,10 +517,9 @@ static void rfble_gap_handle_passkey_action(uint16_t conn_handle, struct ble_gap
       return;
     }
 
-    pkey.action = params->action;
-    pkey.numcmp_accept = rfble_opts.pair_req_numcmp_cb(conn_handle, params->numcmp);
-    rc = ble_sm_inject_io(conn_handle, &pkey);
-    ESP_LOGI(tag, "ble_sm_inject_io result: %d\n", rc);
+    // Answered later through rfble_pair_numcmp_reply, so the host
+    // keeps serving other connections while the user decides.
+    rfble_opts.pair_req_numcmp_cb(conn_handle, params->numcmp);
   } else if (params->action == BLE_SM_IOACT_INPUT) {
     if (rfble_opts.pair_req_type_key_cb == NULL) {
       ESP_LOGE(TAG, "Requested BLE_SM_IOACT_INPUT passkey action but callback was unset.");
@@ -236,9 +540,12 @@ static void rfble_gap_handle_passkey_action(uint16_t conn_handle, struct ble_gap
 static void rfble_gap_handle_disconnect(struct ble_gap_conn_desc* desc, int reason) {
   ESP_LOGI(TAG, "Peer disconnected; reason=%d; " RFBLE_PEER_FULL_DESC_FMT, reason, RFBLE_PEER_FULL_DESC_FMT_PARAMS(*desc));
 
+  rfble_conn_on_disconnect(desc->conn_handle);
+  rfble_ota_on_disconnect(desc->conn_handle);
+
   /* Connection terminated; resume advertising. */
-  rfble_state.conn_handle = 0;
-  rfble_advertise();
+  rfble_conn_slot_free(desc->conn_handle);
+  rfble_advertise_restart();
 }
 
 static void rfble_gap_handle_conn_update_req(uint16_t conn_handle) {
@@ -247,10 +554,11 @@ static void rfble_gap_handle_conn_update_req(uint16_t conn_handle) {
   ESP_LOGI(TAG, "Connection updated request; " RFBLE_PEER_FULL_DESC_FMT, RFBLE_PEER_FULL_DESC_FMT_PARAMS(desc));
 }
 
-static void rfble_gap_handle_conn_update(uint16_t conn_handle) {
+static void rfble_gap_handle_conn_update(uint16_t conn_handle, int status) {
   struct ble_gap_conn_desc desc;
   assert(ble_gap_conn_find(conn_handle, &desc) == 0);
-  ESP_LOGI(TAG, "Connection updated; " RFBLE_PEER_FULL_DESC_FMT, RFBLE_PEER_FULL_DESC_FMT_PARAMS(desc));
+  ESP_LOGI(TAG, "Connection updated; status=%d; " RFBLE_PEER_FULL_DESC_FMT, status, RFBLE_PEER_FULL_DESC_FMT_PARAMS(desc));
+  rfble_conn_on_update(conn_handle, status);
 }
 
 static void rfble_gap_handle_adv_complete(int reason) {
@@ -264,6 +572,20 @@ static void rfble_gap_handle_enc_change(uint16_t conn_handle, int status) {
   if (status != 0) {
     ble_gap_terminate(conn_handle, BLE_ERR_REM_USER_CONN_TERM);
     ESP_LOGW(TAG, "Encryption status is != 0. Connection terminated");
+  } else if (desc.sec_state.bonded) {
+    // Candidate for directed advertising on the next reconnection
+    rfble_remember_last_peer(&desc.peer_id_addr);
+    rfble_bonds_on_bonded(&desc.peer_id_addr);
+    rfble_track_resolving_list_entry(&desc.peer_id_addr);
+
+    // Keep the peers in use in the controller lists
+    if (rfble_bonds_touch(&desc.peer_id_addr, RFBLE_WHITELIST_SIZE)) {
+      controller_lists_dirty = true;
+      if (ble_gap_adv_active()) {
+	rfble_advertise_restart();
+      }
+    }
+    rfble_cache_on_bonded(conn_handle, &desc.peer_id_addr);
   }
 }
 
@@ -274,10 +596,12 @@ static void rfble_gap_handle_identity_resolved(uint16_t conn_handle) {
 }
 
 
-static void rfble_gap_handle_subscribe(uint16_t conn_handle) {
+static void rfble_gap_handle_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
   struct ble_gap_conn_desc desc;
   assert(ble_gap_conn_find(conn_handle, &desc) == 0);
-  ESP_LOGI(TAG, "Subscription updated; " RFBLE_PEER_FULL_DESC_FMT, RFBLE_PEER_FULL_DESC_FMT_PARAMS(desc));
+  ESP_LOGI(TAG, "Subscription updated; attr_handle=%d; notify=%d; " RFBLE_PEER_FULL_DESC_FMT,
+	   attr_handle, notify, RFBLE_PEER_FULL_DESC_FMT_PARAMS(desc));
+  rfble_gatt_on_subscribe(conn_handle, attr_handle, notify);
 }
 
 static void rfble_gap_handle_mtu_update(uint16_t conn_handle, uint16_t channel, uint16_t value) {
@@ -292,7 +616,9 @@ static int rfble_gap_handle_repeat_pairing(uint16_t conn_handle) {
 
   if (rfble_opts.allow_device_pairing) {
     ESP_LOGW(TAG, "Peer " RFBLE_ADDR_FMT " is attempting to re-pair. Allow device re-pairing is enabled and keys will be updated", RFBLE_ADDR_FMT_PARAMS(desc.peer_id_addr));
-    ble_store_util_delete_peer(&desc.peer_id_addr);
+    rfble_bonds_delete(&desc.peer_id_addr);
+    rfble_cache_forget_peer(&desc.peer_id_addr);
+    rfble_trigger_forget_peer(&desc.peer_id_addr);
     return BLE_GAP_REPEAT_PAIRING_RETRY;
   } else {
     ESP_LOGW(TAG, "Peer " RFBLE_ADDR_FMT " is attempting to repeat pairing but pairing is disabled. Ignoring request.", RFBLE_ADDR_FMT_PARAMS(desc.peer_id_addr));
@@ -323,12 +649,25 @@ static int rfble_gap_event(struct ble_gap_event *event, void *arg) {
     return 0;
 
   case BLE_GAP_EVENT_CONN_UPDATE:
-    rfble_gap_handle_conn_update(event->conn_update.conn_handle);
+    rfble_gap_handle_conn_update(event->conn_update.conn_handle, event->conn_update.status);
+    return 0;
+
+  case BLE_GAP_EVENT_PHY_UPDATE_COMPLETE:
+    rfble_conn_on_phy_update(event->phy_updated.conn_handle, event->phy_updated.status,
+			     event->phy_updated.tx_phy, event->phy_updated.rx_phy);
+    return 0;
+
+  case BLE_GAP_EVENT_NOTIFY_TX:
+    rfble_conn_on_notify_tx(event->notify_tx.conn_handle, event->notify_tx.status);
+    rfble_cache_on_notify_tx(event->notify_tx.conn_handle, event->notify_tx.attr_handle,
+			     event->notify_tx.status, event->notify_tx.indication);
     return 0;
 
   case BLE_GAP_EVENT_ADV_COMPLETE:
     rfble_gap_handle_adv_complete(event->adv_complete.reason);
-    rfble_advertise();
+    if (rfble_connection_count() < RFBLE_MAX_CONNECTIONS) {
+      rfble_advertise_next_phase();
+    }
     return 0;
 
   case BLE_GAP_EVENT_ENC_CHANGE:
@@ -340,7 +679,8 @@ static int rfble_gap_event(struct ble_gap_event *event, void *arg) {
     return 0;
 
   case BLE_GAP_EVENT_SUBSCRIBE:
-    rfble_gap_handle_subscribe(event->subscribe.conn_handle);
+    rfble_gap_handle_subscribe(event->subscribe.conn_handle, event->subscribe.attr_handle,
+			       event->subscribe.cur_notify);
     return 0;
 
   case BLE_GAP_EVENT_MTU:
@@ -383,16 +723,95 @@ static int rfble_gap_event(struct ble_gap_event *event, void *arg) {
   return 0;
 }
 
+/** Options waiting to be applied by the host task */
+static rfble_opts_t reconfigure_opts;
+static struct ble_npl_event reconfigure_ev;
+static StaticSemaphore_t reconfigure_done_storage;
+static SemaphoreHandle_t reconfigure_done;
+
+// Disconnects the peers that are not bonded, once pairing is not
+// allowed anymore. This includes peers in the middle of pairing.
+static void rfble_drop_unbonded_peers(void) {
+  struct ble_gap_conn_desc desc;
+
+  for (int i = 0; i < RFBLE_MAX_CONNECTIONS; i++) {
+    if (!rfble_state.conns[i].used ||
+	ble_gap_conn_find(rfble_state.conns[i].conn_handle, &desc) != 0) {
+      continue;
+    }
+
+    if (!desc.sec_state.bonded || !rfble_bonds_is_authorised(&desc.peer_id_addr)) {
+      ESP_LOGI(TAG, "Disconnecting unbonded peer, since pairing is not allowed anymore; "
+	       RFBLE_PEER_FULL_DESC_FMT, RFBLE_PEER_FULL_DESC_FMT_PARAMS(desc));
+      ble_gap_terminate(desc.conn_handle, BLE_ERR_REM_USER_CONN_TERM);
+    }
+  }
+}
+
+// Applies the options given to rfble_reconfigure. Runs in the host
+// task, so nothing else touches the state of the advertising schedule
+// or the connections meanwhile.
+static void rfble_on_reconfigure(struct ble_npl_event* ev) {
+  bool allowed_pairing = rfble_opts.allow_device_pairing;
+  int rc;
+
+  if (ble_gap_adv_active()) {
+    ble_gap_adv_stop();
+  }
+
+  memcpy(&rfble_opts, &reconfigure_opts, sizeof(rfble_opts_t));
+  ble_hs_cfg.sm_io_cap = rfble_opts.io_cap;
+  rfble_gatt_rebind_handlers();
+
+  if (rfble_opts.device_name != NULL) {
+    rc = ble_svc_gap_device_name_set(rfble_opts.device_name);
+    if (rc != 0) {
+      ESP_LOGE(TAG, "Unable to set the device name; rc=%d", rc);
+    }
+  }
+
+  if (allowed_pairing && !rfble_opts.allow_device_pairing) {
+    rfble_drop_unbonded_peers();
+  }
+
+  // Pick up the bonds made while pairing was allowed
+  controller_lists_dirty = true;
+  if (ble_hs_synced()) {
+    rfble_advertise_restart();
+  }
+
+  ESP_LOGI(TAG, "Reconfigured; discovery_mode=%d; allow_device_pairing=%d",
+	   rfble_opts.discovery_mode, rfble_opts.allow_device_pairing);
+  xSemaphoreGive(reconfigure_done);
+}
+
+void rfble_reconfigure(const rfble_opts_t* opts) {
+  memcpy(&reconfigure_opts, opts, sizeof(rfble_opts_t));
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &reconfigure_ev);
+  xSemaphoreTake(reconfigure_done, portMAX_DELAY);
+}
+
 static void rfble_on_reset(int reason) {
   ESP_LOGE(TAG, "Resetting state; reason=%d\n", reason);
 }
 
 static void rfble_on_sync(void) {
+  // The image is able to bring up the host, and so to get updated
+  // again
+  rfble_ota_confirm_image();
+
+  rfble_bonds_load();
+  rl_all_bonds_loaded = true;
+  rfble_cache_on_sync();
+  rfble_trigger_on_sync();
+
+  ESP_LOGI(TAG, "GATT database holds %d attributes", rfble_gatt_attr_count());
+
   // Set whitelist before start advertising
-  rfble_sync_whitelist_with_bonded_devs();
+  rfble_sync_controller_lists();
 
   /* Begin advertising. */
-  rfble_advertise();
+  rfble_advertise_restart();
 }
 
 static void rfble_host_task(void *param) {
@@ -415,7 +834,7 @@ void rfble_begin(rfble_opts_t* opts) {
   ble_hs_cfg.reset_cb = rfble_on_reset;
   ble_hs_cfg.sync_cb = rfble_on_sync;
   ble_hs_cfg.gatts_register_cb = rfble_gatt_register_cb;
-  ble_hs_cfg.store_status_cb = ble_store_util_status_rr;
+  ble_hs_cfg.store_status_cb = rfble_bonds_store_status_cb;
   ble_hs_cfg.sm_io_cap = opts->io_cap;
   ble_hs_cfg.sm_bonding = 1;
   ble_hs_cfg.sm_mitm = 1;
@@ -431,6 +850,14 @@ void rfble_begin(rfble_opts_t* opts) {
   rc = rfble_gatt_init();
   assert(rc == 0);
 
+  rfble_conn_init();
+
+  rc = rfble_ota_init();
+  assert(rc == 0);
+
+  reconfigure_done = xSemaphoreCreateBinaryStatic(&reconfigure_done_storage);
+  ble_npl_event_init(&reconfigure_ev, rfble_on_reconfigure, NULL);
+
   /* Set the default device name. */
   if (opts->device_name != NULL) {
     rc = ble_svc_gap_device_name_set(opts->device_name);
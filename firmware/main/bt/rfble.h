@@ -2,14 +2,14 @@
 #define RFBLE_H
 
 #include <stdbool.h>
+#include <stddef.h>
 #include <stdint.h>
 #include "services/gap/ble_svc_gap.h"
 #include "host/ble_hs.h"
 #include "rfble_gatt.h"
-
-#if CONFIG_BT_NIMBLE_MAX_BONDS != CONFIG_BT_NIMBLE_WHITELIST_SIZE
-#error It is required the maximum number of bonded devices to be the same as the max whitelist size (CONFIG_BT_NIMBLE_MAX_BONDS == CONFIG_BT_NIMBLE_WHITELIST_SIZE)
-#endif
+#include "rfble_conn.h"
+#include "rfble_cmd.h"
+#include "rfble_trigger.h"
 
 #define RFBLE_ADDR_FMT "%02hhx:%02hhx:%02hhx:%02hhx:%02hhx:%02hhx"
 #define RFBLE_ADDR_FMT_PARAMS(addr)                                           \
@@ -37,13 +37,56 @@
       (desc).sec_state.encrypted, (desc).sec_state.authenticated,              \
       (desc).sec_state.bonded, (desc).sec_state.key_size
 
+/* Max number of bonds. The host persists the keys and the CCCDs of
+   every bond in the nvs partition, whose 24 KiB hold about 32 of
+   them, and the partition table cannot grow with an OTA update. */
 #define RFBLE_MAX_KNOWN_DEVICES CONFIG_BT_NIMBLE_MAX_BONDS
 
+/* Number of bonds kept in the controller whitelist and resolving
+   list. When there are more bonds, the most recently used ones are
+   kept there, and the rest are checked by the host. See
+   rfble_bonds.h. */
+#define RFBLE_WHITELIST_SIZE CONFIG_BT_NIMBLE_WHITELIST_SIZE
+
+/* Max number of peers that can be connected at the same time */
+#define RFBLE_MAX_CONNECTIONS CONFIG_BT_NIMBLE_MAX_CONNECTIONS
+
+/* Advertising schedule. After booting or losing a connection, the
+   device advertises in the following phases, moving to the next one
+   when each of them times out:
+
+     1. High duty cycle directed advertising to the last bonded peer,
+        only in filtered discovery mode. Limited by the controller to
+        1.28 s.
+     2. Fast undirected advertising, for RFBLE_ADV_FAST_DURATION_MS.
+     3. Slow undirected advertising, until a peer connects.
+
+   Intervals are expressed in units of 0.625 ms. */
+#define RFBLE_ADV_DIRECTED_DURATION_MS 1280
+#define RFBLE_ADV_FAST_ITVL_MIN 32 /* 20 ms */
+#define RFBLE_ADV_FAST_ITVL_MAX 48 /* 30 ms */
+#define RFBLE_ADV_FAST_DURATION_MS 30000
+#define RFBLE_ADV_SLOW_ITVL_MIN 1600 /* 1 s */
+#define RFBLE_ADV_SLOW_ITVL_MAX 2048 /* 1.28 s */
+
+typedef enum rfble_adv_phase {
+  RFBLE_ADV_PHASE_DIRECTED = 0,
+  RFBLE_ADV_PHASE_FAST,
+  RFBLE_ADV_PHASE_SLOW,
+} rfble_adv_phase_t;
+
 // Callback types
 typedef void (*rfble_passkey_cb_display_key)(uint16_t conn_handle, uint32_t key);
-typedef bool (*rfble_passkey_cb_request_accept_key)(uint16_t conn_handle, uint32_t key);
+typedef void (*rfble_passkey_cb_request_accept_key)(uint16_t conn_handle, uint32_t key);
 typedef uint32_t (*rfble_passkey_cb_request_enter_key)(uint16_t conn_handle);
-typedef int(*rfble_gatt_cb_chr_access)(struct ble_gatt_access_ctxt *ctxt, const ble_uuid_t* chr_id);
+typedef int(*rfble_gatt_cb_chr_access)(uint16_t conn_handle, struct ble_gatt_access_ctxt *ctxt);
+
+/** Handlers of a characteristic. Any of them can be NULL. */
+typedef struct rfble_gatt_chr_handler {
+  const ble_uuid_t* uuid;
+  rfble_gatt_cb_chr_access read_cb;
+  rfble_gatt_cb_chr_access write_cb;
+} rfble_gatt_chr_handler_t;
 
 // Structs
 typedef enum rfble_discovery_mode {
@@ -83,53 +126,130 @@ typedef struct rfble_opts {
   rfble_passkey_cb_display_key pair_req_display_key_cb;
 
   /** Callback called when a pairing request requires a numeric
-     comparison between two devices */
+     comparison between two devices. It runs in the host task, so it
+     must return right away, and answer later with
+     rfble_pair_numcmp_reply. */
   rfble_passkey_cb_request_accept_key pair_req_numcmp_cb;
 
   /** Callback called when a pairing request requires the user to type
      the key available in the screen of the remote device*/
   rfble_passkey_cb_request_enter_key pair_req_type_key_cb;
 
-  /** Callback called when a GATT attribute is attempted to be read. */
-  rfble_gatt_cb_chr_access gatt_read_cb;
+  /** Handlers of the characteristics, terminated by an entry with a
+      NULL uuid. They are resolved to attribute handles once, when the
+      services are registered. */
+  const rfble_gatt_chr_handler_t* chr_handlers;
 
-  /** Callback called when a GATT attribute is attempted to be written. */
-  rfble_gatt_cb_chr_access gatt_write_cb;
+  /** Callback called for every command received through the command
+      characteristic. */
+  rfble_cmd_cb_t cmd_cb;
+
+  /** Callback called for every connectionless trigger accepted from a
+      bonded peer. Only used when CONFIG_RFAPP_BLE_ADV_TRIGGER is
+      enabled. */
+  rfble_trigger_cb_t trigger_cb;
 } rfble_opts_t;
 
-typedef struct rfble_state {
+typedef struct rfble_conn_slot {
+  /** Whether this slot holds a connection */
+  bool used;
+
   uint16_t conn_handle;
+
+  /** Connection parameters mode last requested to the peer */
+  rfble_conn_mode_t requested_mode;
+
+  /** Statistics of the connection */
+  struct rfble_conn_stats stats;
+
+  /** Whether the peer is subscribed to the Status characteristic */
+  bool status_subscribed;
+
+  /** Whether the peer hasn't been notified the current status yet */
+  bool status_dirty;
+
+  /** Time of the last status notification sent to the peer */
+  int64_t status_sent_us;
+
+  /** Whether the peer is subscribed to the Antenna state characteristic */
+  bool antenna_subscribed;
+
+  /** Whether the peer hasn't been notified the current antenna state yet */
+  bool antenna_dirty;
+
+  /** Whether the peer is subscribed to the Send RF, Command and OTA
+      control characteristics */
+  bool send_rf_subscribed;
+  bool command_subscribed;
+  bool ota_control_subscribed;
+
+  /** GATT Client Supported Features enabled by the peer */
+  uint8_t client_features;
+
+  /** Whether the peer hasn't learnt about a change of the attribute
+      database yet */
+  bool change_unaware;
+
+  /** Whether the peer has been answered Database Out Of Sync since
+      it became change-unaware */
+  bool out_of_sync_sent;
+} rfble_conn_slot_t;
+
+typedef struct rfble_state {
+  /** State of each connection. Slots are reused as peers come and
+      go. */
+  rfble_conn_slot_t conns[RFBLE_MAX_CONNECTIONS];
   rfble_gatt_handles_t gatt_handles;
 } rfble_state_t;
 
 void rfble_begin(rfble_opts_t *opts);
+
+/**
+ * Replaces the options given to rfble_begin while the host keeps
+ * running. Advertising is stopped, the options are swapped, the
+ * controller lists are rebuilt from the current bonds and advertising
+ * starts over. Connections from bonded peers are kept, while the rest
+ * are dropped if pairing is not allowed anymore.
+ *
+ * Blocks until the host task has applied the options, so it must not
+ * be called from the host task, e.g. from any of the callbacks.
+ */
+void rfble_reconfigure(const rfble_opts_t *opts);
 void rfble_sync_whitelist_with_bonded_devs();
 
+/** Loads the IRKs of the bonded peers into the controller resolving list */
+void rfble_sync_resolving_list_with_bonded_devs();
+
 /** rfble_opts_t instance, initialized with rfble_begin */
 extern rfble_opts_t rfble_opts;
 
 /** rfle_state_t instance holding the state of the Bluetooth service. Initialized with rfble_begin */
 extern rfble_state_t rfble_state;
 
+/** Returns whether any peer is connected */
 bool rfble_is_connected();
 
+/** Returns the number of peers currently connected */
+size_t rfble_connection_count();
+
+/** Answers a numeric comparison requested through pair_req_numcmp_cb */
+int rfble_pair_numcmp_reply(uint16_t conn_handle, bool accept);
+
+/** Returns the slot of the given connection, or NULL if unknown */
+rfble_conn_slot_t* rfble_conn_slot(uint16_t conn_handle);
+
 /** Pushes a 8 bit number to the peer device on a GATT characteristic read request */
 int rfble_gatt_push8(struct ble_gatt_access_ctxt *ctxt, uint8_t value);
 
 /** Receives a 8 bit number to the peer device on a GATT characteristic write request */
 int rfble_gatt_recv8(struct ble_gatt_access_ctxt *ctxt, uint8_t *value);
 
-/** Sends a 8 bit number to the peer device as a notification of a GATT characteristic */
-int rfble_gatt_notif8(uint16_t att_handle, uint8_t value);
-
-// Temp shit copied from blprph example.
-/** GATT server. */
-#define GATT_SVR_SVC_ALERT_UUID               0x1811
-#define GATT_SVR_CHR_SUP_NEW_ALERT_CAT_UUID   0x2A47
-#define GATT_SVR_CHR_NEW_ALERT                0x2A46
-#define GATT_SVR_CHR_SUP_UNR_ALERT_CAT_UUID   0x2A48
-#define GATT_SVR_CHR_UNR_ALERT_STAT_UUID      0x2A45
-#define GATT_SVR_CHR_ALERT_NOT_CTRL_PT        0x2A44
+/** Returns whether the given peer is subscribed to notifications of the characteristic */
+bool rfble_gatt_subscribed(uint16_t conn_handle, uint16_t attr_handle);
+
+/** Sends a 8 bit number to the given peer device as a notification of a GATT characteristic.
+    Returns BLE_HS_EDISABLED if the peer isn't subscribed to it. */
+int rfble_gatt_notif8(uint16_t conn_handle, uint16_t att_handle, uint8_t value);
 
 void rfble_gatt_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg);
 int rfble_gatt_init(void);
@@ -0,0 +1,428 @@
+#include "rfble_bonds.h"
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "host/util/util.h"
+#include "mbedtls/aes.h"
+#include "nvs.h"
+#include "rfble.h"
+
+#define TAG "RF BLE BONDS"
+
+#define NVS_NAMESPACE "rfble_bonds"
+#define NVS_KEY_LRU "lru"
+
+#define TABLE_EMPTY -1
+
+/* Slots of the hash table: the next power of two from twice the max
+   number of bonds, so probe sequences stay short */
+#define POW2_SMEAR1(x) ((x) | ((x) >> 1))
+#define POW2_SMEAR2(x) (POW2_SMEAR1(x) | (POW2_SMEAR1(x) >> 2))
+#define POW2_SMEAR4(x) (POW2_SMEAR2(x) | (POW2_SMEAR2(x) >> 4))
+#define POW2_SMEAR8(x) (POW2_SMEAR4(x) | (POW2_SMEAR4(x) >> 8))
+#define RFBLE_BONDS_TABLE_SIZE (POW2_SMEAR8(2 * RFBLE_MAX_KNOWN_DEVICES - 1) + 1)
+
+_Static_assert(RFBLE_MAX_KNOWN_DEVICES <= INT16_MAX / 2,
+	       "Bond indexes must fit the int16_t slots of the hash table");
+
+/** Time of use of a bond, as persisted */
+struct rfble_bonds_lru_entry {
+  ble_addr_t addr;
+  uint32_t last_used;
+};
+
+/* The index is read from the host task, and modified from the console
+   task too */
+static portMUX_TYPE bonds_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct rfble_bond bonds[RFBLE_MAX_KNOWN_DEVICES];
+static size_t bonds_len = 0;
+static uint32_t use_clock = 0;
+
+/** Open addressing hash table of indexes into bonds */
+static int16_t table[RFBLE_BONDS_TABLE_SIZE];
+
+static uint32_t rfble_bonds_hash(const ble_addr_t* addr) {
+  // FNV-1a
+  uint32_t hash = 2166136261u;
+
+  hash = (hash ^ addr->type) * 16777619u;
+  for (int i = 0; i < sizeof(addr->val); i++) {
+    hash = (hash ^ addr->val[i]) * 16777619u;
+  }
+
+  return hash;
+}
+
+// Must be called with the lock held
+static void rfble_bonds_rebuild_table(void) {
+  uint32_t slot;
+
+  for (int i = 0; i < RFBLE_BONDS_TABLE_SIZE; i++) {
+    table[i] = TABLE_EMPTY;
+  }
+
+  for (int i = 0; i < bonds_len; i++) {
+    slot = rfble_bonds_hash(&bonds[i].addr) & (RFBLE_BONDS_TABLE_SIZE - 1);
+    while (table[slot] != TABLE_EMPTY) {
+      slot = (slot + 1) & (RFBLE_BONDS_TABLE_SIZE - 1);
+    }
+    table[slot] = i;
+  }
+}
+
+// Must be called with the lock held
+static int rfble_bonds_find(const ble_addr_t* addr) {
+  uint32_t slot = rfble_bonds_hash(addr) & (RFBLE_BONDS_TABLE_SIZE - 1);
+
+  while (table[slot] != TABLE_EMPTY) {
+    if (ble_addr_cmp(&bonds[table[slot]].addr, addr) == 0) {
+      return table[slot];
+    }
+    slot = (slot + 1) & (RFBLE_BONDS_TABLE_SIZE - 1);
+  }
+
+  return -1;
+}
+
+// Must be called with the lock held
+static void rfble_bonds_put(const struct rfble_bond* bond) {
+  int index = rfble_bonds_find(&bond->addr);
+
+  if (index >= 0) {
+    bonds[index] = *bond;
+    return;
+  }
+
+  if (bonds_len == RFBLE_MAX_KNOWN_DEVICES) {
+    return;
+  }
+
+  bonds[bonds_len++] = *bond;
+  rfble_bonds_rebuild_table();
+}
+
+// Must be called with the lock held
+static void rfble_bonds_remove(const ble_addr_t* addr) {
+  int index = rfble_bonds_find(addr);
+
+  if (index >= 0) {
+    bonds[index] = bonds[--bonds_len];
+    rfble_bonds_rebuild_table();
+  }
+}
+
+static void rfble_bond_from_store(struct rfble_bond* bond, const struct ble_store_value_sec* sec) {
+  bond->addr = sec->peer_addr;
+  bond->irk_present = sec->irk_present;
+  bond->ltk_present = sec->ltk_present;
+  memcpy(bond->irk, sec->irk, sizeof(bond->irk));
+  bond->last_used = 0;
+}
+
+static void rfble_bonds_save_lru(void) {
+  static struct rfble_bonds_lru_entry lru[RFBLE_MAX_KNOWN_DEVICES];
+  nvs_handle_t handle;
+  size_t len;
+  esp_err_t err;
+
+  portENTER_CRITICAL(&bonds_lock);
+  len = bonds_len;
+  for (int i = 0; i < len; i++) {
+    lru[i].addr = bonds[i].addr;
+    lru[i].last_used = bonds[i].last_used;
+  }
+  portEXIT_CRITICAL(&bonds_lock);
+
+  if ((err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to open NVS: %s", esp_err_to_name(err));
+    return;
+  }
+
+  err = nvs_set_blob(handle, NVS_KEY_LRU, lru, len * sizeof(struct rfble_bonds_lru_entry));
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to persist the order of use of bonds: %s", esp_err_to_name(err));
+  }
+
+  nvs_close(handle);
+}
+
+// Must be called with the lock held
+static void rfble_bonds_apply_lru(const struct rfble_bonds_lru_entry* lru, size_t len) {
+  int index;
+
+  for (int i = 0; i < len; i++) {
+    if ((index = rfble_bonds_find(&lru[i].addr)) >= 0) {
+      bonds[index].last_used = lru[i].last_used;
+      if (lru[i].last_used > use_clock) {
+	use_clock = lru[i].last_used;
+      }
+    }
+  }
+}
+
+struct rfble_bonds_loader {
+  struct rfble_bond bonds[RFBLE_MAX_KNOWN_DEVICES];
+  size_t len;
+  struct rfble_bonds_lru_entry lru[RFBLE_MAX_KNOWN_DEVICES];
+  size_t lru_len;
+};
+
+static int rfble_bonds_load_entry(int obj_type, union ble_store_value* val, void* arg) {
+  struct rfble_bonds_loader* loader = arg;
+
+  if (loader->len == RFBLE_MAX_KNOWN_DEVICES) {
+    return 1;
+  }
+
+  rfble_bond_from_store(&loader->bonds[loader->len++], &val->sec);
+  return 0;
+}
+
+void rfble_bonds_load(void) {
+  static struct rfble_bonds_loader loader;
+  nvs_handle_t handle;
+  size_t lru_size;
+  int rc;
+
+  loader.len = 0;
+  rc = ble_store_iterate(BLE_STORE_OBJ_TYPE_PEER_SEC, rfble_bonds_load_entry, &loader);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Failed to load bonded peers; rc=%d", rc);
+    return;
+  }
+
+  loader.lru_len = 0;
+  if (nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle) == ESP_OK) {
+    lru_size = sizeof(loader.lru);
+    if (nvs_get_blob(handle, NVS_KEY_LRU, loader.lru, &lru_size) == ESP_OK) {
+      loader.lru_len = lru_size / sizeof(struct rfble_bonds_lru_entry);
+    }
+    nvs_close(handle);
+  }
+
+  portENTER_CRITICAL(&bonds_lock);
+  memcpy(bonds, loader.bonds, loader.len * sizeof(struct rfble_bond));
+  bonds_len = loader.len;
+  rfble_bonds_rebuild_table();
+  rfble_bonds_apply_lru(loader.lru, loader.lru_len);
+  portEXIT_CRITICAL(&bonds_lock);
+
+  ESP_LOGI(TAG, "Loaded %d bonded peers", (int) loader.len);
+}
+
+bool rfble_bonds_lookup(const ble_addr_t* addr, struct rfble_bond* bond) {
+  int index;
+
+  portENTER_CRITICAL(&bonds_lock);
+  index = rfble_bonds_find(addr);
+  if (index >= 0 && bond != NULL) {
+    *bond = bonds[index];
+  }
+  portEXIT_CRITICAL(&bonds_lock);
+
+  return index >= 0;
+}
+
+bool rfble_bonds_is_authorised(const ble_addr_t* addr) {
+  struct rfble_bond bond;
+  return rfble_bonds_lookup(addr, &bond) && bond.ltk_present;
+}
+
+// Computes the hash of a private address with the given IRK, as the
+// ah function of the Security Manager. Addresses and keys are stored
+// least significant octet first, while AES works with the most
+// significant first.
+static bool rfble_bonds_rpa_matches(const ble_addr_t* rpa, const uint8_t* irk) {
+  mbedtls_aes_context aes;
+  uint8_t key[16];
+  uint8_t in[16] = {0};
+  uint8_t out[16];
+  int rc;
+
+  for (int i = 0; i < 16; i++) {
+    key[i] = irk[15 - i];
+  }
+
+  in[13] = rpa->val[5];
+  in[14] = rpa->val[4];
+  in[15] = rpa->val[3];
+
+  mbedtls_aes_init(&aes);
+  rc = mbedtls_aes_setkey_enc(&aes, key, 128);
+  if (rc == 0) {
+    rc = mbedtls_aes_crypt_ecb(&aes, MBEDTLS_AES_ENCRYPT, in, out);
+  }
+  mbedtls_aes_free(&aes);
+
+  return rc == 0 && out[13] == rpa->val[2] && out[14] == rpa->val[1] && out[15] == rpa->val[0];
+}
+
+bool rfble_bonds_resolve(const ble_addr_t* rpa, struct rfble_bond* bond) {
+  static struct rfble_bond candidates[RFBLE_MAX_KNOWN_DEVICES];
+  size_t len;
+
+  if (!BLE_ADDR_IS_RPA(rpa)) {
+    return false;
+  }
+
+  // Copied out so the AES operations run without holding the lock
+  len = rfble_bonds_list(candidates, RFBLE_MAX_KNOWN_DEVICES);
+  for (int i = 0; i < len; i++) {
+    if (candidates[i].irk_present && rfble_bonds_rpa_matches(rpa, candidates[i].irk)) {
+      *bond = candidates[i];
+      return true;
+    }
+  }
+
+  return false;
+}
+
+size_t rfble_bonds_count(void) {
+  return bonds_len;
+}
+
+size_t rfble_bonds_list(struct rfble_bond* out, size_t max_bonds) {
+  size_t len;
+
+  portENTER_CRITICAL(&bonds_lock);
+  len = bonds_len < max_bonds ? bonds_len : max_bonds;
+  memcpy(out, bonds, len * sizeof(struct rfble_bond));
+  portEXIT_CRITICAL(&bonds_lock);
+
+  return len;
+}
+
+// Must be called with the lock held. Fills order with the indexes of
+// the max_bonds most recently used bonds, most recent first.
+static size_t rfble_bonds_rank(int* order, size_t max_bonds) {
+  size_t len = 0;
+  int pos;
+
+  // Insertion into a short sorted list, as max_bonds is the size of
+  // the controller lists
+  for (int i = 0; i < bonds_len; i++) {
+    if (len == max_bonds && bonds[i].last_used <= bonds[order[len - 1]].last_used) {
+      continue;
+    }
+
+    pos = len < max_bonds ? len++ : len - 1;
+    while (pos > 0 && bonds[order[pos - 1]].last_used < bonds[i].last_used) {
+      order[pos] = order[pos - 1];
+      pos--;
+    }
+    order[pos] = i;
+  }
+
+  return len;
+}
+
+size_t rfble_bonds_most_recent(struct rfble_bond* out, size_t max_bonds) {
+  int order[max_bonds];
+  size_t len;
+
+  if (max_bonds == 0) {
+    return 0;
+  }
+
+  portENTER_CRITICAL(&bonds_lock);
+  len = rfble_bonds_rank(order, max_bonds);
+  for (int i = 0; i < len; i++) {
+    out[i] = bonds[order[i]];
+  }
+  portEXIT_CRITICAL(&bonds_lock);
+
+  return len;
+}
+
+bool rfble_bonds_touch(const ble_addr_t* addr, size_t max_recent) {
+  int order[max_recent];
+  bool recent = false;
+  size_t len;
+  int index;
+
+  if (max_recent == 0) {
+    return false;
+  }
+
+  portENTER_CRITICAL(&bonds_lock);
+  index = rfble_bonds_find(addr);
+  if (index >= 0) {
+    len = rfble_bonds_rank(order, max_recent);
+    for (int i = 0; i < len; i++) {
+      recent |= order[i] == index;
+    }
+    bonds[index].last_used = ++use_clock;
+  }
+  portEXIT_CRITICAL(&bonds_lock);
+
+  if (index < 0 || recent) {
+    return false;
+  }
+
+  // Only persisted when the set of recent bonds changes, so the
+  // relative order within it may be stale after a reboot, but not
+  // which bonds belong to it.
+  rfble_bonds_save_lru();
+  return true;
+}
+
+void rfble_bonds_on_bonded(const ble_addr_t* addr) {
+  struct ble_store_key_sec key_sec = { .peer_addr = *addr };
+  struct ble_store_value_sec value_sec;
+  struct rfble_bond bond;
+
+  // Re-pairing deletes the previous bond first, so known peers still
+  // have the same keys
+  if (rfble_bonds_lookup(addr, NULL)) {
+    return;
+  }
+
+  if (ble_store_read_peer_sec(&key_sec, &value_sec) != 0) {
+    return;
+  }
+
+  rfble_bond_from_store(&bond, &value_sec);
+
+  portENTER_CRITICAL(&bonds_lock);
+  rfble_bonds_put(&bond);
+  portEXIT_CRITICAL(&bonds_lock);
+}
+
+int rfble_bonds_delete(const ble_addr_t* addr) {
+  int rc = ble_store_util_delete_peer(addr);
+
+  if (rc == 0) {
+    portENTER_CRITICAL(&bonds_lock);
+    rfble_bonds_remove(addr);
+    portEXIT_CRITICAL(&bonds_lock);
+  }
+
+  return rc;
+}
+
+int rfble_bonds_clear(void) {
+  int rc = ble_store_clear();
+
+  if (rc == 0) {
+    portENTER_CRITICAL(&bonds_lock);
+    bonds_len = 0;
+    rfble_bonds_rebuild_table();
+    portEXIT_CRITICAL(&bonds_lock);
+  }
+
+  return rc;
+}
+
+int rfble_bonds_store_status_cb(struct ble_store_status_event* event, void* arg) {
+  int rc = ble_store_util_status_rr(event, arg);
+
+  // The oldest bond may have been deleted for making room
+  if (rc == 0 && event->event_code == BLE_STORE_EVENT_OVERFLOW) {
+    rfble_bonds_load();
+  }
+
+  return rc;
+}
@@ -0,0 +1,87 @@
+#ifndef RFBLE_BONDS_H
+#define RFBLE_BONDS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "host/ble_hs.h"
+#include "host/ble_store.h"
+
+/* In-RAM index of the bonded peers. It is loaded from the store once
+   the host syncs, and kept up to date as bonds are added or deleted,
+   so checking whether a peer is bonded doesn't need to read flash.
+
+   There can be more bonds than entries in the controller whitelist
+   and resolving list. Those only hold the most recently used bonds,
+   and the rest are looked up in a hash table on the host, which also
+   resolves their private addresses. The order of use is persisted in
+   NVS. */
+
+struct rfble_bond {
+  /** Identity address of the peer */
+  ble_addr_t addr;
+
+  bool irk_present;
+  bool ltk_present;
+
+  /** IRK of the peer, as stored by the host. Valid if irk_present. */
+  uint8_t irk[16];
+
+  /** Logical time of the last connection, higher is more recent */
+  uint32_t last_used;
+};
+
+/** Loads the index from the store */
+void rfble_bonds_load(void);
+
+/**
+ * Looks up the bond of the given identity address. Returns false if
+ * the peer is not bonded.
+ */
+bool rfble_bonds_lookup(const ble_addr_t* addr, struct rfble_bond* bond);
+
+/** Returns whether the peer is bonded and has a LTK to encrypt with */
+bool rfble_bonds_is_authorised(const ble_addr_t* addr);
+
+/**
+ * Resolves a resolvable private address against the IRKs of the
+ * bonded peers. Returns false if it doesn't belong to any of them.
+ */
+bool rfble_bonds_resolve(const ble_addr_t* rpa, struct rfble_bond* bond);
+
+/** Returns the number of bonded peers */
+size_t rfble_bonds_count(void);
+
+/**
+ * Copies up to max_bonds bonds from the index into bonds. Returns the
+ * number of bonds copied.
+ */
+size_t rfble_bonds_list(struct rfble_bond* bonds, size_t max_bonds);
+
+/**
+ * Copies the max_bonds most recently used bonds into bonds, most
+ * recent first. Returns the number of bonds copied.
+ */
+size_t rfble_bonds_most_recent(struct rfble_bond* bonds, size_t max_bonds);
+
+/**
+ * Marks the bond of the given peer as just used. Returns true if the
+ * peer wasn't among the max_recent most recently used bonds, so the
+ * controller lists need to be refreshed.
+ */
+bool rfble_bonds_touch(const ble_addr_t* addr, size_t max_recent);
+
+/** Refreshes the bond of the given peer after pairing with it */
+void rfble_bonds_on_bonded(const ble_addr_t* addr);
+
+/** Deletes the bond of the given peer from the store and the index */
+int rfble_bonds_delete(const ble_addr_t* addr);
+
+/** Deletes every bond */
+int rfble_bonds_clear(void);
+
+/** Store status callback. Keeps the index in sync when the store
+    drops the oldest bonds for making room for new ones. */
+int rfble_bonds_store_status_cb(struct ble_store_status_event* event, void* arg);
+
+#endif
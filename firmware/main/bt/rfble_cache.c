@@ -0,0 +1,440 @@
+#include "rfble_cache.h"
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "host/ble_att.h"
+#include "host/ble_hs.h"
+#include "host/ble_uuid.h"
+#include "mbedtls/cipher.h"
+#include "mbedtls/cmac.h"
+#include "nvs.h"
+#include "rfble.h"
+
+#define TAG "RF BLE CACHE"
+
+#define NVS_NAMESPACE "rfble_cache"
+#define NVS_KEY_DB_HASH "db_hash"
+
+#define UUID_SVC_GATT 0x1801
+#define UUID_CHR_SERVICE_CHANGED 0x2a05
+#define UUID_CHR_CLIENT_SUPPORTED_FEATURES 0x2b29
+#define UUID_CHR_DATABASE_HASH 0x2b2a
+
+#define UUID_PRIMARY_SERVICE 0x2800
+#define UUID_SECONDARY_SERVICE 0x2801
+#define UUID_CHARACTERISTIC 0x2803
+#define UUID_DSC_FIRST 0x2900
+#define UUID_DSC_EXTENDED_PROPS 0x2900
+#define UUID_DSC_CLIENT_CONFIG 0x2902
+#define UUID_DSC_LAST 0x2905
+
+/* Characteristic properties are the low bits of the flags, plus the
+   extended properties bit for the flags living in that descriptor */
+#define CHR_PROPS_MASK 0x7f
+#define CHR_PROP_EXTENDED 0x80
+
+/* Bits of the Characteristic Extended Properties descriptor */
+#define CHR_EXT_PROP_RELIABLE_WRITE 0x0001
+#define CHR_EXT_PROP_WRITABLE_AUX 0x0002
+
+/** Caching state persisted for each bonded peer */
+struct rfble_cache_peer {
+  uint8_t features;
+
+  /** Database hash last known by the peer */
+  uint8_t db_hash[RFBLE_CACHE_DB_HASH_LEN];
+};
+
+static int rfble_cache_access(uint16_t conn_handle, uint16_t attr_handle,
+			      struct ble_gatt_access_ctxt* ctxt, void* arg);
+
+static const struct ble_gatt_svc_def rfble_cache_svcs[] = {
+  {
+    .type = BLE_GATT_SVC_TYPE_PRIMARY,
+    .uuid = BLE_UUID16_DECLARE(UUID_SVC_GATT),
+    .characteristics = (struct ble_gatt_chr_def[]){
+      {
+	.uuid = BLE_UUID16_DECLARE(UUID_CHR_SERVICE_CHANGED),
+	.access_cb = rfble_cache_access,
+	.flags = BLE_GATT_CHR_F_INDICATE,
+	.val_handle = &rfble_state.gatt_handles.service_changed_handle,
+      },
+      {
+	.uuid = BLE_UUID16_DECLARE(UUID_CHR_CLIENT_SUPPORTED_FEATURES),
+	.access_cb = rfble_cache_access,
+	.flags = BLE_GATT_CHR_F_READ | BLE_GATT_CHR_F_WRITE,
+	.val_handle = &rfble_state.gatt_handles.client_features_handle,
+      },
+      {
+	.uuid = BLE_UUID16_DECLARE(UUID_CHR_DATABASE_HASH),
+	.access_cb = rfble_cache_access,
+	.flags = BLE_GATT_CHR_F_READ,
+	.val_handle = &rfble_state.gatt_handles.db_hash_handle,
+      },
+      { 0 }
+    },
+  },
+  { 0 }
+};
+
+/** Attributes hashed into the database hash, in handle order */
+static struct {
+  uint8_t data[RFBLE_CACHE_HASH_INPUT_LEN];
+  size_t len;
+  bool overflow;
+} hash_input;
+
+static uint8_t db_hash[RFBLE_CACHE_DB_HASH_LEN];
+static bool db_hash_ready = false;
+
+static void rfble_cache_peer_key(const ble_addr_t* addr, char* key) {
+  // NVS keys are limited to 15 characters
+  snprintf(key, NVS_KEY_NAME_MAX_SIZE, "p%01x%02x%02x%02x%02x%02x%02x", addr->type & 0xf,
+	   addr->val[5], addr->val[4], addr->val[3], addr->val[2], addr->val[1], addr->val[0]);
+}
+
+static esp_err_t rfble_cache_load_peer(const ble_addr_t* addr, struct rfble_cache_peer* peer) {
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  size_t len = sizeof(struct rfble_cache_peer);
+  nvs_handle_t handle;
+  esp_err_t err;
+
+  if ((err = nvs_open(NVS_NAMESPACE, NVS_READONLY, &handle)) != ESP_OK) {
+    return err;
+  }
+
+  rfble_cache_peer_key(addr, key);
+  err = nvs_get_blob(handle, key, peer, &len);
+  if (err == ESP_OK && len != sizeof(struct rfble_cache_peer)) {
+    err = ESP_ERR_INVALID_SIZE;
+  }
+
+  nvs_close(handle);
+  return err;
+}
+
+static esp_err_t rfble_cache_store_peer(const ble_addr_t* addr, const struct rfble_cache_peer* peer) {
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+  esp_err_t err;
+
+  if ((err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+    return err;
+  }
+
+  rfble_cache_peer_key(addr, key);
+  err = nvs_set_blob(handle, key, peer, sizeof(struct rfble_cache_peer));
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+
+  nvs_close(handle);
+  return err;
+}
+
+void rfble_cache_forget_peer(const ble_addr_t* addr) {
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+
+  rfble_cache_peer_key(addr, key);
+  if (nvs_erase_key(handle, key) == ESP_OK) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+}
+
+// Persists the state of the given connection, if bonded.
+static void rfble_cache_save_conn(rfble_conn_slot_t* slot) {
+  struct ble_gap_conn_desc desc;
+  struct rfble_cache_peer peer;
+  esp_err_t err;
+
+  if (ble_gap_conn_find(slot->conn_handle, &desc) != 0 || !desc.sec_state.bonded) {
+    return;
+  }
+
+  peer.features = slot->client_features;
+  memcpy(peer.db_hash, db_hash, sizeof(db_hash));
+  if ((err = rfble_cache_store_peer(&desc.peer_id_addr, &peer)) != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to persist caching state of handle=%d: %s", slot->conn_handle,
+	     esp_err_to_name(err));
+  }
+}
+
+static void rfble_cache_set_change_aware(rfble_conn_slot_t* slot) {
+  if (slot->change_unaware) {
+    ESP_LOGI(TAG, "Client handle=%d is now change-aware", slot->conn_handle);
+    slot->change_unaware = false;
+    slot->out_of_sync_sent = false;
+    rfble_cache_save_conn(slot);
+  }
+}
+
+static int rfble_cache_access(uint16_t conn_handle, uint16_t attr_handle,
+			      struct ble_gatt_access_ctxt* ctxt, void* arg) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  uint8_t features;
+
+  if (attr_handle == rfble_state.gatt_handles.service_changed_handle) {
+    // Only read for building the indications. The whole range is
+    // reported as changed.
+    uint8_t range[4] = { 0x01, 0x00, 0xff, 0xff };
+    return os_mbuf_append(ctxt->om, range, sizeof(range)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+  }
+
+  if (slot == NULL) {
+    return BLE_ATT_ERR_UNLIKELY;
+  }
+
+  if (attr_handle == rfble_state.gatt_handles.db_hash_handle) {
+    if (!db_hash_ready) {
+      return BLE_ATT_ERR_UNLIKELY;
+    }
+
+    // Reading the hash is how clients learn about changes
+    rfble_cache_set_change_aware(slot);
+    return os_mbuf_append(ctxt->om, db_hash, sizeof(db_hash)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+  }
+
+  if (attr_handle == rfble_state.gatt_handles.client_features_handle) {
+    switch (ctxt->op) {
+    case BLE_GATT_ACCESS_OP_READ_CHR:
+      return os_mbuf_append(ctxt->om, &slot->client_features, sizeof(uint8_t)) == 0 ?
+	0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+
+    case BLE_GATT_ACCESS_OP_WRITE_CHR:
+      if (OS_MBUF_PKTLEN(ctxt->om) < 1 || os_mbuf_copydata(ctxt->om, 0, 1, &features) != 0) {
+	return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+      }
+
+      // Features cannot be disabled once enabled, and only the
+      // supported ones are kept.
+      if ((slot->client_features & ~features) != 0) {
+	return BLE_ATT_ERR_VALUE_NOT_ALLOWED;
+      }
+
+      features &= RFBLE_CACHE_CSF_ROBUST_CACHING;
+      if (features != slot->client_features) {
+	slot->client_features = features;
+	ESP_LOGI(TAG, "Client handle=%d enabled features 0x%02x", conn_handle, features);
+	rfble_cache_save_conn(slot);
+      }
+      return 0;
+    }
+  }
+
+  return BLE_ATT_ERR_UNLIKELY;
+}
+
+int rfble_cache_check_request(uint16_t conn_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+
+  if (slot == NULL || !slot->change_unaware) {
+    return 0;
+  }
+
+  // A client that keeps sending requests after being told the
+  // database is out of sync is considered aware of the change
+  if (slot->out_of_sync_sent) {
+    rfble_cache_set_change_aware(slot);
+    return 0;
+  }
+
+  slot->out_of_sync_sent = true;
+  return BLE_ATT_ERR_DB_OUT_OF_SYNC;
+}
+
+void rfble_cache_on_bonded(uint16_t conn_handle, const ble_addr_t* peer_id_addr) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  struct rfble_cache_peer peer;
+
+  if (slot == NULL || rfble_cache_load_peer(peer_id_addr, &peer) != ESP_OK) {
+    return;
+  }
+
+  slot->client_features = peer.features;
+  if ((peer.features & RFBLE_CACHE_CSF_ROBUST_CACHING) && db_hash_ready &&
+      memcmp(peer.db_hash, db_hash, sizeof(db_hash)) != 0) {
+    ESP_LOGI(TAG, "Client handle=%d is change-unaware", conn_handle);
+    slot->change_unaware = true;
+  }
+}
+
+void rfble_cache_on_notify_tx(uint16_t conn_handle, uint16_t attr_handle, int status, bool indication) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+
+  if (slot != NULL && indication && status == BLE_HS_EDONE &&
+      attr_handle == rfble_state.gatt_handles.service_changed_handle) {
+    rfble_cache_set_change_aware(slot);
+  }
+}
+
+static void rfble_cache_hash_append(const void* data, size_t len) {
+  if (hash_input.len + len > sizeof(hash_input.data)) {
+    hash_input.overflow = true;
+    return;
+  }
+
+  memcpy(hash_input.data + hash_input.len, data, len);
+  hash_input.len += len;
+}
+
+static void rfble_cache_hash_append16(uint16_t value) {
+  uint8_t buf[2] = { value & 0xff, value >> 8 };
+  rfble_cache_hash_append(buf, sizeof(buf));
+}
+
+static void rfble_cache_hash_append_uuid(const ble_uuid_t* uuid) {
+  uint8_t buf[16];
+
+  if (ble_uuid_flat(uuid, buf) == 0) {
+    rfble_cache_hash_append(buf, ble_uuid_length(uuid));
+  }
+}
+
+void rfble_cache_on_register(struct ble_gatt_register_ctxt* ctxt) {
+  const struct ble_gatt_chr_def* chr;
+  uint16_t uuid;
+  uint16_t ext_props;
+  uint8_t props;
+
+  // Only the declarations and the descriptors are hashed, not the
+  // values of the characteristics. Of the descriptors, only the value
+  // of the extended properties one is part of the hash.
+  switch (ctxt->op) {
+  case BLE_GATT_REGISTER_OP_SVC:
+    rfble_cache_hash_append16(ctxt->svc.handle);
+    rfble_cache_hash_append16(ctxt->svc.svc_def->type == BLE_GATT_SVC_TYPE_PRIMARY ?
+			      UUID_PRIMARY_SERVICE : UUID_SECONDARY_SERVICE);
+    rfble_cache_hash_append_uuid(ctxt->svc.svc_def->uuid);
+    break;
+
+  case BLE_GATT_REGISTER_OP_CHR:
+    chr = ctxt->chr.chr_def;
+    rfble_cache_hash_append16(ctxt->chr.def_handle);
+    rfble_cache_hash_append16(UUID_CHARACTERISTIC);
+    props = chr->flags & CHR_PROPS_MASK;
+    if (chr->flags & (BLE_GATT_CHR_F_RELIABLE_WRITE | BLE_GATT_CHR_F_AUX_WRITE)) {
+      props |= CHR_PROP_EXTENDED;
+    }
+    rfble_cache_hash_append(&props, sizeof(props));
+    rfble_cache_hash_append16(ctxt->chr.val_handle);
+    rfble_cache_hash_append_uuid(chr->uuid);
+
+    // The host adds the client configuration descriptor right after
+    // the value, without reporting it
+    if (chr->flags & (BLE_GATT_CHR_F_NOTIFY | BLE_GATT_CHR_F_INDICATE)) {
+      rfble_cache_hash_append16(ctxt->chr.val_handle + 1);
+      rfble_cache_hash_append16(UUID_DSC_CLIENT_CONFIG);
+    }
+    break;
+
+  case BLE_GATT_REGISTER_OP_DSC:
+    if (ctxt->dsc.dsc_def->uuid->type != BLE_UUID_TYPE_16) {
+      break;
+    }
+
+    uuid = BLE_UUID16(ctxt->dsc.dsc_def->uuid)->value;
+    if (uuid >= UUID_DSC_FIRST && uuid <= UUID_DSC_LAST) {
+      rfble_cache_hash_append16(ctxt->dsc.handle);
+      rfble_cache_hash_append16(uuid);
+    }
+
+    // Its value follows the flags of the characteristic, whatever the
+    // access callback of the descriptor serves
+    if (uuid == UUID_DSC_EXTENDED_PROPS) {
+      chr = ctxt->dsc.chr_def;
+      ext_props = 0;
+      if (chr->flags & BLE_GATT_CHR_F_RELIABLE_WRITE) {
+	ext_props |= CHR_EXT_PROP_RELIABLE_WRITE;
+      }
+      if (chr->flags & BLE_GATT_CHR_F_AUX_WRITE) {
+	ext_props |= CHR_EXT_PROP_WRITABLE_AUX;
+      }
+      rfble_cache_hash_append16(ext_props);
+    }
+    break;
+  }
+}
+
+static esp_err_t rfble_cache_compute_hash(void) {
+  static const uint8_t key[16] = { 0 };
+  uint8_t mac[RFBLE_CACHE_DB_HASH_LEN];
+  int rc;
+
+  if (hash_input.overflow) {
+    ESP_LOGE(TAG, "The attribute database exceeds RFBLE_CACHE_HASH_INPUT_LEN");
+    return ESP_ERR_NO_MEM;
+  }
+
+  rc = mbedtls_cipher_cmac(mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_128_ECB),
+			   key, 128, hash_input.data, hash_input.len, mac);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Unable to compute the database hash; rc=%d", rc);
+    return ESP_FAIL;
+  }
+
+  // Characteristic values go least significant octet first
+  for (int i = 0; i < RFBLE_CACHE_DB_HASH_LEN; i++) {
+    db_hash[i] = mac[RFBLE_CACHE_DB_HASH_LEN - 1 - i];
+  }
+
+  return ESP_OK;
+}
+
+void rfble_cache_on_sync(void) {
+  uint8_t stored_hash[RFBLE_CACHE_DB_HASH_LEN];
+  size_t len = sizeof(stored_hash);
+  nvs_handle_t handle;
+  esp_err_t err;
+
+  // Services are only registered once, even if the host resyncs
+  if (db_hash_ready || rfble_cache_compute_hash() != ESP_OK) {
+    return;
+  }
+
+  db_hash_ready = true;
+
+  if ((err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to open NVS: %s", esp_err_to_name(err));
+    return;
+  }
+
+  err = nvs_get_blob(handle, NVS_KEY_DB_HASH, stored_hash, &len);
+  if (err == ESP_OK && len == sizeof(stored_hash) && memcmp(stored_hash, db_hash, len) == 0) {
+    nvs_close(handle);
+    return;
+  }
+
+  if (err == ESP_OK) {
+    // Bonded peers subscribed to Service Changed get it indicated
+    // once they reconnect
+    ESP_LOGI(TAG, "Attribute database changed since last boot");
+    ble_gatts_chr_updated(rfble_state.gatt_handles.service_changed_handle);
+  }
+
+  err = nvs_set_blob(handle, NVS_KEY_DB_HASH, db_hash, sizeof(db_hash));
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to persist the database hash: %s", esp_err_to_name(err));
+  }
+
+  nvs_close(handle);
+}
+
+int rfble_cache_init(void) {
+  int rc;
+
+  rc = ble_gatts_count_cfg(rfble_cache_svcs);
+  if (rc != 0) {
+    return rc;
+  }
+
+  return ble_gatts_add_svcs(rfble_cache_svcs);
+}
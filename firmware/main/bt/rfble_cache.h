@@ -0,0 +1,64 @@
+#ifndef RFBLE_CACHE_H
+#define RFBLE_CACHE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "host/ble_gap.h"
+#include "host/ble_gatt.h"
+
+/* GATT caching support. Replaces the stock GATT service with one that
+   also exposes the Client Supported Features and Database Hash
+   characteristics, so bonded clients can cache the attribute database
+   and skip the service discovery on reconnections.
+
+   The hash is computed from the services as they get registered, and
+   persisted in NVS. If it differs from the one of the previous boot,
+   the bonded peers subscribed to Service Changed are indicated the
+   change the next time they connect. The features enabled by each
+   bonded client, and the hash it last saw, are persisted too. Clients
+   with robust caching enabled are kept change-unaware until they
+   acknowledge the change, and get their requests rejected with
+   Database Out Of Sync meanwhile. */
+
+#define RFBLE_CACHE_DB_HASH_LEN 16
+
+/* Client Supported Features, bit 0 of the first octet */
+#define RFBLE_CACHE_CSF_ROBUST_CACHING 0x01
+
+#ifndef BLE_ATT_ERR_DB_OUT_OF_SYNC
+#define BLE_ATT_ERR_DB_OUT_OF_SYNC 0x12
+#endif
+
+/* Max size of the attributes hashed for computing the database hash */
+#define RFBLE_CACHE_HASH_INPUT_LEN 1024
+
+/** Registers the GATT service. Needs to be called before the host
+    starts, in place of ble_svc_gatt_init. */
+int rfble_cache_init(void);
+
+/** Feeds the registered services into the database hash */
+void rfble_cache_on_register(struct ble_gatt_register_ctxt* ctxt);
+
+/** Computes the database hash once the services are registered, and
+    flags bonded peers for a Service Changed indication if it differs
+    from the previous boot */
+void rfble_cache_on_sync(void);
+
+/** Loads the caching state of a bonded peer once the link is
+    encrypted */
+void rfble_cache_on_bonded(uint16_t conn_handle, const ble_addr_t* peer_id_addr);
+
+/** Tracks the acknowledgement of Service Changed indications */
+void rfble_cache_on_notify_tx(uint16_t conn_handle, uint16_t attr_handle, int status, bool indication);
+
+/** Drops the caching state persisted for a peer */
+void rfble_cache_forget_peer(const ble_addr_t* peer_id_addr);
+
+/**
+ * Checks whether a request from the given connection can be served.
+ * Returns 0 if so, or BLE_ATT_ERR_DB_OUT_OF_SYNC if the client has to
+ * learn about a database change first.
+ */
+int rfble_cache_check_request(uint16_t conn_handle);
+
+#endif
@@ -0,0 +1,141 @@
+#include "rfble_cmd.h"
+#include <string.h>
+#include "esp_log.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/task.h"
+#include "host/ble_gatt.h"
+#include "rfble.h"
+
+#define TAG "RF BLE CMD"
+
+/* Responses of the write being processed. Writes are processed from
+   the host task, so the batch is only used from it. */
+static struct {
+  bool open;
+  TaskHandle_t task;
+  uint16_t conn_handle;
+  size_t len;
+  uint8_t buf[RFBLE_CMD_MAX_BATCH_LEN];
+} batch;
+
+static uint8_t write_buf[RFBLE_CMD_MAX_WRITE_LEN];
+
+static size_t rfble_cmd_max_notif_len(uint16_t conn_handle) {
+  size_t len = ble_att_mtu(conn_handle);
+
+  // Notifications carry 3 bytes of ATT header
+  len = len > 3 ? len - 3 : 0;
+  return len < RFBLE_CMD_MAX_BATCH_LEN ? len : RFBLE_CMD_MAX_BATCH_LEN;
+}
+
+static int rfble_cmd_notify(uint16_t conn_handle, const void* data, size_t len) {
+  struct os_mbuf* om;
+
+  // Peers that haven't subscribed to the command characteristic don't
+  // get responses
+  if (!rfble_gatt_subscribed(conn_handle, rfble_state.gatt_handles.command_handle)) {
+    return 0;
+  }
+
+  om = ble_hs_mbuf_from_flat(data, len);
+  if (om == NULL) {
+    return BLE_HS_ENOMEM;
+  }
+
+  return ble_gatts_notify_custom(conn_handle, rfble_state.gatt_handles.command_handle, om);
+}
+
+static void rfble_cmd_flush() {
+  int rc;
+
+  if (batch.len == 0) {
+    return;
+  }
+
+  rc = rfble_cmd_notify(batch.conn_handle, batch.buf, batch.len);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Failed to notify command responses; rc=%d", rc);
+  }
+  batch.len = 0;
+}
+
+static bool rfble_cmd_batching(uint16_t conn_handle) {
+  return batch.open && batch.conn_handle == conn_handle &&
+    batch.task == xTaskGetCurrentTaskHandle();
+}
+
+int rfble_cmd_respond(uint16_t conn_handle, uint8_t type, uint8_t req_id, const void* value,
+		      uint8_t len) {
+  uint8_t record[RFBLE_CMD_HEADER_LEN + UINT8_MAX];
+  size_t record_len = RFBLE_CMD_HEADER_LEN + len;
+
+  record[0] = type;
+  record[1] = req_id;
+  record[2] = len;
+  memcpy(record + RFBLE_CMD_HEADER_LEN, value, len);
+
+  if (!rfble_cmd_batching(conn_handle)) {
+    return rfble_cmd_notify(conn_handle, record, record_len);
+  }
+
+  if (batch.len + record_len > rfble_cmd_max_notif_len(conn_handle)) {
+    rfble_cmd_flush();
+  }
+
+  if (record_len > rfble_cmd_max_notif_len(conn_handle)) {
+    return BLE_HS_EMSGSIZE;
+  }
+
+  memcpy(batch.buf + batch.len, record, record_len);
+  batch.len += record_len;
+  return 0;
+}
+
+int rfble_cmd_respond8(uint16_t conn_handle, uint8_t type, uint8_t req_id, uint8_t value) {
+  return rfble_cmd_respond(conn_handle, type, req_id, &value, sizeof(uint8_t));
+}
+
+int rfble_cmd_handle_write(uint16_t conn_handle, struct os_mbuf* om) {
+  struct rfble_cmd cmd = { .conn_handle = conn_handle };
+  uint16_t len;
+  size_t pos = 0;
+  int err;
+
+  if (ble_hs_mbuf_to_flat(om, write_buf, sizeof(write_buf), &len) != 0) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  batch.open = true;
+  batch.task = xTaskGetCurrentTaskHandle();
+  batch.conn_handle = conn_handle;
+  batch.len = 0;
+
+  while (pos < len) {
+    if (len - pos < RFBLE_CMD_HEADER_LEN || len - pos - RFBLE_CMD_HEADER_LEN < write_buf[pos + 2]) {
+      ESP_LOGW(TAG, "Truncated command record at offset %d", (int) pos);
+      rfble_cmd_respond8(conn_handle, RFBLE_CMD_ERROR,
+			 len - pos >= 2 ? write_buf[pos + 1] : 0, RFBLE_CMD_ERR_TRUNCATED);
+      break;
+    }
+
+    cmd.type = write_buf[pos];
+    cmd.req_id = write_buf[pos + 1];
+    cmd.len = write_buf[pos + 2];
+    cmd.value = write_buf + pos + RFBLE_CMD_HEADER_LEN;
+    pos += RFBLE_CMD_HEADER_LEN + cmd.len;
+
+    if (rfble_opts.cmd_cb == NULL) {
+      err = RFBLE_CMD_ERR_UNKNOWN_TYPE;
+    } else {
+      err = rfble_opts.cmd_cb(&cmd);
+    }
+
+    if (err != 0) {
+      rfble_cmd_respond8(conn_handle, RFBLE_CMD_ERROR, cmd.req_id, (uint8_t) err);
+    }
+  }
+
+  rfble_cmd_flush();
+  batch.open = false;
+  return 0;
+}
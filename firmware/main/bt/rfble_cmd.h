@@ -0,0 +1,93 @@
+#ifndef RFBLE_CMD_H
+#define RFBLE_CMD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "host/ble_hs.h"
+
+/* Binary command protocol carried by the command characteristic.
+
+   Every write holds one or more records, laid out as:
+
+     u8 type     RFBLE_CMD_* command type
+     u8 req_id   Chosen by the client, echoed back in the responses
+     u8 len      Length of the value
+     u8 value[len]
+
+   The characteristic accepts writes without response, so clients can
+   pipeline several commands, or batch them in a single write, without
+   waiting a connection event for each one. Responses are notified to
+   the requesting peer on the same characteristic, as records with the
+   same layout carrying the type and request id of the command they
+   answer. Responses produced while a write is being processed are
+   batched into as few notifications as the MTU allows. */
+
+#define RFBLE_CMD_HEADER_LEN 3
+
+/* Max length of the writes accepted by the command characteristic */
+#define RFBLE_CMD_MAX_WRITE_LEN BLE_ATT_ATTR_MAX_LEN
+
+/* Max length of a batch of responses. Notifications are also bound by
+   the MTU of each connection. */
+#define RFBLE_CMD_MAX_BATCH_LEN 244
+
+typedef enum rfble_cmd_type {
+  /** Sends a pre-stored RF signal. Value: u8 stored signal id.
+      Responses: u8 rfble_gatt_send_rf_notif_t, as with the Send RF
+      characteristic. */
+  RFBLE_CMD_SEND_RF = 0x01,
+
+  /** Reads the antenna state. No value. Response: u8
+      rfble_gatt_antenna_state_notif_t. */
+  RFBLE_CMD_GET_ANTENNA_STATE = 0x02,
+
+  /** Response only: the command couldn't be processed. Value: u8
+      rfble_cmd_error_t. */
+  RFBLE_CMD_ERROR = 0xff,
+} rfble_cmd_type_t;
+
+typedef enum rfble_cmd_error {
+  /** The command type is unknown */
+  RFBLE_CMD_ERR_UNKNOWN_TYPE = 1,
+
+  /** The value length is not valid for the command type */
+  RFBLE_CMD_ERR_INVALID_LEN = 2,
+
+  /** The record is truncated. Any records after it are dropped. */
+  RFBLE_CMD_ERR_TRUNCATED = 3,
+} rfble_cmd_error_t;
+
+struct rfble_cmd {
+  /** The connection that sent the command */
+  uint16_t conn_handle;
+
+  uint8_t type;
+  uint8_t req_id;
+  uint8_t len;
+
+  /** The value of the command. Only valid during the callback. */
+  const uint8_t* value;
+};
+
+/**
+ * Called for every command received. Returns 0 if the command has been
+ * accepted, or a rfble_cmd_error_t otherwise, which will be responded
+ * to the client.
+ */
+typedef int (*rfble_cmd_cb_t)(const struct rfble_cmd* cmd);
+
+/** Processes a write to the command characteristic. */
+int rfble_cmd_handle_write(uint16_t conn_handle, struct os_mbuf* om);
+
+/**
+ * Sends a response to a command. If called while the command is
+ * being processed, the response is batched with the rest of the
+ * responses of the same write.
+ */
+int rfble_cmd_respond(uint16_t conn_handle, uint8_t type, uint8_t req_id, const void* value,
+		      uint8_t len);
+
+/** Sends a response with a single byte value */
+int rfble_cmd_respond8(uint16_t conn_handle, uint8_t type, uint8_t req_id, uint8_t value);
+
+#endif
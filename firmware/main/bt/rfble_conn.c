@@ -0,0 +1,293 @@
+#include "rfble_conn.h"
+#include <string.h>
+#include "esp_log.h"
+#include "esp_timer.h"
+#include "host/ble_gap.h"
+#include "host/ble_hs.h"
+#include "nimble/nimble_port.h"
+#include "rfble.h"
+
+#define TAG "RF BLE CONN"
+
+static esp_timer_handle_t idle_timer;
+
+/** Whether the active parameters are being held by the app */
+static volatile bool active_held = false;
+
+/* The connection table is only touched from the host task, so the idle
+   timer and the app post these events to it instead. Posting an event
+   that is already queued is a no-op, and its handler reads the latest
+   state. */
+static struct ble_npl_event idle_ev;
+static struct ble_npl_event activity_ev;
+
+static const struct ble_gap_upd_params active_params = {
+  .itvl_min = RFBLE_CONN_ACTIVE_ITVL_MIN,
+  .itvl_max = RFBLE_CONN_ACTIVE_ITVL_MAX,
+  .latency = RFBLE_CONN_ACTIVE_LATENCY,
+  .supervision_timeout = RFBLE_CONN_ACTIVE_TIMEOUT,
+};
+
+static const struct ble_gap_upd_params idle_params = {
+  .itvl_min = RFBLE_CONN_IDLE_ITVL_MIN,
+  .itvl_max = RFBLE_CONN_IDLE_ITVL_MAX,
+  .latency = RFBLE_CONN_IDLE_LATENCY,
+  .supervision_timeout = RFBLE_CONN_IDLE_TIMEOUT,
+};
+
+// Returns false if the update could not be requested
+static bool rfble_conn_request(rfble_conn_slot_t* slot, rfble_conn_mode_t mode) {
+  int rc;
+
+  if (slot == NULL || !slot->used || slot->requested_mode == mode) {
+    return true;
+  }
+
+  rc = ble_gap_update_params(slot->conn_handle, mode == RFBLE_CONN_MODE_ACTIVE ? &active_params : &idle_params);
+  if (rc != 0) {
+    // Most likely another update is still in progress (BLE_HS_EALREADY)
+    ESP_LOGW(TAG, "Failed to request %s connection parameters; handle=%d; rc=%d",
+	     mode == RFBLE_CONN_MODE_ACTIVE ? "active" : "idle", slot->conn_handle, rc);
+    return false;
+  }
+
+  slot->requested_mode = mode;
+  if (mode == RFBLE_CONN_MODE_ACTIVE) {
+    slot->stats.active_requests++;
+  }
+  return true;
+}
+
+static bool rfble_conn_request_all(rfble_conn_mode_t mode) {
+  bool ok = true;
+
+  for (int i = 0; i < RFBLE_MAX_CONNECTIONS; i++) {
+    ok &= rfble_conn_request(&rfble_state.conns[i], mode);
+  }
+  return ok;
+}
+
+static void rfble_conn_schedule_idle(uint32_t delay_ms) {
+  esp_timer_stop(idle_timer);
+  esp_timer_start_once(idle_timer, (uint64_t) delay_ms * 1000);
+}
+
+// A failed active request is retried on the next activity change, but
+// nothing else would retry a failed idle one, so it re-arms the timer
+static void rfble_conn_on_idle(struct ble_npl_event* ev) {
+  if (!active_held && !rfble_conn_request_all(RFBLE_CONN_MODE_IDLE)) {
+    rfble_conn_schedule_idle(RFBLE_CONN_IDLE_RETRY_MS);
+  }
+}
+
+static void rfble_conn_on_activity(struct ble_npl_event* ev) {
+  if (active_held) {
+    // Results of the commands are notified to every subscribed peer,
+    // so all of them are kept responsive.
+    esp_timer_stop(idle_timer);
+    rfble_conn_request_all(RFBLE_CONN_MODE_ACTIVE);
+  } else if (rfble_is_connected()) {
+    rfble_conn_schedule_idle(RFBLE_CONN_IDLE_DELAY_MS);
+  }
+}
+
+static void rfble_conn_idle_timer_cb(void* arg) {
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &idle_ev);
+}
+
+void rfble_conn_init() {
+  const esp_timer_create_args_t timer_args = {
+    .callback = rfble_conn_idle_timer_cb,
+    .name = "rfble_conn_idle",
+  };
+
+  ble_npl_event_init(&idle_ev, rfble_conn_on_idle, NULL);
+  ble_npl_event_init(&activity_ev, rfble_conn_on_activity, NULL);
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &idle_timer));
+}
+
+void rfble_conn_on_connect(uint16_t conn_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  struct ble_gap_conn_desc desc;
+  int rc;
+
+  if (slot == NULL) {
+    return;
+  }
+
+  memset(&slot->stats, 0, sizeof(slot->stats));
+  slot->stats.connected_at_us = esp_timer_get_time();
+  slot->stats.tx_phy = BLE_GAP_LE_PHY_1M;
+  slot->stats.rx_phy = BLE_GAP_LE_PHY_1M;
+  if (ble_gap_conn_find(conn_handle, &desc) == 0) {
+    slot->stats.itvl = desc.conn_itvl;
+    slot->stats.latency = desc.conn_latency;
+    slot->stats.supervision_timeout = desc.supervision_timeout;
+  }
+
+  slot->requested_mode = RFBLE_CONN_MODE_NONE;
+
+#if MYNEWT_VAL(BLE_LL_CFG_FEAT_LE_2M_PHY)
+  rc = ble_gap_set_prefered_le_phy(conn_handle, BLE_GAP_LE_PHY_2M_MASK, BLE_GAP_LE_PHY_2M_MASK,
+				   BLE_GAP_LE_PHY_CODED_ANY);
+  if (rc != 0) {
+    ESP_LOGW(TAG, "Failed to request 2M PHY; rc=%d", rc);
+  }
+#endif
+
+  rc = ble_gap_set_data_len(conn_handle, RFBLE_CONN_DATA_LEN_OCTETS, RFBLE_CONN_DATA_LEN_TIME_US);
+  if (rc != 0) {
+    ESP_LOGW(TAG, "Failed to request data length extension; rc=%d", rc);
+  }
+
+  // Pairing, encryption and service discovery happen right after
+  // connecting, and are the first thing users wait for.
+  rfble_conn_request(slot, RFBLE_CONN_MODE_ACTIVE);
+  if (!active_held) {
+    rfble_conn_schedule_idle(RFBLE_CONN_SETUP_IDLE_DELAY_MS);
+  }
+}
+
+void rfble_conn_on_disconnect(uint16_t conn_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+
+  if (slot != NULL) {
+    rfble_conn_log_stats(conn_handle);
+    slot->requested_mode = RFBLE_CONN_MODE_NONE;
+  }
+}
+
+void rfble_conn_on_update(uint16_t conn_handle, int status) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  struct ble_gap_conn_desc desc;
+
+  if (slot == NULL) {
+    return;
+  }
+
+  if (status != 0) {
+    ESP_LOGW(TAG, "Connection parameters update failed; handle=%d; status=%d", conn_handle, status);
+    slot->requested_mode = RFBLE_CONN_MODE_NONE;
+    if (!active_held) {
+      rfble_conn_schedule_idle(RFBLE_CONN_IDLE_RETRY_MS);
+    }
+    return;
+  }
+
+  if (ble_gap_conn_find(conn_handle, &desc) != 0) {
+    return;
+  }
+
+  slot->stats.itvl = desc.conn_itvl;
+  slot->stats.latency = desc.conn_latency;
+  slot->stats.supervision_timeout = desc.supervision_timeout;
+  slot->stats.param_updates++;
+
+  ESP_LOGI(TAG, "Connection parameters: handle=%d; itvl=%d.%02d ms; latency=%d; timeout=%d ms",
+	   conn_handle, desc.conn_itvl * 125 / 100, desc.conn_itvl * 125 % 100, desc.conn_latency,
+	   desc.supervision_timeout * 10);
+}
+
+void rfble_conn_on_phy_update(uint16_t conn_handle, int status, uint8_t tx_phy, uint8_t rx_phy) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+
+  if (slot == NULL) {
+    return;
+  }
+
+  if (status != 0) {
+    ESP_LOGW(TAG, "PHY update failed; handle=%d; status=%d", conn_handle, status);
+    return;
+  }
+
+  slot->stats.tx_phy = tx_phy;
+  slot->stats.rx_phy = rx_phy;
+  ESP_LOGI(TAG, "PHY updated; handle=%d; tx_phy=%d; rx_phy=%d", conn_handle, tx_phy, rx_phy);
+}
+
+static void rfble_conn_on_first_write(rfble_conn_slot_t* slot) {
+  struct rfble_conn_stats* stats = &slot->stats;
+
+  stats->first_write_us = (uint32_t) (esp_timer_get_time() - stats->connected_at_us);
+  ESP_LOGI(TAG, "First write; handle=%d; after=%lu us", slot->conn_handle,
+	   (unsigned long) stats->first_write_us);
+}
+
+void rfble_conn_on_write(uint16_t conn_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+
+  if (slot == NULL) {
+    return;
+  }
+
+  if (slot->stats.first_write_us == 0) {
+    rfble_conn_on_first_write(slot);
+  }
+
+  if (slot->stats._pending_write_us == 0) {
+    slot->stats._pending_write_us = esp_timer_get_time();
+  }
+
+  rfble_conn_request(slot, RFBLE_CONN_MODE_ACTIVE);
+  if (!active_held) {
+    rfble_conn_schedule_idle(RFBLE_CONN_IDLE_DELAY_MS);
+  }
+}
+
+void rfble_conn_on_notify_tx(uint16_t conn_handle, int status) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  struct rfble_conn_stats* stats;
+  uint32_t elapsed;
+
+  if (slot == NULL || status != 0 || slot->stats._pending_write_us == 0) {
+    return;
+  }
+
+  stats = &slot->stats;
+  elapsed = (uint32_t) (esp_timer_get_time() - stats->_pending_write_us);
+  stats->_pending_write_us = 0;
+
+  if (stats->responses == 0 || elapsed < stats->response_min_us) {
+    stats->response_min_us = elapsed;
+  }
+  if (elapsed > stats->response_max_us) {
+    stats->response_max_us = elapsed;
+  }
+  stats->response_total_us += elapsed;
+  stats->responses++;
+}
+
+void rfble_conn_set_active(bool active) {
+  active_held = active;
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &activity_ev);
+}
+
+const struct rfble_conn_stats* rfble_conn_get_stats(uint16_t conn_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  return slot != NULL ? &slot->stats : NULL;
+}
+
+void rfble_conn_log_stats(uint16_t conn_handle) {
+  const struct rfble_conn_stats* stats = rfble_conn_get_stats(conn_handle);
+
+  if (stats == NULL) {
+    return;
+  }
+
+  ESP_LOGI(TAG, "Connection stats: handle=%d; uptime=%lld ms; itvl=%d; latency=%d; tx_phy=%d; "
+	   "rx_phy=%d; param_updates=%lu; active_requests=%lu",
+	   conn_handle, (esp_timer_get_time() - stats->connected_at_us) / 1000, stats->itvl,
+	   stats->latency, stats->tx_phy, stats->rx_phy, (unsigned long) stats->param_updates,
+	   (unsigned long) stats->active_requests);
+
+  if (stats->first_write_us > 0) {
+    ESP_LOGI(TAG, "Connect to first write: handle=%d; %lu us",
+	     conn_handle, (unsigned long) stats->first_write_us);
+  }
+
+  if (stats->responses > 0) {
+    ESP_LOGI(TAG, "Write to response latency: handle=%d; n=%lu; min=%lu us; avg=%llu us; max=%lu us",
+	     conn_handle, (unsigned long) stats->responses, (unsigned long) stats->response_min_us,
+	     stats->response_total_us / stats->responses, (unsigned long) stats->response_max_us);
+  }
+}
@@ -0,0 +1,106 @@
+#ifndef RFBLE_CONN_H
+#define RFBLE_CONN_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* Connection parameters requested while a command is being processed,
+   for the lowest latency between the peer and the antenna. Intervals
+   are expressed in units of 1.25 ms, and timeouts in units of 10 ms. */
+#define RFBLE_CONN_ACTIVE_ITVL_MIN 6  /* 7.5 ms */
+#define RFBLE_CONN_ACTIVE_ITVL_MAX 12 /* 15 ms */
+#define RFBLE_CONN_ACTIVE_LATENCY 0
+#define RFBLE_CONN_ACTIVE_TIMEOUT 200 /* 2 s */
+
+/* Connection parameters requested while idle. Peripheral latency lets
+   the controller skip connection events while there's nothing to
+   send, so the radio stays off for up to (latency + 1) intervals. */
+#define RFBLE_CONN_IDLE_ITVL_MIN 24 /* 30 ms */
+#define RFBLE_CONN_IDLE_ITVL_MAX 40 /* 50 ms */
+#define RFBLE_CONN_IDLE_LATENCY 4
+#define RFBLE_CONN_IDLE_TIMEOUT 400 /* 4 s */
+
+/* Time to wait after the last activity before relaxing the connection
+   parameters. Right after connecting it is longer, to let the peer
+   finish securing the link and discovering the services. */
+#define RFBLE_CONN_IDLE_DELAY_MS 2000
+#define RFBLE_CONN_SETUP_IDLE_DELAY_MS 5000
+
+/* Time to wait before requesting the idle parameters again, when the
+   previous request could not be made or was rejected */
+#define RFBLE_CONN_IDLE_RETRY_MS 1000
+
+/* Data length requested for the link layer PDUs */
+#define RFBLE_CONN_DATA_LEN_OCTETS 251
+#define RFBLE_CONN_DATA_LEN_TIME_US 2120
+
+typedef enum rfble_conn_mode {
+  RFBLE_CONN_MODE_NONE = 0,
+  RFBLE_CONN_MODE_ACTIVE,
+  RFBLE_CONN_MODE_IDLE,
+} rfble_conn_mode_t;
+
+struct rfble_conn_stats {
+  /** Time at which the connection was established */
+  int64_t connected_at_us;
+
+  /** Current connection parameters, as reported by the controller */
+  uint16_t itvl;
+  uint16_t latency;
+  uint16_t supervision_timeout;
+
+  /** Current PHYs of the connection */
+  uint8_t tx_phy;
+  uint8_t rx_phy;
+
+  /** Number of connection parameter updates completed */
+  uint32_t param_updates;
+
+  /** Number of times the active parameters have been requested */
+  uint32_t active_requests;
+
+  /** Number of writes from the peer that got a response notified */
+  uint32_t responses;
+
+  /** Time between a write from the peer and the first notification
+      sent after it */
+  uint32_t response_min_us;
+  uint32_t response_max_us;
+  uint64_t response_total_us;
+
+  /** Time from the connection to the first write of the peer, which
+      includes securing the link and discovering the services, or 0
+      if there hasn't been any write yet */
+  uint32_t first_write_us;
+
+  /** (Internal) time of the last write still waiting for a response,
+      or 0 if none */
+  int64_t _pending_write_us;
+};
+
+/** Sets up the connection policy. Needs to be called before the host
+    starts. */
+void rfble_conn_init();
+
+void rfble_conn_on_connect(uint16_t conn_handle);
+void rfble_conn_on_disconnect(uint16_t conn_handle);
+void rfble_conn_on_update(uint16_t conn_handle, int status);
+void rfble_conn_on_phy_update(uint16_t conn_handle, int status, uint8_t tx_phy, uint8_t rx_phy);
+void rfble_conn_on_write(uint16_t conn_handle);
+void rfble_conn_on_notify_tx(uint16_t conn_handle, int status);
+
+/**
+ * Holds the low latency connection parameters while active is true,
+ * e.g while a command is being processed. Once released, the
+ * parameters are relaxed after RFBLE_CONN_IDLE_DELAY_MS without
+ * further activity. Can be called from any task, the requests are
+ * made from the host task.
+ */
+void rfble_conn_set_active(bool active);
+
+/** Returns the statistics of the given connection, or NULL if unknown */
+const struct rfble_conn_stats* rfble_conn_get_stats(uint16_t conn_handle);
+
+void rfble_conn_log_stats(uint16_t conn_handle);
+
+#endif
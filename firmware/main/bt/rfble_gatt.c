@@ -18,6 +18,7 @@
  */
 
 #include <assert.h>
+#include <inttypes.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <string.h>
@@ -26,11 +27,19 @@
 #include "host/ble_gatt.h"
 #include "host/ble_hs.h"
 #include "host/ble_uuid.h"
+#include "os/os_mbuf.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "nimble/nimble_port.h"
 #include "services/gap/ble_svc_gap.h"
 #include "services/gatt/ble_svc_gatt.h"
-#include "services/ans/ble_svc_ans.h"
 #include "rfble.h"
 #include "rfble_gatt.h"
+#include "rfble_conn.h"
+#include "rfble_cmd.h"
+#include "rfble_cache.h"
+#include "rfble_trigger.h"
+#include "rfble_ota.h"
 
 #define TAG "RF BLE GATT"
 
@@ -49,6 +58,24 @@
 
 #define BLE_GATT_END { 0 }
 
+/* Notifications take msys blocks shared with the rest of the host. In
+   the worst case a peer has waiting at once the status and the antenna
+   state, a send rf response, a batch of command responses and an OTA
+   response, all of which fit a block but the batch. The msys blocks
+   cover that burst on every connection on top of the ones needed by
+   the host for the OTA writes. Status and antenna state are coalesced
+   by the flush, so there is at most one of each waiting per peer. */
+#define NOTIF_MSYS_BLOCK_DATA_LEN					\
+  (CONFIG_BT_NIMBLE_MSYS_1_BLOCK_SIZE - sizeof(struct os_mbuf) - sizeof(struct os_mbuf_pkthdr))
+#define NOTIF_BATCH_MSYS_BLOCKS						\
+  ((RFBLE_CMD_MAX_BATCH_LEN + 3 + NOTIF_MSYS_BLOCK_DATA_LEN - 1) / NOTIF_MSYS_BLOCK_DATA_LEN)
+#define NOTIF_MSYS_BLOCKS_PER_CONN (NOTIF_BATCH_MSYS_BLOCKS + 4)
+#define HOST_MSYS_BLOCKS 24
+
+_Static_assert(CONFIG_BT_NIMBLE_MSYS_1_BLOCK_COUNT >=
+	       HOST_MSYS_BLOCKS + CONFIG_BT_NIMBLE_MAX_CONNECTIONS * NOTIF_MSYS_BLOCKS_PER_CONN,
+	       "Not enough msys blocks for a burst of notifications");
+
 #define DSC_CHARACTERISTIC_NAME(name) \
   {						\
     .uuid = &rfble_gatt_chr_name_uuid.u,	\
@@ -62,6 +89,59 @@ static int rfble_gatt_chr_access(uint16_t conn_handle, uint16_t attr_handle,
 				 struct ble_gatt_access_ctxt *ctxt,
 				 void *arg);
 
+/* Upper bound of the attribute handles in the database, including
+   the services registered before ours */
+#define RFBLE_GATT_MAX_HANDLES 64
+
+/** Handlers of each characteristic, indexed by value handle */
+struct rfble_gatt_dispatch {
+  const ble_uuid_t* uuid;
+  rfble_gatt_cb_chr_access read_cb;
+  rfble_gatt_cb_chr_access write_cb;
+};
+
+static struct rfble_gatt_dispatch dispatch[RFBLE_GATT_MAX_HANDLES];
+
+/** Highest attribute handle registered, i.e. the number of attributes
+    in the database. Clients discover all of them on the first
+    connection. */
+static uint16_t attr_count = 0;
+
+#if CONFIG_RFAPP_BLE_GATT_TRACE
+/* Number of accesses that can be recorded between flushes */
+#define RFBLE_GATT_TRACE_LEN 32
+#define RFBLE_GATT_TRACE_FLUSH_MS 1000
+
+struct rfble_gatt_trace_entry {
+  int64_t time_us;
+  uint16_t conn_handle;
+  uint16_t attr_handle;
+  uint8_t op;
+};
+
+static portMUX_TYPE trace_lock = portMUX_INITIALIZER_UNLOCKED;
+static struct {
+  struct rfble_gatt_trace_entry entries[RFBLE_GATT_TRACE_LEN];
+  size_t head;
+  size_t len;
+  uint32_t dropped;
+} trace;
+static esp_timer_handle_t trace_timer;
+#endif
+
+static portMUX_TYPE status_lock = portMUX_INITIALIZER_UNLOCKED;
+static rfble_gatt_status_t status;
+/** Whether status changed since the last flush. Guarded by status_lock. */
+static bool status_changed = false;
+/** Last antenna state to notify, and whether it changed since the last
+    flush. Guarded by status_lock. */
+static uint8_t antenna_state = RFBLE_GATT_ANTENNA_STATE_FREE;
+static bool antenna_state_changed = false;
+static esp_timer_handle_t notif_timer;
+/** Runs the flush in the host task, which owns the connection table */
+static struct ble_npl_event notif_flush_ev;
+
+
 static const struct ble_gatt_svc_def rfble_gatt_svcs[] = {
   {
     .type = BLE_GATT_SVC_TYPE_PRIMARY,
@@ -90,6 +170,72 @@ static const struct ble_gatt_svc_def rfble_gatt_svcs[] = {
 	  BLE_GATT_END
 	},
       },
+      {
+	.uuid = &rfble_gatt_chr_command_uuid.u,
+	.access_cb = rfble_gatt_chr_access,
+	.flags = CHR_SECURE_WRITE_FLAGS | BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_PROP_NOTIFY,
+	.min_key_size = 0,
+	.val_handle = &rfble_state.gatt_handles.command_handle,
+	.descriptors = (struct ble_gatt_dsc_def[]){
+	  DSC_CHARACTERISTIC_NAME("Command channel"),
+	  BLE_GATT_END
+	},
+      },
+      {
+	.uuid = &rfble_gatt_chr_status_uuid.u,
+	.access_cb = rfble_gatt_chr_access,
+	.flags = BLE_GATT_CHR_PROP_NOTIFY | CHR_SECURE_READ_FLAGS,
+	.min_key_size = 0,
+	.val_handle = &rfble_state.gatt_handles.status_handle,
+	.descriptors = (struct ble_gatt_dsc_def[]){
+	  DSC_CHARACTERISTIC_NAME("Status"),
+	  BLE_GATT_END
+	},
+      },
+#if CONFIG_RFAPP_BLE_ADV_TRIGGER
+      {
+	.uuid = &rfble_gatt_chr_trigger_key_uuid.u,
+	.access_cb = rfble_gatt_chr_access,
+	.flags = CHR_SECURE_READ_FLAGS,
+	.min_key_size = 0,
+	.val_handle = &rfble_state.gatt_handles.trigger_key_handle,
+	.descriptors = (struct ble_gatt_dsc_def[]){
+	  DSC_CHARACTERISTIC_NAME("Trigger key"),
+	  BLE_GATT_END
+	},
+      },
+#endif
+      BLE_GATT_END
+    },
+  },
+  {
+    .type = BLE_GATT_SVC_TYPE_PRIMARY,
+    .uuid = &rfble_gatt_svc_ota_uuid.u,
+    .characteristics =
+    (struct ble_gatt_chr_def[]){
+      {
+	.uuid = &rfble_gatt_chr_ota_control_uuid.u,
+	.access_cb = rfble_gatt_chr_access,
+	.flags = BLE_GATT_CHR_F_WRITE | BLE_GATT_CHR_F_WRITE_ENC | BLE_GATT_CHR_F_WRITE_AUTHEN |
+	BLE_GATT_CHR_PROP_NOTIFY,
+	.min_key_size = 0,
+	.val_handle = &rfble_state.gatt_handles.ota_control_handle,
+	.descriptors = (struct ble_gatt_dsc_def[]){
+	  DSC_CHARACTERISTIC_NAME("OTA control"),
+	  BLE_GATT_END
+	},
+      },
+      {
+	.uuid = &rfble_gatt_chr_ota_data_uuid.u,
+	.access_cb = rfble_gatt_chr_access,
+	.flags = BLE_GATT_CHR_F_WRITE_NO_RSP | BLE_GATT_CHR_F_WRITE_ENC | BLE_GATT_CHR_F_WRITE_AUTHEN,
+	.min_key_size = 0,
+	.val_handle = &rfble_state.gatt_handles.ota_data_handle,
+	.descriptors = (struct ble_gatt_dsc_def[]){
+	  DSC_CHARACTERISTIC_NAME("OTA data"),
+	  BLE_GATT_END
+	},
+      },
       BLE_GATT_END
     },
   },
@@ -120,7 +266,11 @@ static int rfble_gatt_push(struct ble_gatt_access_ctxt *ctxt, void* value, size_
 }
 
 static int rfble_gatt_notif(uint16_t conn_handle, uint16_t attr_handle, void* value, size_t len) {
-  struct os_mbuf *om = ble_hs_mbuf_from_flat(value, sizeof(uint8_t));
+  struct os_mbuf *om = ble_hs_mbuf_from_flat(value, len);
+  if (om == NULL) {
+    return BLE_HS_ENOMEM;
+  }
+
   return ble_gatts_notify_custom(conn_handle, attr_handle, om);
 }
 
@@ -132,90 +282,411 @@ int rfble_gatt_recv8(struct ble_gatt_access_ctxt *ctxt, uint8_t* value) {
   return rfble_gatt_svr_chr_write(ctxt->om, sizeof(uint8_t), sizeof(uint8_t), value, NULL);
 }
 
-int rfble_gatt_notif8(uint16_t att_handle, uint8_t value) {
-  uint16_t conn = rfble_state.conn_handle;
-  if (conn == 0) {
+bool rfble_gatt_subscribed(uint16_t conn_handle, uint16_t attr_handle) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+  const rfble_gatt_handles_t* handles = &rfble_state.gatt_handles;
+
+  if (slot == NULL) {
+    return false;
+  }
+
+  if (attr_handle == handles->status_handle) {
+    return slot->status_subscribed;
+  } else if (attr_handle == handles->antenna_state_handle) {
+    return slot->antenna_subscribed;
+  } else if (attr_handle == handles->send_rf_handle) {
+    return slot->send_rf_subscribed;
+  } else if (attr_handle == handles->command_handle) {
+    return slot->command_subscribed;
+  } else if (attr_handle == handles->ota_control_handle) {
+    return slot->ota_control_subscribed;
+  }
+  return false;
+}
+
+int rfble_gatt_notif8(uint16_t conn_handle, uint16_t att_handle, uint8_t value) {
+  if (rfble_conn_slot(conn_handle) == NULL) {
     return BLE_HS_ENOTCONN;
   }
 
-  return rfble_gatt_notif(conn, att_handle, &value, sizeof(uint8_t));
+  // The host doesn't check the CCCD of custom notifications
+  if (!rfble_gatt_subscribed(conn_handle, att_handle)) {
+    return BLE_HS_EDISABLED;
+  }
+
+  return rfble_gatt_notif(conn_handle, att_handle, &value, sizeof(uint8_t));
 }
 
-void rfble_gatt_notify_antenna_state_change() {
+void rfble_gatt_status_get(rfble_gatt_status_t* out) {
+  portENTER_CRITICAL(&status_lock);
+  *out = status;
+  portEXIT_CRITICAL(&status_lock);
+}
+
+// Notifies value to the given peer. Returns false if it has to be
+// retried later.
+static bool rfble_gatt_notif_slot(rfble_conn_slot_t* slot, uint16_t attr_handle, void* value, size_t len) {
   int rc;
 
-  if (rfble_is_connected()) {
-    rc = ble_gatts_notify(rfble_state.conn_handle, rfble_state.gatt_handles.antenna_state_handle);
-    if (rc == 0) {
-      ESP_LOGI(TAG, "Notified antenna state change");
-    } else {
-      ESP_LOGE(TAG, "Failed to notify antenna state change with error %d", rc);
+  rc = rfble_gatt_notif(slot->conn_handle, attr_handle, value, len);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Failed to notify handle=%d to conn handle=%d; rc=%d", attr_handle, slot->conn_handle, rc);
+    return false;
+  }
+
+  return true;
+}
+
+// Notifies the current status to the given peer. Returns false if it
+// has to be retried later.
+static bool rfble_gatt_status_send(rfble_conn_slot_t* slot) {
+  rfble_gatt_status_t value;
+
+  rfble_gatt_status_get(&value);
+  if (!rfble_gatt_notif_slot(slot, rfble_state.gatt_handles.status_handle, &value, sizeof(value))) {
+    return false;
+  }
+
+  slot->status_sent_us = esp_timer_get_time();
+  return true;
+}
+
+// Sends the pending antenna state and status notifications, and
+// schedules the timer for the ones that have to wait. Peers get at most
+// one status notification per connection interval, carrying the latest
+// status. Antenna state changes are sent right away. Runs in the host
+// task.
+static void rfble_gatt_notif_flush(struct ble_npl_event* ev) {
+  int64_t now = esp_timer_get_time();
+  int64_t next_due = INT64_MAX;
+  bool changed;
+  bool antenna_changed;
+  uint8_t antenna;
+
+  portENTER_CRITICAL(&status_lock);
+  changed = status_changed;
+  status_changed = false;
+  antenna_changed = antenna_state_changed;
+  antenna_state_changed = false;
+  antenna = antenna_state;
+  portEXIT_CRITICAL(&status_lock);
+
+  for (int i = 0; i < RFBLE_MAX_CONNECTIONS; i++) {
+    rfble_conn_slot_t* slot = &rfble_state.conns[i];
+    int64_t due;
+
+    if (!slot->used) {
+      continue;
+    }
+
+    if (antenna_changed && slot->antenna_subscribed) {
+      slot->antenna_dirty = true;
+    }
+
+    if (slot->antenna_dirty) {
+      // Interval is expressed in units of 1.25 ms
+      if (!slot->antenna_subscribed ||
+	  rfble_gatt_notif_slot(slot, rfble_state.gatt_handles.antenna_state_handle,
+				&antenna, sizeof(antenna))) {
+	slot->antenna_dirty = false;
+      } else if (now + slot->stats.itvl * 1250 < next_due) {
+	next_due = now + slot->stats.itvl * 1250;
+      }
+    }
+
+    if (changed && slot->status_subscribed) {
+      slot->status_dirty = true;
+    }
+
+    if (!slot->status_dirty) {
+      continue;
+    }
+
+    if (!slot->status_subscribed) {
+      slot->status_dirty = false;
+      continue;
     }
+
+    due = slot->status_sent_us + slot->stats.itvl * 1250;
+    if (due <= now) {
+      // Cleared before reading the status, so a change made meanwhile
+      // gets notified on the next pass
+      slot->status_dirty = false;
+      if (rfble_gatt_status_send(slot)) {
+	continue;
+      }
+
+      // Out of msys blocks or notification rejected, retry once the next
+      // interval has elapsed
+      slot->status_dirty = true;
+      due = now + slot->stats.itvl * 1250;
+    }
+
+    if (due < next_due) {
+      next_due = due;
+    }
+  }
+
+  if (next_due != INT64_MAX) {
+    esp_timer_stop(notif_timer);
+    esp_timer_start_once(notif_timer, next_due > now ? next_due - now : 0);
+  }
+}
+
+static void rfble_gatt_notif_timer_cb(void* arg) {
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &notif_flush_ev);
+}
+
+void rfble_gatt_notify_antenna_state_change(bool busy) {
+  portENTER_CRITICAL(&status_lock);
+  antenna_state = busy ? RFBLE_GATT_ANTENNA_STATE_BUSY : RFBLE_GATT_ANTENNA_STATE_FREE;
+  antenna_state_changed = true;
+  portEXIT_CRITICAL(&status_lock);
+
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &notif_flush_ev);
+}
+
+void rfble_gatt_status_set(const rfble_gatt_status_t* value) {
+  portENTER_CRITICAL(&status_lock);
+  uint8_t seq = status.seq;
+  status = *value;
+  status.seq = seq + 1;
+  status_changed = true;
+  portEXIT_CRITICAL(&status_lock);
+
+  // Flushed from the host task, so several changes made in a row are
+  // sent in a single notification. Posting the event while it's
+  // still queued does nothing.
+  ble_npl_eventq_put(nimble_port_get_dflt_eventq(), &notif_flush_ev);
+}
+
+void rfble_gatt_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify) {
+  rfble_conn_slot_t* slot = rfble_conn_slot(conn_handle);
+
+  if (slot == NULL) {
+    return;
+  }
+
+  if (attr_handle == rfble_state.gatt_handles.status_handle) {
+    slot->status_subscribed = notify;
+  } else if (attr_handle == rfble_state.gatt_handles.antenna_state_handle) {
+    slot->antenna_subscribed = notify;
+  } else if (attr_handle == rfble_state.gatt_handles.send_rf_handle) {
+    slot->send_rf_subscribed = notify;
+  } else if (attr_handle == rfble_state.gatt_handles.command_handle) {
+    slot->command_subscribed = notify;
+  } else if (attr_handle == rfble_state.gatt_handles.ota_control_handle) {
+    slot->ota_control_subscribed = notify;
   }
 }
 
-void rfble_gatt_notify_send_rf_response(rfble_gatt_send_rf_notif_t notification) {
+void rfble_gatt_notify_send_rf_response(uint16_t conn_handle, rfble_gatt_send_rf_notif_t notification) {
   int rc;
 
-  if (rfble_is_connected()) {
-    rc = rfble_gatt_notif8(rfble_state.gatt_handles.send_rf_handle, (uint8_t) notification);
+  if (rfble_conn_slot(conn_handle) != NULL) {
+    rc = rfble_gatt_notif8(conn_handle, rfble_state.gatt_handles.send_rf_handle, (uint8_t) notification);
     if (rc == 0) {
-      ESP_LOGI(TAG, "Sent send rf response code %d", notification);
+      ESP_LOGI(TAG, "Sent send rf response code %d to handle=%d", notification, conn_handle);
+    } else if (rc == BLE_HS_EDISABLED) {
+      ESP_LOGD(TAG, "Peer not subscribed to send rf responses; handle=%d", conn_handle);
     } else {
       ESP_LOGE(TAG, "Failed to notify send rf response with error %d", rc);
     }
   }
 }
 
+static int rfble_gatt_status_read(uint16_t conn_handle, struct ble_gatt_access_ctxt *ctxt) {
+  rfble_gatt_status_t value;
+  rfble_gatt_status_get(&value);
+  return rfble_gatt_push(ctxt, &value, sizeof(value));
+}
+
+static int rfble_gatt_command_write(uint16_t conn_handle, struct ble_gatt_access_ctxt *ctxt) {
+  return rfble_cmd_handle_write(conn_handle, ctxt->om);
+}
+
+/** Characteristics handled by this module rather than by the app */
+static const rfble_gatt_chr_handler_t rfble_gatt_own_handlers[] = {
+  { .uuid = &rfble_gatt_chr_status_uuid.u, .read_cb = rfble_gatt_status_read },
+  { .uuid = &rfble_gatt_chr_command_uuid.u, .write_cb = rfble_gatt_command_write },
+  { .uuid = &rfble_gatt_chr_trigger_key_uuid.u, .read_cb = rfble_trigger_key_read },
+  { .uuid = &rfble_gatt_chr_ota_control_uuid.u, .write_cb = rfble_ota_control_write },
+  { .uuid = &rfble_gatt_chr_ota_data_uuid.u, .write_cb = rfble_ota_data_write },
+  BLE_GATT_END
+};
+
+#if CONFIG_RFAPP_BLE_GATT_TRACE
+static void rfble_gatt_trace(uint16_t conn_handle, uint16_t attr_handle, uint8_t op) {
+  struct rfble_gatt_trace_entry* entry;
+
+  portENTER_CRITICAL(&trace_lock);
+  if (trace.len == RFBLE_GATT_TRACE_LEN) {
+    trace.dropped++;
+  } else {
+    entry = &trace.entries[(trace.head + trace.len) % RFBLE_GATT_TRACE_LEN];
+    entry->time_us = esp_timer_get_time();
+    entry->conn_handle = conn_handle;
+    entry->attr_handle = attr_handle;
+    entry->op = op;
+    trace.len++;
+  }
+  portEXIT_CRITICAL(&trace_lock);
+}
+
+// Logs the recorded accesses, away from the host task.
+static void rfble_gatt_trace_flush(void* arg) {
+  struct rfble_gatt_trace_entry entry;
+  struct ble_gap_conn_desc desc;
+  char buf[BLE_UUID_STR_LEN];
+  uint32_t dropped;
+
+  while (1) {
+    portENTER_CRITICAL(&trace_lock);
+    if (trace.len == 0) {
+      dropped = trace.dropped;
+      trace.dropped = 0;
+      portEXIT_CRITICAL(&trace_lock);
+      break;
+    }
+    entry = trace.entries[trace.head];
+    trace.head = (trace.head + 1) % RFBLE_GATT_TRACE_LEN;
+    trace.len--;
+    portEXIT_CRITICAL(&trace_lock);
+
+    if (entry.attr_handle < RFBLE_GATT_MAX_HANDLES && dispatch[entry.attr_handle].uuid != NULL) {
+      ble_uuid_to_str(dispatch[entry.attr_handle].uuid, buf);
+    } else {
+      snprintf(buf, sizeof(buf), "handle %d", entry.attr_handle);
+    }
+
+    if (ble_gap_conn_find(entry.conn_handle, &desc) == 0) {
+      ESP_LOGI(TAG, "[%" PRId64 "] Peer (" RFBLE_ADDR_FMT ") accessed GATT entry %s [%s]",
+	       entry.time_us, RFBLE_ADDR_FMT_PARAMS(desc.peer_id_addr), buf,
+	       (entry.op & 1) == 0 ? "READ" : "WRITE");
+    } else {
+      ESP_LOGI(TAG, "[%" PRId64 "] Handle=%d accessed GATT entry %s [%s]",
+	       entry.time_us, entry.conn_handle, buf, (entry.op & 1) == 0 ? "READ" : "WRITE");
+    }
+  }
+
+  if (dropped > 0) {
+    ESP_LOGW(TAG, "%" PRIu32 " GATT accesses not traced", dropped);
+  }
+}
+#else
+#define rfble_gatt_trace(conn_handle, attr_handle, op)
+#endif
+
 static int rfble_gatt_chr_access(uint16_t conn_handle, uint16_t attr_handle,
 					struct ble_gatt_access_ctxt *ctxt,
 					void *arg) {
-  struct ble_gap_conn_desc desc;
-  char buf[BLE_UUID_STR_LEN];
+  const struct rfble_gatt_dispatch* entry = NULL;
 
-  if (conn_handle != 0xffff) {
-    // This is coming from a notify read request and it is not
-    // associated with an specific connection.
-    bool reading = (ctxt->op & 1) == 0;
-    assert(ble_gap_conn_find(conn_handle, &desc) == 0);
+  if (attr_handle < RFBLE_GATT_MAX_HANDLES) {
+    entry = &dispatch[attr_handle];
+  }
 
-    ESP_LOGI(TAG, "Peer (" RFBLE_ADDR_FMT ") accessing GATT entry %s [%s]",
-	     RFBLE_ADDR_FMT_PARAMS(desc.peer_id_addr),
-	     ble_uuid_to_str(ctxt->chr->uuid, buf), reading ? "READ" : "WRITE");
+  // Reads for notifying a value are not associated with an specific
+  // connection, and are not traced.
+  if (conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+    rfble_gatt_trace(conn_handle, attr_handle, ctxt->op);
+  }
+
+  if (conn_handle != BLE_HS_CONN_HANDLE_NONE) {
+    int rc = rfble_cache_check_request(conn_handle);
+    if (rc != 0) {
+      return rc;
+    }
   }
 
   switch (ctxt->op) {
   case BLE_GATT_ACCESS_OP_READ_DSC:
-    if (ble_uuid_cmp(ctxt->dsc->uuid, &rfble_gatt_chr_name_uuid.u) == 0) {
-      return rfble_gatt_push(ctxt, arg, strlen(arg));
-    }
-    break;
+    // Characteristic names are the only descriptors served from here
+    return rfble_gatt_push(ctxt, arg, strlen(arg));
 
   case BLE_GATT_ACCESS_OP_READ_CHR:
-    if (rfble_opts.gatt_read_cb != NULL) {
-      return rfble_opts.gatt_read_cb(ctxt, ctxt->chr->uuid);
+    if (entry != NULL && entry->read_cb != NULL) {
+      return entry->read_cb(conn_handle, ctxt);
     }
     break;
 
   case BLE_GATT_ACCESS_OP_WRITE_CHR:
-    if (rfble_opts.gatt_write_cb != NULL) {
-      return rfble_opts.gatt_write_cb(ctxt, ctxt->chr->uuid);
+    rfble_conn_on_write(conn_handle);
+    if (entry != NULL && entry->write_cb != NULL) {
+      return entry->write_cb(conn_handle, ctxt);
     }
-
     break;
   }
 
   return BLE_ATT_ERR_UNLIKELY;
 }
 
+static const rfble_gatt_chr_handler_t* rfble_gatt_find_handler(const rfble_gatt_chr_handler_t* handlers,
+								const ble_uuid_t* uuid) {
+  for (; handlers != NULL && handlers->uuid != NULL; handlers++) {
+    if (ble_uuid_cmp(handlers->uuid, uuid) == 0) {
+      return handlers;
+    }
+  }
+
+  return NULL;
+}
+
+// Resolves the handlers of a characteristic once, when it gets its
+// handle assigned, so accesses don't need to compare UUIDs.
+static void rfble_gatt_register_chr(const ble_uuid_t* uuid, uint16_t val_handle) {
+  const rfble_gatt_chr_handler_t* handler;
+
+  handler = rfble_gatt_find_handler(rfble_gatt_own_handlers, uuid);
+  if (handler == NULL) {
+    handler = rfble_gatt_find_handler(rfble_opts.chr_handlers, uuid);
+  }
+
+  if (val_handle >= RFBLE_GATT_MAX_HANDLES) {
+    if (handler == NULL) {
+      return;
+    }
+
+    ESP_LOGE(TAG, "Characteristic handle %d exceeds the dispatch table size", val_handle);
+    abort();
+  }
+
+  // The UUID is kept even without handlers, so they can be bound
+  // later by rfble_gatt_rebind_handlers.
+  dispatch[val_handle].uuid = uuid;
+  dispatch[val_handle].read_cb = handler != NULL ? handler->read_cb : NULL;
+  dispatch[val_handle].write_cb = handler != NULL ? handler->write_cb : NULL;
+}
+
+uint16_t rfble_gatt_attr_count(void) {
+  return attr_count;
+}
+
+void rfble_gatt_rebind_handlers(void) {
+  for (uint16_t i = 0; i < RFBLE_GATT_MAX_HANDLES; i++) {
+    if (dispatch[i].uuid != NULL) {
+      rfble_gatt_register_chr(dispatch[i].uuid, i);
+    }
+  }
+}
+
+static void rfble_gatt_count_attr(uint16_t handle) {
+  if (handle > attr_count) {
+    attr_count = handle;
+  }
+}
+
 void rfble_gatt_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg) {
   char buf[BLE_UUID_STR_LEN];
 
+  rfble_cache_on_register(ctxt);
+
   switch (ctxt->op) {
   case BLE_GATT_REGISTER_OP_SVC:
     ESP_LOGI(TAG, "Registered service %s with handle=%d",
 	     ble_uuid_to_str(ctxt->svc.svc_def->uuid, buf),
 	     ctxt->svc.handle);
+    rfble_gatt_count_attr(ctxt->svc.handle);
     break;
 
   case BLE_GATT_REGISTER_OP_CHR:
@@ -224,22 +695,45 @@ void rfble_gatt_register_cb(struct ble_gatt_register_ctxt *ctxt, void *arg) {
 	     ble_uuid_to_str(ctxt->chr.chr_def->uuid, buf),
 	     ctxt->chr.def_handle,
 	     ctxt->chr.val_handle);
+    rfble_gatt_register_chr(ctxt->chr.chr_def->uuid, ctxt->chr.val_handle);
+    rfble_gatt_count_attr(ctxt->chr.val_handle);
     break;
 
   case BLE_GATT_REGISTER_OP_DSC:
     ESP_LOGI(TAG, "registering descriptor %s with handle=%d",
 	     ble_uuid_to_str(ctxt->dsc.dsc_def->uuid, buf),
 	     ctxt->dsc.handle);
+    rfble_gatt_count_attr(ctxt->dsc.handle);
     break;
   }
 }
 
 int rfble_gatt_init(void) {
+  const esp_timer_create_args_t timer_args = {
+    .callback = rfble_gatt_notif_timer_cb,
+    .name = "rfble_notif"
+  };
   int rc;
 
+  ble_npl_event_init(&notif_flush_ev, rfble_gatt_notif_flush, NULL);
+  ESP_ERROR_CHECK(esp_timer_create(&timer_args, &notif_timer));
+
+#if CONFIG_RFAPP_BLE_GATT_TRACE
+  const esp_timer_create_args_t trace_timer_args = {
+    .callback = rfble_gatt_trace_flush,
+    .name = "rfble_trace"
+  };
+
+  ESP_ERROR_CHECK(esp_timer_create(&trace_timer_args, &trace_timer));
+  ESP_ERROR_CHECK(esp_timer_start_periodic(trace_timer, RFBLE_GATT_TRACE_FLUSH_MS * 1000));
+#endif
+
   ble_svc_gap_init();
-  ble_svc_gatt_init();
-  ble_svc_ans_init();
+  // In place of ble_svc_gatt_init, for exposing the database hash
+  rc = rfble_cache_init();
+  if (rc != 0) {
+    return rc;
+  }
 
   rc = ble_gatts_count_cfg(rfble_gatt_svcs);
   if (rc != 0) {
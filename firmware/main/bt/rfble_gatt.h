@@ -1,6 +1,7 @@
 #include "host/ble_gatt.h"
 #include "services/gatt/ble_svc_gatt.h"
 #include "host/ble_uuid.h"
+#include <stdbool.h>
 #include <stdint.h>
 
 #ifndef RFBLE_GATT_H
@@ -31,6 +32,51 @@ static const ble_uuid128_t rfble_gatt_chr_antenna_state_uuid =
     BLE_UUID128_INIT(0xa0, 0xf3, 0x33, 0x4d, 0x76, 0xe9, 0x48, 0x5a, 0x95, 0x5b,
                      0x56, 0x57, 0xee, 0x50, 0x56, 0x9f);
 
+/* 6e1f4a2c-8d3b-4c59-b7e2-1a9f0c3d5e74 */
+/** RF Companion Service - Command characteristic: Accepts pipelined
+   binary commands tagged with a request id, and notifies the responses
+   back through the same characteristic. See rfble_cmd.h. */
+static const ble_uuid128_t rfble_gatt_chr_command_uuid =
+  BLE_UUID128_INIT(0x74, 0x5e, 0x3d, 0x0c, 0x9f, 0x1a, 0xe2, 0xb7,
+		   0x59, 0x4c, 0x3b, 0x8d, 0x2c, 0x4a, 0x1f, 0x6e);
+
+/* 3b8d0e6a-4f27-4c1e-9a53-d2c7e8f1a096 */
+/** RF Companion Service - Status characteristic: Packed
+   rfble_gatt_status_t with the antenna state and the progress of the
+   last send rf request. Changes are coalesced into at most one
+   notification per connection interval. */
+static const ble_uuid128_t rfble_gatt_chr_status_uuid =
+  BLE_UUID128_INIT(0x96, 0xa0, 0xf1, 0xe8, 0xc7, 0xd2, 0x53, 0x9a,
+		   0x1e, 0x4c, 0x27, 0x4f, 0x6a, 0x0e, 0x8d, 0x3b);
+
+/* c2d4e8f1-7a3b-4d6e-9f05-81b2c3a4d5e6 */
+/** RF Companion Service - Trigger Key characteristic: The key the
+   reading peer signs its connectionless triggers with, and the counter
+   of its last accepted trigger. Only available when they are enabled.
+   See rfble_trigger.h. */
+static const ble_uuid128_t rfble_gatt_chr_trigger_key_uuid =
+  BLE_UUID128_INIT(0xe6, 0xd5, 0xa4, 0xc3, 0xb2, 0x81, 0x05, 0x9f,
+		   0x6e, 0x4d, 0x3b, 0x7a, 0xf1, 0xe8, 0xd4, 0xc2);
+
+/* 7d2e4b90-3c1f-4a8e-b6d5-0e9f8a7c6b51 */
+/** OTA Service: Firmware updates. See rfble_ota.h. */
+static const ble_uuid128_t rfble_gatt_svc_ota_uuid =
+  BLE_UUID128_INIT(0x51, 0x6b, 0x7c, 0x8a, 0x9f, 0x0e, 0xd5, 0xb6,
+		   0x8e, 0x4a, 0x1f, 0x3c, 0x90, 0x4b, 0x2e, 0x7d);
+
+/* 7d2e4b91-3c1f-4a8e-b6d5-0e9f8a7c6b51 */
+/** OTA Service - Control characteristic: Begins, ends or aborts an
+   update, and notifies its progress */
+static const ble_uuid128_t rfble_gatt_chr_ota_control_uuid =
+  BLE_UUID128_INIT(0x51, 0x6b, 0x7c, 0x8a, 0x9f, 0x0e, 0xd5, 0xb6,
+		   0x8e, 0x4a, 0x1f, 0x3c, 0x91, 0x4b, 0x2e, 0x7d);
+
+/* 7d2e4b92-3c1f-4a8e-b6d5-0e9f8a7c6b51 */
+/** OTA Service - Data characteristic: Receives the compressed image */
+static const ble_uuid128_t rfble_gatt_chr_ota_data_uuid =
+  BLE_UUID128_INIT(0x51, 0x6b, 0x7c, 0x8a, 0x9f, 0x0e, 0xd5, 0xb6,
+		   0x8e, 0x4a, 0x1f, 0x3c, 0x92, 0x4b, 0x2e, 0x7d);
+
 /** The handle of the Antenna State characteristic, that can be used
     for sending notifications. This value will only be valid after the
     GATT service has been registered */
@@ -48,12 +94,70 @@ typedef enum rfble_gatt_antenna_state_notif {
   RFBLE_GATT_ANTENNA_STATE_BUSY = 1
 } rfble_gatt_antenna_state_notif_t;
 
+/** Value of the Status characteristic */
+typedef struct __attribute__((packed)) rfble_gatt_status {
+  /** Incremented on every change, so clients can tell how many
+      updates got coalesced */
+  uint8_t seq;
+
+  /** rfble_gatt_antenna_state_notif_t */
+  uint8_t antenna_state;
+
+  /** Number of send rf requests accepted and not completed yet */
+  uint8_t queue_depth;
+
+  /** Request id of the last send rf request, if issued through the
+      command characteristic, or 0 otherwise */
+  uint8_t req_id;
+
+  /** rfble_gatt_send_rf_notif_t last reported for a send rf request,
+      or 0 if none */
+  uint8_t last_result;
+} rfble_gatt_status_t;
+
 typedef struct rfble_gatt_handles {
   uint16_t antenna_state_handle;
   uint16_t send_rf_handle;
+  uint16_t command_handle;
+  uint16_t status_handle;
+  uint16_t trigger_key_handle;
+  uint16_t ota_control_handle;
+  uint16_t ota_data_handle;
+  uint16_t service_changed_handle;
+  uint16_t client_features_handle;
+  uint16_t db_hash_handle;
 } rfble_gatt_handles_t;
 
-void rfble_gatt_notify_antenna_state_change();
-void rfble_gatt_notify_send_rf_response(rfble_gatt_send_rf_notif_t notification);
+/**
+ * Notifies the antenna state to every subscribed peer, from the host
+ * task along with the status notifications.
+ */
+void rfble_gatt_notify_antenna_state_change(bool busy);
+
+/**
+ * Updates the value of the Status characteristic and schedules its
+ * notification to the subscribed peers. The seq field is managed
+ * internally.
+ */
+void rfble_gatt_status_set(const rfble_gatt_status_t* status);
+
+/** Retrieves the current value of the Status characteristic */
+void rfble_gatt_status_get(rfble_gatt_status_t* status);
+
+/** Tracks the peers subscribed to each notified characteristic */
+void rfble_gatt_on_subscribe(uint16_t conn_handle, uint16_t attr_handle, bool notify);
+
+/** Returns the number of attributes in the database, once registered */
+uint16_t rfble_gatt_attr_count(void);
+
+/**
+ * Resolves again the handlers of every characteristic against
+ * rfble_opts.chr_handlers, after they have been replaced. Must run in
+ * the host task.
+ */
+void rfble_gatt_rebind_handlers(void);
+
+/** Notifies the result of a send rf request to the peer that made it */
+void rfble_gatt_notify_send_rf_response(uint16_t conn_handle, rfble_gatt_send_rf_notif_t notification);
 
 #endif
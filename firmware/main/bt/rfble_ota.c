@@ -0,0 +1,551 @@
+#include "rfble_ota.h"
+#include <inttypes.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_ota_ops.h"
+#include "esp_system.h"
+#include "esp_timer.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/task.h"
+#include "host/ble_att.h"
+#include "host/ble_gatt.h"
+#include "host/ble_hs.h"
+#include "mbedtls/sha256.h"
+#include "os/endian.h"
+#include "rom/miniz.h"
+#include "rfble.h"
+
+#define TAG "RF BLE OTA"
+
+#define OTA_TASK_STACK_SIZE 4096
+#define OTA_TASK_PRIORITY 5
+
+#define RESPONSE_LEN (1 + 1 + 4)
+
+/* Aborts the update without answering, as the updater is gone */
+#define MSG_OP_DROP 0x80
+
+/** Parameters of BEGIN */
+struct rfble_ota_begin {
+  uint16_t conn_handle;
+  uint32_t image_len;
+  uint32_t compressed_len;
+  uint8_t sha256[RFBLE_OTA_SHA256_LEN];
+};
+
+/** Request to the update task */
+struct rfble_ota_msg {
+  /** rfble_ota_op_t, RFBLE_OTA_OP_PROGRESS for data, or MSG_OP_DROP */
+  uint8_t op;
+
+  /** Status of the request, if rejected by the host */
+  uint8_t status;
+
+  /** Buffer holding the data, or -1 if none */
+  int8_t buf;
+  uint16_t len;
+
+  /** Only set for BEGIN */
+  struct rfble_ota_begin begin;
+};
+
+static uint8_t bufs[RFBLE_OTA_BUF_COUNT][RFBLE_OTA_BUF_SIZE];
+
+static StaticQueue_t free_queue_holder;
+static uint8_t free_queue_storage[RFBLE_OTA_BUF_COUNT * sizeof(int8_t)];
+static QueueHandle_t free_queue;
+
+/* Room for a whole update: BEGIN, every buffer, and the END or ABORT
+   following them. BEGIN is only accepted once the previous update has
+   been drained, see rfble_ota_task_idle. */
+#define MSG_QUEUE_LEN (RFBLE_OTA_BUF_COUNT + 2)
+static StaticQueue_t msg_queue_holder;
+static uint8_t msg_queue_storage[MSG_QUEUE_LEN * sizeof(struct rfble_ota_msg)];
+static QueueHandle_t msg_queue;
+
+static StackType_t ota_task_stack[OTA_TASK_STACK_SIZE];
+static StaticTask_t ota_task_storage;
+
+/** State of the update as seen by the host task */
+static struct {
+  bool active;
+  uint16_t conn_handle;
+  uint32_t compressed_len;
+  uint32_t received;
+
+  /** Buffer being filled, or -1 if none */
+  int8_t fill_buf;
+  uint16_t fill_len;
+} host;
+
+/** State of the update as seen by the update task */
+static struct {
+  bool active;
+
+  /** Set once any step fails. Following data is dropped until the
+      client aborts. */
+  bool failed;
+  struct rfble_ota_begin req;
+  const esp_partition_t* partition;
+  esp_ota_handle_t handle;
+  mbedtls_sha256_context sha256;
+  tinfl_decompressor inflator;
+  bool inflate_done;
+  size_t dict_ofs;
+  uint32_t consumed;
+  uint32_t written;
+
+  int64_t begin_us;
+  int64_t busy_us;
+} ota;
+
+/* Inflated data lands here before being written to flash. tinfl
+   needs the whole window of the deflate stream as a ring buffer. */
+static uint8_t dict[TINFL_LZ_DICT_SIZE];
+
+static void rfble_ota_respond(uint16_t conn_handle, uint8_t op, uint8_t status, uint32_t value) {
+  uint8_t resp[RESPONSE_LEN];
+  struct os_mbuf* om;
+  int rc;
+
+  resp[0] = op;
+  resp[1] = status;
+  put_le32(&resp[2], value);
+
+  if (!rfble_gatt_subscribed(conn_handle, rfble_state.gatt_handles.ota_control_handle)) {
+    ESP_LOGW(TAG, "Peer not subscribed to the responses; op=%d; status=%d", op, status);
+    return;
+  }
+
+  om = ble_hs_mbuf_from_flat(resp, sizeof(resp));
+  if (om == NULL) {
+    ESP_LOGE(TAG, "No buffers for responding op=%d", op);
+    return;
+  }
+
+  rc = ble_gatts_notify_custom(conn_handle, rfble_state.gatt_handles.ota_control_handle, om);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Failed to respond op=%d; rc=%d", op, rc);
+  }
+}
+
+static void rfble_ota_fail(uint8_t op, rfble_ota_status_t status) {
+  ESP_LOGE(TAG, "Update failed; op=%d; status=%d; consumed=%" PRIu32 "; written=%" PRIu32,
+	   op, status, ota.consumed, ota.written);
+  ota.failed = true;
+  rfble_ota_respond(ota.req.conn_handle, op, status, ota.consumed);
+}
+
+static void rfble_ota_task_begin(const struct rfble_ota_begin* req) {
+  esp_err_t err;
+
+  if (ota.active) {
+    esp_ota_abort(ota.handle);
+    mbedtls_sha256_free(&ota.sha256);
+  }
+
+  memset(&ota, 0, sizeof(ota));
+  ota.req = *req;
+  ota.begin_us = esp_timer_get_time();
+
+  ota.partition = esp_ota_get_next_update_partition(NULL);
+  if (ota.partition == NULL || ota.req.image_len > ota.partition->size) {
+    rfble_ota_fail(RFBLE_OTA_OP_BEGIN, RFBLE_OTA_ERR_SIZE);
+    return;
+  }
+
+  // Sectors are erased as they are written, rather than all of them
+  // upfront, so erasing overlaps with the transfer.
+  err = esp_ota_begin(ota.partition, OTA_WITH_SEQUENTIAL_WRITES, &ota.handle);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to begin update: %s", esp_err_to_name(err));
+    rfble_ota_fail(RFBLE_OTA_OP_BEGIN, RFBLE_OTA_ERR_FLASH);
+    return;
+  }
+
+  ota.active = true;
+  mbedtls_sha256_init(&ota.sha256);
+  mbedtls_sha256_starts(&ota.sha256, 0);
+  tinfl_init(&ota.inflator);
+
+  ESP_LOGI(TAG, "Update started; partition=%s; image_len=%" PRIu32 "; compressed_len=%" PRIu32,
+	   ota.partition->label, ota.req.image_len, ota.req.compressed_len);
+  rfble_ota_respond(ota.req.conn_handle, RFBLE_OTA_OP_BEGIN, RFBLE_OTA_OK, RFBLE_OTA_WINDOW);
+}
+
+// Writes a piece of the inflated image
+static rfble_ota_status_t rfble_ota_write(const uint8_t* data, size_t len) {
+  esp_err_t err;
+
+  if (ota.written + len > ota.req.image_len) {
+    return RFBLE_OTA_ERR_VERIFY;
+  }
+
+  err = esp_ota_write(ota.handle, data, len);
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to write image: %s", esp_err_to_name(err));
+    return RFBLE_OTA_ERR_FLASH;
+  }
+
+  mbedtls_sha256_update(&ota.sha256, data, len);
+  ota.written += len;
+  return RFBLE_OTA_OK;
+}
+
+// Inflates a buffer of the compressed image, writing the output to
+// flash as it comes
+static rfble_ota_status_t rfble_ota_inflate(const uint8_t* in, size_t len) {
+  rfble_ota_status_t status;
+  tinfl_status st;
+  size_t in_bytes;
+  size_t out_bytes;
+
+  while (true) {
+    if (ota.inflate_done) {
+      // Nothing is expected after the end of the stream
+      return len == 0 ? RFBLE_OTA_OK : RFBLE_OTA_ERR_INFLATE;
+    }
+
+    in_bytes = len;
+    out_bytes = TINFL_LZ_DICT_SIZE - ota.dict_ofs;
+    st = tinfl_decompress(&ota.inflator, in, &in_bytes, dict, &dict[ota.dict_ofs], &out_bytes,
+			  TINFL_FLAG_PARSE_ZLIB_HEADER | TINFL_FLAG_HAS_MORE_INPUT);
+    in += in_bytes;
+    len -= in_bytes;
+
+    if (out_bytes > 0) {
+      if ((status = rfble_ota_write(&dict[ota.dict_ofs], out_bytes)) != RFBLE_OTA_OK) {
+	return status;
+      }
+      ota.dict_ofs = (ota.dict_ofs + out_bytes) & (TINFL_LZ_DICT_SIZE - 1);
+    }
+
+    if (st < TINFL_STATUS_DONE) {
+      ESP_LOGE(TAG, "Unable to inflate image; status=%d", st);
+      return RFBLE_OTA_ERR_INFLATE;
+    }
+
+    if (st == TINFL_STATUS_DONE) {
+      ota.inflate_done = true;
+    } else if (st == TINFL_STATUS_NEEDS_MORE_INPUT && len == 0) {
+      return RFBLE_OTA_OK;
+    }
+  }
+}
+
+static void rfble_ota_task_data(const struct rfble_ota_msg* msg) {
+  rfble_ota_status_t status;
+  int64_t start_us;
+
+  if (!ota.active || ota.failed) {
+    return;
+  }
+
+  start_us = esp_timer_get_time();
+  status = rfble_ota_inflate(bufs[msg->buf], msg->len);
+  ota.busy_us += esp_timer_get_time() - start_us;
+  ota.consumed += msg->len;
+
+  if (status != RFBLE_OTA_OK) {
+    rfble_ota_fail(RFBLE_OTA_OP_PROGRESS, status);
+  }
+}
+
+static void rfble_ota_log_stats(int64_t elapsed_us) {
+  uint32_t elapsed_ms = elapsed_us / 1000;
+
+  if (elapsed_ms == 0) {
+    elapsed_ms = 1;
+  }
+
+  // busy is the time spent inflating and writing to flash. The rest
+  // of the time the update task waited for data.
+  ESP_LOGI(TAG, "Update received; compressed=%" PRIu32 " B; image=%" PRIu32 " B; elapsed=%" PRIu32 " ms; "
+	   "link=%" PRIu32 " B/s; image=%" PRIu32 " B/s; busy=%" PRIu32 " ms",
+	   ota.consumed, ota.written, elapsed_ms,
+	   (uint32_t) ((uint64_t) ota.consumed * 1000 / elapsed_ms),
+	   (uint32_t) ((uint64_t) ota.written * 1000 / elapsed_ms),
+	   (uint32_t) (ota.busy_us / 1000));
+}
+
+static void rfble_ota_task_end(void) {
+  uint8_t sha256[RFBLE_OTA_SHA256_LEN];
+  int64_t elapsed_us;
+  esp_err_t err;
+
+  if (!ota.active || ota.failed) {
+    rfble_ota_respond(ota.req.conn_handle, RFBLE_OTA_OP_END, RFBLE_OTA_ERR_STATE, 0);
+    return;
+  }
+
+  mbedtls_sha256_finish(&ota.sha256, sha256);
+  mbedtls_sha256_free(&ota.sha256);
+  ota.active = false;
+
+  if (!ota.inflate_done || ota.consumed != ota.req.compressed_len || ota.written != ota.req.image_len ||
+      memcmp(sha256, ota.req.sha256, sizeof(sha256)) != 0) {
+    esp_ota_abort(ota.handle);
+    rfble_ota_fail(RFBLE_OTA_OP_END, RFBLE_OTA_ERR_VERIFY);
+    return;
+  }
+
+  // Checks the image itself, and its signature if secure boot is
+  // enabled
+  err = esp_ota_end(ota.handle);
+  if (err == ESP_OK) {
+    err = esp_ota_set_boot_partition(ota.partition);
+  }
+
+  if (err != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to validate image: %s", esp_err_to_name(err));
+    rfble_ota_fail(RFBLE_OTA_OP_END, RFBLE_OTA_ERR_VERIFY);
+    return;
+  }
+
+  elapsed_us = esp_timer_get_time() - ota.begin_us;
+  rfble_ota_log_stats(elapsed_us);
+  rfble_ota_respond(ota.req.conn_handle, RFBLE_OTA_OP_END, RFBLE_OTA_OK, elapsed_us / 1000);
+
+  ESP_LOGI(TAG, "Restarting into the new image");
+  vTaskDelay(RFBLE_OTA_RESTART_DELAY_MS / portTICK_PERIOD_MS);
+  esp_restart();
+}
+
+static void rfble_ota_task_abort(void) {
+  if (ota.active) {
+    esp_ota_abort(ota.handle);
+    mbedtls_sha256_free(&ota.sha256);
+    ota.active = false;
+    ESP_LOGI(TAG, "Update aborted; consumed=%" PRIu32 "; written=%" PRIu32, ota.consumed, ota.written);
+  }
+}
+
+static void rfble_ota_task(void* arg) {
+  struct rfble_ota_msg msg;
+
+  while (true) {
+    if (xQueueReceive(msg_queue, &msg, portMAX_DELAY) != pdTRUE) {
+      continue;
+    }
+
+    if (msg.status != RFBLE_OTA_OK) {
+      // Rejected by the host
+      rfble_ota_fail(msg.op, msg.status);
+      rfble_ota_task_abort();
+    } else {
+      switch (msg.op) {
+      case RFBLE_OTA_OP_BEGIN:
+	rfble_ota_task_begin(&msg.begin);
+	break;
+
+      case RFBLE_OTA_OP_PROGRESS:
+	rfble_ota_task_data(&msg);
+	break;
+
+      case RFBLE_OTA_OP_END:
+	rfble_ota_task_end();
+	break;
+
+      case RFBLE_OTA_OP_ABORT:
+	rfble_ota_task_abort();
+	rfble_ota_respond(ota.req.conn_handle, RFBLE_OTA_OP_ABORT, RFBLE_OTA_OK, ota.consumed);
+	break;
+
+      case MSG_OP_DROP:
+	rfble_ota_task_abort();
+	break;
+      }
+    }
+
+    // The buffer goes back before reporting the progress, so the
+    // client never gets credit for a buffer the host cannot fill yet.
+    if (msg.buf >= 0) {
+      xQueueSend(free_queue, &msg.buf, portMAX_DELAY);
+    }
+
+    if (msg.op == RFBLE_OTA_OP_PROGRESS && ota.active && !ota.failed) {
+      rfble_ota_respond(ota.req.conn_handle, RFBLE_OTA_OP_PROGRESS, RFBLE_OTA_OK, ota.consumed);
+    }
+  }
+}
+
+// Hands a request over to the update task, along with the buffer
+// being filled
+static void rfble_ota_post(uint8_t op, uint8_t status, const struct rfble_ota_begin* begin) {
+  struct rfble_ota_msg msg = {
+    .op = op,
+    .status = status,
+    .buf = host.fill_buf,
+    .len = host.fill_len,
+  };
+
+  if (begin != NULL) {
+    msg.begin = *begin;
+  }
+
+  host.fill_buf = -1;
+  host.fill_len = 0;
+
+  // Doesn't block, as the queue has room for every request of an
+  // update, and the previous one is drained before BEGIN is accepted
+  xQueueSend(msg_queue, &msg, portMAX_DELAY);
+}
+
+// Whether the update task is done with the previous update: no
+// requests queued, and every buffer back. Its last request may still
+// be in progress, but it is ahead of anything posted now.
+static bool rfble_ota_task_idle(void) {
+  return uxQueueMessagesWaiting(msg_queue) == 0 && uxQueueMessagesWaiting(free_queue) == RFBLE_OTA_BUF_COUNT;
+}
+
+static void rfble_ota_host_stop(uint8_t op, uint8_t status) {
+  host.active = false;
+  rfble_ota_post(op, status, NULL);
+}
+
+int rfble_ota_control_write(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt) {
+  uint8_t req[RFBLE_OTA_BEGIN_LEN];
+  uint16_t len = OS_MBUF_PKTLEN(ctxt->om);
+  struct rfble_ota_begin begin;
+
+  if (len < 1 || len > sizeof(req) || os_mbuf_copydata(ctxt->om, 0, len, req) != 0) {
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  switch (req[0]) {
+  case RFBLE_OTA_OP_BEGIN:
+    if (len != RFBLE_OTA_BEGIN_LEN) {
+      rfble_ota_respond(conn_handle, req[0], RFBLE_OTA_ERR_INVALID_LEN, 0);
+      return 0;
+    }
+
+    if (!rfble_opts.allow_device_pairing) {
+      ESP_LOGW(TAG, "Update refused, as the device is not in pairing mode");
+      rfble_ota_respond(conn_handle, req[0], RFBLE_OTA_ERR_NOT_PERMITTED, 0);
+      return 0;
+    }
+
+    if (host.active || !rfble_ota_task_idle()) {
+      rfble_ota_respond(conn_handle, req[0], RFBLE_OTA_ERR_STATE, 0);
+      return 0;
+    }
+
+    begin.conn_handle = conn_handle;
+    begin.image_len = get_le32(&req[1]);
+    begin.compressed_len = get_le32(&req[5]);
+    memcpy(begin.sha256, &req[9], RFBLE_OTA_SHA256_LEN);
+
+    host.active = true;
+    host.conn_handle = conn_handle;
+    host.compressed_len = begin.compressed_len;
+    host.received = 0;
+    rfble_ota_post(RFBLE_OTA_OP_BEGIN, RFBLE_OTA_OK, &begin);
+    return 0;
+
+  case RFBLE_OTA_OP_END:
+  case RFBLE_OTA_OP_ABORT:
+    if (!host.active || conn_handle != host.conn_handle) {
+      rfble_ota_respond(conn_handle, req[0], RFBLE_OTA_ERR_STATE, 0);
+      return 0;
+    }
+
+    // The last buffer goes along with END, as it is not full
+    if (req[0] == RFBLE_OTA_OP_END && host.fill_buf >= 0) {
+      rfble_ota_post(RFBLE_OTA_OP_PROGRESS, RFBLE_OTA_OK, NULL);
+    }
+    rfble_ota_host_stop(req[0], RFBLE_OTA_OK);
+    return 0;
+  }
+
+  return BLE_ATT_ERR_REQ_NOT_SUPPORTED;
+}
+
+int rfble_ota_data_write(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt) {
+  uint16_t len = OS_MBUF_PKTLEN(ctxt->om);
+  uint16_t off = 0;
+  uint16_t n;
+
+  if (!host.active || conn_handle != host.conn_handle) {
+    return BLE_ATT_ERR_WRITE_NOT_PERMITTED;
+  }
+
+  if (host.received + len > host.compressed_len) {
+    rfble_ota_host_stop(RFBLE_OTA_OP_PROGRESS, RFBLE_OTA_ERR_OVERFLOW);
+    return BLE_ATT_ERR_INVALID_ATTR_VALUE_LEN;
+  }
+
+  while (off < len) {
+    if (host.fill_buf < 0) {
+      // The client went over the window
+      if (xQueueReceive(free_queue, &host.fill_buf, 0) != pdTRUE) {
+	host.fill_buf = -1;
+	rfble_ota_host_stop(RFBLE_OTA_OP_PROGRESS, RFBLE_OTA_ERR_OVERFLOW);
+	return BLE_ATT_ERR_PREPARE_QUEUE_FULL;
+      }
+      host.fill_len = 0;
+    }
+
+    n = len - off;
+    if (n > RFBLE_OTA_BUF_SIZE - host.fill_len) {
+      n = RFBLE_OTA_BUF_SIZE - host.fill_len;
+    }
+
+    os_mbuf_copydata(ctxt->om, off, n, &bufs[host.fill_buf][host.fill_len]);
+    host.fill_len += n;
+    off += n;
+
+    if (host.fill_len == RFBLE_OTA_BUF_SIZE) {
+      rfble_ota_post(RFBLE_OTA_OP_PROGRESS, RFBLE_OTA_OK, NULL);
+    }
+  }
+
+  host.received += len;
+  return 0;
+}
+
+void rfble_ota_on_disconnect(uint16_t conn_handle) {
+  if (host.active && conn_handle == host.conn_handle) {
+    ESP_LOGW(TAG, "Updater disconnected; received=%" PRIu32, host.received);
+    rfble_ota_host_stop(MSG_OP_DROP, RFBLE_OTA_OK);
+  }
+}
+
+void rfble_ota_confirm_image(void) {
+  const esp_partition_t* running = esp_ota_get_running_partition();
+  esp_ota_img_states_t state;
+  esp_err_t err;
+
+  if (esp_ota_get_state_partition(running, &state) != ESP_OK || state != ESP_OTA_IMG_PENDING_VERIFY) {
+    return;
+  }
+
+  err = esp_ota_mark_app_valid_cancel_rollback();
+  if (err == ESP_OK) {
+    ESP_LOGI(TAG, "Image in %s marked as valid", running->label);
+  } else {
+    ESP_LOGE(TAG, "Unable to mark image as valid: %s", esp_err_to_name(err));
+  }
+}
+
+int rfble_ota_init(void) {
+  TaskHandle_t task;
+
+  free_queue = xQueueCreateStatic(RFBLE_OTA_BUF_COUNT, sizeof(int8_t), free_queue_storage,
+				  &free_queue_holder);
+  msg_queue = xQueueCreateStatic(MSG_QUEUE_LEN, sizeof(struct rfble_ota_msg), msg_queue_storage,
+				 &msg_queue_holder);
+
+  for (int8_t i = 0; i < RFBLE_OTA_BUF_COUNT; i++) {
+    xQueueSend(free_queue, &i, 0);
+  }
+  host.fill_buf = -1;
+
+  // Large writes, so each of them fills a link layer PDU of the
+  // extended data length
+  ble_att_set_preferred_mtu(BLE_ATT_MTU_MAX);
+
+  task = xTaskCreateStaticPinnedToCore(rfble_ota_task, "OTA Task", OTA_TASK_STACK_SIZE, NULL,
+				       OTA_TASK_PRIORITY, ota_task_stack, &ota_task_storage, 0);
+  return task != NULL ? 0 : BLE_HS_ENOMEM;
+}
@@ -0,0 +1,100 @@
+#ifndef RFBLE_OTA_H
+#define RFBLE_OTA_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "host/ble_gatt.h"
+
+/* Firmware updates over GATT. The image is sent zlib compressed, and
+   inflated into the inactive OTA partition while it is received.
+
+   The client drives the update through the OTA Control characteristic
+   (write, notify):
+
+     BEGIN  01 | image_len (4) | compressed_len (4) | sha256 (32)
+     END    02
+     ABORT  03
+
+   and writes the compressed image, in order, to the OTA Data
+   characteristic with write without response. Every request, and
+   every buffer of data consumed, is answered with a notification on
+   OTA Control:
+
+     op (1) | rfble_ota_status_t (1) | value (4)
+
+   where value is the window for BEGIN, the compressed bytes consumed
+   so far for PROGRESS, and the elapsed time in ms for END. The client
+   must not have more than window bytes written and not consumed yet.
+   Multi-octet fields go least significant octet first, except the
+   SHA-256 of the uncompressed image.
+
+   BEGIN is only accepted in pairing mode, which takes pressing the
+   pairing button of the device, so a bonded peer alone cannot replace
+   the firmware. It is also refused while the update task still holds
+   requests of a previous update.
+
+   Received data goes into one of RFBLE_OTA_BUF_COUNT buffers. Full
+   buffers are inflated and written to flash by a task of their own,
+   while the host keeps filling the next one. After END, the image is
+   checked against the SHA-256 given on BEGIN and validated, and the
+   device restarts into it. The new image is marked valid once its
+   host syncs, so the bootloader rolls back to the previous one if it
+   cannot get that far. */
+
+#define RFBLE_OTA_BUF_SIZE 4096
+#define RFBLE_OTA_BUF_COUNT 2
+#define RFBLE_OTA_WINDOW (RFBLE_OTA_BUF_SIZE * RFBLE_OTA_BUF_COUNT)
+
+#define RFBLE_OTA_SHA256_LEN 32
+#define RFBLE_OTA_BEGIN_LEN (1 + 4 + 4 + RFBLE_OTA_SHA256_LEN)
+
+/* Time given to the END response to go out before restarting */
+#define RFBLE_OTA_RESTART_DELAY_MS 1000
+
+typedef enum rfble_ota_op {
+  RFBLE_OTA_OP_BEGIN = 1,
+  RFBLE_OTA_OP_END = 2,
+  RFBLE_OTA_OP_ABORT = 3,
+  RFBLE_OTA_OP_PROGRESS = 4,
+} rfble_ota_op_t;
+
+typedef enum rfble_ota_status {
+  RFBLE_OTA_OK = 0,
+
+  /** The request is not valid in the current state, e.g. END without
+      BEGIN, or BEGIN while another update is in progress or still
+      being wound down */
+  RFBLE_OTA_ERR_STATE = 1,
+  RFBLE_OTA_ERR_INVALID_LEN = 2,
+
+  /** The image doesn't fit in the inactive partition */
+  RFBLE_OTA_ERR_SIZE = 3,
+
+  /** More data was written than the window allows */
+  RFBLE_OTA_ERR_OVERFLOW = 4,
+  RFBLE_OTA_ERR_INFLATE = 5,
+  RFBLE_OTA_ERR_FLASH = 6,
+
+  /** The image doesn't match the given lengths or SHA-256, or failed
+      validation */
+  RFBLE_OTA_ERR_VERIFY = 7,
+
+  /** Updates are only accepted in pairing mode */
+  RFBLE_OTA_ERR_NOT_PERMITTED = 8,
+} rfble_ota_status_t;
+
+/** Sets up the update task. Needs to be called before the host
+    starts. */
+int rfble_ota_init(void);
+
+/** Marks the running image as valid, if it is booting for the first
+    time after an update, cancelling the rollback */
+void rfble_ota_confirm_image(void);
+
+int rfble_ota_control_write(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt);
+int rfble_ota_data_write(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt);
+
+/** Aborts the update in progress, if the given peer is the updater */
+void rfble_ota_on_disconnect(uint16_t conn_handle);
+
+#endif
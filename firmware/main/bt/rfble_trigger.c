@@ -0,0 +1,387 @@
+#include "rfble_trigger.h"
+#include "sdkconfig.h"
+
+#if CONFIG_RFAPP_BLE_ADV_TRIGGER
+#include <inttypes.h>
+#include <stdio.h>
+#include <string.h>
+#include "esp_log.h"
+#include "esp_random.h"
+#include "host/ble_hs.h"
+#include "host/ble_hs_adv.h"
+#include "mbedtls/cipher.h"
+#include "mbedtls/cmac.h"
+#include "nvs.h"
+#include "os/endian.h"
+#include "rfble.h"
+#include "rfble_bonds.h"
+
+#define TAG "RF BLE TRIGGER"
+
+#define NVS_NAMESPACE "rfble_trig"
+
+/* Octets of the frame covered by the mac, besides the counter */
+#define FRAME_SIGNED_LEN (RFBLE_TRIGGER_FRAME_LEN - RFBLE_TRIGGER_MAC_LEN)
+
+#define FRAME_ID_OFFSET 3
+#define FRAME_SIGNAL_OFFSET (FRAME_ID_OFFSET + RFBLE_TRIGGER_ID_LEN)
+
+/** Trigger state persisted for each bonded peer */
+struct rfble_trigger_peer {
+  ble_addr_t addr;
+  uint8_t key[RFBLE_TRIGGER_KEY_LEN];
+
+  /** Counter of the last frame accepted from the peer */
+  uint32_t counter;
+};
+
+static struct rfble_trigger_peer peers[RFBLE_MAX_KNOWN_DEVICES];
+static size_t peers_len = 0;
+
+/** Ids of the frames with the counters that follow the last accepted
+    one of each peer, indexed like peers */
+static uint32_t peer_ids[RFBLE_MAX_KNOWN_DEVICES][RFBLE_TRIGGER_WINDOW];
+
+/** NVS keys of the peers that are not bonded anymore, found while
+    loading */
+static char stale_keys[RFBLE_MAX_KNOWN_DEVICES][NVS_KEY_NAME_MAX_SIZE];
+
+static int rfble_trigger_gap_event(struct ble_gap_event* event, void* arg);
+
+static void rfble_trigger_peer_key(const ble_addr_t* addr, char* key) {
+  // NVS keys are limited to 15 characters
+  snprintf(key, NVS_KEY_NAME_MAX_SIZE, "p%01x%02x%02x%02x%02x%02x%02x", addr->type & 0xf,
+	   addr->val[5], addr->val[4], addr->val[3], addr->val[2], addr->val[1], addr->val[0]);
+}
+
+static esp_err_t rfble_trigger_store_peer(const struct rfble_trigger_peer* peer) {
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+  esp_err_t err;
+
+  if ((err = nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle)) != ESP_OK) {
+    return err;
+  }
+
+  rfble_trigger_peer_key(&peer->addr, key);
+  err = nvs_set_blob(handle, key, peer, sizeof(struct rfble_trigger_peer));
+  if (err == ESP_OK) {
+    err = nvs_commit(handle);
+  }
+
+  nvs_close(handle);
+  return err;
+}
+
+// Computes the AES-CMAC of data followed by the counter under the key
+// of the peer
+static int rfble_trigger_cmac(const struct rfble_trigger_peer* peer, const uint8_t* data, size_t len,
+			      uint32_t counter, uint8_t* mac) {
+  const mbedtls_cipher_info_t* info = mbedtls_cipher_info_from_type(MBEDTLS_CIPHER_AES_128_ECB);
+  mbedtls_cipher_context_t ctx;
+  uint8_t counter_le[sizeof(uint32_t)];
+  int rc;
+
+  put_le32(counter_le, counter);
+  mbedtls_cipher_init(&ctx);
+  if ((rc = mbedtls_cipher_setup(&ctx, info)) == 0 &&
+      (rc = mbedtls_cipher_cmac_starts(&ctx, peer->key, 128)) == 0 &&
+      (rc = mbedtls_cipher_cmac_update(&ctx, data, len)) == 0 &&
+      (rc = mbedtls_cipher_cmac_update(&ctx, counter_le, sizeof(counter_le))) == 0) {
+    rc = mbedtls_cipher_cmac_finish(&ctx, mac);
+  }
+  mbedtls_cipher_free(&ctx);
+
+  return rc;
+}
+
+// Precomputes the ids of the frames the peer at index i may send next
+static void rfble_trigger_fill_window(size_t i) {
+  static const uint8_t id_prefix = 0;
+  uint8_t mac[16];
+
+  for (uint32_t n = 0; n < RFBLE_TRIGGER_WINDOW; n++) {
+    if (rfble_trigger_cmac(&peers[i], &id_prefix, 1, peers[i].counter + 1 + n, mac) != 0) {
+      // Leaves the slot unmatchable rather than stale
+      mac[0] = mac[1] = mac[2] = mac[3] = 0;
+    }
+    peer_ids[i][n] = get_le32(mac);
+  }
+}
+
+// Loads the peers that are still bonded, and drops the rest
+static void rfble_trigger_load(void) {
+  struct rfble_trigger_peer* peer;
+  nvs_iterator_t it = NULL;
+  nvs_entry_info_t info;
+  nvs_handle_t handle;
+  size_t num_stale = 0;
+  size_t len;
+  esp_err_t err;
+
+  peers_len = 0;
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+
+  err = nvs_entry_find(NVS_DEFAULT_PART_NAME, NVS_NAMESPACE, NVS_TYPE_BLOB, &it);
+  while (err == ESP_OK) {
+    nvs_entry_info(it, &info);
+    peer = &peers[peers_len];
+    len = sizeof(struct rfble_trigger_peer);
+
+    if (peers_len < RFBLE_MAX_KNOWN_DEVICES &&
+	nvs_get_blob(handle, info.key, peer, &len) == ESP_OK && len == sizeof(struct rfble_trigger_peer) &&
+	rfble_bonds_is_authorised(&peer->addr)) {
+      rfble_trigger_fill_window(peers_len);
+      peers_len++;
+    } else if (num_stale < RFBLE_MAX_KNOWN_DEVICES) {
+      strlcpy(stale_keys[num_stale++], info.key, NVS_KEY_NAME_MAX_SIZE);
+    }
+
+    err = nvs_entry_next(&it);
+  }
+  nvs_release_iterator(it);
+
+  for (int i = 0; i < num_stale; i++) {
+    nvs_erase_key(handle, stale_keys[i]);
+  }
+  if (num_stale > 0) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+
+  ESP_LOGI(TAG, "Loaded trigger keys of %d peers; dropped %d", (int) peers_len, (int) num_stale);
+}
+
+static struct rfble_trigger_peer* rfble_trigger_find_addr(const ble_addr_t* addr) {
+  for (int i = 0; i < peers_len; i++) {
+    if (ble_addr_cmp(&peers[i].addr, addr) == 0) {
+      return &peers[i];
+    }
+  }
+
+  return NULL;
+}
+
+// Creates the key of a peer, reusing the slot of a peer that is not
+// bonded anymore if the table is full. The key is only handed out
+// once persisted.
+static struct rfble_trigger_peer* rfble_trigger_create(const ble_addr_t* addr) {
+  struct rfble_trigger_peer* peer;
+  ble_addr_t stale;
+  esp_err_t err;
+
+  for (int i = 0; i < peers_len && peers_len == RFBLE_MAX_KNOWN_DEVICES; i++) {
+    if (!rfble_bonds_is_authorised(&peers[i].addr)) {
+      stale = peers[i].addr;
+      rfble_trigger_forget_peer(&stale);
+    }
+  }
+
+  if (peers_len == RFBLE_MAX_KNOWN_DEVICES) {
+    return NULL;
+  }
+
+  peer = &peers[peers_len];
+  memset(peer, 0, sizeof(struct rfble_trigger_peer));
+  peer->addr = *addr;
+  esp_fill_random(peer->key, sizeof(peer->key));
+
+  if ((err = rfble_trigger_store_peer(peer)) != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to persist trigger key of " RFBLE_ADDR_FMT ": %s",
+	     RFBLE_ADDR_FMT_PARAMS(*addr), esp_err_to_name(err));
+    return NULL;
+  }
+
+  rfble_trigger_fill_window(peers_len);
+  peers_len++;
+
+  ESP_LOGI(TAG, "Created trigger key of " RFBLE_ADDR_FMT, RFBLE_ADDR_FMT_PARAMS(*addr));
+  return peer;
+}
+
+void rfble_trigger_forget_peer(const ble_addr_t* addr) {
+  struct rfble_trigger_peer* peer = rfble_trigger_find_addr(addr);
+  char key[NVS_KEY_NAME_MAX_SIZE];
+  nvs_handle_t handle;
+
+  if (peer != NULL) {
+    peers_len--;
+    *peer = peers[peers_len];
+    memmove(peer_ids[peer - peers], peer_ids[peers_len], sizeof(peer_ids[0]));
+  }
+
+  if (nvs_open(NVS_NAMESPACE, NVS_READWRITE, &handle) != ESP_OK) {
+    return;
+  }
+
+  rfble_trigger_peer_key(addr, key);
+  if (nvs_erase_key(handle, key) == ESP_OK) {
+    nvs_commit(handle);
+  }
+  nvs_close(handle);
+}
+
+int rfble_trigger_key_read(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt) {
+  uint8_t value[RFBLE_TRIGGER_KEY_LEN + sizeof(uint32_t)];
+  struct rfble_trigger_peer* peer;
+  struct ble_gap_conn_desc desc;
+
+  if (ble_gap_conn_find(conn_handle, &desc) != 0 || !desc.sec_state.bonded) {
+    return BLE_ATT_ERR_INSUFFICIENT_AUTHEN;
+  }
+
+  peer = rfble_trigger_find_addr(&desc.peer_id_addr);
+  if (peer == NULL && (peer = rfble_trigger_create(&desc.peer_id_addr)) == NULL) {
+    return BLE_ATT_ERR_INSUFFICIENT_RES;
+  }
+
+  memcpy(value, peer->key, RFBLE_TRIGGER_KEY_LEN);
+  put_le32(&value[RFBLE_TRIGGER_KEY_LEN], peer->counter);
+  return os_mbuf_append(ctxt->om, value, sizeof(value)) == 0 ? 0 : BLE_ATT_ERR_INSUFFICIENT_RES;
+}
+
+// Returns the trigger frame in the given advertising data, if any.
+// Cheaper than ble_hs_adv_parse_fields, as it runs for every
+// advertisement received.
+static const uint8_t* rfble_trigger_find_frame(const uint8_t* data, uint8_t len) {
+  const uint8_t* frame;
+  uint8_t field_len;
+
+  for (uint8_t off = 0; off + 1 < len; off += 1 + field_len) {
+    field_len = data[off];
+    if (field_len == 0 || off + 1 + field_len > len) {
+      return NULL;
+    }
+
+    frame = &data[off + 2];
+    if (data[off + 1] == BLE_HS_ADV_TYPE_MFG_DATA && field_len - 1 == RFBLE_TRIGGER_FRAME_LEN &&
+	get_le16(frame) == RFBLE_TRIGGER_COMPANY_ID && frame[2] == RFBLE_TRIGGER_MAGIC) {
+      return frame;
+    }
+  }
+
+  return NULL;
+}
+
+static bool rfble_trigger_mac_valid(const struct rfble_trigger_peer* peer, const uint8_t* frame,
+				    uint32_t counter) {
+  uint8_t mac[16];
+  uint8_t diff = 0;
+  int rc;
+
+  rc = rfble_trigger_cmac(peer, frame, FRAME_SIGNED_LEN, counter, mac);
+  if (rc != 0) {
+    ESP_LOGE(TAG, "Unable to compute the frame mac; rc=%d", rc);
+    return false;
+  }
+
+  // Constant time, so the mac cannot be guessed octet by octet
+  for (int i = 0; i < RFBLE_TRIGGER_MAC_LEN; i++) {
+    diff |= mac[i] ^ frame[FRAME_SIGNED_LEN + i];
+  }
+
+  return diff == 0;
+}
+
+static void rfble_trigger_accept(size_t i, uint32_t counter, uint8_t signal, int8_t rssi) {
+  struct rfble_trigger_peer* peer = &peers[i];
+  esp_err_t err;
+
+  peer->counter = counter;
+  rfble_trigger_fill_window(i);
+  ESP_LOGI(TAG, "Trigger from " RFBLE_ADDR_FMT "; counter=%" PRIu32 "; signal=%d; rssi=%d",
+	   RFBLE_ADDR_FMT_PARAMS(peer->addr), counter, signal, rssi);
+
+  if (rfble_opts.trigger_cb != NULL) {
+    rfble_opts.trigger_cb(&peer->addr, signal);
+  }
+
+  // Persisted after triggering, so it doesn't add latency
+  if ((err = rfble_trigger_store_peer(peer)) != ESP_OK) {
+    ESP_LOGE(TAG, "Unable to persist trigger counter: %s", esp_err_to_name(err));
+  }
+}
+
+static void rfble_trigger_on_adv(const struct ble_gap_disc_desc* disc) {
+  const uint8_t* frame;
+  uint32_t id;
+
+  frame = rfble_trigger_find_frame(disc->data, disc->length_data);
+  if (frame == NULL) {
+    return;
+  }
+
+  // Peers repeat every frame for a while, so most of them are
+  // expected to be stale, and to match no id. Ids are short, so the
+  // mac settles which peer, if any, sent the frame.
+  id = get_le32(&frame[FRAME_ID_OFFSET]);
+  for (size_t i = 0; i < peers_len; i++) {
+    for (uint32_t n = 0; n < RFBLE_TRIGGER_WINDOW; n++) {
+      uint32_t counter = peers[i].counter + 1 + n;
+
+      if (peer_ids[i][n] != id || !rfble_bonds_is_authorised(&peers[i].addr)) {
+	continue;
+      }
+
+      if (rfble_trigger_mac_valid(&peers[i], frame, counter)) {
+	rfble_trigger_accept(i, counter, frame[FRAME_SIGNAL_OFFSET], disc->rssi);
+	return;
+      }
+    }
+  }
+}
+
+static void rfble_trigger_scan(void) {
+  struct ble_gap_disc_params params = {
+    .itvl = RFBLE_TRIGGER_SCAN_ITVL,
+    .window = RFBLE_TRIGGER_SCAN_WINDOW,
+    .filter_policy = BLE_HCI_SCAN_FILT_NO_WL,
+    .passive = 1,
+    // Controllers filter duplicates by address, which would drop the
+    // following frames of the same peer
+    .filter_duplicates = 0,
+  };
+  int rc;
+
+  rc = ble_gap_disc(BLE_OWN_ADDR_RPA_PUBLIC_DEFAULT, BLE_HS_FOREVER, &params,
+		    rfble_trigger_gap_event, NULL);
+  if (rc != 0 && rc != BLE_HS_EALREADY) {
+    ESP_LOGE(TAG, "Error starting scan; rc=%d", rc);
+  }
+}
+
+static int rfble_trigger_gap_event(struct ble_gap_event* event, void* arg) {
+  switch (event->type) {
+  case BLE_GAP_EVENT_DISC:
+    rfble_trigger_on_adv(&event->disc);
+    return 0;
+
+  case BLE_GAP_EVENT_DISC_COMPLETE:
+    ESP_LOGI(TAG, "Scan completed; reason=%d", event->disc_complete.reason);
+    rfble_trigger_scan();
+    return 0;
+  }
+
+  return 0;
+}
+
+void rfble_trigger_on_sync(void) {
+  rfble_trigger_load();
+  rfble_trigger_scan();
+}
+
+#else
+
+void rfble_trigger_on_sync(void) {
+}
+
+int rfble_trigger_key_read(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt) {
+  return BLE_ATT_ERR_UNLIKELY;
+}
+
+void rfble_trigger_forget_peer(const ble_addr_t* peer_id_addr) {
+}
+
+#endif
@@ -0,0 +1,70 @@
+#ifndef RFBLE_TRIGGER_H
+#define RFBLE_TRIGGER_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "host/ble_gap.h"
+#include "host/ble_gatt.h"
+
+/* Connectionless triggers. Bonded peers can request sending a stored
+   signal by broadcasting a short advertisement, instead of connecting,
+   encrypting the link and writing a characteristic.
+
+   Each bonded peer reads its own trigger key, and the counter of the
+   last frame accepted from it, from the Trigger Key characteristic
+   over an authenticated link. Frames are carried as manufacturer
+   specific data:
+
+     company_id (2) | magic (1) | id (4) | signal (1) | mac (8)
+
+   Multi-octet fields go least significant octet first. The peer
+   increments its counter for every frame. id is the AES-CMAC of a
+   zero octet followed by the counter under the peer key, truncated to
+   its first 4 octets. It changes with every frame, so unlike a fixed
+   key identifier it can't be used to track the peer across its
+   private addresses. mac is the AES-CMAC of the preceding octets
+   followed by the counter under the peer key, truncated to its first
+   8 octets. The counter itself is never sent.
+
+   The ids of the next RFBLE_TRIGGER_WINDOW counters of every peer are
+   kept precomputed, which finds the peer and the counter of a frame
+   without a CMAC per peer. A frame is accepted only if its counter
+   is greater than the last one accepted from that peer, which is
+   persisted, so frames cannot be replayed. Peers that skipped more
+   counters than the window resync by reading the characteristic. */
+
+/* Company id reserved for testing by the Bluetooth SIG */
+#define RFBLE_TRIGGER_COMPANY_ID 0xffff
+#define RFBLE_TRIGGER_MAGIC 0x54
+
+#define RFBLE_TRIGGER_KEY_LEN 16
+#define RFBLE_TRIGGER_MAC_LEN 8
+#define RFBLE_TRIGGER_ID_LEN 4
+#define RFBLE_TRIGGER_FRAME_LEN (2 + 1 + RFBLE_TRIGGER_ID_LEN + 1 + RFBLE_TRIGGER_MAC_LEN)
+
+/* Number of counters ahead of the last accepted one whose frames are
+   recognized */
+#define RFBLE_TRIGGER_WINDOW 16
+
+/* Passive scan schedule, in units of 0.625 ms. The window is half of
+   the interval, so a peer advertising at 20-30 ms intervals is picked
+   up within a couple of its advertisements. */
+#define RFBLE_TRIGGER_SCAN_ITVL 160 /* 100 ms */
+#define RFBLE_TRIGGER_SCAN_WINDOW 80 /* 50 ms */
+
+/** Callback called for every accepted frame. Runs in the host task. */
+typedef void (*rfble_trigger_cb_t)(const ble_addr_t* peer_id_addr, uint8_t signal);
+
+/** Loads the keys of the bonded peers and starts scanning. Needs to
+    be called once the host is synced and the bonds are loaded. */
+void rfble_trigger_on_sync(void);
+
+/** Reads the key of the bonded peer of the given connection, followed
+    by the counter of the last frame accepted from it, creating the key
+    the first time */
+int rfble_trigger_key_read(uint16_t conn_handle, struct ble_gatt_access_ctxt* ctxt);
+
+/** Drops the key of a peer, e.g. when it pairs again */
+void rfble_trigger_forget_peer(const ble_addr_t* peer_id_addr);
+
+#endif
@@ -13,9 +13,19 @@
 #include "driver/gptimer.h"
 #include "hal/gpio_types.h"
 #include "private.h"
+#include "pulsetrain.h"
 
 #define TAG "clemsa_code"
 
+/* Durations of the sections of the waveform, in microseconds */
+#define CLEMSA_CODEGEN_CLK_HIGH_US \
+  ((uint64_t) CLEMSA_CODEGEN_CLK_HIGH_COUNT * 1000000 / CLEMSA_CODEGEN_BASE_CLK_RESOLUTION)
+#define CLEMSA_CODEGEN_CLK_LOW_US \
+  ((uint64_t) CLEMSA_CODEGEN_CLK_LOW_COUNT * 1000000 / CLEMSA_CODEGEN_BASE_CLK_RESOLUTION)
+#define CLEMSA_CODEGEN_CYCLE_US (CLEMSA_CODEGEN_CLK_HIGH_US + CLEMSA_CODEGEN_CLK_LOW_US)
+#define CLEMSA_CODEGEN_ASK_TICK_US \
+  ((1000000 + CLEMSA_CODEGEN_ASK_CLK_FREQUENCY / 2) / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY)
+
 // repetition is base 0!
 static uint32_t get_code_repetition_begin_cycle(uint32_t repetition, size_t code_len) {
   return CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES +
@@ -253,3 +263,71 @@ esp_err_t clemsa_codegen_begin_tx(struct clemsa_codegen* generator, struct clems
 bool clemsa_codegen_tx_finished(struct clemsa_codegen_tx *tx) {
   return tx->_terminated;
 }
+
+static void clemsa_codegen_timeline_digit(struct pulsetrain_writer* writer, bool digit) {
+  // Number of ASK ticks that happen before the falling edge of the
+  // base clock stops the ASK clock.
+  uint32_t window_ticks = (CLEMSA_CODEGEN_CLK_HIGH_US - 1) / CLEMSA_CODEGEN_ASK_TICK_US;
+  uint32_t ticks = digit ? CLEMSA_CODEGEN_ASK_TICKS_ONE : CLEMSA_CODEGEN_ASK_TICKS_ZERO;
+  uint32_t elapsed;
+
+  if (ticks > window_ticks) {
+    ticks = window_ticks;
+  }
+
+  // The ASK clock first ticks one period after being started, and
+  // every tick toggles the output.
+  pulsetrain_writer_put(writer, false, CLEMSA_CODEGEN_ASK_TICK_US);
+  elapsed = CLEMSA_CODEGEN_ASK_TICK_US;
+
+  if (ticks >= 2) {
+    pulsetrain_writer_begin_repeat(writer);
+    pulsetrain_writer_put(writer, true, CLEMSA_CODEGEN_ASK_TICK_US);
+    pulsetrain_writer_put(writer, false, CLEMSA_CODEGEN_ASK_TICK_US);
+    pulsetrain_writer_end_repeat(writer, ticks / 2);
+    elapsed += (ticks / 2) * 2 * CLEMSA_CODEGEN_ASK_TICK_US;
+  }
+
+  if (ticks % 2 != 0) {
+    pulsetrain_writer_put(writer, true, CLEMSA_CODEGEN_ASK_TICK_US);
+    elapsed += CLEMSA_CODEGEN_ASK_TICK_US;
+  }
+
+  pulsetrain_writer_put(writer, false, CLEMSA_CODEGEN_CYCLE_US - elapsed);
+}
+
+esp_err_t clemsa_codegen_build_timeline(const bool* code, size_t code_len,
+					uint32_t repetition_count, uint8_t* out,
+					size_t out_cap, size_t* out_len) {
+  struct pulsetrain_writer writer;
+
+  pulsetrain_writer_init(&writer, CLEMSA_CODEGEN_TIMELINE_TIMEBASE_US, out, out_cap);
+
+  // Stage 1: Synchronization signal
+  pulsetrain_writer_begin_repeat(&writer);
+  pulsetrain_writer_put(&writer, true, CLEMSA_CODEGEN_CLK_HIGH_US);
+  pulsetrain_writer_put(&writer, false, CLEMSA_CODEGEN_CLK_LOW_US);
+  pulsetrain_writer_end_repeat(&writer, CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES);
+  pulsetrain_writer_put(&writer, false, CLEMSA_CODEGEN_WAIT_CLOCK_CYCLES * CLEMSA_CODEGEN_CYCLE_US);
+
+  // Stage 2: Code repetitions
+  for (uint32_t rep = 0; rep < repetition_count; rep++) {
+    if (rep > 0) {
+      pulsetrain_writer_put(&writer, false,
+			    CLEMSA_CODEGEN_CYCLES_BETWEEN_REPETITIONS * CLEMSA_CODEGEN_CYCLE_US);
+    }
+
+    for (size_t i = 0; i < code_len; i++) {
+      clemsa_codegen_timeline_digit(&writer, code[i]);
+    }
+  }
+
+  switch (pulsetrain_writer_finish(&writer, out_len)) {
+  case PULSETRAIN_OK:
+    return ESP_OK;
+  case PULSETRAIN_ERR_NO_SPACE:
+    return ESP_ERR_INVALID_SIZE;
+  default:
+    return ESP_ERR_INVALID_ARG;
+  }
+}
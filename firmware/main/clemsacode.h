@@ -7,46 +7,7 @@
 #include <stdint.h>
 #include <unistd.h>
 #include "driver/gpio.h"
-
-#define CLEMSA_CODEGEN_DEFAULT_CODE_SIZE 36
-
-/* Number of base clock cycles to generate before starting sending the
-   code itself. */
-#define CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES 79
-
-/* Number of base clock cycles between the end of the transmission of
-   the sync signal and the beginning of the code transmission */
-#define CLEMSA_CODEGEN_WAIT_CLOCK_CYCLES 5
-
-/* Number of base clock cycles between the end of the transmission of
-   the code and the beginning of a repetition */
-#define CLEMSA_CODEGEN_CYCLES_BETWEEN_REPETITIONS 5
-
-/* The resolution of the base clock. Base clock will take 1 / (this
-   value) seconds to count one. */
-#define CLEMSA_CODEGEN_BASE_CLK_RESOLUTION 1000000
-
-/* The frequency of the ASK generator */
-#define CLEMSA_CODEGEN_ASK_CLK_FREQUENCY 16670
-
-/* The time the base clock will generate a high signal, and low
-   signal, respectively, expressed as the number of cycles of the base
-   clock at a frequency of CLEMSA_CODEGEN_BASE_CLK_RESOLUTION. This
-   will use to generate a PWM pulse in wich the cycle width will be
-   CLEMSA_CODEGEN_CLK_HIGH_COUNT + CLEMSA_CODEGEN_CLK_LOW_COUNT, and
-   the duty, CLEMSA_CODEGEN_CLK_HIGH_COUNT /
-   (CLEMSA_CODEGEN_CLK_HIGH_COUNT + CLEMSA_CODEGEN_CLK_LOW_COUNT) */
-#define CLEMSA_CODEGEN_CLK_HIGH_COUNT 2070
-#define CLEMSA_CODEGEN_CLK_LOW_COUNT 1030
-
-/* The number of the ASK ticks that needs to be emitted for each digit
-   of the transmitting code */
-#define CLEMSA_CODEGEN_ASK_TICKS_ZERO 15
-#define CLEMSA_CODEGEN_ASK_TICKS_ONE 100
-
-#if (CLEMSA_CODEGEN_CLK_LOW_COUNT >= CLEMSA_CODEGEN_CLK_HIGH_COUNT)
-#error "CLEMSA_CODEGEN_CLK_LOW_COUNT cannot be greater or equal than CLEMSA_CODEGEN_CLK_HIGH_COUNT"
-#endif
+#include "clemsacode_defs.h"
 
 struct clemsa_codegen_tx;
 
@@ -117,4 +78,11 @@ esp_err_t clemsa_codegen_begin_tx(struct clemsa_codegen *instance,
                                   struct clemsa_codegen_tx *tx);
 
 bool clemsa_codegen_tx_finished(struct clemsa_codegen_tx *tx);
+
+/* Builds the timeline of the waveform that clemsa_codegen_begin_tx
+   generates for the given code, as an encoded pulse train (see
+   pulsetrain.h), so it can be played back by other means. */
+esp_err_t clemsa_codegen_build_timeline(const bool* code, size_t code_len,
+					uint32_t repetition_count, uint8_t* out,
+					size_t out_cap, size_t* out_len);
 #endif /* CLEMSACODE_H */
@@ -0,0 +1,417 @@
+#include "pulsetrain.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Minimum number of pulses that a repetition needs to save for the
+   encoder to emit a repeat token, since the repeat token itself takes
+   a couple of bytes. */
+#define PULSETRAIN_MIN_REPEAT_GAIN 3
+
+/* Max number of timebase units that a single pulse may last */
+#define PULSETRAIN_MAX_UNITS (UINT32_MAX >> 2)
+
+static uint32_t pulsetrain_quantize(uint32_t duration_us, uint32_t timebase_us) {
+  uint32_t units = (uint32_t) (((uint64_t) duration_us + timebase_us / 2) / timebase_us);
+
+  // Never collapse a pulse to zero, it would shift the rest of the
+  // train.
+  if (units == 0 && duration_us > 0) {
+    units = 1;
+  }
+
+  return units;
+}
+
+static uint32_t pulsetrain_pulse_token(const struct pulsetrain_pulse* pulse, uint32_t timebase_us) {
+  return (pulsetrain_quantize(pulse->duration_us, timebase_us) << 2) |
+    (pulse->level ? PULSETRAIN_TOK_HIGH : PULSETRAIN_TOK_LOW);
+}
+
+static pulsetrain_status_t pulsetrain_put_varint(uint8_t* out, size_t out_cap, size_t* pos, uint32_t value) {
+  do {
+    if (*pos >= out_cap) {
+      return PULSETRAIN_ERR_NO_SPACE;
+    }
+
+    uint8_t byte = value & 0x7f;
+    value >>= 7;
+    if (value != 0) {
+      byte |= 0x80;
+    }
+    out[(*pos)++] = byte;
+  } while (value != 0);
+
+  return PULSETRAIN_OK;
+}
+
+static pulsetrain_status_t pulsetrain_get_varint(const uint8_t* data, size_t len, size_t* pos, uint32_t* value) {
+  uint32_t result = 0;
+
+  for (int i = 0; i < PULSETRAIN_MAX_VARINT_LEN; i++) {
+    if (*pos >= len) {
+      return PULSETRAIN_ERR_TRUNCATED;
+    }
+
+    uint8_t byte = data[(*pos)++];
+    if (i == PULSETRAIN_MAX_VARINT_LEN - 1 && (byte & 0xf0) != 0) {
+      // Would overflow 32 bits
+      return PULSETRAIN_ERR_FORMAT;
+    }
+
+    result |= (uint32_t) (byte & 0x7f) << (7 * i);
+    if ((byte & 0x80) == 0) {
+      *value = result;
+      return PULSETRAIN_OK;
+    }
+  }
+
+  return PULSETRAIN_ERR_FORMAT;
+}
+
+// Returns how many times in a row the section of period pulses that
+// begins at start appears, including the section itself.
+static uint32_t pulsetrain_count_repetitions(const struct pulsetrain_pulse* pulses, size_t count,
+					     uint32_t timebase_us, size_t start, size_t period) {
+  uint32_t reps = 1;
+  size_t next = start + period;
+
+  while (next + period <= count) {
+    for (size_t k = 0; k < period; k++) {
+      if (pulsetrain_pulse_token(&pulses[start + k], timebase_us) !=
+	  pulsetrain_pulse_token(&pulses[next + k], timebase_us)) {
+	return reps;
+      }
+    }
+
+    reps++;
+    next += period;
+  }
+
+  return reps;
+}
+
+pulsetrain_status_t pulsetrain_encode(const struct pulsetrain_pulse* pulses, size_t count,
+				      uint32_t timebase_us, uint8_t* out, size_t out_cap,
+				      size_t* out_len) {
+  pulsetrain_status_t rc;
+  size_t pos = 0;
+  size_t i = 0;
+
+  if (timebase_us == 0 || count > UINT32_MAX || (pulses == NULL && count > 0)) {
+    return PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  for (size_t k = 0; k < count; k++) {
+    if (pulsetrain_quantize(pulses[k].duration_us, timebase_us) > PULSETRAIN_MAX_UNITS) {
+      return PULSETRAIN_ERR_INVALID_ARG;
+    }
+  }
+
+  if (out_cap < 1) {
+    return PULSETRAIN_ERR_NO_SPACE;
+  }
+  out[pos++] = PULSETRAIN_FORMAT_VERSION;
+
+  if ((rc = pulsetrain_put_varint(out, out_cap, &pos, timebase_us)) != PULSETRAIN_OK) {
+    return rc;
+  }
+
+  if ((rc = pulsetrain_put_varint(out, out_cap, &pos, (uint32_t) count)) != PULSETRAIN_OK) {
+    return rc;
+  }
+
+  while (i < count) {
+    size_t best_period = 0;
+    uint32_t best_reps = 1;
+    size_t best_gain = 0;
+
+    // Look for the section starting at i that, when repeated, covers
+    // the highest number of pulses.
+    for (size_t period = 1; period <= PULSETRAIN_MAX_REPEAT_PERIOD && i + 2 * period <= count; period++) {
+      uint32_t reps = pulsetrain_count_repetitions(pulses, count, timebase_us, i, period);
+      size_t gain = (reps - 1) * period;
+
+      if (reps > 1 && gain > best_gain) {
+	best_period = period;
+	best_reps = reps;
+	best_gain = gain;
+      }
+    }
+
+    if (best_gain < PULSETRAIN_MIN_REPEAT_GAIN) {
+      best_period = 1;
+      best_reps = 1;
+    }
+
+    size_t body_start = pos;
+    for (size_t k = 0; k < best_period; k++) {
+      if ((rc = pulsetrain_put_varint(out, out_cap, &pos,
+				      pulsetrain_pulse_token(&pulses[i + k], timebase_us))) != PULSETRAIN_OK) {
+	return rc;
+      }
+    }
+
+    if (best_reps > 1) {
+      uint32_t back = (uint32_t) (pos - body_start);
+      if ((rc = pulsetrain_put_varint(out, out_cap, &pos, (back << 2) | PULSETRAIN_TOK_REPEAT)) != PULSETRAIN_OK) {
+	return rc;
+      }
+
+      if ((rc = pulsetrain_put_varint(out, out_cap, &pos, best_reps - 1)) != PULSETRAIN_OK) {
+	return rc;
+      }
+    }
+
+    i += best_period * best_reps;
+  }
+
+  if ((rc = pulsetrain_put_varint(out, out_cap, &pos, PULSETRAIN_TOK_END)) != PULSETRAIN_OK) {
+    return rc;
+  }
+
+  *out_len = pos;
+  return PULSETRAIN_OK;
+}
+
+pulsetrain_status_t pulsetrain_writer_init(struct pulsetrain_writer* writer, uint32_t timebase_us,
+					   uint8_t* out, size_t out_cap) {
+  writer->timebase_us = timebase_us;
+  writer->pulse_count = 0;
+  writer->status = PULSETRAIN_OK;
+  writer->_out = out;
+  writer->_out_cap = out_cap;
+  writer->_pos = 0;
+  writer->_count_pos = 0;
+  writer->_repeat_start = SIZE_MAX;
+  writer->_repeat_pulses = 0;
+
+  if (timebase_us == 0 || out == NULL) {
+    return writer->status = PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  // The pulse count is not known until the train is finished, so room
+  // is left for the largest varint, which is padded when written.
+  if (out_cap < 1) {
+    return writer->status = PULSETRAIN_ERR_NO_SPACE;
+  }
+  out[writer->_pos++] = PULSETRAIN_FORMAT_VERSION;
+
+  if ((writer->status = pulsetrain_put_varint(out, out_cap, &writer->_pos, timebase_us)) != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  if (writer->_pos + PULSETRAIN_MAX_VARINT_LEN > out_cap) {
+    return writer->status = PULSETRAIN_ERR_NO_SPACE;
+  }
+  writer->_count_pos = writer->_pos;
+  writer->_pos += PULSETRAIN_MAX_VARINT_LEN;
+
+  return PULSETRAIN_OK;
+}
+
+pulsetrain_status_t pulsetrain_writer_put(struct pulsetrain_writer* writer, bool level,
+					  uint32_t duration_us) {
+  struct pulsetrain_pulse pulse = { .level = level, .duration_us = duration_us };
+
+  if (writer->status != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  if (pulsetrain_quantize(duration_us, writer->timebase_us) > PULSETRAIN_MAX_UNITS) {
+    return writer->status = PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  writer->status = pulsetrain_put_varint(writer->_out, writer->_out_cap, &writer->_pos,
+					 pulsetrain_pulse_token(&pulse, writer->timebase_us));
+  if (writer->status == PULSETRAIN_OK) {
+    writer->pulse_count++;
+    writer->_repeat_pulses++;
+  }
+
+  return writer->status;
+}
+
+pulsetrain_status_t pulsetrain_writer_begin_repeat(struct pulsetrain_writer* writer) {
+  if (writer->status != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  if (writer->_repeat_start != SIZE_MAX) {
+    // Repeated sections cannot be nested
+    return writer->status = PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  writer->_repeat_start = writer->_pos;
+  writer->_repeat_pulses = 0;
+  return PULSETRAIN_OK;
+}
+
+pulsetrain_status_t pulsetrain_writer_end_repeat(struct pulsetrain_writer* writer, uint32_t times) {
+  uint32_t back;
+
+  if (writer->status != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  if (writer->_repeat_start == SIZE_MAX || times == 0) {
+    return writer->status = PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  back = (uint32_t) (writer->_pos - writer->_repeat_start);
+  writer->_repeat_start = SIZE_MAX;
+
+  if (times == 1 || back == 0) {
+    // Nothing to repeat
+    return PULSETRAIN_OK;
+  }
+
+  if ((writer->status = pulsetrain_put_varint(writer->_out, writer->_out_cap, &writer->_pos,
+					      (back << 2) | PULSETRAIN_TOK_REPEAT)) != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  if ((writer->status = pulsetrain_put_varint(writer->_out, writer->_out_cap, &writer->_pos,
+					      times - 1)) != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  writer->pulse_count += writer->_repeat_pulses * (times - 1);
+  return PULSETRAIN_OK;
+}
+
+pulsetrain_status_t pulsetrain_writer_finish(struct pulsetrain_writer* writer, size_t* len) {
+  uint32_t count = writer->pulse_count;
+
+  if (writer->status != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  if (writer->_repeat_start != SIZE_MAX) {
+    return writer->status = PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  if ((writer->status = pulsetrain_put_varint(writer->_out, writer->_out_cap, &writer->_pos,
+					      PULSETRAIN_TOK_END)) != PULSETRAIN_OK) {
+    return writer->status;
+  }
+
+  // Write the pulse count in the room left by pulsetrain_writer_init,
+  // padding it with continuation bytes.
+  for (int i = 0; i < PULSETRAIN_MAX_VARINT_LEN; i++) {
+    uint8_t byte = count & 0x7f;
+    count >>= 7;
+    if (i < PULSETRAIN_MAX_VARINT_LEN - 1) {
+      byte |= 0x80;
+    }
+    writer->_out[writer->_count_pos + i] = byte;
+  }
+
+  *len = writer->_pos;
+  return PULSETRAIN_OK;
+}
+
+pulsetrain_status_t pulsetrain_reader_init(struct pulsetrain_reader* reader,
+					   const uint8_t* data, size_t len) {
+  pulsetrain_status_t rc;
+
+  if (data == NULL || len < 1) {
+    return PULSETRAIN_ERR_INVALID_ARG;
+  }
+
+  if (data[0] != PULSETRAIN_FORMAT_VERSION) {
+    return PULSETRAIN_ERR_FORMAT;
+  }
+
+  reader->_data = data;
+  reader->_len = len;
+  reader->_pos = 1;
+  reader->_loop_start = 0;
+  reader->_loop_token = SIZE_MAX;
+  reader->_loop_left = 0;
+
+  if ((rc = pulsetrain_get_varint(data, len, &reader->_pos, &reader->timebase_us)) != PULSETRAIN_OK) {
+    return rc;
+  }
+
+  if ((rc = pulsetrain_get_varint(data, len, &reader->_pos, &reader->remaining_pulses)) != PULSETRAIN_OK) {
+    return rc;
+  }
+
+  return reader->timebase_us == 0 ? PULSETRAIN_ERR_FORMAT : PULSETRAIN_OK;
+}
+
+pulsetrain_status_t pulsetrain_read(struct pulsetrain_reader* reader,
+				    struct pulsetrain_pulse* pulse) {
+  pulsetrain_status_t rc;
+  uint32_t token;
+  uint32_t times;
+
+  if (reader->remaining_pulses == 0) {
+    return PULSETRAIN_DONE;
+  }
+
+  while (true) {
+    size_t token_pos = reader->_pos;
+    if ((rc = pulsetrain_get_varint(reader->_data, reader->_len, &reader->_pos, &token)) != PULSETRAIN_OK) {
+      return rc;
+    }
+
+    switch (token & 0x3) {
+    case PULSETRAIN_TOK_LOW:
+    case PULSETRAIN_TOK_HIGH:
+      pulse->level = (token & 0x3) == PULSETRAIN_TOK_HIGH;
+      pulse->duration_us = (token >> 2) * reader->timebase_us;
+      reader->remaining_pulses--;
+      return PULSETRAIN_OK;
+
+    case PULSETRAIN_TOK_REPEAT:
+      if ((rc = pulsetrain_get_varint(reader->_data, reader->_len, &reader->_pos, &times)) != PULSETRAIN_OK) {
+	return rc;
+      }
+
+      if (reader->_loop_token == token_pos) {
+	// End of an iteration of the section being repeated.
+	if (reader->_loop_left > 0) {
+	  reader->_loop_left--;
+	  reader->_pos = reader->_loop_start;
+	} else {
+	  reader->_loop_token = SIZE_MAX;
+	}
+	break;
+      }
+
+      if (reader->_loop_token != SIZE_MAX || (token >> 2) == 0 || (token >> 2) > token_pos || times == 0) {
+	return PULSETRAIN_ERR_FORMAT;
+      }
+
+      reader->_loop_start = token_pos - (token >> 2);
+      reader->_loop_token = token_pos;
+      reader->_loop_left = times - 1;
+      reader->_pos = reader->_loop_start;
+      break;
+
+    default:
+      // End token found, but the header said there were more pulses.
+      return PULSETRAIN_ERR_FORMAT;
+    }
+  }
+}
+
+pulsetrain_status_t pulsetrain_read_many(struct pulsetrain_reader* reader,
+					 struct pulsetrain_pulse* pulses, size_t max_count,
+					 size_t* count) {
+  pulsetrain_status_t rc = PULSETRAIN_OK;
+  size_t n = 0;
+
+  while (n < max_count && (rc = pulsetrain_read(reader, &pulses[n])) == PULSETRAIN_OK) {
+    n++;
+  }
+
+  *count = n;
+  if (rc < 0) {
+    return rc;
+  }
+
+  return n == 0 && max_count > 0 ? PULSETRAIN_DONE : PULSETRAIN_OK;
+}
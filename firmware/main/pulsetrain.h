@@ -0,0 +1,180 @@
+#ifndef PULSETRAIN_H
+#define PULSETRAIN_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Compact storage format for (level, duration) pulse trains.
+
+   An encoded pulse train is laid out as follows:
+
+     u8     PULSETRAIN_FORMAT_VERSION
+     varint timebase_us   Every duration is a multiple of this value
+     varint pulse_count   Number of pulses yielded once fully decoded
+     token*               Until a PULSETRAIN_TOK_END token is found
+
+   Every token is a varint (LEB128, little endian, 7 bits per byte)
+   whose two lowest bits define its kind:
+
+     PULSETRAIN_TOK_LOW / PULSETRAIN_TOK_HIGH: a single pulse at the
+     given level, that lasts (token >> 2) timebase units.
+
+     PULSETRAIN_TOK_REPEAT: the tokens located between (token >> 2)
+     bytes before this token and this token need to be replayed the
+     number of times given by the varint that follows. Repeated
+     sections cannot contain other repeat tokens.
+
+     PULSETRAIN_TOK_END: end of the pulse train.
+
+   This file has no dependencies on ESP-IDF, so it can be built as is
+   on the host or by other processors. */
+
+#define PULSETRAIN_FORMAT_VERSION 1
+
+/* Max number of bytes that a varint can take in this format */
+#define PULSETRAIN_MAX_VARINT_LEN 5
+
+/* Max length, expressed in pulses, of a section that the encoder will
+   try to find repetitions of. */
+#define PULSETRAIN_MAX_REPEAT_PERIOD 64
+
+#define PULSETRAIN_TOK_LOW 0
+#define PULSETRAIN_TOK_HIGH 1
+#define PULSETRAIN_TOK_REPEAT 2
+#define PULSETRAIN_TOK_END 3
+
+typedef enum pulsetrain_status {
+  PULSETRAIN_OK = 0,
+
+  /** No more pulses available in the decoded pulse train */
+  PULSETRAIN_DONE = 1,
+
+  /** The input data finished before the end of the pulse train */
+  PULSETRAIN_ERR_TRUNCATED = -1,
+
+  /** The input data is not a valid encoded pulse train */
+  PULSETRAIN_ERR_FORMAT = -2,
+
+  /** The output buffer is not large enough */
+  PULSETRAIN_ERR_NO_SPACE = -3,
+
+  /** Invalid arguments supplied */
+  PULSETRAIN_ERR_INVALID_ARG = -4,
+} pulsetrain_status_t;
+
+struct pulsetrain_pulse {
+  /* Level of the output during the pulse */
+  bool level;
+
+  /* Duration of the pulse, in microseconds */
+  uint32_t duration_us;
+};
+
+struct pulsetrain_reader {
+  /* Time base of the pulse train being read, in microseconds */
+  uint32_t timebase_us;
+
+  /* Number of pulses that still need to be read */
+  uint32_t remaining_pulses;
+
+  /* (Internal) encoded data */
+  const uint8_t* _data;
+  size_t _len;
+
+  /* (Internal) position of the next token in _data */
+  size_t _pos;
+
+  /* (Internal) start of the body of the section being repeated */
+  size_t _loop_start;
+
+  /* (Internal) position of the repeat token of the section being
+     repeated, or SIZE_MAX if no section is being repeated */
+  size_t _loop_token;
+
+  /* (Internal) Number of remaining repetitions of the section being
+     repeated */
+  uint32_t _loop_left;
+};
+
+struct pulsetrain_writer {
+  /* Time base of the pulse train being written, in microseconds */
+  uint32_t timebase_us;
+
+  /* Number of pulses written so far, counting the repetitions */
+  uint32_t pulse_count;
+
+  /* Status of the writer. Once an operation fails, all the following
+     ones are ignored and return this same status. */
+  pulsetrain_status_t status;
+
+  /* (Internal) output buffer */
+  uint8_t* _out;
+  size_t _out_cap;
+  size_t _pos;
+
+  /* (Internal) position of the pulse count in the header */
+  size_t _count_pos;
+
+  /* (Internal) position of the first token of the section being
+     repeated, or SIZE_MAX if no section is being repeated */
+  size_t _repeat_start;
+
+  /* (Internal) number of pulses of the section being repeated */
+  uint32_t _repeat_pulses;
+};
+
+/**
+ * Encodes the given pulses into out, quantizing their durations to
+ * multiples of timebase_us and collapsing the repeated sections of the
+ * train. The number of bytes written is stored into out_len.
+ */
+pulsetrain_status_t pulsetrain_encode(const struct pulsetrain_pulse* pulses, size_t count,
+				      uint32_t timebase_us, uint8_t* out, size_t out_cap,
+				      size_t* out_len);
+
+/**
+ * Prepares the writer for encoding a pulse train into out pulse by
+ * pulse, for trains whose structure is known in advance and do not
+ * fit in memory as an array of pulses.
+ */
+pulsetrain_status_t pulsetrain_writer_init(struct pulsetrain_writer* writer, uint32_t timebase_us,
+					   uint8_t* out, size_t out_cap);
+
+/** Appends a pulse to the train */
+pulsetrain_status_t pulsetrain_writer_put(struct pulsetrain_writer* writer, bool level,
+					  uint32_t duration_us);
+
+/** Marks the beginning of a section that will be repeated */
+pulsetrain_status_t pulsetrain_writer_begin_repeat(struct pulsetrain_writer* writer);
+
+/**
+ * Marks the end of the section that begun with the last call to
+ * pulsetrain_writer_begin_repeat. The section will be played times
+ * times in total.
+ */
+pulsetrain_status_t pulsetrain_writer_end_repeat(struct pulsetrain_writer* writer, uint32_t times);
+
+/** Terminates the pulse train, storing its length in bytes into len */
+pulsetrain_status_t pulsetrain_writer_finish(struct pulsetrain_writer* writer, size_t* len);
+
+/** Prepares the reader for decoding the given encoded pulse train. */
+pulsetrain_status_t pulsetrain_reader_init(struct pulsetrain_reader* reader,
+					   const uint8_t* data, size_t len);
+
+/**
+ * Reads the next pulse of the train. Returns PULSETRAIN_DONE once all
+ * the pulses have been read.
+ */
+pulsetrain_status_t pulsetrain_read(struct pulsetrain_reader* reader,
+				    struct pulsetrain_pulse* pulse);
+
+/**
+ * Reads up to max_count pulses into pulses, storing the number of
+ * pulses read into count. Intended for refilling transmit buffers.
+ */
+pulsetrain_status_t pulsetrain_read_many(struct pulsetrain_reader* reader,
+					 struct pulsetrain_pulse* pulses, size_t max_count,
+					 size_t* count);
+
+#endif /* PULSETRAIN_H */
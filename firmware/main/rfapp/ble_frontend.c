@@ -0,0 +1,153 @@
+#include "rfapp.h"
+#include "sdkconfig.h"
+
+#if CONFIG_RFAPP_FRONTEND_BLE
+#include "host/ble_hs.h"
+#include "host/ble_uuid.h"
+#include "../bt/rfble_gatt.h"
+#include "../bt/rfble_conn.h"
+#include "../bt/rfble_cmd.h"
+
+static void rf_ble_on_result(const struct rf_requester* requester, rf_send_result_t result);
+static void rf_ble_on_antenna_state(bool busy);
+
+/** Front-end of the RF Companion service, the command characteristic
+    and the connectionless triggers */
+static const struct rf_frontend rf_ble_frontend = {
+  .name = "BLE",
+  .on_result = rf_ble_on_result,
+  .on_antenna_state = rf_ble_on_antenna_state,
+};
+
+_Static_assert((int) RF_SEND_PROCESSING == (int) RFBLE_GATT_SEND_RF_PROCESSING
+	       && (int) RF_SEND_BUSY == (int) RFBLE_GATT_SEND_RF_BUSY
+	       && (int) RF_SEND_COMPLETED == (int) RFBLE_GATT_SEND_RF_COMPLETED
+	       && (int) RF_SEND_UNKNOWN_SIGNAL == (int) RFBLE_GATT_SEND_RF_UNKNOWN_SIGNAL,
+	       "Send RF results must match their GATT notifications");
+
+/** Value of the Status characteristic */
+static rfble_gatt_status_t rf_status;
+static portMUX_TYPE rf_status_lock = portMUX_INITIALIZER_UNLOCKED;
+
+// Applies the given changes to the status and publishes it, along
+// with the depth of the queue. The status is updated from both the
+// host and the tx task.
+static void rf_status_update(int antenna_state, int req_id, int last_result) {
+  rfble_gatt_status_t value;
+
+  portENTER_CRITICAL(&rf_status_lock);
+  if (antenna_state >= 0) {
+    rf_status.antenna_state = antenna_state;
+  }
+  rf_status.queue_depth = rf_core_queue_depth();
+  if (req_id >= 0) {
+    rf_status.req_id = req_id;
+  }
+  if (last_result >= 0) {
+    rf_status.last_result = last_result;
+  }
+  value = rf_status;
+  portEXIT_CRITICAL(&rf_status_lock);
+
+  rfble_gatt_status_set(&value);
+}
+
+static void rf_ble_on_antenna_state(bool busy) {
+  rf_status_update(busy ? RFBLE_GATT_ANTENNA_STATE_BUSY : RFBLE_GATT_ANTENNA_STATE_FREE, -1, -1);
+  // Keep the link responsive until the result of the tx is notified
+  rfble_conn_set_active(busy);
+  rfble_gatt_notify_antenna_state_change(busy);
+}
+
+// Rejected requests are only answered, so they don't hide the state of
+// the queued ones in the status.
+static void rf_ble_on_result(const struct rf_requester* requester, rf_send_result_t result) {
+  if (result == RF_SEND_PROCESSING || result == RF_SEND_COMPLETED) {
+    rf_status_update(-1, requester->has_req_id ? requester->req_id : 0, result);
+  }
+
+  if (requester->has_req_id) {
+    rfble_cmd_respond8(requester->conn, RFBLE_CMD_SEND_RF, requester->req_id, result);
+  } else {
+    rfble_gatt_notify_send_rf_response(requester->conn, (rfble_gatt_send_rf_notif_t) result);
+  }
+}
+
+void init_ble_frontend(void) {
+  ESP_ERROR_CHECK(rf_core_register_frontend(&rf_ble_frontend));
+}
+
+// This function is only intended to be called from the Send RF GATT
+// Operation, because it will notify back the GATT server about
+// changes in the operation.
+void rf_begin_send_stored_signal(uint16_t conn_handle, rf_stored_signal_t signal) {
+  struct rf_requester requester = { .conn = conn_handle };
+  rf_core_send_signal(&requester, signal);
+}
+
+static int rf_companion_bt_read_antenna_state(uint16_t conn_handle,
+					     struct ble_gatt_access_ctxt *ctxt) {
+  RF_LOGI("Requested antenna state");
+  return rfble_gatt_push8(ctxt, rf_antenna_is_busy());
+}
+
+static int rf_companion_bt_write_send_rf(uint16_t conn_handle, struct ble_gatt_access_ctxt *ctxt) {
+  uint8_t value;
+  int rc;
+
+  rc = rfble_gatt_recv8(ctxt, &value);
+  if (rc != 0) {
+    return rc;
+  }
+
+  RF_LOGI("Requested sending stored RF signal with id %d", value);
+  rf_begin_send_stored_signal(conn_handle, value);
+  return 0;
+}
+
+const rfble_gatt_chr_handler_t rf_companion_bt_chr_handlers[] = {
+  { .uuid = &rfble_gatt_chr_antenna_state_uuid.u, .read_cb = rf_companion_bt_read_antenna_state },
+  { .uuid = &rfble_gatt_chr_send_rf_uuid.u, .write_cb = rf_companion_bt_write_send_rf },
+  { 0 }
+};
+
+void rf_companion_bt_trigger_cb(const ble_addr_t* peer_id_addr, uint8_t signal) {
+  // Nobody to notify back, besides the subscribers of the status
+  struct rf_requester requester = { .conn = BLE_HS_CONN_HANDLE_NONE };
+
+  RF_LOGI("Trigger from " RFBLE_ADDR_FMT " requested sending stored RF signal with id %d",
+	  RFBLE_ADDR_FMT_PARAMS(*peer_id_addr), signal);
+  rf_core_send_signal(&requester, signal);
+}
+
+int rf_companion_bt_cmd_cb(const struct rfble_cmd* cmd) {
+  struct rf_requester requester = { 0 };
+
+  switch (cmd->type) {
+  case RFBLE_CMD_SEND_RF:
+    if (cmd->len != sizeof(uint8_t)) {
+      return RFBLE_CMD_ERR_INVALID_LEN;
+    }
+
+    RF_LOGI("Command %d requested sending stored RF signal with id %d", cmd->req_id, cmd->value[0]);
+    requester.conn = cmd->conn_handle;
+    requester.has_req_id = true;
+    requester.req_id = cmd->req_id;
+    rf_core_send_signal(&requester, cmd->value[0]);
+    return 0;
+
+  case RFBLE_CMD_GET_ANTENNA_STATE:
+    if (cmd->len != 0) {
+      return RFBLE_CMD_ERR_INVALID_LEN;
+    }
+
+    rfble_cmd_respond8(cmd->conn_handle, cmd->type, cmd->req_id, rf_antenna_is_busy());
+    return 0;
+  }
+
+  return RFBLE_CMD_ERR_UNKNOWN_TYPE;
+}
+#else
+void init_ble_frontend(void) {
+}
+#endif
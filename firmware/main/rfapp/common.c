@@ -1,20 +1,22 @@
 #include "esp_err.h"
+#include "esp_pm.h"
 #include "esp_system.h"
 #include "esp_timer.h"
 #include "freertos/portmacro.h"
 #include "hal/gpio_types.h"
-#include "host/ble_uuid.h"
 #include "led_strip.h"
 #include "led_strip_types.h"
 #include "nvs.h"
 #include "rfapp.h"
 #include "driver/gpio.h"
 #include "nvs_flash.h"
+#include <inttypes.h>
 #include <stdint.h>
+#include <stdlib.h>
 #include "../clemsacode.h"
-#include "../private.h"
-#include "../bt/rfble_gatt.h"
 #include "../teslacharger.h"
+#include "../sigindex.h"
+#include "rfcore.h"
 
 struct rgb COLOR_RED = {.r = 255, .g = 0, .b = 0};
 struct rgb COLOR_BLUE = {.r = 0, .g = 0, .b = 255};
@@ -22,24 +24,48 @@ struct rgb COLOR_GREEN = {.r = 0, .g = 255, .b = 0};
 struct rgb COLOR_CYAN = {.r = 0, .g = 255, .b = 255};
 
 static led_strip_handle_t status_led;
-static bool antenna_busy = false;
 
-static struct clemsa_codegen generator = {0};
-static struct clemsa_codegen_tx tx = {0};
+/** Index of the fingerprints of the stored signals. Built by the first
+    lookup, so that neither the boot nor the RAM pay for it until a
+    capture is looked up. */
+static struct sigindex* signal_index;
+static portMUX_TYPE signal_index_lock = portMUX_INITIALIZER_UNLOCKED;
 
 bool pairing_mode;
-bool ready_to_reboot = false;
+bool ready_to_switch_mode = false;
 
-nvs_handle_t app_nvs_handle;
+/** Mode requested through rf_app_request_mode, applied by the main
+    task, or RF_APP_INIT_HW_DEFINED if none */
+static volatile uint8_t requested_mode = RF_APP_INIT_HW_DEFINED;
+
+DECL_STATIC_TASK(status_led, 4096);
+static TaskHandle_t status_led_task;
 
-DECL_STATIC_QUEUE(tx_start, sizeof(tx_type_t), 1);
-QueueHandle_t queue_tx_start_handle;
+nvs_handle_t app_nvs_handle;
 
 void init_antenna(void) {
   gpio_reset_pin(RF_ANTENNA_GPIO);
   gpio_set_direction(RF_ANTENNA_GPIO, GPIO_MODE_OUTPUT);
 }
 
+void init_power_management(void) {
+#if CONFIG_PM_ENABLE
+#if CONFIG_IDF_TARGET_ESP32S3
+  esp_pm_config_esp32s3_t pm_config = {
+#else
+  esp_pm_config_esp32_t pm_config = {
+#endif
+    .max_freq_mhz = CONFIG_ESP_DEFAULT_CPU_FREQ_MHZ,
+    .min_freq_mhz = CONFIG_XTAL_FREQ,
+    .light_sleep_enable = true,
+  };
+
+  // Lets the main processor sleep while idle, in particular while the
+  // ULP plays a tx
+  ESP_ERROR_CHECK(esp_pm_configure(&pm_config));
+#endif
+}
+
 void init_status_led(void) {
   led_strip_config_t strip_config = {
     .strip_gpio_num = STATUS_LED_GPIO,
@@ -71,6 +97,84 @@ void status_led_color_rgb(struct rgb *rgb) {
   status_led_color(rgb->r, rgb->g, rgb->b);
 }
 
+// Shows the current mode in the status led. It is woken up whenever
+// the mode changes, so the new pattern shows up right away.
+void task_status_led(void* arg) {
+  struct rgb pairing_colors[] = {COLOR_BLUE, COLOR_RED};
+  bool showing_pairing = !pairing_mode;
+  int next = 0;
+
+  while (1) {
+    if (ready_to_switch_mode) {
+      if (next++ % 2) {
+	status_led_off();
+      } else {
+	status_led_color_rgb(&COLOR_CYAN);
+      }
+      ulTaskNotifyTake(pdTRUE, 100 / portTICK_PERIOD_MS);
+    } else if (pairing_mode) {
+      showing_pairing = true;
+      status_led_color_rgb(&pairing_colors[next++ % (sizeof(pairing_colors) / sizeof(struct rgb))]);
+      ulTaskNotifyTake(pdTRUE, 300 / portTICK_PERIOD_MS);
+    } else if (showing_pairing) {
+      // Just entered the default mode
+      showing_pairing = false;
+      status_led_color_rgb(&COLOR_GREEN);
+      ulTaskNotifyTake(pdTRUE, 1000 / portTICK_PERIOD_MS);
+    } else {
+      status_led_color_rgb(&COLOR_GREEN);
+      vTaskDelay(100 / portTICK_PERIOD_MS);
+      status_led_off();
+      ulTaskNotifyTake(pdTRUE, 60000 / portTICK_PERIOD_MS);
+    }
+  }
+
+  vTaskDelete(NULL);
+}
+
+void status_led_show_mode(void) {
+  if (status_led_task == NULL) {
+    status_led_task = xTaskCreateStaticPinnedToCore
+      (
+       task_status_led,
+       "Status Led Task",
+       task_status_led_stack_size,
+       NULL,
+       tskIDLE_PRIORITY,
+       task_status_led_stack,
+       &task_status_led_storage,
+       0);
+    return;
+  }
+
+  xTaskNotifyGive(status_led_task);
+}
+
+void rf_app_request_mode(uint8_t mode) {
+  requested_mode = mode;
+}
+
+// Applies the mode requested through rf_app_request_mode, if any
+static bool rf_app_apply_requested_mode(void) {
+  uint8_t mode = requested_mode;
+
+  if (mode == RF_APP_INIT_HW_DEFINED) {
+    return false;
+  }
+  requested_mode = RF_APP_INIT_HW_DEFINED;
+
+  if (mode == RF_APP_INIT_PAIRING_MODE && !pairing_mode) {
+    rf_app_enter_pairing_mode();
+  } else if (mode == RF_APP_INIT_DEFAULT_MODE && pairing_mode) {
+    rf_app_enter_default_mode();
+  } else {
+    return false;
+  }
+
+  status_led_show_mode();
+  return true;
+}
+
 void init_nvs(void) {
     esp_err_t ret = nvs_flash_init();
     if (ret == ESP_ERR_NVS_NO_FREE_PAGES || ret == ESP_ERR_NVS_NEW_VERSION_FOUND) {
@@ -98,18 +202,6 @@ uint8_t rf_app_get_next_boot_mode() {
   return RF_APP_INIT_HW_DEFINED;
 }
 
-void rf_app_set_next_boot_mode(uint8_t mode) {
-  esp_err_t ret = nvs_set_u8(app_nvs_handle, RF_APP_INIT_MODE_KEY, mode);
-  if (ret == ESP_OK) {
-    ret = nvs_commit(app_nvs_handle);
-  }
-
-  if (ret != ESP_OK) {
-    RF_LOGE("Unable to set boot mode: %s", esp_err_to_name(ret));
-  }
-}
-
-
 void rf_app_clear_next_boot_mode() {
   esp_err_t ret = nvs_erase_key(app_nvs_handle, RF_APP_INIT_MODE_KEY);
   if (ret == ESP_OK) {
@@ -121,156 +213,116 @@ void rf_app_clear_next_boot_mode() {
   }
 }
 
-bool rf_antenna_is_busy() { return antenna_busy; }
-
-void rf_antenna_set_busy(bool value) {
-  bool changed = antenna_busy != value;
-  antenna_busy = value;
-  if (changed) {
-    rfble_gatt_notify_antenna_state_change();
+// A duplicate means two stored signals carry the same payload, so
+// captures of it couldn't tell which one they are
+static esp_err_t rf_index_stored_signal(struct sigindex* index, const struct sigindex_fingerprint* fingerprint,
+					rf_stored_signal_t signal) {
+  esp_err_t err = sigindex_insert(index, fingerprint, signal);
+  uint32_t existing;
+
+  if (err == ESP_ERR_INVALID_STATE && sigindex_lookup(index, fingerprint, &existing) == ESP_OK) {
+    RF_LOGE("Stored signal %d has the same payload as stored signal %" PRIu32, signal, existing);
+  } else if (err != ESP_OK) {
+    RF_LOGE("Unable to index stored signal %d: %s", signal, esp_err_to_name(err));
   }
-}
 
-static void clemsa_codegen_tx_cb(struct clemsa_codegen_tx* tx) {
-  rf_antenna_set_busy(false);
-  rfble_gatt_notify_send_rf_response(RFBLE_GATT_SEND_RF_COMPLETED);
+  return err;
 }
 
-// Task that will initiate the transmission from the CPU 1, so
-// interrupts are also handled by CPU 1 and can run without weird
-// stuff interferring on them.
-static void transmission_initiator_task(void* arg) {
-  tx_type_t tx_type;
+// Every stored signal goes through the index, which rejects duplicates
+static esp_err_t rf_build_signal_index(struct sigindex* index) {
+  struct sigindex_fingerprint fingerprint;
+  const struct rf_signal* signal;
+  const uint8_t* payload;
+  size_t payload_len;
+  esp_err_t err;
 
-  while (1) {
-    xQueueReceive(queue_tx_start_handle, &tx_type, portMAX_DELAY);
-    switch (tx_type) {
+  sigindex_init(index);
+
+  for (uint32_t id = 1; id <= RF_SIGNALS_MAX_ID; id++) {
+    signal = rf_signal_by_id(id);
+    if (signal == NULL) {
+      continue;
+    }
+
+    switch (signal->tx_type) {
     case TX_TYPE_CLEMSA_CODEGEN:
-      // In this kind of transmission, everything's already set up by
-      // the caller, we just need to initiate the tx. The callback of
-      // the tx will then free the antenna and send the termination
-      // notification.
-      ESP_ERROR_CHECK(clemsa_codegen_begin_tx(&generator, &tx));
+      sigindex_fingerprint_bits(SIGINDEX_PROTO_CLEMSA, signal->code,
+				CLEMSA_CODEGEN_DEFAULT_CODE_SIZE, &fingerprint);
       break;
     case TX_TYPE_TESLA_CHARGER_OPEN:
-      // In this tx, the antenna is set to busy prior to this call,
-      // and the state of the request is set to PROCESSING. We need to
-      // run the tx, free the antenna and send the RF task completion
-      // notification.
-      tesla_charger_open_door_sync(RF_ANTENNA_GPIO);
-      rfble_gatt_notify_send_rf_response(RFBLE_GATT_SEND_RF_COMPLETED);
-      rf_antenna_set_busy(false);
+      payload = tesla_charger_door_payload(&payload_len);
+      sigindex_fingerprint_bytes(SIGINDEX_PROTO_TESLA_CHARGER, payload, payload_len * 8, &fingerprint);
+      break;
+    default:
+      continue;
     }
 
-    RF_LOGI("Transmission initiated");
+    if ((err = rf_index_stored_signal(index, &fingerprint, signal->id)) != ESP_OK) {
+      return err;
+    }
   }
-}
-
-void init_clemsa_codegen() {
-  queue_tx_start_handle = xQueueCreateStatic
-    (queue_tx_start_max_item_count,
-     queue_tx_start_item_size,
-     queue_tx_start_storage,
-     &queue_tx_start_holder);
-
-  ESP_ERROR_CHECK(clemsa_codegen_init(&generator, RF_ANTENNA_GPIO));
-
-  generator.done_callback = clemsa_codegen_tx_cb;
-  tx.repetition_count = 10;
-  tx.code_len = CLEMSA_CODEGEN_DEFAULT_CODE_SIZE;
 
-  xTaskCreatePinnedToCore
-    (
-     transmission_initiator_task,
-     "Transmission initiator task",
-     4*1024, NULL, tskIDLE_PRIORITY + 1, NULL, 1);
+  return ESP_OK;
 }
 
-/**
- * Acquires the RF antenna and sends to the Transmission initiator
- * task a signal for initiating the transmission of a signal.
- */
-static void rf_push_tx(tx_type_t type) {
-  if (rf_antenna_is_busy()) {
-    RF_LOGE("Couldn't initiate the transmission because the antenna is busy.");
-    return;
+// Returns the signal index, building it on the first call. Two tasks
+// racing on the first lookup both build one, and the loser frees its
+// own. Returns NULL if there is no memory for it, or if the stored
+// signals cannot be indexed.
+static const struct sigindex* rf_signal_index(esp_err_t* err) {
+  struct sigindex* index;
+  struct sigindex* built;
+
+  taskENTER_CRITICAL(&signal_index_lock);
+  built = signal_index;
+  taskEXIT_CRITICAL(&signal_index_lock);
+  if (built != NULL) {
+    return built;
   }
 
-  rfble_gatt_notify_send_rf_response(RFBLE_GATT_SEND_RF_PROCESSING);
-  rf_antenna_set_busy(true);
-  xQueueSend(queue_tx_start_handle, &type, 0);
-}
-
-static void rf_push_clemsa_tx(const bool* code, const char* code_name) {
-  if (rf_antenna_is_busy()) {
-    RF_LOGE("Couldn't initiate the transmission because the antenna is busy.");
-    return;
+  if ((index = malloc(sizeof(*index))) == NULL) {
+    *err = ESP_ERR_NO_MEM;
+    return NULL;
   }
-
-  tx.code = code;
-  tx.code_name = code_name;
-  rf_push_tx(TX_TYPE_CLEMSA_CODEGEN);
-}
-
-// This function is only intended to be called from the Send RF GATT
-// Operation, because it will notify back the GATT server about
-// changes in the operation.
-void rf_begin_send_stored_signal(rf_stored_signal_t signal) {
-  if (rf_antenna_is_busy()) {
-    rfble_gatt_notify_send_rf_response(RFBLE_GATT_SEND_RF_BUSY);
-    return;
+  if ((*err = rf_build_signal_index(index)) != ESP_OK) {
+    free(index);
+    return NULL;
   }
 
-  switch (signal) {
-  case STORED_SIGNAL_HOME_GARAGE_ENTER:
-    rf_push_clemsa_tx(HOME_GARAGE_ENTER_CODE, "Home Enter Garage");
-    break;
-  case STORED_SIGNAL_HOME_GARAGE_EXIT:
-    rf_push_clemsa_tx(HOME_GARAGE_EXIT_CODE, "Home Exit Garage");
-    break;
-  case STORED_SIGNAL_PARENTS_GARAGE_LEFT:
-    rf_push_clemsa_tx(PARENTS_GARAGE_ENTER_CODE, "Parents Enter Garage");
-    break;
-  case STORED_SIGNAL_PARENTS_GARAGE_RIGHT:
-    rf_push_clemsa_tx(PARENTS_GARAGE_EXIT_CODE, "Parents Exit Garage");
-    break;
-  case STORED_SIGNAL_TESLA_CHARGER_DOOR_OPEN:
-    rf_push_tx(TX_TYPE_TESLA_CHARGER_OPEN);
-    break;
-  default:
-    RF_LOGE("Unknown stored signal requested to be sent: %d", signal);
-    rfble_gatt_notify_send_rf_response(RFBLE_GATT_SEND_RF_UNKNOWN_SIGNAL);
-    return;
+  taskENTER_CRITICAL(&signal_index_lock);
+  if (signal_index == NULL) {
+    signal_index = index;
+    index = NULL;
   }
+  built = signal_index;
+  taskEXIT_CRITICAL(&signal_index_lock);
 
+  free(index);
+  return built;
 }
 
-int rf_companion_bt_read_chr_cb(struct ble_gatt_access_ctxt *ctxt, const ble_uuid_t* chr_id) {
-  if (ble_uuid_cmp(chr_id, &rfble_gatt_chr_antenna_state_uuid.u) == 0) {
-    RF_LOGI("Requested antenna state");
+esp_err_t rf_find_stored_signal(const struct pulsetrain_pulse* pulses, size_t count,
+				const struct rf_signal** signal) {
+  const struct sigindex* index;
+  struct sigindex_fingerprint fingerprint;
+  uint32_t signal_id;
+  esp_err_t err;
 
-    return rfble_gatt_push8(ctxt, rf_antenna_is_busy());
+  err = sigindex_fingerprint_clemsa_capture(pulses, count, CLEMSA_CODEGEN_DEFAULT_CODE_SIZE, &fingerprint);
+  if (err != ESP_OK) {
+    return err;
   }
 
-  return BLE_ATT_ERR_UNLIKELY;
-}
-
-int rf_companion_bt_write_chr_cb(struct ble_gatt_access_ctxt *ctxt, const ble_uuid_t* chr_id) {
-  int rc;
-
-  if (ble_uuid_cmp(chr_id, &rfble_gatt_chr_send_rf_uuid.u) == 0) {
-    uint8_t value;
-    rc = rfble_gatt_recv8(ctxt, &value);
-    if (rc != 0) {
-      return rc;
-    }
-
-    RF_LOGI("Requested sending stored RF signal with id %d", value);
-    rf_begin_send_stored_signal(value);
-    return 0;
+  if ((index = rf_signal_index(&err)) == NULL) {
+    return err;
+  }
+  if ((err = sigindex_lookup(index, &fingerprint, &signal_id)) != ESP_OK) {
+    return err;
   }
 
-  return BLE_ATT_ERR_UNLIKELY;
+  *signal = rf_signal_by_id(signal_id);
+  return ESP_OK;
 }
 
 void init_pairing_mode_button() {
@@ -285,7 +337,7 @@ bool pairing_mode_button_state() {
 
 void rf_companion_main_task() {
   int64_t pairing_button_pressed_since = esp_timer_get_time();
-  bool ready_to_reboot_led_on = false;
+  bool pairing_button_consumed = false;
 
   #ifdef CONFIG_RFAPP_DEVO_MODE
   RF_LOGW("/====================================================================\\");
@@ -297,39 +349,43 @@ void rf_companion_main_task() {
   #endif
 
   while (true) {
-    if (ready_to_reboot) {
-      if (ready_to_reboot_led_on) {
-	status_led_off();
-      } else {
-	status_led_color_rgb(&COLOR_CYAN);
-      }
-      ready_to_reboot_led_on = !ready_to_reboot_led_on;
-
-      if (!gpio_get_level(PAIRING_BUTTON_GPIO)) {
-	vTaskDelay(100 / portTICK_PERIOD_MS);
-	esp_restart();
-	break;
-      }
+    if (ready_to_switch_mode && !pairing_mode_button_state()) {
+      ready_to_switch_mode = false;
+      rf_app_request_mode(RF_APP_INIT_DEFAULT_MODE);
+    }
 
-      // Delay for a blink in the led
-      vTaskDelay(100 / portTICK_PERIOD_MS);
-      continue;
+    if (rf_app_apply_requested_mode()) {
+      // A press that switched modes is ignored until the button is
+      // released.
+      pairing_button_consumed = true;
     }
 
     if (!pairing_mode_button_state()) {
       pairing_button_pressed_since = esp_timer_get_time();
+      pairing_button_consumed = false;
+    }
+
+    // While a pairing request is pending, a shorter press accepts it
+    // instead. The press is then ignored until the button is released.
+    if (pairing_mode && !pairing_button_consumed && pairing_numcmp_pending() &&
+	esp_timer_get_time() - pairing_button_pressed_since > PAIRING_NUMCMP_ACCEPT_MICROS) {
+      pairing_button_consumed = pairing_numcmp_resolve(true, "pairing button");
     }
 
-    if (esp_timer_get_time() - pairing_button_pressed_since > PAIRING_BUTTON_MICROS) {
+    if (!pairing_button_consumed &&
+	esp_timer_get_time() - pairing_button_pressed_since > PAIRING_BUTTON_MICROS) {
+      pairing_button_consumed = true;
       if (pairing_mode) {
-	// If in pairing mode, the button will reboot the esp in
-	// normal mode, once the user releases it.
-	ready_to_reboot = true;
-	RF_LOGI("Pairing mode button held. Ready to reboot.");
+	// If in pairing mode, the button will switch to normal mode,
+	// once the user releases it.
+	ready_to_switch_mode = true;
+	status_led_show_mode();
+	RF_LOGI("Pairing mode button held. Release it for leaving pairing mode.");
       } else {
-	// When not in pairing mode, the button will just reboot instantly the esp.
-	RF_LOGI("Pairing mode button held. Rebooting");
-	esp_restart();
+	// When not in pairing mode, the button switches to pairing
+	// mode right away.
+	RF_LOGI("Pairing mode button held. Entering pairing mode");
+	rf_app_request_mode(RF_APP_INIT_PAIRING_MODE);
       }
     }
 
@@ -1,13 +1,11 @@
 #include "esp_err.h"
 #include "esp_system.h"
+#include "esp_timer.h"
 #include "freertos/FreeRTOS.h"
 #include "freertos/portmacro.h"
 #include "freertos/projdefs.h"
 #include "freertos/task.h"
 #include "freertos/queue.h"
-#include "host/ble_gap.h"
-#include "host/ble_store.h"
-#include "nimble/ble.h"
 #include "rfapp.h"
 #include "esp_console.h"
 #include "argtable3/argtable3.h"
@@ -16,13 +14,34 @@
 #include <stdio.h>
 #include <string.h>
 
+#if CONFIG_RFAPP_FRONTEND_BLE
+#include "host/ble_gap.h"
+#include "host/ble_store.h"
+#include "../bt/rfble_bonds.h"
+#include "nimble/ble.h"
+#endif
+
 #define CONSOLE_MAX_LINE_LEN 256
 
-DECL_STATIC_TASK(pairing_led, 4096);
-DECL_STATIC_QUEUE(numcmp_confirm, sizeof(bool), 1);
+static int cmd_exit(int argc, char** argv) {
+  if (!pairing_mode) {
+    printf("Not in pairing mode\n");
+    return 0;
+  }
+
+  rf_app_request_mode(RF_APP_INIT_DEFAULT_MODE);
+  return 0;
+}
+
+#if CONFIG_RFAPP_FRONTEND_BLE
+/** Numeric comparison waiting for the user to answer */
+static struct {
+  bool pending;
+  uint16_t conn_handle;
+} numcmp;
 
-QueueHandle_t queue_numcmp_confirm_handle;
-volatile bool passkey_pending_numcmp = false;
+static portMUX_TYPE numcmp_lock = portMUX_INITIALIZER_UNLOCKED;
+static esp_timer_handle_t numcmp_timer;
 
 struct {
   struct arg_str* action;
@@ -30,29 +49,44 @@ struct {
   struct arg_end* end;
 } devs_cmd_args;
 
-void task_pairing_led(void* arg) {
-  struct rgb colors[] = {COLOR_BLUE, COLOR_RED};
-  int next = 0;
+bool pairing_numcmp_pending() {
+  return numcmp.pending;
+}
 
-  while (!ready_to_reboot) {
-    status_led_color_rgb(&colors[next++ % (sizeof(colors) / sizeof(struct rgb))]);
-    vTaskDelay(300 / portTICK_PERIOD_MS);
+bool pairing_numcmp_resolve(bool accepted, const char* source) {
+  uint16_t conn_handle;
+  int rc;
+
+  portENTER_CRITICAL(&numcmp_lock);
+  if (!numcmp.pending) {
+    portEXIT_CRITICAL(&numcmp_lock);
+    return false;
+  }
+  numcmp.pending = false;
+  conn_handle = numcmp.conn_handle;
+  portEXIT_CRITICAL(&numcmp_lock);
+
+  esp_timer_stop(numcmp_timer);
+  RF_LOGI("Pairing request %s from %s", accepted ? "accepted" : "declined", source);
+  if ((rc = rfble_pair_numcmp_reply(conn_handle, accepted)) != 0) {
+    RF_LOGW("Unable to answer pairing request; rc=%d", rc);
   }
 
-  vTaskDelete(NULL);
+  return true;
 }
 
-static void write_passkey_numcmp_result(bool accepted) {
-  passkey_pending_numcmp = false;
-  xQueueSend(queue_numcmp_confirm_handle, &accepted, 0);
+static void numcmp_timeout_cb(void* arg) {
+  if (pairing_numcmp_resolve(false, "timeout")) {
+    RF_LOGW("Pairing operation timeout. Operation aborted");
+  }
 }
 
 static bool ensure_pairing_key_request_pending() {
-  if (!passkey_pending_numcmp) {
+  if (!numcmp.pending) {
     printf("There's no pending pairing request\n");
   }
 
-  return passkey_pending_numcmp;
+  return numcmp.pending;
 }
 
 static int cmd_accept(int argc, char **argv) {
@@ -60,7 +94,7 @@ static int cmd_accept(int argc, char **argv) {
     return 0;
   }
 
-  write_passkey_numcmp_result(true);
+  pairing_numcmp_resolve(true, "console");
   return 0;
 }
 
@@ -69,13 +103,7 @@ static int cmd_decline(int argc, char** argv) {
     return 0;
   }
 
-  write_passkey_numcmp_result(false);
-  return 0;
-}
-
-static int cmd_exit(int argc, char** argv) {
-  rf_app_set_next_boot_mode(RF_APP_INIT_DEFAULT_MODE);
-  esp_restart();
+  pairing_numcmp_resolve(false, "console");
   return 0;
 }
 
@@ -103,24 +131,21 @@ static int cmd_devs(int argc, char** argv) {
 
   const char* action = devs_cmd_args.action->sval[0];
   const char* device = devs_cmd_args.device->sval[0];
-  ble_addr_t peers[RFBLE_MAX_KNOWN_DEVICES];
+  struct rfble_bond peers[RFBLE_MAX_KNOWN_DEVICES];
   ble_addr_t deleting_peer;
   int rc;
-  int num_peers;
+  size_t num_peers;
 
   bool unused_device;
   if (strcmp("", action) == 0) {
     // List devices
     unused_device = true;
-    rc = ble_store_util_bonded_peers(peers, &num_peers, RFBLE_MAX_KNOWN_DEVICES);
-    if (rc != 0) {
-      printf("Unable to enumerate bonded devices: %d\n", rc);
-      return 0;
-    }
+    num_peers = rfble_bonds_list(peers, RFBLE_MAX_KNOWN_DEVICES);
 
     printf("List of bonded devices:\n");
     for (int i = 0; i < num_peers; i++) {
-      printf(" - " RFBLE_ADDR_FMT "\n", RFBLE_ADDR_FMT_PARAMS(peers[i]));
+      printf(" - " RFBLE_ADDR_FMT "%s\n", RFBLE_ADDR_FMT_PARAMS(peers[i].addr),
+	     peers[i].irk_present ? " (private address)" : "");
     }
     printf("\n");
   } else if (strcmp("delete", action) == 0 || strcmp("remove", action) == 0) {
@@ -130,14 +155,14 @@ static int cmd_devs(int argc, char** argv) {
       return 0;
     }
 
-    if ((rc = ble_store_util_delete_peer(&deleting_peer)) == 0) {
+    if ((rc = rfble_bonds_delete(&deleting_peer)) == 0) {
       printf("Device removed from bonded list\n");
     } else {
       printf("Error removing peer: %d.\n", rc);
     }
   } else if (strcmp("clear", action) == 0) {
     unused_device = true;
-    if ((rc = ble_store_clear()) == 0) {
+    if ((rc = rfble_bonds_clear()) == 0) {
       printf("Cleared list of bonded devices\n");
     } else {
       printf("Error clearing list of bonded devices: %d.\n", rc);
@@ -153,8 +178,25 @@ static int cmd_devs(int argc, char** argv) {
 
   return 0;
 }
+#else
+// Pairing over SPP is answered by the Bluetooth stack itself
+bool pairing_numcmp_pending() {
+  return false;
+}
+
+bool pairing_numcmp_resolve(bool accepted, const char* source) {
+  return false;
+}
+#endif
 
 static void register_commands() {
+  esp_console_cmd_t exit_cmd = {
+    .command = "exit",
+    .help = "Exits from the pairing mode",
+    .func = &cmd_exit
+  };
+
+#if CONFIG_RFAPP_FRONTEND_BLE
   esp_console_cmd_t accept_cmd = {
     .command = "accept",
     .help = "Accept incoming pairing request.",
@@ -167,12 +209,6 @@ static void register_commands() {
     .func = &cmd_decline
   };
 
-  esp_console_cmd_t exit_cmd = {
-    .command = "exit",
-    .help = "Exits from the pairing mode",
-    .func = &cmd_exit
-  };
-
   devs_cmd_args.action = arg_str0(NULL, NULL, "<action>", "action");
   devs_cmd_args.device = arg_str0(NULL, NULL, "<dev>", "bluetooth address");
   devs_cmd_args.end = arg_end(2);
@@ -187,77 +223,78 @@ static void register_commands() {
     .argtable = &devs_cmd_args
   };
 
-
-
   esp_console_cmd_register(&accept_cmd);
   esp_console_cmd_register(&decline_cmd);
   esp_console_cmd_register(&devices_cmd);
+#endif
   esp_console_cmd_register(&exit_cmd);
 
   esp_console_register_help_command();
 }
 
-static bool passkey_numcmp_cb(uint16_t conn_handle, uint32_t key) {
+#if CONFIG_RFAPP_FRONTEND_BLE
+static void passkey_numcmp_cb(uint16_t conn_handle, uint32_t key) {
   struct ble_gap_conn_desc desc;
-  bool accept;
 
   if (ble_gap_conn_find(conn_handle, &desc) != 0) {
     RF_LOGW("Number comparison aborted since connection is not available anymore");
-    return false;
+    rfble_pair_numcmp_reply(conn_handle, false);
+    return;
   }
 
+  // Only one request is answered at a time
+  pairing_numcmp_resolve(false, "a newer request");
+
   RF_LOGI("============================================================================================");
   RF_LOGI("Device " RFBLE_ADDR_FMT " is attempting to pair.", RFBLE_ADDR_FMT_PARAMS(desc.peer_id_addr));
   RF_LOGI("Check that this key matches on the remote device: %" PRIu32, key);
-  RF_LOGI("Use the command 'accept' or 'decline' to proceed or cancel the pairing request respectively.");
+  RF_LOGI("Use the command 'accept' or 'decline' to proceed or cancel the pairing request respectively,");
+  RF_LOGI("or hold the pairing button for accepting it.");
   RF_LOGI("============================================================================================");
 
 #ifdef CONFIG_RFAPP_DEVO_MODE
   RF_LOGW("Automatic accepting peer " RFBLE_ADDR_FMT " since development mode is enabled.", RFBLE_ADDR_FMT_PARAMS(desc.peer_id_addr));
-  accept = true;
-  return accept;
+  rfble_pair_numcmp_reply(conn_handle, true);
 #else
-  passkey_pending_numcmp = true;
-  if (xQueueReceive(queue_numcmp_confirm_handle, &accept, 30000 / portTICK_PERIOD_MS) == pdTRUE) {
-    return accept;
-  } else {
-    RF_LOGW("Pairing operation timeout. Operation aborted");
-    return false;
-  }
+  portENTER_CRITICAL(&numcmp_lock);
+  numcmp.conn_handle = conn_handle;
+  numcmp.pending = true;
+  portEXIT_CRITICAL(&numcmp_lock);
+
+  esp_timer_start_once(numcmp_timer, PAIRING_NUMCMP_TIMEOUT_MICROS);
 #endif
 }
 
-void app_pairing_mode_main(void) {
-  RF_LOGI("Enter pairing mode...");
-  pairing_mode = true;
+static const rfble_opts_t pairing_ble_opts = {
+  .device_name = RF_COMPANION_DEVICE_NAME,
+  .discovery_mode = RFBLE_DISC_GENERAL,
+  .allow_device_pairing = true,
+  .io_cap = RFBLE_IO_CAP_KEYBOARD_DISPLAY,
+  .pair_req_numcmp_cb = passkey_numcmp_cb,
+  .chr_handlers = rf_companion_bt_chr_handlers,
+  .cmd_cb = rf_companion_bt_cmd_cb,
+  .trigger_cb = rf_companion_bt_trigger_cb
+};
+#endif
 
-  xTaskCreateStaticPinnedToCore
-    (
-     task_pairing_led,
-     "Pairing Led Task",
-     task_pairing_led_stack_size,
-     NULL,
-     tskIDLE_PRIORITY,
-     task_pairing_led_stack,
-     &task_pairing_led_storage,
-     0);
-
-  queue_numcmp_confirm_handle = xQueueCreateStatic
-    (queue_numcmp_confirm_max_item_count,
-     queue_numcmp_confirm_item_size,
-     queue_numcmp_confirm_storage,
-     &queue_numcmp_confirm_holder);
-  rfble_opts_t ble_opts = {
-    .device_name = RF_COMPANION_DEVICE_NAME,
-    .discovery_mode = RFBLE_DISC_GENERAL,
-    .allow_device_pairing = true,
-    .io_cap = RFBLE_IO_CAP_KEYBOARD_DISPLAY,
-    .pair_req_numcmp_cb = passkey_numcmp_cb,
-    .gatt_read_cb = rf_companion_bt_read_chr_cb,
-    .gatt_write_cb = rf_companion_bt_write_chr_cb
-  };
+// Sets up what pairing mode needs the first time it is entered: the
+// timeout of pairing requests and the console. Both are kept when
+// leaving pairing mode, so entering it again is immediate.
+static void init_pairing_mode() {
+  static bool initialized = false;
 
-  rfble_begin(&ble_opts);
+  if (initialized) {
+    return;
+  }
+  initialized = true;
+
+#if CONFIG_RFAPP_FRONTEND_BLE
+  const esp_timer_create_args_t numcmp_timer_args = {
+    .callback = numcmp_timeout_cb,
+    .name = "numcmp_timeout"
+  };
+  ESP_ERROR_CHECK(esp_timer_create(&numcmp_timer_args, &numcmp_timer));
+#endif
 
   esp_console_repl_t* repl;
   esp_console_repl_config_t repl_config = ESP_CONSOLE_REPL_CONFIG_DEFAULT();
@@ -282,12 +319,42 @@ void app_pairing_mode_main(void) {
 #error Unsupported console type
 #endif
 
-    RF_LOGI("You're in the RF Companion pairing mode. Pair your device with the ESP32 now.");
-    RF_LOGI("You may find the ESP32 under the name of '" RF_COMPANION_DEVICE_NAME "'");
-    RF_LOGI("Make sure your device supports BLE 4.2+!");
-    RF_LOGI("");
-
     register_commands();
     ESP_ERROR_CHECK(esp_console_start_repl(repl));
-    rf_companion_main_task();
+}
+
+static void log_pairing_mode_help() {
+  RF_LOGI("You're in the RF Companion pairing mode. Pair your device with the ESP32 now.");
+  RF_LOGI("You may find the ESP32 under the name of '" RF_COMPANION_DEVICE_NAME "'");
+#if CONFIG_RFAPP_FRONTEND_BLE
+  RF_LOGI("Make sure your device supports BLE 4.2+!");
+#endif
+  RF_LOGI("");
+}
+
+void rf_app_enter_pairing_mode(void) {
+  RF_LOGI("Enter pairing mode...");
+  init_pairing_mode();
+  pairing_mode = true;
+
+#if CONFIG_RFAPP_FRONTEND_BLE
+  rfble_reconfigure(&pairing_ble_opts);
+#endif
+  log_pairing_mode_help();
+}
+
+void app_pairing_mode_main(void) {
+  RF_LOGI("Enter pairing mode...");
+  pairing_mode = true;
+  status_led_show_mode();
+
+  init_pairing_mode();
+
+#if CONFIG_RFAPP_FRONTEND_BLE
+  rfble_opts_t ble_opts = pairing_ble_opts;
+  rfble_begin(&ble_opts);
+#endif
+
+  log_pairing_mode_help();
+  rf_companion_main_task();
 }
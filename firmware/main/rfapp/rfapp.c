@@ -1,47 +1,38 @@
 #include "rfapp.h"
 #include "freertos/portmacro.h"
 
-DECL_STATIC_TASK(activity_led, 4096);
-
-void task_activity_led(void* arg) {
-  status_led_color_rgb(&COLOR_GREEN);
-  vTaskDelay(1000 / portTICK_PERIOD_MS);
-
-  while (1) {
-    status_led_color_rgb(&COLOR_GREEN);
-    vTaskDelay(100 / portTICK_PERIOD_MS);
-    status_led_off();
-    vTaskDelay(60000 / portTICK_PERIOD_MS);
-  }
+#if CONFIG_RFAPP_FRONTEND_BLE
+static const rfble_opts_t default_ble_opts = {
+  .device_name = RF_COMPANION_DEVICE_NAME,
+  .discovery_mode = RFBLE_DISC_FILTERED,
+  .allow_device_pairing = false,
+  .io_cap = RFBLE_IO_CAP_KEYBOARD_DISPLAY,
+  .chr_handlers = rf_companion_bt_chr_handlers,
+  .cmd_cb = rf_companion_bt_cmd_cb,
+  .trigger_cb = rf_companion_bt_trigger_cb
+};
+#endif
+
+void rf_app_enter_default_mode(void) {
+  RF_LOGI("Leaving pairing mode...");
+  pairing_numcmp_resolve(false, "leaving pairing mode");
+  pairing_mode = false;
 
-  vTaskDelete(NULL);
+#if CONFIG_RFAPP_FRONTEND_BLE
+  rfble_reconfigure(&default_ble_opts);
+#endif
+  RF_LOGI("Ready!");
 }
 
 void app_rf_main(void) {
   RF_LOGI("Initializing app...");
   pairing_mode = false;
+  status_led_show_mode();
 
-  xTaskCreateStaticPinnedToCore
-    (
-     task_activity_led,
-     "Activity Led Task",
-     task_activity_led_stack_size,
-     NULL,
-     tskIDLE_PRIORITY,
-     task_activity_led_stack,
-     &task_activity_led_storage,
-     0);
-
-  rfble_opts_t ble_opts = {
-    .device_name = RF_COMPANION_DEVICE_NAME,
-    .discovery_mode = RFBLE_DISC_FILTERED,
-    .allow_device_pairing = false,
-    .io_cap = RFBLE_IO_CAP_KEYBOARD_DISPLAY,
-    .gatt_read_cb = rf_companion_bt_read_chr_cb,
-    .gatt_write_cb = rf_companion_bt_write_chr_cb
-  };
-
+#if CONFIG_RFAPP_FRONTEND_BLE
+  rfble_opts_t ble_opts = default_ble_opts;
   rfble_begin(&ble_opts);
+#endif
 
   RF_LOGI("Ready!");
   rf_companion_main_task();
@@ -6,12 +6,28 @@
 #include "led_strip.h"
 #include <stdint.h>
 #include "esp_log.h"
+#include "sdkconfig.h"
+#if CONFIG_RFAPP_FRONTEND_BLE
 #include "../bt/rfble.h"
+#endif
+#include "../pulsetrain.h"
+#include "../rfsignals.h"
+#include "rfcore.h"
 
 #define PAIRING_BUTTON_MICROS (3 * 1000000)
 
+/** Time to hold the pairing button for accepting a pending pairing
+    request */
+#define PAIRING_NUMCMP_ACCEPT_MICROS (1 * 1000000)
+
+/** Time after which pending pairing requests are declined */
+#define PAIRING_NUMCMP_TIMEOUT_MICROS (30 * 1000000)
+
 // Make this match your workbench!
-#ifdef CONFIG_RFAPP_DEVO_MODE
+#if CONFIG_RFAPP_TARGET_ESP32_DEVKIT
+#define RF_ANTENNA_GPIO GPIO_NUM_4
+#define PAIRING_BUTTON_GPIO GPIO_NUM_27
+#elif defined(CONFIG_RFAPP_DEVO_MODE)
 #define RF_ANTENNA_GPIO GPIO_NUM_43
 #define PAIRING_BUTTON_GPIO GPIO_NUM_15
 #else
@@ -22,6 +38,9 @@
 
 #if CONFIG_RFAPP_TARGET_ESP32S3_LOLIN_MINI
 #define STATUS_LED_GPIO 47
+#elif CONFIG_RFAPP_TARGET_ESP32_DEVKIT
+// The board has no addressable led, so it is wired externally
+#define STATUS_LED_GPIO 13
 #else
 #define STATUS_LED_GPIO 48
 #endif
@@ -74,23 +93,11 @@
 extern bool pairing_mode;
 
 /**
- * Set to true when the device is in pairing mode and the reset button
- * has been pressed and it is waiting the user to release the button to reboot.
+ * Set to true when the device is in pairing mode and the pairing
+ * button has been held, and it is waiting the user to release the
+ * button to switch to the default mode.
  */
-extern bool ready_to_reboot;
-
-typedef enum {
-  STORED_SIGNAL_HOME_GARAGE_EXIT = 1,
-  STORED_SIGNAL_HOME_GARAGE_ENTER = 2,
-  STORED_SIGNAL_PARENTS_GARAGE_LEFT = 3,
-  STORED_SIGNAL_PARENTS_GARAGE_RIGHT = 4,
-  STORED_SIGNAL_TESLA_CHARGER_DOOR_OPEN = 5,
-} rf_stored_signal_t;
-
-typedef enum __attribute__((packed)) {
-  TX_TYPE_CLEMSA_CODEGEN = 1,
-  TX_TYPE_TESLA_CHARGER_OPEN = 2
-} tx_type_t;
+extern bool ready_to_switch_mode;
 
 struct rgb {
   uint8_t r;
@@ -105,33 +112,85 @@ extern struct rgb COLOR_CYAN;
 
 void init_antenna(void);
 
+/** Enables light sleep and frequency scaling when CONFIG_PM_ENABLE is set */
+void init_power_management(void);
+
 void init_status_led(void);
 void status_led_color(uint8_t r, uint8_t g, uint8_t b);
 void status_led_off(void);
 void status_led_color_rgb(struct rgb *rgb);
 
+/** Updates the status led pattern after the mode changed. The first
+    call starts the status led task. */
+void status_led_show_mode(void);
+
+/* The next boot mode used to be written to NVS before rebooting into
+   the other mode. Mode switches no longer reboot, so it is only read
+   and cleared once after an update from those firmwares. */
 uint8_t rf_app_get_next_boot_mode();
-void rf_app_set_next_boot_mode(uint8_t mode);
 void rf_app_clear_next_boot_mode();
 
 void app_pairing_mode_main(void);
 void app_rf_main(void);
 
+/**
+ * Switches modes while running, without rebooting. Called from the
+ * main task only, see rf_app_request_mode.
+ */
+void rf_app_enter_pairing_mode(void);
+void rf_app_enter_default_mode(void);
+
+/**
+ * Requests switching to the given mode (RF_APP_INIT_DEFAULT_MODE or
+ * RF_APP_INIT_PAIRING_MODE). It is applied by the main task shortly.
+ */
+void rf_app_request_mode(uint8_t mode);
+
 void init_nvs(void);
 
-bool rf_antenna_is_busy();
-void rf_antenna_set_busy(bool value);
+#if CONFIG_RFAPP_FRONTEND_BLE
+/** Handlers of the RF Companion characteristics */
+extern const rfble_gatt_chr_handler_t rf_companion_bt_chr_handlers[];
+int rf_companion_bt_cmd_cb(const struct rfble_cmd* cmd);
+void rf_companion_bt_trigger_cb(const ble_addr_t* peer_id_addr, uint8_t signal);
 
-int rf_companion_bt_read_chr_cb(struct ble_gatt_access_ctxt *ctxt, const ble_uuid_t* chr_id);
-int rf_companion_bt_write_chr_cb(struct ble_gatt_access_ctxt *ctxt,
-                                 const ble_uuid_t *chr_id);
+void rf_begin_send_stored_signal(uint16_t conn_handle, rf_stored_signal_t signal);
+#endif
 
-void init_clemsa_codegen();
-void rf_begin_send_stored_signal(rf_stored_signal_t signal);
+/**
+ * Registers the BLE front-end in the transmit core, when
+ * CONFIG_RFAPP_FRONTEND_BLE is enabled.
+ */
+void init_ble_frontend(void);
+
+/**
+ * Starts the SPP front-end, when CONFIG_RFAPP_FRONTEND_SPP is
+ * enabled. Commands are read and answered from a task of its own.
+ */
+void init_spp_frontend(void);
+
+/**
+ * Finds the stored signal that matches the given captured pulse
+ * train. Returns ESP_ERR_NOT_FOUND if the capture doesn't match any
+ * stored signal. The index of the stored signals is built by the
+ * first call, which returns ESP_ERR_INVALID_STATE if two stored
+ * signals carry the same payload.
+ */
+esp_err_t rf_find_stored_signal(const struct pulsetrain_pulse* pulses, size_t count,
+				const struct rf_signal** signal);
 
 void rf_companion_main_task();
 
 void init_pairing_mode_button();
 bool pairing_mode_button_state();
 
+/** Returns whether a pairing request waits for the user to answer */
+bool pairing_numcmp_pending();
+
+/**
+ * Answers the pending pairing request, if any. Returns false if there
+ * was none.
+ */
+bool pairing_numcmp_resolve(bool accepted, const char* source);
+
 #endif
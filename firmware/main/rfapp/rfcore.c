@@ -0,0 +1,206 @@
+#include <inttypes.h>
+#include "rfcore.h"
+#include "rfapp.h"
+#include "freertos/FreeRTOS.h"
+#include "freertos/queue.h"
+#include "freertos/semphr.h"
+#include "freertos/task.h"
+#include "../clemsacode.h"
+#include "../teslacharger.h"
+#include "../ulpplayer.h"
+
+/* Max time to wait for the ULP to play a tx. Longer than any tx, it
+   only guards against a ULP that never finishes. */
+#define RF_ULP_PLAYER_TIMEOUT_MS 10000
+
+static const struct rf_frontend* frontend;
+
+/** A request accepted and waiting for the tx task */
+struct rf_core_request {
+  struct rf_requester requester;
+  const struct rf_signal* signal;
+};
+
+/** Serializes the changes of queue_depth with the notifications that
+    report them, as front-ends request txs from their own tasks while
+    the tx task completes them. Otherwise a free notification could
+    overtake the busy one of the next request. */
+static SemaphoreHandle_t core_lock;
+static StaticSemaphore_t core_lock_storage;
+
+/** Requests accepted and not completed yet, including the one being
+    sent. The antenna is busy while there is any. */
+static uint32_t queue_depth = 0;
+
+static struct clemsa_codegen generator = {0};
+static struct clemsa_codegen_tx tx = {0};
+static TaskHandle_t tx_task;
+
+#if CONFIG_RFAPP_ULP_PLAYER
+/** Encoded waveform of the tx being played from the ULP */
+static uint8_t ulp_tx_timeline[RFPLAYER_MAX_TIMELINE_LEN];
+#endif
+
+DECL_STATIC_QUEUE(tx_requests, sizeof(struct rf_core_request), RF_CORE_QUEUE_LEN);
+static QueueHandle_t queue_tx_requests_handle;
+
+esp_err_t rf_core_register_frontend(const struct rf_frontend* new_frontend) {
+  if (frontend != NULL) {
+    RF_LOGE("Unable to register front-end %s: %s is registered already", new_frontend->name, frontend->name);
+    return ESP_ERR_INVALID_STATE;
+  }
+
+  frontend = new_frontend;
+  RF_LOGI("Registered front-end %s", frontend->name);
+  return ESP_OK;
+}
+
+static void rf_core_notify_result(const struct rf_requester* requester, rf_send_result_t result) {
+  if (frontend != NULL && frontend->on_result != NULL) {
+    frontend->on_result(requester, result);
+  }
+}
+
+static void rf_antenna_notify(bool busy) {
+  if (frontend != NULL && frontend->on_antenna_state != NULL) {
+    frontend->on_antenna_state(busy);
+  }
+}
+
+bool rf_antenna_is_busy(void) { return queue_depth > 0; }
+
+uint32_t rf_core_queue_depth(void) { return queue_depth; }
+
+// Called once the timer based generator finishes a tx
+static void clemsa_codegen_tx_cb(struct clemsa_codegen_tx* tx) {
+  xTaskNotifyGive(tx_task);
+}
+
+#if CONFIG_RFAPP_ULP_PLAYER
+// Plays the current clemsa tx from the ULP, leaving the main
+// processor idle (and able to go to light sleep) until it finishes.
+// Returns false if the ULP cannot play it, so the caller falls back
+// to the timer based generator.
+static bool rf_play_clemsa_tx_on_ulp() {
+  size_t len;
+  esp_err_t err;
+
+  err = clemsa_codegen_build_timeline(tx.code, tx.code_len, tx.repetition_count,
+				      ulp_tx_timeline, sizeof(ulp_tx_timeline), &len);
+  if (err == ESP_OK) {
+    err = ulp_player_begin(RF_ANTENNA_GPIO, ulp_tx_timeline, len);
+  }
+
+  if (err != ESP_OK) {
+    if (err != ESP_ERR_NOT_SUPPORTED) {
+      RF_LOGW("Unable to play tx on the ULP: %s", esp_err_to_name(err));
+    }
+    return false;
+  }
+
+  if ((err = ulp_player_wait(pdMS_TO_TICKS(RF_ULP_PLAYER_TIMEOUT_MS))) != ESP_OK) {
+    RF_LOGE("ULP tx of %s didn't finish: %s", tx.code_name, esp_err_to_name(err));
+  }
+
+  if ((err = ulp_player_end(RF_ANTENNA_GPIO)) != ESP_OK) {
+    RF_LOGE("ULP tx of %s failed: %s", tx.code_name, esp_err_to_name(err));
+  }
+
+  return true;
+}
+#else
+static bool rf_play_clemsa_tx_on_ulp() {
+  return false;
+}
+#endif
+
+// Sends a request and waits for it to finish
+static void rf_core_send(const struct rf_core_request* req) {
+  switch (req->signal->tx_type) {
+  case TX_TYPE_CLEMSA_CODEGEN:
+    tx.code = req->signal->code;
+    tx.code_name = req->signal->desc;
+    if (!rf_play_clemsa_tx_on_ulp()) {
+      ulTaskNotifyTake(pdTRUE, 0);
+      ESP_ERROR_CHECK(clemsa_codegen_begin_tx(&generator, &tx));
+      ulTaskNotifyTake(pdTRUE, portMAX_DELAY);
+    }
+    break;
+  case TX_TYPE_TESLA_CHARGER_OPEN:
+    tesla_charger_open_door_sync(RF_ANTENNA_GPIO);
+    break;
+  }
+}
+
+// Task that sends the queued requests one after the other, from the
+// CPU 1, so the interrupts of the generators are also handled by CPU 1
+// and can run without weird stuff interferring on them.
+static void transmission_task(void* arg) {
+  struct rf_core_request req;
+
+  while (1) {
+    xQueueReceive(queue_tx_requests_handle, &req, portMAX_DELAY);
+
+    RF_LOGI("Sending %s; queued=%" PRIu32, req.signal->desc, queue_depth - 1);
+    rf_core_send(&req);
+
+    xSemaphoreTake(core_lock, portMAX_DELAY);
+    queue_depth--;
+    rf_core_notify_result(&req.requester, RF_SEND_COMPLETED);
+    if (queue_depth == 0) {
+      rf_antenna_notify(false);
+    }
+    xSemaphoreGive(core_lock);
+  }
+}
+
+void rf_core_init(void) {
+  queue_tx_requests_handle = xQueueCreateStatic
+    (queue_tx_requests_max_item_count,
+     queue_tx_requests_item_size,
+     queue_tx_requests_storage,
+     &queue_tx_requests_holder);
+  core_lock = xSemaphoreCreateMutexStatic(&core_lock_storage);
+
+  ESP_ERROR_CHECK(clemsa_codegen_init(&generator, RF_ANTENNA_GPIO));
+
+  generator.done_callback = clemsa_codegen_tx_cb;
+  tx.repetition_count = 10;
+  tx.code_len = CLEMSA_CODEGEN_DEFAULT_CODE_SIZE;
+
+  xTaskCreatePinnedToCore
+    (
+     transmission_task,
+     "Transmission task",
+     4*1024, NULL, tskIDLE_PRIORITY + 1, &tx_task, 1);
+}
+
+void rf_core_send_signal(const struct rf_requester* requester, uint32_t signal_id) {
+  struct rf_core_request req = {
+    .requester = *requester,
+    .signal = rf_signal_by_id(signal_id),
+  };
+
+  if (req.signal == NULL) {
+    RF_LOGE("Unknown stored signal requested to be sent: %" PRIu32, signal_id);
+    rf_core_notify_result(requester, RF_SEND_UNKNOWN_SIGNAL);
+    return;
+  }
+
+  xSemaphoreTake(core_lock, portMAX_DELAY);
+  if (queue_depth >= RF_CORE_QUEUE_LEN) {
+    xSemaphoreGive(core_lock);
+    rf_core_notify_result(requester, RF_SEND_BUSY);
+    return;
+  }
+
+  queue_depth++;
+  if (queue_depth == 1) {
+    rf_antenna_notify(true);
+  }
+  rf_core_notify_result(requester, RF_SEND_PROCESSING);
+
+  // Never full, as queue_depth counts every request in it
+  xQueueSend(queue_tx_requests_handle, &req, 0);
+  xSemaphoreGive(core_lock);
+}
@@ -0,0 +1,72 @@
+#ifndef RFCORE_H
+#define RFCORE_H
+
+#include <stdbool.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "../rfsignals.h"
+
+/* Transmit core shared by every front-end. Front-ends (BLE, SPP, ...)
+   turn the requests of their transport into rf_core_send_signal()
+   calls, and report the results back in their own format from their
+   on_result callback. Each front-end needs its own Bluetooth host, so
+   a build registers one, chosen in Kconfig. Requests are queued and
+   sent one after the other, and a request made while the queue is
+   full is answered with RF_SEND_BUSY. */
+
+/* Max number of requests accepted and not completed yet, including
+   the one being sent */
+#define RF_CORE_QUEUE_LEN 4
+
+typedef enum {
+  RF_SEND_PROCESSING = 1,
+  RF_SEND_BUSY = 2,
+  RF_SEND_COMPLETED = 3,
+  RF_SEND_UNKNOWN_SIGNAL = 4,
+} rf_send_result_t;
+
+/** The origin of a send rf request, which will get its result
+    notified */
+struct rf_requester {
+  /** Connection of the requester in its front-end, if any */
+  uint32_t conn;
+
+  /** Whether the request carries an id to be sent back with the
+      results */
+  bool has_req_id;
+  uint8_t req_id;
+};
+
+struct rf_frontend {
+  const char* name;
+
+  /** Called with each result of every request, so the front-end can
+      publish the state of the antenna to all its peers. Called from
+      the task of the requester, or from the tx task. Optional. */
+  void (*on_result)(const struct rf_requester* requester, rf_send_result_t result);
+
+  /** Called when the antenna becomes busy or free. Optional. */
+  void (*on_antenna_state)(bool busy);
+};
+
+/** Sets up the transmitters and starts the tx task */
+void rf_core_init(void);
+
+/** Sets the front-end, which will get notified of the results of
+    every request from then on. Fails if one is set already. */
+esp_err_t rf_core_register_frontend(const struct rf_frontend* frontend);
+
+/** Queues sending the given stored signal. The progress is reported
+    to the front-ends, starting with RF_SEND_PROCESSING once queued, or
+    RF_SEND_BUSY or RF_SEND_UNKNOWN_SIGNAL if the request is
+    rejected. */
+void rf_core_send_signal(const struct rf_requester* requester, uint32_t signal_id);
+
+/** Whether any request is queued or being sent */
+bool rf_antenna_is_busy(void);
+
+/** Returns the number of requests accepted and not completed yet. It
+    is up to date when read from the callbacks of the front-ends. */
+uint32_t rf_core_queue_depth(void);
+
+#endif
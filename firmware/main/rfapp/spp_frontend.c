@@ -0,0 +1,149 @@
+#include "rfapp.h"
+#include "sdkconfig.h"
+
+#if CONFIG_RFAPP_FRONTEND_SPP
+#include <inttypes.h>
+#include <string.h>
+#include "freertos/queue.h"
+#include "../bluetooth/bt_spp_bluedroid.h"
+
+#define SPP_RECV_QUEUE_LEN 10
+
+/* Time a response waits for a free send buffer before being dropped.
+   Kept short, as completions are reported from the tx task. */
+#define SPP_SEND_TIMEOUT_MS 100
+
+#define CMD_NOP "nop"
+
+#define CMD_RESP_ERR_INV_CMD "ERR_INV_CMD"
+#define CMD_RESP_ERR_BUSY "ERR_BUSY"
+#define CMD_RESP_OK "OK"
+
+static void rf_spp_on_result(const struct rf_requester* requester, rf_send_result_t result);
+
+static const struct rf_frontend rf_spp_frontend = {
+  .name = "SPP",
+  .on_result = rf_spp_on_result,
+};
+
+DECL_STATIC_QUEUE(spp_recv, sizeof(struct bt_spp_bluedroid_msg_event), SPP_RECV_QUEUE_LEN);
+static QueueHandle_t queue_spp_recv_handle;
+
+DECL_STATIC_TASK(spp_frontend, 4096);
+
+static esp_err_t rf_spp_send_string(uint32_t handle, const char* text) {
+  struct bt_spp_bluedroid_send_msg* msg;
+  size_t len = strlen(text);
+  esp_err_t err;
+
+  if (len + 1 > BT_SPP_PEER_SEND_BUFFER_SIZE) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  msg = bt_spp_send_alloc(pdMS_TO_TICKS(SPP_SEND_TIMEOUT_MS));
+  if (msg == NULL) {
+    RF_LOGE("No SPP send buffer got free in time. Dropping response: %s", text);
+    return ESP_ERR_TIMEOUT;
+  }
+
+  memcpy(msg->buffer, text, len);
+  msg->buffer[len] = '\n'; // Will add an extra new line to finish the message.
+  msg->data_len = len + 1;
+  msg->handle = handle;
+
+  err = bt_spp_send_msg(msg);
+  if (err != ESP_OK) {
+    RF_LOGE("Cannot send SPP response %s: %s", text, esp_err_to_name(err));
+  }
+
+  return err;
+}
+
+static void rf_spp_on_result(const struct rf_requester* requester, rf_send_result_t result) {
+  switch (result) {
+  case RF_SEND_COMPLETED:
+    rf_spp_send_string(requester->conn, CMD_RESP_OK);
+    break;
+  case RF_SEND_BUSY:
+    rf_spp_send_string(requester->conn, CMD_RESP_ERR_BUSY);
+    break;
+  case RF_SEND_UNKNOWN_SIGNAL:
+    rf_spp_send_string(requester->conn, CMD_RESP_ERR_INV_CMD);
+    break;
+  case RF_SEND_PROCESSING:
+    break;
+  }
+}
+
+// Looks up the signal of a command, which is only copied if it wraps
+// around the reception ring
+static const struct rf_signal* rf_spp_find_signal(const struct bt_spp_bluedroid_msg_event* evt) {
+  struct bt_spp_slice slice;
+  char cmd[RF_SIGNALS_CMD_MAX_LEN];
+
+  bt_spp_msg_slice(evt, &slice);
+  if (slice.len[1] == 0) {
+    return rf_signal_by_cmd(slice.data[0], slice.len[0]);
+  }
+
+  if (evt->data_len > sizeof(cmd)) {
+    return NULL;
+  }
+
+  memcpy(cmd, slice.data[0], slice.len[0]);
+  memcpy(cmd + slice.len[0], slice.data[1], slice.len[1]);
+  return rf_signal_by_cmd(cmd, evt->data_len);
+}
+
+static void task_spp_frontend(void* arg) {
+  struct bt_spp_bluedroid_msg_event evt;
+  struct rf_requester requester = { 0 };
+  const struct rf_signal* signal;
+
+  while (1) {
+    xQueueReceive(queue_spp_recv_handle, &evt, portMAX_DELAY);
+
+    if (bt_spp_msg_equals(&evt, CMD_NOP)) {
+      // Do nothing, just for check if the connection is still alive.
+    } else if ((signal = rf_spp_find_signal(&evt)) != NULL) {
+      RF_LOGI("SPP peer %" PRIu32 " requested sending %s", evt.handle, signal->cmd);
+      requester.conn = evt.handle;
+      rf_core_send_signal(&requester, signal->id);
+    } else {
+      RF_LOGW("Received unknown SPP command");
+      rf_spp_send_string(evt.handle, CMD_RESP_ERR_INV_CMD);
+    }
+
+    bt_spp_msg_release(&evt);
+  }
+}
+
+void init_spp_frontend(void) {
+  struct bt_spp_bluedroid_config config;
+
+  queue_spp_recv_handle = xQueueCreateStatic
+    (queue_spp_recv_max_item_count,
+     queue_spp_recv_item_size,
+     queue_spp_recv_storage,
+     &queue_spp_recv_holder);
+
+  ESP_ERROR_CHECK(rf_core_register_frontend(&rf_spp_frontend));
+
+  xTaskCreateStaticPinnedToCore
+    (
+     task_spp_frontend,
+     "SPP front-end task",
+     task_spp_frontend_stack_size,
+     NULL,
+     tskIDLE_PRIORITY + 1,
+     task_spp_frontend_stack,
+     &task_spp_frontend_storage,
+     0);
+
+  config.recv_queue = queue_spp_recv_handle;
+  bt_spp_bluedroid_init(&config);
+}
+#else
+void init_spp_frontend(void) {
+}
+#endif
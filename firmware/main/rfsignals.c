@@ -0,0 +1,54 @@
+#include "rfsignals.h"
+#include <string.h>
+#include "private.h"
+
+#define RF_SIGNAL_CHECK_ID(id, name, cmd, tx_type, code, desc)		\
+  _Static_assert((id) > 0 && (id) <= RF_SIGNALS_MAX_ID, "Signal id out of range: " #name); \
+  _Static_assert(sizeof(cmd) - 1 <= RF_SIGNALS_CMD_MAX_LEN, "Signal command too long: " #name);
+RF_STORED_SIGNALS(RF_SIGNAL_CHECK_ID)
+#undef RF_SIGNAL_CHECK_ID
+
+/* Duplicated ids fail to build, as duplicated case labels */
+#define RF_SIGNAL_CASE(id, name, cmd, tx_type, code, desc) case id:
+static void __attribute__((unused)) rf_signal_check_unique_ids(uint32_t id) {
+  switch (id) {
+    RF_STORED_SIGNALS(RF_SIGNAL_CASE)
+    break;
+  }
+}
+#undef RF_SIGNAL_CASE
+
+/* Indexed by id, so binary ids are looked up directly */
+#define RF_SIGNAL_ENTRY(id_, name, cmd_, tx_type_, code_, desc_)	\
+  [id_] = {								\
+    .id = STORED_SIGNAL_##name,						\
+    .tx_type = tx_type_,						\
+    .cmd_len = sizeof(cmd_) - 1,					\
+    .cmd = cmd_,							\
+    .code = code_,							\
+    .desc = desc_,							\
+  },
+static const struct rf_signal signals[RF_SIGNALS_MAX_ID + 1] = {
+  RF_STORED_SIGNALS(RF_SIGNAL_ENTRY)
+};
+#undef RF_SIGNAL_ENTRY
+
+const struct rf_signal* rf_signal_by_id(uint32_t id) {
+  if (id > RF_SIGNALS_MAX_ID || signals[id].cmd == NULL) {
+    return NULL;
+  }
+
+  return &signals[id];
+}
+
+const struct rf_signal* rf_signal_by_cmd(const char* cmd, size_t len) {
+  // A handful of signals, told apart by their length before comparing
+  // any text
+  for (size_t i = 1; i <= RF_SIGNALS_MAX_ID; i++) {
+    if (signals[i].cmd != NULL && signals[i].cmd_len == len && memcmp(signals[i].cmd, cmd, len) == 0) {
+      return &signals[i];
+    }
+  }
+
+  return NULL;
+}
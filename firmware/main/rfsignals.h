@@ -0,0 +1,60 @@
+#ifndef RFSIGNALS_H
+#define RFSIGNALS_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* Stored signals that can be requested to be sent, by any transport.
+   Each entry is:
+
+     X(id, name, text command, tx type, Clemsa code, description)
+
+   The id is the binary identifier used over BLE, and must be unique
+   and no greater than RF_SIGNALS_MAX_ID. The text command is the one
+   used over SPP. The Clemsa code is only used for signals with the
+   TX_TYPE_CLEMSA_CODEGEN tx type. */
+#define RF_STORED_SIGNALS(X)						\
+  X(1, HOME_GARAGE_EXIT, "home-garage-exit", TX_TYPE_CLEMSA_CODEGEN,	\
+    HOME_GARAGE_EXIT_CODE, "Home Exit Garage")				\
+  X(2, HOME_GARAGE_ENTER, "home-garage-enter", TX_TYPE_CLEMSA_CODEGEN,	\
+    HOME_GARAGE_ENTER_CODE, "Home Enter Garage")			\
+  X(3, PARENTS_GARAGE_LEFT, "parents-garage-left", TX_TYPE_CLEMSA_CODEGEN, \
+    PARENTS_GARAGE_ENTER_CODE, "Parents Enter Garage")			\
+  X(4, PARENTS_GARAGE_RIGHT, "parents-garage-right", TX_TYPE_CLEMSA_CODEGEN, \
+    PARENTS_GARAGE_EXIT_CODE, "Parents Exit Garage")			\
+  X(5, TESLA_CHARGER_DOOR_OPEN, "tesla-charger-door-open", TX_TYPE_TESLA_CHARGER_OPEN, \
+    NULL, "Tesla Charger Door Open")
+
+#define RF_SIGNALS_MAX_ID 5
+#define RF_SIGNALS_CMD_MAX_LEN 32
+
+typedef enum {
+#define RF_SIGNAL_ENUM(id, name, cmd, tx_type, code, desc) STORED_SIGNAL_##name = id,
+  RF_STORED_SIGNALS(RF_SIGNAL_ENUM)
+#undef RF_SIGNAL_ENUM
+} rf_stored_signal_t;
+
+typedef enum __attribute__((packed)) {
+  TX_TYPE_CLEMSA_CODEGEN = 1,
+  TX_TYPE_TESLA_CHARGER_OPEN = 2
+} tx_type_t;
+
+struct rf_signal {
+  rf_stored_signal_t id;
+  tx_type_t tx_type;
+  uint8_t cmd_len;
+  const char* cmd;
+  const bool* code;
+  const char* desc;
+};
+
+/** Returns the signal with the given binary id, or NULL if there is
+    none */
+const struct rf_signal* rf_signal_by_id(uint32_t id);
+
+/** Returns the signal with the given text command, which doesn't need
+    to be NUL terminated, or NULL if there is none */
+const struct rf_signal* rf_signal_by_cmd(const char* cmd, size_t len);
+
+#endif
@@ -0,0 +1,218 @@
+#include "sigindex.h"
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include "clemsacode_defs.h"
+
+#define SIGINDEX_FNV_OFFSET_BASIS 2166136261u
+#define SIGINDEX_FNV_PRIME 16777619u
+
+/* Duration of each half period of the Clemsa ASK carrier */
+#define SIGINDEX_CLEMSA_ASK_HALF_PERIOD_US (1000000 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY)
+
+/* Max number of ASK ticks that fit in the high section of a base
+   clock cycle. Digits with more ticks are cut at the falling edge of
+   the base clock. */
+#define SIGINDEX_CLEMSA_WINDOW_TICKS \
+  (CLEMSA_CODEGEN_CLK_HIGH_COUNT / SIGINDEX_CLEMSA_ASK_HALF_PERIOD_US)
+
+#define SIGINDEX_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* Expected time the output stays high during the burst of each digit */
+#define SIGINDEX_CLEMSA_ZERO_HIGH_US                                           \
+  (((SIGINDEX_MIN(CLEMSA_CODEGEN_ASK_TICKS_ZERO, SIGINDEX_CLEMSA_WINDOW_TICKS) + 1) / 2) * \
+   SIGINDEX_CLEMSA_ASK_HALF_PERIOD_US)
+#define SIGINDEX_CLEMSA_ONE_HIGH_US                                            \
+  (((SIGINDEX_MIN(CLEMSA_CODEGEN_ASK_TICKS_ONE, SIGINDEX_CLEMSA_WINDOW_TICKS) + 1) / 2) * \
+   SIGINDEX_CLEMSA_ASK_HALF_PERIOD_US)
+
+/* Bursts with more high time than this are ones, zeros otherwise */
+#define SIGINDEX_CLEMSA_DIGIT_THRESHOLD_US \
+  ((SIGINDEX_CLEMSA_ZERO_HIGH_US + SIGINDEX_CLEMSA_ONE_HIGH_US) / 2)
+
+/* A low section longer than this terminates an ASK burst */
+#define SIGINDEX_CLEMSA_BURST_GAP_US (3 * SIGINDEX_CLEMSA_ASK_HALF_PERIOD_US)
+
+/* A high section longer than this is a pulse of the sync signal */
+#define SIGINDEX_CLEMSA_SYNC_HIGH_US (CLEMSA_CODEGEN_CLK_HIGH_COUNT / 2)
+
+/* A low section longer than this separates two code repetitions */
+#define SIGINDEX_CLEMSA_REPETITION_GAP_US \
+  (2 * (CLEMSA_CODEGEN_CLK_HIGH_COUNT + CLEMSA_CODEGEN_CLK_LOW_COUNT))
+
+#if SIGINDEX_CLEMSA_ZERO_HIGH_US >= SIGINDEX_CLEMSA_ONE_HIGH_US
+#error "Clemsa zero and one digits cannot be told apart by their burst length"
+#endif
+
+struct sigindex_hasher {
+  uint32_t hash;
+  uint8_t pending;
+  size_t bits;
+};
+
+static void sigindex_hasher_begin(struct sigindex_hasher* hasher, uint8_t protocol) {
+  hasher->hash = (SIGINDEX_FNV_OFFSET_BASIS ^ protocol) * SIGINDEX_FNV_PRIME;
+  hasher->pending = 0;
+  hasher->bits = 0;
+}
+
+static void sigindex_hasher_add_bit(struct sigindex_hasher* hasher, bool bit) {
+  hasher->pending = (hasher->pending << 1) | (bit ? 1 : 0);
+  if ((++hasher->bits & 0x7) == 0) {
+    hasher->hash = (hasher->hash ^ hasher->pending) * SIGINDEX_FNV_PRIME;
+    hasher->pending = 0;
+  }
+}
+
+static void sigindex_hasher_end(struct sigindex_hasher* hasher, uint8_t protocol,
+				struct sigindex_fingerprint* fingerprint) {
+  uint32_t hash = hasher->hash;
+
+  if ((hasher->bits & 0x7) != 0) {
+    hash = (hash ^ hasher->pending) * SIGINDEX_FNV_PRIME;
+  }
+
+  // The bit count is part of the hash, so codes that only differ in
+  // trailing zeros don't collide.
+  hash = (hash ^ (hasher->bits & 0xff)) * SIGINDEX_FNV_PRIME;
+  hash = (hash ^ ((hasher->bits >> 8) & 0xff)) * SIGINDEX_FNV_PRIME;
+
+  fingerprint->protocol = protocol;
+  fingerprint->bit_count = (uint16_t) hasher->bits;
+  fingerprint->hash = hash;
+}
+
+static bool sigindex_fingerprint_eq(const struct sigindex_fingerprint* a,
+				    const struct sigindex_fingerprint* b) {
+  return a->hash == b->hash && a->protocol == b->protocol && a->bit_count == b->bit_count;
+}
+
+void sigindex_init(struct sigindex* index) {
+  memset(index, 0, sizeof(struct sigindex));
+}
+
+void sigindex_fingerprint_bits(uint8_t protocol, const bool* bits, size_t bit_count,
+			       struct sigindex_fingerprint* fingerprint) {
+  struct sigindex_hasher hasher;
+
+  sigindex_hasher_begin(&hasher, protocol);
+  for (size_t i = 0; i < bit_count; i++) {
+    sigindex_hasher_add_bit(&hasher, bits[i]);
+  }
+  sigindex_hasher_end(&hasher, protocol, fingerprint);
+}
+
+void sigindex_fingerprint_bytes(uint8_t protocol, const uint8_t* bytes, size_t bit_count,
+				struct sigindex_fingerprint* fingerprint) {
+  struct sigindex_hasher hasher;
+
+  sigindex_hasher_begin(&hasher, protocol);
+  for (size_t i = 0; i < bit_count; i++) {
+    sigindex_hasher_add_bit(&hasher, (bytes[i / 8] >> (7 - (i % 8))) & 0x1);
+  }
+  sigindex_hasher_end(&hasher, protocol, fingerprint);
+}
+
+esp_err_t sigindex_fingerprint_clemsa_capture(const struct pulsetrain_pulse* pulses, size_t count,
+					      size_t code_len,
+					      struct sigindex_fingerprint* fingerprint) {
+  struct sigindex_hasher hasher;
+  uint32_t burst_high_us = 0;
+  bool synced = false;
+
+  sigindex_hasher_begin(&hasher, SIGINDEX_PROTO_CLEMSA);
+
+  for (size_t i = 0; i < count; i++) {
+    const struct pulsetrain_pulse* pulse = &pulses[i];
+
+    if (pulse->level) {
+      if (pulse->duration_us >= SIGINDEX_CLEMSA_SYNC_HIGH_US) {
+	// Sync pulse. Digits start after it.
+	sigindex_hasher_begin(&hasher, SIGINDEX_PROTO_CLEMSA);
+	burst_high_us = 0;
+	synced = true;
+      } else {
+	burst_high_us += pulse->duration_us;
+      }
+      continue;
+    }
+
+    if (pulse->duration_us < SIGINDEX_CLEMSA_BURST_GAP_US) {
+      continue;
+    }
+
+    // End of an ASK burst, if any.
+    if (synced && burst_high_us > 0) {
+      sigindex_hasher_add_bit(&hasher, burst_high_us > SIGINDEX_CLEMSA_DIGIT_THRESHOLD_US);
+
+      if (hasher.bits == code_len) {
+	sigindex_hasher_end(&hasher, SIGINDEX_PROTO_CLEMSA, fingerprint);
+	return ESP_OK;
+      }
+    }
+    burst_high_us = 0;
+
+    if (pulse->duration_us >= SIGINDEX_CLEMSA_REPETITION_GAP_US) {
+      // Either the gap before the first code or between two
+      // repetitions: a complete code starts after it, even if the
+      // capture missed the sync signal.
+      sigindex_hasher_begin(&hasher, SIGINDEX_PROTO_CLEMSA);
+      synced = true;
+    }
+  }
+
+  return ESP_ERR_NOT_FOUND;
+}
+
+esp_err_t sigindex_insert(struct sigindex* index, const struct sigindex_fingerprint* fingerprint,
+			  uint32_t signal_id) {
+  size_t slot = fingerprint->hash & (SIGINDEX_CAPACITY - 1);
+
+  for (size_t probe = 0; probe < SIGINDEX_CAPACITY; probe++) {
+    struct sigindex_entry* entry = &index->entries[slot];
+
+    if (!entry->used) {
+      // Keep at least a free slot so lookups of unknown signals
+      // always terminate on an empty slot.
+      if (index->count >= SIGINDEX_CAPACITY - 1) {
+	return ESP_ERR_NO_MEM;
+      }
+
+      entry->fingerprint = *fingerprint;
+      entry->signal_id = signal_id;
+      entry->used = true;
+      index->count++;
+      return ESP_OK;
+    }
+
+    if (sigindex_fingerprint_eq(&entry->fingerprint, fingerprint)) {
+      return ESP_ERR_INVALID_STATE;
+    }
+
+    slot = (slot + 1) & (SIGINDEX_CAPACITY - 1);
+  }
+
+  return ESP_ERR_NO_MEM;
+}
+
+esp_err_t sigindex_lookup(const struct sigindex* index, const struct sigindex_fingerprint* fingerprint,
+			  uint32_t* signal_id) {
+  size_t slot = fingerprint->hash & (SIGINDEX_CAPACITY - 1);
+
+  for (size_t probe = 0; probe < SIGINDEX_CAPACITY; probe++) {
+    const struct sigindex_entry* entry = &index->entries[slot];
+
+    if (!entry->used) {
+      return ESP_ERR_NOT_FOUND;
+    }
+
+    if (sigindex_fingerprint_eq(&entry->fingerprint, fingerprint)) {
+      *signal_id = entry->signal_id;
+      return ESP_OK;
+    }
+
+    slot = (slot + 1) & (SIGINDEX_CAPACITY - 1);
+  }
+
+  return ESP_ERR_NOT_FOUND;
+}
@@ -0,0 +1,79 @@
+#ifndef SIGINDEX_H
+#define SIGINDEX_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "esp_err.h"
+#include "pulsetrain.h"
+
+/* Number of slots of the index. Must be a power of two, and should be
+   at least twice the number of signals stored in order to keep probe
+   sequences short. */
+#define SIGINDEX_CAPACITY 32
+
+#if (SIGINDEX_CAPACITY & (SIGINDEX_CAPACITY - 1)) != 0
+#error "SIGINDEX_CAPACITY must be a power of two"
+#endif
+
+typedef enum {
+  SIGINDEX_PROTO_CLEMSA = 1,
+  SIGINDEX_PROTO_TESLA_CHARGER = 2
+} sigindex_proto_t;
+
+/* Identifies a signal by its protocol and the bits of its payload,
+   regardless of the timing of the waveform that carried it. */
+struct sigindex_fingerprint {
+  uint8_t protocol;
+  uint16_t bit_count;
+  uint32_t hash;
+};
+
+struct sigindex_entry {
+  struct sigindex_fingerprint fingerprint;
+  uint32_t signal_id;
+  bool used;
+};
+
+struct sigindex {
+  struct sigindex_entry entries[SIGINDEX_CAPACITY];
+  size_t count;
+};
+
+void sigindex_init(struct sigindex* index);
+
+/** Computes the fingerprint of a payload given as one bool per bit */
+void sigindex_fingerprint_bits(uint8_t protocol, const bool* bits, size_t bit_count,
+			       struct sigindex_fingerprint* fingerprint);
+
+/** Computes the fingerprint of a payload given as packed bits, MSB first */
+void sigindex_fingerprint_bytes(uint8_t protocol, const uint8_t* bytes, size_t bit_count,
+				struct sigindex_fingerprint* fingerprint);
+
+/**
+ * Recovers the first complete code of code_len digits carried by a
+ * captured Clemsa waveform and computes its fingerprint. Digits are
+ * classified by the length of their ASK bursts, so jitter on
+ * individual edges does not change the result. Returns
+ * ESP_ERR_NOT_FOUND if the capture does not contain a complete code.
+ */
+esp_err_t sigindex_fingerprint_clemsa_capture(const struct pulsetrain_pulse* pulses, size_t count,
+					      size_t code_len,
+					      struct sigindex_fingerprint* fingerprint);
+
+/**
+ * Adds a signal to the index. Returns ESP_ERR_INVALID_STATE if a
+ * signal with the same fingerprint is already indexed, and
+ * ESP_ERR_NO_MEM if the index is full.
+ */
+esp_err_t sigindex_insert(struct sigindex* index, const struct sigindex_fingerprint* fingerprint,
+			  uint32_t signal_id);
+
+/**
+ * Looks up the signal with the given fingerprint. Returns
+ * ESP_ERR_NOT_FOUND if there's no such signal.
+ */
+esp_err_t sigindex_lookup(const struct sigindex* index, const struct sigindex_fingerprint* fingerprint,
+			  uint32_t* signal_id);
+
+#endif /* SIGINDEX_H */
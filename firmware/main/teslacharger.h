@@ -2,7 +2,12 @@
 #define TESLACHARGER_H
 
 #include "driver/gpio.h"
+#include <stddef.h>
+#include <stdint.h>
 
 void tesla_charger_open_door_sync(gpio_num_t gpio);
 
+/** Returns the payload of the door open signal, storing its length in bytes into len */
+const uint8_t* tesla_charger_door_payload(size_t* len);
+
 #endif
@@ -0,0 +1,17 @@
+#ifndef TESLACHARGER_DEFS_H
+#define TESLACHARGER_DEFS_H
+
+/* Timing of the Tesla charger door signal. This file has no
+   dependencies on ESP-IDF, so host tools can check captures against
+   it. */
+
+// Ref: https://github.com/rgerganov/tesla-opener
+#define TESLA_CHARGER_BIT_RATE_SECOND 2500
+#define TESLA_CHARGER_SIGNAL_PERIOD_US (1000000 / TESLA_CHARGER_BIT_RATE_SECOND)
+#define TESLA_CHARGER_DISTANCE_BETWEEN_REPETITIONS_US 23000
+#define TESLA_CHARGER_NUM_REPETITIONS 5
+
+/* Length in bytes of the door open payload, sent on each repetition */
+#define TESLA_CHARGER_PAYLOAD_LEN 43
+
+#endif /* TESLACHARGER_DEFS_H */
@@ -0,0 +1,70 @@
+#include <stdbool.h>
+#include <stdint.h>
+#include "ulp_riscv.h"
+#include "ulp_riscv_utils.h"
+#include "ulp_riscv_gpio.h"
+#include "soc/rtc_cntl_reg.h"
+#include "rfplayer.h"
+#include "../pulsetrain.h"
+
+/* ULP-RISC-V program that plays an encoded pulse train (see
+   pulsetrain.h) on an RTC GPIO, and wakes up and interrupts the main
+   processor once done. */
+
+/* Longest wait against a single deadline. Deadlines are compared as
+   signed differences of the 32 bit cycle counter, so longer pulses are
+   waited for in several steps. */
+#define RFPLAYER_MAX_WAIT_CYCLES 0x40000000u
+
+/* Set by the main processor before starting the ULP. Cycles per
+   microsecond are in 24.8 fixed point, since the ULP has no FPU, and
+   the nominal ones are used if 0. */
+uint32_t gpio_num;
+uint32_t cycles_per_us_fp8;
+uint32_t timeline_len;
+uint8_t timeline[RFPLAYER_MAX_TIMELINE_LEN];
+
+/* Set by the ULP once the whole pulse train has been played */
+volatile uint32_t done;
+volatile int32_t status;
+
+static void wait_until(uint32_t deadline) {
+  while ((int32_t) (deadline - ulp_riscv_get_cpu_cycles()) > 0);
+}
+
+int main(void) {
+  struct pulsetrain_reader reader;
+  struct pulsetrain_pulse pulse;
+  pulsetrain_status_t rc;
+  uint32_t deadline;
+  uint32_t fp8 = cycles_per_us_fp8 != 0 ? cycles_per_us_fp8 : RFPLAYER_NOMINAL_CYCLES_PER_US_FP8;
+  uint64_t cycles;
+
+  rc = pulsetrain_reader_init(&reader, timeline, timeline_len);
+  if (rc == PULSETRAIN_OK) {
+    // Edges are scheduled against absolute deadlines, so the time
+    // spent decoding the train doesn't accumulate as drift.
+    deadline = ulp_riscv_get_cpu_cycles();
+    while ((rc = pulsetrain_read(&reader, &pulse)) == PULSETRAIN_OK) {
+      ulp_riscv_gpio_output_level(gpio_num, pulse.level);
+      cycles = ((uint64_t) pulse.duration_us * fp8) >> 8;
+      while (cycles > RFPLAYER_MAX_WAIT_CYCLES) {
+	deadline += RFPLAYER_MAX_WAIT_CYCLES;
+	cycles -= RFPLAYER_MAX_WAIT_CYCLES;
+	wait_until(deadline);
+      }
+      deadline += (uint32_t) cycles;
+      wait_until(deadline);
+    }
+  }
+
+  ulp_riscv_gpio_output_level(gpio_num, 0);
+  status = rc;
+  done = 1;
+
+  // Don't let the ULP timer run the player again.
+  ulp_riscv_timer_stop();
+  SET_PERI_REG_MASK(RTC_CNTL_COCPU_CTRL_REG, RTC_CNTL_COCPU_SW_INT_TRIGGER);
+  ulp_riscv_wakeup_main_processor();
+  return 0;
+}
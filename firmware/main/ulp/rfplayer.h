@@ -0,0 +1,20 @@
+#ifndef RFPLAYER_H
+#define RFPLAYER_H
+
+/* Definitions shared between the ULP-RISC-V waveform player and the
+   main processor */
+
+/* Max length of the encoded pulse train that the player can hold in
+   RTC memory */
+#define RFPLAYER_MAX_TIMELINE_LEN 3072
+
+/* The ULP runs from RC_FAST, whose frequency varies by several percent
+   between chips and with temperature. These are its nominal frequency
+   and the matching cycles of the ULP per microsecond (as
+   ULP_RISCV_CYCLES_PER_US), in 24.8 fixed point. The main processor
+   scales the latter by the measured frequency before starting the
+   player. */
+#define RFPLAYER_NOMINAL_CLOCK_HZ 17500000
+#define RFPLAYER_NOMINAL_CYCLES_PER_US_FP8 2176 /* 8.5 */
+
+#endif /* RFPLAYER_H */
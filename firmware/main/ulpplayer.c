@@ -0,0 +1,136 @@
+#include "ulpplayer.h"
+#include "sdkconfig.h"
+
+#if CONFIG_RFAPP_ULP_PLAYER
+#include <string.h>
+#include "driver/rtc_io.h"
+#include "esp_attr.h"
+#include "esp_sleep.h"
+#include "freertos/task.h"
+#include "soc/rtc.h"
+#include "ulp_riscv.h"
+#include "ulp_rfplayer.h"
+#include "pulsetrain.h"
+
+extern const uint8_t ulp_rfplayer_bin_start[] asm("_binary_ulp_rfplayer_bin_start");
+extern const uint8_t ulp_rfplayer_bin_end[]   asm("_binary_ulp_rfplayer_bin_end");
+
+/* Cycles of the slow clock over which RC_FAST is measured */
+#define ULP_PLAYER_CAL_CYCLES 100
+
+/** Task waiting for the ULP to finish playing */
+static TaskHandle_t waiting_task;
+static bool isr_registered = false;
+
+// Raised by the ULP once done. When the main processor was in light
+// sleep, the ULP wake up resumes it first, and the interrupt is
+// served right after.
+static void IRAM_ATTR ulp_player_isr(void* arg) {
+  BaseType_t woken = pdFALSE;
+
+  vTaskNotifyGiveFromISR(waiting_task, &woken);
+  if (woken) {
+    portYIELD_FROM_ISR();
+  }
+}
+
+// Measures RC_FAST, the clock of the ULP, against the crystal, so the
+// pulses are only off by the error of the measurement (well under 1%)
+// instead of by the spread of RC_FAST around its nominal frequency.
+static uint32_t ulp_player_cycles_per_us_fp8(void) {
+  // Period of RC_FAST / 256 in microseconds, in Q13.19
+  uint32_t period = rtc_clk_cal(RTC_CAL_8MD256, ULP_PLAYER_CAL_CYCLES);
+  uint64_t freq_hz;
+
+  if (period == 0) {
+    return RFPLAYER_NOMINAL_CYCLES_PER_US_FP8;
+  }
+
+  freq_hz = ((uint64_t) 256 * 1000000 << 19) / period;
+  return (uint32_t) (RFPLAYER_NOMINAL_CYCLES_PER_US_FP8 * freq_hz / RFPLAYER_NOMINAL_CLOCK_HZ);
+}
+
+esp_err_t ulp_player_begin(gpio_num_t gpio, const uint8_t* timeline, size_t len) {
+  esp_err_t err;
+
+  if (!rtc_gpio_is_valid_gpio(gpio)) {
+    return ESP_ERR_NOT_SUPPORTED;
+  }
+
+  if (len > RFPLAYER_MAX_TIMELINE_LEN) {
+    return ESP_ERR_INVALID_SIZE;
+  }
+
+  if (!isr_registered) {
+    if ((err = ulp_riscv_isr_register(ulp_player_isr, NULL, ULP_RISCV_SW_INT)) != ESP_OK) {
+      return err;
+    }
+    isr_registered = true;
+  }
+
+  err = ulp_riscv_load_binary(ulp_rfplayer_bin_start, ulp_rfplayer_bin_end - ulp_rfplayer_bin_start);
+  if (err != ESP_OK) {
+    return err;
+  }
+
+  memcpy(&ulp_timeline, timeline, len);
+  ulp_timeline_len = len;
+  ulp_gpio_num = rtc_io_number_get(gpio);
+  ulp_cycles_per_us_fp8 = ulp_player_cycles_per_us_fp8();
+  ulp_done = 0;
+  ulp_status = 0;
+  waiting_task = xTaskGetCurrentTaskHandle();
+  ulTaskNotifyTake(pdTRUE, 0);
+
+  if ((err = rtc_gpio_init(gpio)) != ESP_OK ||
+      (err = rtc_gpio_set_direction(gpio, RTC_GPIO_MODE_OUTPUT_ONLY)) != ESP_OK ||
+      (err = rtc_gpio_set_level(gpio, 0)) != ESP_OK) {
+    return err;
+  }
+
+  // The ULP wakes up the main processor once done, in case it went to
+  // light sleep meanwhile.
+  if ((err = esp_sleep_enable_ulp_wakeup()) != ESP_OK) {
+    rtc_gpio_deinit(gpio);
+    return err;
+  }
+
+  if ((err = ulp_riscv_run()) != ESP_OK) {
+    rtc_gpio_deinit(gpio);
+  }
+
+  return err;
+}
+
+esp_err_t ulp_player_wait(TickType_t timeout) {
+  if (ulTaskNotifyTake(pdTRUE, timeout) == 0 && ulp_done == 0) {
+    return ESP_ERR_TIMEOUT;
+  }
+
+  return ESP_OK;
+}
+
+esp_err_t ulp_player_end(gpio_num_t gpio) {
+  ulp_riscv_timer_stop();
+  rtc_gpio_deinit(gpio);
+  gpio_set_direction(gpio, GPIO_MODE_OUTPUT);
+  gpio_set_level(gpio, 0);
+
+  return (int32_t) ulp_status == PULSETRAIN_DONE ? ESP_OK : ESP_FAIL;
+}
+
+#else
+
+esp_err_t ulp_player_begin(gpio_num_t gpio, const uint8_t* timeline, size_t len) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t ulp_player_wait(TickType_t timeout) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+esp_err_t ulp_player_end(gpio_num_t gpio) {
+  return ESP_ERR_NOT_SUPPORTED;
+}
+
+#endif
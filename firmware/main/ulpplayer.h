@@ -0,0 +1,42 @@
+#ifndef ULPPLAYER_H
+#define ULPPLAYER_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include "driver/gpio.h"
+#include "esp_err.h"
+#include "freertos/FreeRTOS.h"
+#include "ulp/rfplayer.h"
+
+/**
+ * Starts playing the given encoded pulse train (see pulsetrain.h) on
+ * gpio from the ULP-RISC-V coprocessor, so the main processor is free
+ * to sleep while the transmission is ongoing. The timeline is copied
+ * into RTC memory, so it can be reused once this function returns.
+ *
+ * The calling task is the one notified once the train is played, so
+ * it must be the one calling ulp_player_wait.
+ *
+ * Returns ESP_ERR_NOT_SUPPORTED if the player is disabled, or gpio
+ * cannot be driven by the ULP (only RTC GPIOs can), in which case
+ * the caller is expected to play the train by other means.
+ */
+esp_err_t ulp_player_begin(gpio_num_t gpio, const uint8_t* timeline, size_t len);
+
+/**
+ * Blocks until the ULP has finished playing the pulse train, which it
+ * signals through its interrupt, so the main processor stays asleep
+ * meanwhile. Returns ESP_ERR_TIMEOUT if it didn't finish within
+ * timeout.
+ */
+esp_err_t ulp_player_wait(TickType_t timeout);
+
+/**
+ * Hands gpio back to the main processor once the player has
+ * finished. Returns ESP_FAIL if the ULP couldn't play the whole pulse
+ * train.
+ */
+esp_err_t ulp_player_end(gpio_num_t gpio);
+
+#endif /* ULPPLAYER_H */
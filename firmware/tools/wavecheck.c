@@ -0,0 +1,741 @@
+/* wavecheck: checks the timing of logic analyser captures of the
+   antenna pin against the constants the firmware generates the
+   waveforms from, reporting histograms of the deviations.
+
+   Captures are read in a single streaming pass, so their size is only
+   bounded by the disk. Supported input formats:
+
+     vcd     Value Change Dump, as exported by sigrok or most logic
+             analyser software. The signal is selected with -s, or the
+             first single bit signal of the dump is used.
+
+     binary  Raw samples, as exported by sigrok-cli -O binary. Needs the
+             sample rate (-r) and the channel to check (-c).
+
+   Build it on the host from the firmware directory with:
+
+     cc -O2 -Wall -o wavecheck tools/wavecheck.c -lm
+
+   Usage:
+
+     wavecheck [-p clemsa|tesla] [-f vcd|binary] [-s signal]
+               [-r sample_rate_hz] [-c channel] [-u unit_size]
+               [-n code_len] [capture|-]
+*/
+
+#include <math.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "../main/clemsacode_defs.h"
+#include "../main/teslacharger_defs.h"
+
+#define PS_PER_US 1000000ull
+
+/* Number of buckets of each histogram. The first and last ones also
+   hold every deviation beyond them. */
+#define HIST_BUCKETS 21
+#define HIST_BAR_WIDTH 50
+
+#define VCD_MAX_TOKEN_LEN 256
+#define BINARY_CHUNK_LEN 65536
+
+/* Derived Clemsa timing, in microseconds */
+#define CLEMSA_CLK_HIGH_US ((double) CLEMSA_CODEGEN_CLK_HIGH_COUNT * 1000000 / CLEMSA_CODEGEN_BASE_CLK_RESOLUTION)
+#define CLEMSA_CLK_LOW_US ((double) CLEMSA_CODEGEN_CLK_LOW_COUNT * 1000000 / CLEMSA_CODEGEN_BASE_CLK_RESOLUTION)
+#define CLEMSA_CYCLE_US (CLEMSA_CLK_HIGH_US + CLEMSA_CLK_LOW_US)
+#define CLEMSA_ASK_HALF_PERIOD_US (1000000.0 / CLEMSA_CODEGEN_ASK_CLK_FREQUENCY)
+
+/* ASK ticks that fit in the high section of the base clock. Digits
+   with more ticks are cut by its falling edge. */
+#define CLEMSA_WINDOW_TICKS ((int) (CLEMSA_CLK_HIGH_US / CLEMSA_ASK_HALF_PERIOD_US))
+#define CLEMSA_MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* High pulses of the burst of each digit. The ASK output starts low
+   and toggles on every tick. */
+#define CLEMSA_ZERO_HIGHS ((CLEMSA_MIN(CLEMSA_CODEGEN_ASK_TICKS_ZERO, CLEMSA_WINDOW_TICKS) + 1) / 2)
+#define CLEMSA_ONE_HIGHS ((CLEMSA_MIN(CLEMSA_CODEGEN_ASK_TICKS_ONE, CLEMSA_WINDOW_TICKS) + 1) / 2)
+
+/* Low sections longer than this terminate an ASK burst */
+#define CLEMSA_BURST_GAP_US (3 * CLEMSA_ASK_HALF_PERIOD_US)
+
+/* High sections longer than this are pulses of the sync signal */
+#define CLEMSA_SYNC_HIGH_US (CLEMSA_CLK_HIGH_US / 2)
+
+/* Low sections longer than this separate two Tesla frames */
+#define TESLA_FRAME_GAP_US (TESLA_CHARGER_DISTANCE_BETWEEN_REPETITIONS_US / 2)
+
+/* Low sections longer than this separate two Tesla transmissions */
+#define TESLA_TX_GAP_US (4 * TESLA_CHARGER_DISTANCE_BETWEEN_REPETITIONS_US)
+
+struct hist {
+  const char* name;
+  const char* unit;
+  double expected;
+  double bucket_width;
+
+  uint64_t count;
+  double sum;
+  double sum_sq;
+  double min;
+  double max;
+  uint64_t buckets[HIST_BUCKETS];
+};
+
+static void hist_init(struct hist* hist, const char* name, const char* unit,
+		      double expected, double bucket_width) {
+  memset(hist, 0, sizeof(struct hist));
+  hist->name = name;
+  hist->unit = unit;
+  hist->expected = expected;
+  hist->bucket_width = bucket_width;
+}
+
+static void hist_add(struct hist* hist, double value) {
+  double dev = value - hist->expected;
+  long bucket = lround(dev / hist->bucket_width) + HIST_BUCKETS / 2;
+
+  if (bucket < 0) {
+    bucket = 0;
+  } else if (bucket >= HIST_BUCKETS) {
+    bucket = HIST_BUCKETS - 1;
+  }
+
+  if (hist->count == 0 || dev < hist->min) {
+    hist->min = dev;
+  }
+  if (hist->count == 0 || dev > hist->max) {
+    hist->max = dev;
+  }
+
+  hist->buckets[bucket]++;
+  hist->count++;
+  hist->sum += dev;
+  hist->sum_sq += dev * dev;
+}
+
+static void hist_print(const struct hist* hist) {
+  uint64_t peak = 0;
+  double mean, stddev;
+
+  printf("%s (expected %.2f %s)\n", hist->name, hist->expected, hist->unit);
+  if (hist->count == 0) {
+    printf("  no samples\n\n");
+    return;
+  }
+
+  mean = hist->sum / hist->count;
+  stddev = sqrt(fmax(0, hist->sum_sq / hist->count - mean * mean));
+  printf("  n=%llu mean=%+.3f stddev=%.3f min=%+.3f max=%+.3f %s\n",
+	 (unsigned long long) hist->count, mean, stddev, hist->min, hist->max, hist->unit);
+
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    if (hist->buckets[i] > peak) {
+      peak = hist->buckets[i];
+    }
+  }
+
+  for (int i = 0; i < HIST_BUCKETS; i++) {
+    double dev = (i - HIST_BUCKETS / 2) * hist->bucket_width;
+    int bar = (int) ((hist->buckets[i] * HIST_BAR_WIDTH + peak - 1) / peak);
+
+    if (hist->buckets[i] == 0) {
+      continue;
+    }
+
+    printf("  %s%+9.2f |%-*.*s %llu\n",
+	   i == 0 ? "<=" : (i == HIST_BUCKETS - 1 ? ">=" : "  "), dev,
+	   HIST_BAR_WIDTH, bar, "##################################################",
+	   (unsigned long long) hist->buckets[i]);
+  }
+  printf("\n");
+}
+
+/* Receives every pulse of the capture, in order. start_ps is the time
+   at which the pulse starts. */
+typedef void (*pulse_sink_t)(void* arg, bool level, uint64_t start_ps, uint64_t duration_ps);
+
+/* Turns a stream of level changes into pulses */
+struct edge_tracker {
+  pulse_sink_t sink;
+  void* arg;
+  bool started;
+  bool level;
+  uint64_t since_ps;
+};
+
+static void edge_tracker_set(struct edge_tracker* tracker, uint64_t time_ps, bool level) {
+  if (!tracker->started) {
+    tracker->started = true;
+    tracker->level = level;
+    tracker->since_ps = time_ps;
+    return;
+  }
+
+  if (level == tracker->level || time_ps < tracker->since_ps) {
+    return;
+  }
+
+  tracker->sink(tracker->arg, tracker->level, tracker->since_ps, time_ps - tracker->since_ps);
+  tracker->level = level;
+  tracker->since_ps = time_ps;
+}
+
+static void edge_tracker_finish(struct edge_tracker* tracker, uint64_t time_ps) {
+  if (tracker->started && time_ps > tracker->since_ps) {
+    tracker->sink(tracker->arg, tracker->level, tracker->since_ps, time_ps - tracker->since_ps);
+  }
+}
+
+/* Clemsa conformance */
+
+struct clemsa_check {
+  size_t code_len;
+
+  uint32_t sync_pulses;
+  uint64_t last_sync_start_ps;
+  bool sync_low_pending;
+  bool after_sync;
+
+  bool in_burst;
+  uint64_t burst_start_ps;
+  uint32_t burst_highs;
+
+  bool have_digit;
+  uint64_t last_digit_start_ps;
+  size_t digits;
+  uint64_t codes;
+  uint64_t zeros;
+  uint64_t ones;
+
+  struct hist sync_count;
+  struct hist sync_high;
+  struct hist sync_low;
+  struct hist sync_cycle;
+  struct hist sync_to_code;
+  struct hist ask_high;
+  struct hist ask_low;
+  struct hist zero_highs;
+  struct hist one_highs;
+  struct hist digit_period;
+  struct hist repetition_gap;
+  struct hist code_digits;
+};
+
+static double ps_to_us(uint64_t ps) {
+  return (double) ps / PS_PER_US;
+}
+
+static void clemsa_check_init(struct clemsa_check* check, size_t code_len) {
+  memset(check, 0, sizeof(struct clemsa_check));
+  check->code_len = code_len;
+
+  hist_init(&check->sync_count, "Sync pulses", "pulses", CLEMSA_CODEGEN_SYNC_CLOCK_CYCLES, 1);
+  hist_init(&check->sync_high, "Sync high time", "us", CLEMSA_CLK_HIGH_US, 1);
+  hist_init(&check->sync_low, "Sync low time", "us", CLEMSA_CLK_LOW_US, 1);
+  hist_init(&check->sync_cycle, "Sync cycle period", "us", CLEMSA_CYCLE_US, 1);
+  // Bursts are detected on their first high pulse, one ASK tick after
+  // the beginning of the cycle.
+  hist_init(&check->sync_to_code, "Last sync pulse to first digit", "us",
+	    (CLEMSA_CODEGEN_WAIT_CLOCK_CYCLES + 1) * CLEMSA_CYCLE_US + CLEMSA_ASK_HALF_PERIOD_US, 5);
+  hist_init(&check->ask_high, "ASK high half period", "us", CLEMSA_ASK_HALF_PERIOD_US, 0.5);
+  hist_init(&check->ask_low, "ASK low half period", "us", CLEMSA_ASK_HALF_PERIOD_US, 0.5);
+  hist_init(&check->zero_highs, "ASK pulses of zero digits", "pulses", CLEMSA_ZERO_HIGHS, 1);
+  hist_init(&check->one_highs, "ASK pulses of one digits", "pulses", CLEMSA_ONE_HIGHS, 1);
+  hist_init(&check->digit_period, "Digit period", "us", CLEMSA_CYCLE_US, 1);
+  hist_init(&check->repetition_gap, "Last digit to first digit of next repetition", "us",
+	    (CLEMSA_CODEGEN_CYCLES_BETWEEN_REPETITIONS + 1) * CLEMSA_CYCLE_US, 5);
+  hist_init(&check->code_digits, "Digits per code", "digits", code_len, 1);
+}
+
+static void clemsa_check_end_code(struct clemsa_check* check) {
+  if (check->digits > 0) {
+    hist_add(&check->code_digits, check->digits);
+    check->codes++;
+  }
+  check->digits = 0;
+}
+
+static void clemsa_check_end_sync(struct clemsa_check* check) {
+  if (check->sync_pulses > 0) {
+    hist_add(&check->sync_count, check->sync_pulses);
+    check->sync_pulses = 0;
+    check->after_sync = true;
+  }
+  check->sync_low_pending = false;
+}
+
+static void clemsa_check_end_burst(struct clemsa_check* check) {
+  uint32_t highs = check->burst_highs;
+
+  check->in_burst = false;
+
+  if (check->after_sync) {
+    clemsa_check_end_code(check);
+    hist_add(&check->sync_to_code, ps_to_us(check->burst_start_ps - check->last_sync_start_ps));
+    check->after_sync = false;
+  } else if (check->have_digit) {
+    double since_last_us = ps_to_us(check->burst_start_ps - check->last_digit_start_ps);
+
+    if (since_last_us < 1.5 * CLEMSA_CYCLE_US) {
+      hist_add(&check->digit_period, since_last_us);
+    } else {
+      clemsa_check_end_code(check);
+      hist_add(&check->repetition_gap, since_last_us);
+    }
+  }
+
+  // Digits are told apart by the number of pulses of their burst,
+  // whichever expected count is closer.
+  if (abs((int) highs - CLEMSA_ONE_HIGHS) < abs((int) highs - CLEMSA_ZERO_HIGHS)) {
+    hist_add(&check->one_highs, highs);
+    check->ones++;
+  } else {
+    hist_add(&check->zero_highs, highs);
+    check->zeros++;
+  }
+
+  check->have_digit = true;
+  check->last_digit_start_ps = check->burst_start_ps;
+  check->digits++;
+}
+
+static void clemsa_check_pulse(void* arg, bool level, uint64_t start_ps, uint64_t duration_ps) {
+  struct clemsa_check* check = (struct clemsa_check*) arg;
+  double duration_us = ps_to_us(duration_ps);
+
+  if (level) {
+    if (duration_us >= CLEMSA_SYNC_HIGH_US) {
+      if (check->in_burst) {
+	clemsa_check_end_burst(check);
+      }
+
+      if (check->sync_pulses > 0) {
+	hist_add(&check->sync_cycle, ps_to_us(start_ps - check->last_sync_start_ps));
+      } else {
+	clemsa_check_end_code(check);
+	check->have_digit = false;
+      }
+
+      hist_add(&check->sync_high, duration_us);
+      check->sync_pulses++;
+      check->last_sync_start_ps = start_ps;
+      check->sync_low_pending = true;
+      return;
+    }
+
+    clemsa_check_end_sync(check);
+    if (!check->in_burst) {
+      check->in_burst = true;
+      check->burst_start_ps = start_ps;
+      check->burst_highs = 0;
+    }
+    check->burst_highs++;
+    hist_add(&check->ask_high, duration_us);
+    return;
+  }
+
+  if (check->sync_low_pending) {
+    check->sync_low_pending = false;
+    if (duration_us < CLEMSA_CLK_HIGH_US) {
+      hist_add(&check->sync_low, duration_us);
+      return;
+    }
+  }
+
+  if (duration_us >= CLEMSA_CLK_HIGH_US) {
+    clemsa_check_end_sync(check);
+  }
+
+  if (check->in_burst) {
+    if (duration_us < CLEMSA_BURST_GAP_US) {
+      hist_add(&check->ask_low, duration_us);
+    } else {
+      clemsa_check_end_burst(check);
+    }
+  }
+}
+
+static void clemsa_check_finish(struct clemsa_check* check) {
+  if (check->in_burst) {
+    clemsa_check_end_burst(check);
+  }
+  clemsa_check_end_sync(check);
+  clemsa_check_end_code(check);
+}
+
+static void clemsa_check_print(const struct clemsa_check* check) {
+  printf("Clemsa: %llu codes, %llu zero digits, %llu one digits\n\n",
+	 (unsigned long long) check->codes, (unsigned long long) check->zeros,
+	 (unsigned long long) check->ones);
+
+  hist_print(&check->sync_count);
+  hist_print(&check->sync_high);
+  hist_print(&check->sync_low);
+  hist_print(&check->sync_cycle);
+  hist_print(&check->sync_to_code);
+  hist_print(&check->ask_high);
+  hist_print(&check->ask_low);
+  hist_print(&check->zero_highs);
+  hist_print(&check->one_highs);
+  hist_print(&check->digit_period);
+  hist_print(&check->repetition_gap);
+  hist_print(&check->code_digits);
+}
+
+/* Tesla charger conformance */
+
+struct tesla_check {
+  bool in_frame;
+  bool have_frame;
+  uint64_t frame_start_ps;
+  uint64_t frame_bits;
+  uint32_t frames;
+  uint64_t txs;
+
+  struct hist pulse_width;
+  struct hist edge_drift;
+  struct hist frame_period;
+  struct hist tx_frames;
+};
+
+static void tesla_check_init(struct tesla_check* check) {
+  memset(check, 0, sizeof(struct tesla_check));
+
+  // Pulses last a whole number of bit periods, so only the remainder
+  // is checked.
+  hist_init(&check->pulse_width, "Pulse width deviation from bit grid", "us", 0, 1);
+  hist_init(&check->edge_drift, "Edge drift from frame start", "us", 0, 20);
+  hist_init(&check->frame_period, "Frame period", "us",
+	    TESLA_CHARGER_PAYLOAD_LEN * 8 * TESLA_CHARGER_SIGNAL_PERIOD_US +
+	    TESLA_CHARGER_DISTANCE_BETWEEN_REPETITIONS_US, 10);
+  hist_init(&check->tx_frames, "Frames per transmission", "frames", TESLA_CHARGER_NUM_REPETITIONS, 1);
+}
+
+static double tesla_bits(double us) {
+  return round(us / TESLA_CHARGER_SIGNAL_PERIOD_US);
+}
+
+static void tesla_check_end_tx(struct tesla_check* check) {
+  if (check->frames > 0) {
+    hist_add(&check->tx_frames, check->frames);
+    check->txs++;
+  }
+  check->frames = 0;
+  check->have_frame = false;
+}
+
+static void tesla_check_pulse(void* arg, bool level, uint64_t start_ps, uint64_t duration_ps) {
+  struct tesla_check* check = (struct tesla_check*) arg;
+  double duration_us = ps_to_us(duration_ps);
+
+  if (!level && duration_us >= TESLA_FRAME_GAP_US) {
+    check->in_frame = false;
+    if (duration_us >= TESLA_TX_GAP_US) {
+      tesla_check_end_tx(check);
+    }
+    return;
+  }
+
+  if (!check->in_frame) {
+    if (!level) {
+      return;
+    }
+
+    if (check->have_frame) {
+      hist_add(&check->frame_period, ps_to_us(start_ps - check->frame_start_ps));
+    }
+    check->in_frame = true;
+    check->have_frame = true;
+    check->frame_start_ps = start_ps;
+    check->frame_bits = 0;
+    check->frames++;
+  } else {
+    // Drift accumulates along the frame, so edges are checked against
+    // the bits decoded so far rather than the nearest bit boundary.
+    hist_add(&check->edge_drift, ps_to_us(start_ps - check->frame_start_ps) -
+	     check->frame_bits * TESLA_CHARGER_SIGNAL_PERIOD_US);
+  }
+
+  check->frame_bits += (uint64_t) tesla_bits(duration_us);
+  hist_add(&check->pulse_width, duration_us - tesla_bits(duration_us) * TESLA_CHARGER_SIGNAL_PERIOD_US);
+}
+
+static void tesla_check_finish(struct tesla_check* check) {
+  tesla_check_end_tx(check);
+}
+
+static void tesla_check_print(const struct tesla_check* check) {
+  printf("Tesla charger: %llu transmissions\n\n", (unsigned long long) check->txs);
+
+  hist_print(&check->pulse_width);
+  hist_print(&check->edge_drift);
+  hist_print(&check->frame_period);
+  hist_print(&check->tx_frames);
+}
+
+/* Readers */
+
+// Reads the next whitespace separated token. Returns false at EOF.
+static bool vcd_token(FILE* in, char* token) {
+  int c;
+  size_t len = 0;
+
+  while ((c = getc(in)) != EOF && (c == ' ' || c == '\t' || c == '\r' || c == '\n'));
+  if (c == EOF) {
+    return false;
+  }
+
+  do {
+    if (len < VCD_MAX_TOKEN_LEN - 1) {
+      token[len++] = (char) c;
+    }
+  } while ((c = getc(in)) != EOF && c != ' ' && c != '\t' && c != '\r' && c != '\n');
+
+  token[len] = '\0';
+  return true;
+}
+
+static bool vcd_skip_to_end(FILE* in, char* token) {
+  while (vcd_token(in, token)) {
+    if (strcmp(token, "$end") == 0) {
+      return true;
+    }
+  }
+  return false;
+}
+
+static uint64_t vcd_parse_timescale(const char* text) {
+  char* unit;
+  uint64_t value = strtoull(text, &unit, 10);
+
+  if (value == 0) {
+    value = 1;
+  }
+
+  if (strcmp(unit, "s") == 0) {
+    return value * 1000000000000ull;
+  } else if (strcmp(unit, "ms") == 0) {
+    return value * 1000000000ull;
+  } else if (strcmp(unit, "us") == 0) {
+    return value * 1000000ull;
+  } else if (strcmp(unit, "ns") == 0) {
+    return value * 1000ull;
+  } else if (strcmp(unit, "ps") == 0) {
+    return value;
+  }
+
+  return 0;
+}
+
+static int read_vcd(FILE* in, const char* signal, struct edge_tracker* tracker) {
+  char token[VCD_MAX_TOKEN_LEN];
+  char id[VCD_MAX_TOKEN_LEN] = "";
+  char timescale[VCD_MAX_TOKEN_LEN] = "1us";
+  uint64_t ps_per_unit;
+  uint64_t now_ps = 0;
+
+  // Header
+  while (vcd_token(in, token)) {
+    if (strcmp(token, "$timescale") == 0) {
+      timescale[0] = '\0';
+      while (vcd_token(in, token) && strcmp(token, "$end") != 0) {
+	strncat(timescale, token, sizeof(timescale) - strlen(timescale) - 1);
+      }
+    } else if (strcmp(token, "$var") == 0) {
+      char var_id[VCD_MAX_TOKEN_LEN];
+      char name[VCD_MAX_TOKEN_LEN];
+      long width;
+
+      // $var <type> <width> <id> <name> [range] $end
+      if (!vcd_token(in, token) || !vcd_token(in, token)) {
+	break;
+      }
+      width = strtol(token, NULL, 10);
+      if (!vcd_token(in, var_id) || !vcd_token(in, name)) {
+	break;
+      }
+      if (id[0] == '\0' && width == 1 && (signal == NULL || strcmp(signal, name) == 0)) {
+	strcpy(id, var_id);
+      }
+      if (strcmp(name, "$end") != 0) {
+	vcd_skip_to_end(in, token);
+      }
+    } else if (strcmp(token, "$enddefinitions") == 0) {
+      vcd_skip_to_end(in, token);
+      break;
+    } else if (token[0] == '$') {
+      vcd_skip_to_end(in, token);
+    }
+  }
+
+  if (id[0] == '\0') {
+    fprintf(stderr, "Signal %s not found in the VCD header\n", signal ? signal : "(any)");
+    return -1;
+  }
+
+  if ((ps_per_unit = vcd_parse_timescale(timescale)) == 0) {
+    fprintf(stderr, "Unsupported timescale: %s\n", timescale);
+    return -1;
+  }
+
+  // Value changes
+  while (vcd_token(in, token)) {
+    switch (token[0]) {
+    case '#':
+      now_ps = strtoull(token + 1, NULL, 10) * ps_per_unit;
+      break;
+    case '0':
+    case '1':
+      if (strcmp(token + 1, id) == 0) {
+	edge_tracker_set(tracker, now_ps, token[0] == '1');
+      }
+      break;
+    case 'b':
+    case 'B':
+    case 'r':
+    case 'R': {
+      // Vector value, followed by its id
+      char value = token[strlen(token) - 1];
+      if (!vcd_token(in, token)) {
+	break;
+      }
+      if (strcmp(token, id) == 0 && (value == '0' || value == '1')) {
+	edge_tracker_set(tracker, now_ps, value == '1');
+      }
+      break;
+    }
+    case '$':
+      // $dumpvars, $dumpon... Their contents are regular value changes.
+      break;
+    default:
+      // x, z and other states are ignored
+      break;
+    }
+  }
+
+  edge_tracker_finish(tracker, now_ps);
+  return 0;
+}
+
+// Long captures would overflow 64 bit intermediate values
+static uint64_t sample_to_ps(uint64_t sample, uint64_t sample_rate_hz) {
+  return (uint64_t) ((unsigned __int128) sample * 1000000000000ull / sample_rate_hz);
+}
+
+static int read_binary(FILE* in, uint64_t sample_rate_hz, unsigned channel, size_t unit_size,
+		       struct edge_tracker* tracker) {
+  static uint8_t chunk[BINARY_CHUNK_LEN];
+  size_t byte = channel / 8;
+  uint8_t mask = 1 << (channel % 8);
+  uint64_t sample = 0;
+  size_t len;
+
+  if (byte >= unit_size) {
+    fprintf(stderr, "Channel %u out of range for unit size %zu\n", channel, unit_size);
+    return -1;
+  }
+
+  // Whole samples only, so the chunk never splits one
+  while ((len = fread(chunk, 1, BINARY_CHUNK_LEN - BINARY_CHUNK_LEN % unit_size, in)) > 0) {
+    for (size_t offset = 0; offset + unit_size <= len; offset += unit_size) {
+      edge_tracker_set(tracker, sample_to_ps(sample, sample_rate_hz),
+		       (chunk[offset + byte] & mask) != 0);
+      sample++;
+    }
+  }
+
+  edge_tracker_finish(tracker, sample_to_ps(sample, sample_rate_hz));
+  return 0;
+}
+
+static void usage(const char* argv0) {
+  fprintf(stderr,
+	  "Usage: %s [-p clemsa|tesla] [-f vcd|binary] [-s signal] [-r sample_rate_hz]\n"
+	  "          [-c channel] [-u unit_size] [-n code_len] [capture|-]\n",
+	  argv0);
+}
+
+int main(int argc, char** argv) {
+  const char* protocol = "clemsa";
+  const char* format = "vcd";
+  const char* signal = NULL;
+  uint64_t sample_rate_hz = 0;
+  unsigned channel = 0;
+  size_t unit_size = 1;
+  size_t code_len = CLEMSA_CODEGEN_DEFAULT_CODE_SIZE;
+  struct clemsa_check clemsa;
+  struct tesla_check tesla;
+  struct edge_tracker tracker = {0};
+  FILE* in = stdin;
+  int opt, ret;
+
+  while ((opt = getopt(argc, argv, "p:f:s:r:c:u:n:h")) != -1) {
+    switch (opt) {
+    case 'p': protocol = optarg; break;
+    case 'f': format = optarg; break;
+    case 's': signal = optarg; break;
+    case 'r': sample_rate_hz = strtoull(optarg, NULL, 10); break;
+    case 'c': channel = (unsigned) strtoul(optarg, NULL, 10); break;
+    case 'u': unit_size = strtoul(optarg, NULL, 10); break;
+    case 'n': code_len = strtoul(optarg, NULL, 10); break;
+    default:
+      usage(argv[0]);
+      return opt == 'h' ? 0 : 2;
+    }
+  }
+
+  if (strcmp(protocol, "clemsa") == 0) {
+    clemsa_check_init(&clemsa, code_len);
+    tracker.sink = clemsa_check_pulse;
+    tracker.arg = &clemsa;
+  } else if (strcmp(protocol, "tesla") == 0) {
+    tesla_check_init(&tesla);
+    tracker.sink = tesla_check_pulse;
+    tracker.arg = &tesla;
+  } else {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (optind < argc && strcmp(argv[optind], "-") != 0) {
+    if ((in = fopen(argv[optind], "rb")) == NULL) {
+      perror(argv[optind]);
+      return 1;
+    }
+  }
+
+  if (strcmp(format, "vcd") == 0) {
+    ret = read_vcd(in, signal, &tracker);
+  } else if (strcmp(format, "binary") == 0) {
+    if (sample_rate_hz == 0 || unit_size == 0) {
+      fprintf(stderr, "binary captures need a sample rate (-r) and a non zero unit size (-u)\n");
+      return 2;
+    }
+    ret = read_binary(in, sample_rate_hz, channel, unit_size, &tracker);
+  } else {
+    usage(argv[0]);
+    return 2;
+  }
+
+  if (in != stdin) {
+    fclose(in);
+  }
+
+  if (ret != 0) {
+    return 1;
+  }
+
+  if (tracker.arg == &clemsa) {
+    clemsa_check_finish(&clemsa);
+    clemsa_check_print(&clemsa);
+  } else {
+    tesla_check_finish(&tesla);
+    tesla_check_print(&tesla);
+  }
+
+  return 0;
+}